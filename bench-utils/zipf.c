@@ -0,0 +1,99 @@
+/* [ zipf.c ] - Zipfian Key Distribution
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2010, Matteo Bertozzi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL MATTEO BERTOZZI BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <math.h>
+
+#include "zipf.h"
+
+uint64_t xorshift64 (uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return(x * 0x2545f4914f6cdd1dULL);
+}
+
+/* Uniform in [0, 1), 53 bits */
+double xorshift64_double (uint64_t *state) {
+    return((xorshift64(state) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/* zetan sums n terms, init is O(n) */
+void zipf_init (zipf_t *zipf,
+                uint64_t n,
+                double theta)
+{
+    double zeta2 = 1.0 + pow(0.5, theta);
+    uint64_t i;
+
+    zipf->zetan = 0;
+    for (i = 1; i <= n; ++i)
+        zipf->zetan += 1.0 / pow((double)i, theta);
+
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+    zipf->half_pow_theta = 1.0 + pow(0.5, theta);
+}
+
+uint64_t zipf_next (const zipf_t *zipf,
+                    uint64_t *state)
+{
+    double u = xorshift64_double(state);
+    double uz = u * zipf->zetan;
+    uint64_t rank;
+
+    if (uz < 1.0)
+        rank = 0;
+    else if (uz < zipf->half_pow_theta)
+        rank = 1;
+    else
+        rank = (uint64_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+
+    if (rank >= zipf->n)
+        rank = zipf->n - 1;
+    return(rank);
+}
+
+uint64_t zipf_scrambled (const zipf_t *zipf,
+                         uint64_t *state)
+{
+    uint64_t rank;
+    uint64_t h;
+    int i;
+
+    rank = zipf_next(zipf, state);
+    h = 0xcbf29ce484222325ULL;
+    for (i = 0; i < 8; ++i, rank >>= 8)
+        h = (h ^ (rank & 0xff)) * 0x100000001b3ULL;
+
+    return(h % zipf->n);
+}
@@ -0,0 +1,62 @@
+/* [ zipf.h ] - Zipfian Key Distribution
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2010, Matteo Bertozzi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL MATTEO BERTOZZI BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * -----------------------------------------------------------------------------
+ */
+
+#ifndef _ZIPF_H_
+#define _ZIPF_H_
+
+#include <stdint.h>
+
+/*
+ * YCSB zipfian generator (Gray et al.) and the xorshift64* source it
+ * draws from, shared by the benchmarks. Build with zipf.c, link -lm.
+ * Ranks go from 0, the most popular item, to n - 1. zipf_scrambled()
+ * spreads them over [0, n) with FNV-1a, so hot items are not adjacent.
+ * Generators are read-only after init, each thread keeps its own state.
+ */
+typedef struct zipf {
+    uint64_t n;
+    double   theta;
+    double   alpha;
+    double   zetan;
+    double   eta;
+    double   half_pow_theta;
+} zipf_t;
+
+uint64_t    xorshift64          (uint64_t *state);
+double      xorshift64_double   (uint64_t *state);
+
+void        zipf_init           (zipf_t *zipf,
+                                 uint64_t n,
+                                 double theta);
+uint64_t    zipf_next           (const zipf_t *zipf,
+                                 uint64_t *state);
+uint64_t    zipf_scrambled      (const zipf_t *zipf,
+                                 uint64_t *state);
+
+#endif /* !_ZIPF_H_ */
@@ -0,0 +1,594 @@
+/*
+ * YCSB-style benchmark, the key generator is in bench-utils. Build with:
+ *   cc -O2 -I../bench-utils bench.c btree.c btcrc.c ../bench-utils/zipf.c \
+ *      -lpthread -lm
+ */
+#define _XOPEN_SOURCE 500
+#include <sys/time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "btree.h"
+#include "zipf.h"
+
+/* Latency histogram: 16 linear buckets per power of two, ~6% error */
+#define __HIST_SUB_BITS     (4)
+#define __HIST_SUB          (1U << __HIST_SUB_BITS)
+#define __HIST_BUCKETS      ((64 - __HIST_SUB_BITS + 1) * __HIST_SUB)
+
+#define __DIST_UNIFORM      (0)
+#define __DIST_ZIPFIAN      (1)
+#define __DIST_SEQUENTIAL   (2)
+
+struct btdisk_data {
+    uint64_t offset;
+    uint64_t reads;
+    uint64_t writes;
+    int fd;
+};
+
+struct bench_conf {
+    const char *path;
+    uint32_t nkeys;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t blob_threshold;
+    uint32_t block_size;
+    uint32_t cache_size;
+    uint32_t read_pct;
+    uint32_t threads;
+    uint32_t seconds;
+    uint32_t sync_ms;
+    uint64_t flush_bytes;
+    uint8_t  format;
+    uint8_t  memcmp_keys;
+    int      dist;
+    double   theta;
+};
+
+struct bench_bulk {
+    const struct bench_conf *conf;
+    uint8_t *value;
+    uint8_t *key;
+    uint32_t next;
+};
+
+struct bench_thread {
+    pthread_t thread;
+    btree_t * btree;
+    const struct bench_conf *conf;
+    const zipf_t *zipf;
+    uint64_t  seed;
+    uint64_t  reads;
+    uint64_t  updates;
+    uint64_t  misses;
+    uint64_t  errors;
+    uint64_t  hist[__HIST_BUCKETS];
+    uint64_t  uhist[__HIST_BUCKETS];  /* Updates only */
+};
+
+static int __bench_running;
+static uint64_t __bench_seq;
+
+static uint64_t time_micros (void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return(now.tv_sec * 1000000U + now.tv_usec);
+}
+
+static uint64_t time_nanos (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+static size_t __key_size;
+
+static int __keycmp (void *user_data,
+                     const void *a,
+                     const void *b)
+{
+    return(memcmp(a, b, __key_size));
+}
+
+static uint64_t __btdisk_append (btdisk_t *disk,
+                                 const void *data,
+                                 uint32_t size)
+{
+    struct btdisk_data *dd = (struct btdisk_data *)disk->internal;
+    uint64_t offset = dd->offset;
+
+    if (pwrite(dd->fd, data, size, offset) != size)
+        perror("pwrite()");
+    dd->offset += size;
+    __atomic_add_fetch(&(dd->writes), 1, __ATOMIC_RELAXED);
+
+    return(offset);
+}
+
+static uint64_t __btdisk_write (btdisk_t *disk,
+                                uint64_t block_offset,
+                                uint32_t block_size,
+                                const void *data,
+                                uint32_t size)
+{
+    struct btdisk_data *dd = (struct btdisk_data *)disk->internal;
+
+    if (block_offset == 0 || size > block_size)
+        return(__btdisk_append(disk, data, size));
+
+    if (pwrite(dd->fd, data, size, block_offset) != size)
+        perror("pwrite()");
+    __atomic_add_fetch(&(dd->writes), 1, __ATOMIC_RELAXED);
+
+    return(block_offset);
+}
+
+static uint32_t __btdisk_read (btdisk_t *disk,
+                               uint64_t offset,
+                               void *buffer,
+                               uint32_t size)
+{
+    struct btdisk_data *dd = (struct btdisk_data *)disk->internal;
+
+    if (pread(dd->fd, buffer, size, offset) != size) {
+        perror("pread()");
+        return(0);
+    }
+    __atomic_add_fetch(&(dd->reads), 1, __ATOMIC_RELAXED);
+
+    return(size);
+}
+
+static uint64_t __btdisk_erase (btdisk_t *disk,
+                                uint64_t offset,
+                                uint32_t size)
+{
+    return(offset);
+}
+
+/* ===========================================================================
+ *  Key Distributions
+ */
+/* Zipfian ranks are scrambled, hot items spread over the keys */
+static uint32_t __bench_next_item (struct bench_thread *bench) {
+    const struct bench_conf *conf = bench->conf;
+
+    switch (conf->dist) {
+        case __DIST_ZIPFIAN:
+            return(zipf_scrambled(bench->zipf, &(bench->seed)));
+        case __DIST_SEQUENTIAL:
+            return(__atomic_fetch_add(&__bench_seq, 1, __ATOMIC_RELAXED) % conf->nkeys);
+    }
+    return(xorshift64(&(bench->seed)) % conf->nkeys);
+}
+
+/* Keys sort as the item number, big-endian in the last 4 bytes */
+static void __bench_key (const struct bench_conf *conf,
+                         uint8_t *key,
+                         uint32_t i)
+{
+    uint8_t *p = key + conf->key_size - 4;
+
+    memset(key, 'k', conf->key_size - 4);
+    p[0] = (i >> 24) & 0xff;
+    p[1] = (i >> 16) & 0xff;
+    p[2] = (i >> 8) & 0xff;
+    p[3] = i & 0xff;
+}
+
+static void __bench_value (const struct bench_conf *conf,
+                           uint8_t *value,
+                           uint32_t i,
+                           uint32_t version)
+{
+    memset(value, 'v', conf->value_size);
+    memcpy(value, &i, (conf->value_size < 4) ? conf->value_size : 4);
+    if (conf->value_size >= 8)
+        memcpy(value + 4, &version, 4);
+}
+
+static int __bench_bulk_next (void *user_data,
+                              const void **key,
+                              const void **value,
+                              uint32_t *size)
+{
+    struct bench_bulk *bulk = (struct bench_bulk *)user_data;
+
+    if (bulk->next >= bulk->conf->nkeys)
+        return(1);
+
+    __bench_key(bulk->conf, bulk->key, bulk->next);
+    __bench_value(bulk->conf, bulk->value, bulk->next, 0);
+    *key = bulk->key;
+    *value = bulk->value;
+    *size = bulk->conf->value_size;
+    bulk->next++;
+    return(0);
+}
+
+/* ===========================================================================
+ *  Latency Histogram
+ */
+static uint32_t __hist_bucket (uint64_t value) {
+    uint32_t bits;
+
+    if (value < __HIST_SUB)
+        return(value);
+
+    bits = 63 - __builtin_clzll(value);
+    return((bits - __HIST_SUB_BITS + 1) * __HIST_SUB +
+           ((value >> (bits - __HIST_SUB_BITS)) & (__HIST_SUB - 1)));
+}
+
+/* Highest value of the bucket */
+static uint64_t __hist_value (uint32_t bucket) {
+    uint32_t bits;
+
+    if (bucket < __HIST_SUB)
+        return(bucket);
+
+    bits = (bucket / __HIST_SUB) + __HIST_SUB_BITS - 1;
+    return((((uint64_t)(__HIST_SUB + (bucket % __HIST_SUB)) + 1) << (bits - __HIST_SUB_BITS)) - 1);
+}
+
+static uint64_t __hist_percentile (const uint64_t *hist,
+                                   uint64_t count,
+                                   double pct)
+{
+    uint64_t target;
+    uint64_t seen;
+    uint32_t i;
+
+    target = (uint64_t)ceil(count * pct / 100.0);
+    for (seen = 0, i = 0; i < __HIST_BUCKETS; ++i) {
+        if ((seen += hist[i]) >= target && seen > 0)
+            return(__hist_value(i));
+    }
+    return(0);
+}
+
+/* ===========================================================================
+ *  Workload
+ */
+static void *__bench_worker (void *arg) {
+    struct bench_thread *bench = (struct bench_thread *)arg;
+    const struct bench_conf *conf = bench->conf;
+    uint8_t value[conf->value_size + 1];
+    uint8_t key[conf->key_size];
+    uint32_t bucket;
+    uint64_t stime;
+    uint32_t i;
+
+    while (__atomic_load_n(&__bench_running, __ATOMIC_RELAXED)) {
+        i = __bench_next_item(bench);
+        __bench_key(conf, key, i);
+
+        if ((xorshift64(&(bench->seed)) % 100) < conf->read_pct) {
+            stime = time_nanos();
+            if (!btree_lookup(bench->btree, key, value, conf->value_size))
+                bench->misses++;
+            bench->hist[__hist_bucket(time_nanos() - stime)]++;
+            bench->reads++;
+        } else {
+            __bench_value(conf, value, i, (uint32_t)bench->updates);
+            stime = time_nanos();
+            if (btree_insert(bench->btree, key, value, conf->value_size))
+                bench->errors++;
+            bucket = __hist_bucket(time_nanos() - stime);
+            bench->hist[bucket]++;
+            bench->uhist[bucket]++;
+            bench->updates++;
+        }
+    }
+
+    return(NULL);
+}
+
+/* Checkpoints while the workers run, the writers wait on them.
+ * Syncs are counted as updates.
+ */
+static void *__bench_syncer (void *arg) {
+    struct bench_thread *bench = (struct bench_thread *)arg;
+
+    while (__atomic_load_n(&__bench_running, __ATOMIC_RELAXED)) {
+        usleep(bench->conf->sync_ms * 1000U);
+        if (btree_sync(bench->btree) < 0)
+            bench->errors++;
+        bench->updates++;
+    }
+
+    return(NULL);
+}
+
+static int __bench_run (btree_t *btree,
+                        struct btdisk_data *data,
+                        const struct bench_conf *conf,
+                        const zipf_t *zipf)
+{
+    btcache_stats_t cstats, pstats;
+    struct bench_thread *threads;
+    struct bench_thread syncer;
+    uint64_t reads, writes;
+    uint64_t stime, etime;
+    uint64_t updates;
+    uint64_t errors;
+    uint64_t misses;
+    uint64_t lookups;
+    uint64_t ops;
+    uint32_t i, b;
+    double secs;
+
+    if ((threads = (struct bench_thread *) calloc(conf->threads, sizeof(struct bench_thread))) == NULL)
+        return(-1);
+
+    btree_cache_stats(btree, &pstats);
+    reads = data->reads;
+    writes = data->writes;
+
+    __atomic_store_n(&__bench_running, 1, __ATOMIC_RELAXED);
+    stime = time_micros();
+    for (i = 0; i < conf->threads; ++i) {
+        threads[i].btree = btree;
+        threads[i].conf = conf;
+        threads[i].zipf = zipf;
+        threads[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&(threads[i].thread), NULL, __bench_worker, &(threads[i]));
+    }
+
+    memset(&syncer, 0, sizeof(struct bench_thread));
+    syncer.btree = btree;
+    syncer.conf = conf;
+    if (conf->sync_ms > 0)
+        pthread_create(&(syncer.thread), NULL, __bench_syncer, &syncer);
+
+    sleep(conf->seconds);
+    __atomic_store_n(&__bench_running, 0, __ATOMIC_RELAXED);
+
+    for (i = 0; i < conf->threads; ++i)
+        pthread_join(threads[i].thread, NULL);
+    etime = time_micros();
+    if (conf->sync_ms > 0)
+        pthread_join(syncer.thread, NULL);
+
+    /* Dirty nodes are written by the sync, they count on the run */
+    btree_sync(btree);
+    btree_cache_stats(btree, &cstats);
+    reads = data->reads - reads;
+    writes = data->writes - writes;
+
+    lookups = updates = misses = errors = 0;
+    for (i = 1; i < conf->threads; ++i) {
+        for (b = 0; b < __HIST_BUCKETS; ++b) {
+            threads[0].hist[b] += threads[i].hist[b];
+            threads[0].uhist[b] += threads[i].uhist[b];
+        }
+    }
+    for (i = 0; i < conf->threads; ++i) {
+        lookups += threads[i].reads;
+        updates += threads[i].updates;
+        misses += threads[i].misses;
+        errors += threads[i].errors;
+    }
+
+    ops = lookups + updates;
+    secs = (etime - stime) / 1000000.0;
+    printf("Throughput   %10.0f ops/sec (%.0f reads, %.0f updates) misses %"PRIu64" errors %"PRIu64"\n",
+           ops / secs, lookups / secs, updates / secs, misses, errors);
+    printf("Latency usec p50 %.2f  p99 %.2f  p999 %.2f\n",
+           __hist_percentile(threads[0].hist, ops, 50.0) / 1000.0,
+           __hist_percentile(threads[0].hist, ops, 99.0) / 1000.0,
+           __hist_percentile(threads[0].hist, ops, 99.9) / 1000.0);
+    if (updates > 0) {
+        printf("Updates usec p50 %.2f  p99 %.2f  p999 %.2f  max %.2f  (%"PRIu64" syncs)\n",
+               __hist_percentile(threads[0].uhist, updates, 50.0) / 1000.0,
+               __hist_percentile(threads[0].uhist, updates, 99.0) / 1000.0,
+               __hist_percentile(threads[0].uhist, updates, 99.9) / 1000.0,
+               __hist_percentile(threads[0].uhist, updates, 100.0) / 1000.0,
+               syncer.updates);
+    }
+    printf("Disk         %.4f blocks read/op, %.4f blocks written/op\n",
+           ops ? (double)reads / ops : 0.0, ops ? (double)writes / ops : 0.0);
+    cstats.hits -= pstats.hits;
+    cstats.misses -= pstats.misses;
+    printf("Cache        %u/%u blocks, hit ratio %.2f%% (%"PRIu64" hits %"PRIu64" misses)\n",
+           cstats.used, cstats.size,
+           (cstats.hits + cstats.misses) ? 100.0 * cstats.hits / (cstats.hits + cstats.misses) : 0.0,
+           cstats.hits, cstats.misses);
+
+    free(threads);
+    return(0);
+}
+
+static void __bench_usage (const char *name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -n keys        keys loaded (1000000)\n"
+        "  -k bytes       key size (16)\n"
+        "  -v bytes       value size (100)\n"
+        "  -l bytes       values over it go to blobs, btree_blob_setup() (0)\n"
+        "  -b bytes       block size (4096)\n"
+        "  -c blocks      cache size (4096)\n"
+        "  -f format      plain, coded (plain)\n"
+        "  -m             keys ordered as memcmp(), btree_memcmp_keys()\n"
+        "  -w workload    ycsb a (50%% reads), b (95%%), c (100%%), zipfian\n"
+        "  -r percent     reads, the rest are updates (95)\n"
+        "  -d dist        uniform, zipfian, sequential (zipfian)\n"
+        "  -z theta       zipfian constant (0.99)\n"
+        "  -t threads     worker threads (1)\n"
+        "  -s seconds     run time (5)\n"
+        "  -i msec        btree_sync() every msec while running (0 never)\n"
+        "  -u bytes       dirty bytes that wake the flusher, btree_flusher_setup() (0 off)\n"
+        "  -p path        disk file (bench.disk)\n", name);
+}
+
+int main (int argc, char **argv) {
+    struct btdisk_data data;
+    struct bench_conf conf;
+    zipf_t zipf;
+    struct bench_bulk bulk;
+    uint64_t stime, etime;
+    btree_t btree;
+    btdisk_t disk;
+    int opt;
+
+    conf.path = "bench.disk";
+    conf.nkeys = 1000000;
+    conf.key_size = 16;
+    conf.value_size = 100;
+    conf.blob_threshold = 0;
+    conf.block_size = 4096;
+    conf.cache_size = 4096;
+    conf.read_pct = 95;
+    conf.threads = 1;
+    conf.seconds = 5;
+    conf.sync_ms = 0;
+    conf.flush_bytes = 0;
+    conf.format = BTREE_FORMAT_PLAIN;
+    conf.memcmp_keys = 0;
+    conf.dist = __DIST_ZIPFIAN;
+    conf.theta = 0.99;
+
+    while ((opt = getopt(argc, argv, "n:k:v:l:b:c:f:mw:r:d:z:t:s:i:u:p:h")) != -1) {
+        switch (opt) {
+            case 'n': conf.nkeys = strtoul(optarg, NULL, 10); break;
+            case 'k': conf.key_size = strtoul(optarg, NULL, 10); break;
+            case 'v': conf.value_size = strtoul(optarg, NULL, 10); break;
+            case 'l': conf.blob_threshold = strtoul(optarg, NULL, 10); break;
+            case 'b': conf.block_size = strtoul(optarg, NULL, 10); break;
+            case 'c': conf.cache_size = strtoul(optarg, NULL, 10); break;
+            case 'm': conf.memcmp_keys = 1; break;
+            case 'r': conf.read_pct = strtoul(optarg, NULL, 10); break;
+            case 'z': conf.theta = strtod(optarg, NULL); break;
+            case 't': conf.threads = strtoul(optarg, NULL, 10); break;
+            case 's': conf.seconds = strtoul(optarg, NULL, 10); break;
+            case 'i': conf.sync_ms = strtoul(optarg, NULL, 10); break;
+            case 'u': conf.flush_bytes = strtoull(optarg, NULL, 10); break;
+            case 'p': conf.path = optarg; break;
+            case 'f':
+                if (!strcmp(optarg, "plain")) {
+                    conf.format = BTREE_FORMAT_PLAIN;
+                } else if (!strcmp(optarg, "coded")) {
+                    conf.format = BTREE_FORMAT_FRONT_CODED;
+                } else {
+                    __bench_usage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'w':
+                conf.dist = __DIST_ZIPFIAN;
+                if (!strcmp(optarg, "a")) {
+                    conf.read_pct = 50;
+                } else if (!strcmp(optarg, "b")) {
+                    conf.read_pct = 95;
+                } else if (!strcmp(optarg, "c")) {
+                    conf.read_pct = 100;
+                } else {
+                    __bench_usage(argv[0]);
+                    return(1);
+                }
+                break;
+            case 'd':
+                if (!strcmp(optarg, "uniform")) {
+                    conf.dist = __DIST_UNIFORM;
+                } else if (!strcmp(optarg, "zipfian")) {
+                    conf.dist = __DIST_ZIPFIAN;
+                } else if (!strcmp(optarg, "sequential")) {
+                    conf.dist = __DIST_SEQUENTIAL;
+                } else {
+                    __bench_usage(argv[0]);
+                    return(1);
+                }
+                break;
+            default:
+                __bench_usage(argv[0]);
+                return(1);
+        }
+    }
+
+    if (conf.nkeys == 0 || conf.key_size < 4 || conf.value_size == 0 ||
+        conf.threads == 0 || conf.read_pct > 100 ||
+        conf.theta <= 0.0 || conf.theta >= 1.0)
+    {
+        __bench_usage(argv[0]);
+        return(1);
+    }
+
+    __key_size = conf.key_size;
+    if (conf.dist == __DIST_ZIPFIAN)
+        zipf_init(&zipf, conf.nkeys, conf.theta);
+
+    /* No crc callbacks, the built-in CRC32C */
+    memset(&disk, 0, sizeof(btdisk_t));
+    disk.append = __btdisk_append;
+    disk.write = __btdisk_write;
+    disk.read = __btdisk_read;
+    disk.erase = __btdisk_erase;
+    disk.internal = &data;
+
+    memset(&data, 0, sizeof(struct btdisk_data));
+    data.offset = 512U + 64U;
+    if ((data.fd = open(conf.path, O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    if (btree_create(&btree, &disk, conf.cache_size, data.offset - 64U,
+                     conf.block_size, conf.format, conf.key_size,
+                     0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf("btree_create(): Failed\n");
+        return(1);
+    }
+
+    if (conf.memcmp_keys && btree_memcmp_keys(&btree))
+        printf("btree_memcmp_keys(): Failed\n");
+    if (btree_blob_setup(&btree, conf.blob_threshold))
+        printf("btree_blob_setup(): Failed\n");
+
+    printf("Load %u keys (%u + %u bytes), block %u, cache %u blocks\n",
+           conf.nkeys, conf.key_size, conf.value_size,
+           conf.block_size, conf.cache_size);
+
+    bulk.conf = &conf;
+    bulk.next = 0;
+    bulk.key = (uint8_t *) malloc(conf.key_size);
+    bulk.value = (uint8_t *) malloc(conf.value_size);
+    stime = time_micros();
+    if (bulk.key == NULL || bulk.value == NULL ||
+        btree_bulk_load(&btree, __bench_bulk_next, &bulk, 100) ||
+        btree_sync(&btree) < 0)
+    {
+        printf("btree_bulk_load(): Failed\n");
+        return(1);
+    }
+    etime = time_micros();
+    free(bulk.value);
+    free(bulk.key);
+    printf("Loaded in %.3f sec, %"PRIu64" bytes on disk\n",
+           (etime - stime) / 1000000.0, data.offset);
+
+    /* Started after the load, bulk load writes its own nodes */
+    if (btree_flusher_setup(&btree, conf.flush_bytes))
+        printf("btree_flusher_setup(): Failed\n");
+
+    printf("Run %s%s, %u%% reads, %u threads, %u sec, sync %u msec, flusher %"PRIu64" bytes\n",
+           (conf.dist == __DIST_UNIFORM) ? "uniform" :
+           (conf.dist == __DIST_ZIPFIAN) ? "zipfian" : "sequential",
+           conf.memcmp_keys ? ", memcmp keys" : "",
+           conf.read_pct, conf.threads, conf.seconds,
+           conf.sync_ms, conf.flush_bytes);
+    __bench_run(&btree, &data, &conf, &zipf);
+
+    btree_close(&btree);
+    close(data.fd);
+    unlink(conf.path);
+    return(0);
+}
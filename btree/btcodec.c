@@ -0,0 +1,189 @@
+#include <string.h>
+
+#include "btcodec.h"
+
+#define __LZ_HEAD_SIZE          (4)
+#define __LZ_HASH_BITS          (12)
+#define __LZ_HASH_SIZE          (1 << __LZ_HASH_BITS)
+#define __LZ_MAX_OFFSET         (1 << 13)
+#define __LZ_MAX_LITERAL        (1 << 5)
+#define __LZ_MIN_MATCH          (3)
+#define __LZ_MAX_MATCH          (2 + 7 + 255)
+
+#define __lz_hash(p)                                                        \
+    ((((uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | (p)[2]) *           \
+      2654435761U) >> (32 - __LZ_HASH_BITS))
+
+/* ===========================================================================
+ *  PRIVATE Methods
+ */
+static uint8_t *__lz_literals (uint8_t *op,
+                               const uint8_t *op_end,
+                               const uint8_t *ip,
+                               uint32_t n)
+{
+    uint32_t run;
+
+    while (n > 0) {
+        run = (n < __LZ_MAX_LITERAL) ? n : __LZ_MAX_LITERAL;
+        if ((op + 1 + run) > op_end)
+            return(NULL);
+
+        *op++ = run - 1;
+        memcpy(op, ip, run);
+        op += run;
+        ip += run;
+        n -= run;
+    }
+
+    return(op);
+}
+
+/* ===========================================================================
+ *  PUBLIC Methods
+ */
+uint32_t btcodec_lz_compress (void *user_data,
+                              void *dst,
+                              const void *src,
+                              uint32_t size)
+{
+    uint32_t htab[__LZ_HASH_SIZE];
+    const uint8_t *anchor;
+    const uint8_t *in_end;
+    const uint8_t *ref;
+    const uint8_t *ip;
+    uint8_t *op_end;
+    uint32_t maxlen;
+    uint32_t len;
+    uint32_t off;
+    uint32_t pos;
+    uint32_t h;
+    uint8_t *op;
+
+    if (size <= (__LZ_HEAD_SIZE + __LZ_MIN_MATCH))
+        return(0);
+
+    /* Output must be smaller than the input to be worth it */
+    op = (uint8_t *)dst;
+    op_end = op + size - 1;
+    *op++ = size & 0xff;
+    *op++ = (size >> 8) & 0xff;
+    *op++ = (size >> 16) & 0xff;
+    *op++ = (size >> 24) & 0xff;
+
+    /* Hash table holds position + 1, zero is empty */
+    memset(htab, 0, sizeof(htab));
+
+    anchor = ip = (const uint8_t *)src;
+    in_end = ip + size;
+    while ((ip + __LZ_MIN_MATCH) <= in_end) {
+        h = __lz_hash(ip);
+        pos = htab[h];
+        htab[h] = (ip - (const uint8_t *)src) + 1;
+
+        ref = (const uint8_t *)src + pos - 1;
+        if (pos == 0 || (ip - ref) > __LZ_MAX_OFFSET ||
+            ref[0] != ip[0] || ref[1] != ip[1] || ref[2] != ip[2])
+        {
+            ip++;
+            continue;
+        }
+
+        maxlen = in_end - ip;
+        if (maxlen > __LZ_MAX_MATCH)
+            maxlen = __LZ_MAX_MATCH;
+
+        len = __LZ_MIN_MATCH;
+        while (len < maxlen && ref[len] == ip[len])
+            len++;
+
+        if ((op = __lz_literals(op, op_end, anchor, ip - anchor)) == NULL)
+            return(0);
+
+        if ((op + 3) > op_end)
+            return(0);
+
+        /* Emit back-reference */
+        off = (ip - ref) - 1;
+        if ((len - 2) < 7) {
+            *op++ = ((len - 2) << 5) | (off >> 8);
+        } else {
+            *op++ = (7 << 5) | (off >> 8);
+            *op++ = len - 2 - 7;
+        }
+        *op++ = off & 0xff;
+
+        ip += len;
+        anchor = ip;
+    }
+
+    if ((op = __lz_literals(op, op_end, anchor, in_end - anchor)) == NULL)
+        return(0);
+
+    return(op - (uint8_t *)dst);
+}
+
+uint32_t btcodec_lz_decompress (void *user_data,
+                                void *dst,
+                                const void *src,
+                                uint32_t size)
+{
+    const uint8_t *ip_end;
+    const uint8_t *ip;
+    uint8_t *op_end;
+    uint32_t raw_size;
+    uint32_t len;
+    uint32_t off;
+    uint8_t *op;
+    uint8_t ctrl;
+
+    if (size < __LZ_HEAD_SIZE)
+        return(0);
+
+    ip = (const uint8_t *)src;
+    ip_end = ip + size;
+    raw_size = (uint32_t)ip[0] | (uint32_t)ip[1] << 8 |
+               (uint32_t)ip[2] << 16 | (uint32_t)ip[3] << 24;
+    ip += __LZ_HEAD_SIZE;
+
+    op = (uint8_t *)dst;
+    op_end = op + raw_size;
+    while (ip < ip_end) {
+        ctrl = *ip++;
+
+        /* Literal run */
+        if (ctrl < __LZ_MAX_LITERAL) {
+            len = ctrl + 1;
+            if ((ip + len) > ip_end || (op + len) > op_end)
+                return(0);
+
+            memcpy(op, ip, len);
+            op += len;
+            ip += len;
+            continue;
+        }
+
+        /* Back-reference, may overlap the output */
+        len = ctrl >> 5;
+        if (len == 7) {
+            if (ip >= ip_end)
+                return(0);
+            len += *ip++;
+        }
+        len += 2;
+
+        if (ip >= ip_end)
+            return(0);
+        off = (((uint32_t)(ctrl & 0x1f) << 8) | *ip++) + 1;
+
+        if (off > (uint32_t)(op - (uint8_t *)dst) || (op + len) > op_end)
+            return(0);
+
+        while (len--) {
+            *op = *(op - off);
+            op++;
+        }
+    }
+
+    return((op == op_end) ? raw_size : 0);
+}
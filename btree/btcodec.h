@@ -0,0 +1,24 @@
+#ifndef _BTCODEC_H_
+#define _BTCODEC_H_
+
+#include <stdint.h>
+
+/*
+ * LZ77 block codec, usable as btdisk_t compress/decompress.
+ *
+ * Stream: 4 byte little-endian raw size, followed by literal runs
+ * (ctrl < 32: ctrl + 1 bytes) and back-references
+ * (len: ctrl >> 5, 7 means one more length byte, offset: 13 bits).
+ * Sorted keys and value padding inside blocks compress well.
+ */
+uint32_t    btcodec_lz_compress     (void *user_data,
+                                     void *dst,
+                                     const void *src,
+                                     uint32_t size);
+
+uint32_t    btcodec_lz_decompress   (void *user_data,
+                                     void *dst,
+                                     const void *src,
+                                     uint32_t size);
+
+#endif /* !_BTCODEC_H_ */
@@ -0,0 +1,261 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "btcrc.h"
+
+#define __CRC32C_POLY           (0x82f63b78U)     /* Reflected */
+
+/* Interleaved streams, crc of each shifted by the lengths of the others */
+#define __CRC32C_LONG           (1024)
+#define __CRC32C_SHORT          (128)
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    #define __CRC32C_HW
+#endif
+
+static uint32_t __crc32c_table[8][256];
+#ifdef __CRC32C_HW
+static uint32_t __crc32c_long[4][256];
+static uint32_t __crc32c_short[4][256];
+#endif
+
+static uint32_t (*__crc32c_func) (uint32_t, const uint8_t *, size_t);
+static pthread_once_t __crc32c_once = PTHREAD_ONCE_INIT;
+
+/* ===========================================================================
+ *  PRIVATE Methods (Slicing-by-8)
+ */
+static uint32_t __crc32c_sw (uint32_t crc,
+                             const uint8_t *p,
+                             size_t n)
+{
+    crc = ~crc;
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+
+    while (n >= 8) {
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+               (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = __crc32c_table[7][crc & 0xff] ^
+              __crc32c_table[6][(crc >> 8) & 0xff] ^
+              __crc32c_table[5][(crc >> 16) & 0xff] ^
+              __crc32c_table[4][crc >> 24] ^
+              __crc32c_table[3][p[4]] ^
+              __crc32c_table[2][p[5]] ^
+              __crc32c_table[1][p[6]] ^
+              __crc32c_table[0][p[7]];
+        p += 8;
+        n -= 8;
+    }
+
+    while (n-- > 0)
+        crc = __crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return(~crc);
+}
+
+#ifdef __CRC32C_HW
+/* ===========================================================================
+ *  PRIVATE Methods (SSE4.2)
+ *
+ *  crc32 has a latency of three cycles and a throughput of one, so three
+ *  independent streams keep it busy. The crc of a stream is then moved
+ *  past the following ones, by the 'len zero bytes' operator, with tables.
+ */
+static uint32_t __gf2_matrix_times (const uint32_t *mat,
+                                    uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    for (; vec != 0; vec >>= 1, mat++) {
+        if (vec & 1)
+            sum ^= *mat;
+    }
+
+    return(sum);
+}
+
+static void __gf2_matrix_square (uint32_t *square,
+                                 const uint32_t *mat)
+{
+    int n;
+
+    for (n = 0; n < 32; ++n)
+        square[n] = __gf2_matrix_times(mat, mat[n]);
+}
+
+/* Operator appending 'len' zero bytes to a crc, len is a power of two */
+static void __crc32c_zeros_op (uint32_t *even,
+                               size_t len)
+{
+    uint32_t odd[32];
+    uint32_t row;
+    int n;
+
+    /* One zero bit */
+    odd[0] = __CRC32C_POLY;
+    for (n = 1, row = 1; n < 32; ++n, row <<= 1)
+        odd[n] = row;
+
+    __gf2_matrix_square(even, odd);     /* 2 bits */
+    __gf2_matrix_square(odd, even);     /* 4 bits */
+
+    /* Square up to 'len' bytes, the result ends in even or odd */
+    for (;;) {
+        __gf2_matrix_square(even, odd);
+        if ((len >>= 1) == 0)
+            return;
+
+        __gf2_matrix_square(odd, even);
+        if ((len >>= 1) == 0)
+            break;
+    }
+
+    memcpy(even, odd, 32 * sizeof(uint32_t));
+}
+
+static void __crc32c_zeros (uint32_t zeros[][256],
+                            size_t len)
+{
+    uint32_t op[32];
+    uint32_t n;
+
+    __crc32c_zeros_op(op, len);
+    for (n = 0; n < 256; ++n) {
+        zeros[0][n] = __gf2_matrix_times(op, n);
+        zeros[1][n] = __gf2_matrix_times(op, n << 8);
+        zeros[2][n] = __gf2_matrix_times(op, n << 16);
+        zeros[3][n] = __gf2_matrix_times(op, n << 24);
+    }
+}
+
+static uint32_t __crc32c_shift (uint32_t zeros[][256],
+                                uint32_t crc)
+{
+    return(zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24]);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t __crc32c_hw (uint32_t crc,
+                             const uint8_t *p,
+                             size_t n)
+{
+    const uint8_t *end;
+    uint64_t crc0, crc1, crc2;
+    uint64_t w0, w1, w2;
+
+    crc0 = ~crc;
+    while (n > 0 && ((uintptr_t)p & 7) != 0) {
+        crc0 = __builtin_ia32_crc32qi((uint32_t)crc0, *p++);
+        n--;
+    }
+
+    while (n >= 3 * __CRC32C_LONG) {
+        crc1 = 0;
+        crc2 = 0;
+        end = p + __CRC32C_LONG;
+        do {
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + __CRC32C_LONG, 8);
+            memcpy(&w2, p + 2 * __CRC32C_LONG, 8);
+            crc0 = __builtin_ia32_crc32di(crc0, w0);
+            crc1 = __builtin_ia32_crc32di(crc1, w1);
+            crc2 = __builtin_ia32_crc32di(crc2, w2);
+            p += 8;
+        } while (p < end);
+        crc0 = __crc32c_shift(__crc32c_long, (uint32_t)crc0) ^ crc1;
+        crc0 = __crc32c_shift(__crc32c_long, (uint32_t)crc0) ^ crc2;
+        p += 2 * __CRC32C_LONG;
+        n -= 3 * __CRC32C_LONG;
+    }
+
+    while (n >= 3 * __CRC32C_SHORT) {
+        crc1 = 0;
+        crc2 = 0;
+        end = p + __CRC32C_SHORT;
+        do {
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + __CRC32C_SHORT, 8);
+            memcpy(&w2, p + 2 * __CRC32C_SHORT, 8);
+            crc0 = __builtin_ia32_crc32di(crc0, w0);
+            crc1 = __builtin_ia32_crc32di(crc1, w1);
+            crc2 = __builtin_ia32_crc32di(crc2, w2);
+            p += 8;
+        } while (p < end);
+        crc0 = __crc32c_shift(__crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = __crc32c_shift(__crc32c_short, (uint32_t)crc0) ^ crc2;
+        p += 2 * __CRC32C_SHORT;
+        n -= 3 * __CRC32C_SHORT;
+    }
+
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&w0, p, 8);
+        crc0 = __builtin_ia32_crc32di(crc0, w0);
+    }
+
+    while (n-- > 0)
+        crc0 = __builtin_ia32_crc32qi((uint32_t)crc0, *p++);
+
+    return(~(uint32_t)crc0);
+}
+#endif /* __CRC32C_HW */
+
+static void __crc32c_init (void) {
+    uint32_t crc;
+    uint32_t n;
+    int k;
+
+    for (n = 0; n < 256; ++n) {
+        crc = n;
+        for (k = 0; k < 8; ++k)
+            crc = (crc & 1) ? ((crc >> 1) ^ __CRC32C_POLY) : (crc >> 1);
+        __crc32c_table[0][n] = crc;
+    }
+
+    for (n = 0; n < 256; ++n) {
+        crc = __crc32c_table[0][n];
+        for (k = 1; k < 8; ++k) {
+            crc = __crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            __crc32c_table[k][n] = crc;
+        }
+    }
+
+    __crc32c_func = __crc32c_sw;
+#ifdef __CRC32C_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        __crc32c_zeros(__crc32c_long, __CRC32C_LONG);
+        __crc32c_zeros(__crc32c_short, __CRC32C_SHORT);
+        __crc32c_func = __crc32c_hw;
+    }
+#endif
+}
+
+/* ===========================================================================
+ *  PUBLIC Methods
+ */
+uint32_t btcrc32c (uint32_t crc,
+                   const void *data,
+                   size_t size)
+{
+    pthread_once(&__crc32c_once, __crc32c_init);
+    return(__crc32c_func(crc, (const uint8_t *)data, size));
+}
+
+uint32_t btcrc32c_sw (uint32_t crc,
+                      const void *data,
+                      size_t size)
+{
+    pthread_once(&__crc32c_once, __crc32c_init);
+    return(__crc32c_sw(crc, (const uint8_t *)data, size));
+}
+
+uint32_t btcrc32c_disk (btdisk_t *disk,
+                        const void *data,
+                        uint32_t size)
+{
+    return(btcrc32c(0, data, size));
+}
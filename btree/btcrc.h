@@ -0,0 +1,29 @@
+#ifndef _BTCRC_H_
+#define _BTCRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "btree.h"
+
+/*
+ * CRC32C (Castagnoli), the default btdisk_t crc_pointer/crc_block.
+ * SSE4.2 crc32 on x86-64, three streams interleaved to hide its latency,
+ * slicing-by-8 tables elsewhere. The implementation is picked once, on
+ * first use. 'crc' is the crc of the previous data (0 to start).
+ */
+uint32_t    btcrc32c            (uint32_t crc,
+                                 const void *data,
+                                 size_t size);
+
+/* Portable slicing-by-8, the fallback of btcrc32c() */
+uint32_t    btcrc32c_sw         (uint32_t crc,
+                                 const void *data,
+                                 size_t size);
+
+/* btdisk_crc_t */
+uint32_t    btcrc32c_disk       (btdisk_t *disk,
+                                 const void *data,
+                                 uint32_t size);
+
+#endif /* !_BTCRC_H_ */
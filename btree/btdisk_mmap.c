@@ -0,0 +1,623 @@
+#define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "btdisk_mmap.h"
+
+#ifdef __linux__
+  #include <sys/syscall.h>
+  #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+    #include <linux/io_uring.h>
+    #define BTDISK_MMAP_URING
+  #endif
+#endif
+
+#define BTDISK_MMAP_SEGMENT_SHIFT       (26)
+#define BTDISK_MMAP_SEGMENT_SIZE        (1ULL << BTDISK_MMAP_SEGMENT_SHIFT)
+#define BTDISK_MMAP_SEGMENT_MASK        (BTDISK_MMAP_SEGMENT_SIZE - 1)
+#define BTDISK_MMAP_SEGMENTS            (1U << 16)    /* Up to 4TiB */
+#define BTDISK_MMAP_AIO_THREADS         (8)
+
+#ifdef BTDISK_MMAP_URING
+struct btdisk_uring {
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    uint32_t *      sq_head;
+    uint32_t *      sq_tail;
+    uint32_t *      sq_mask;
+    uint32_t *      sq_array;
+    uint32_t *      cq_head;
+    uint32_t *      cq_tail;
+    uint32_t *      cq_mask;
+    void *          sq_ring;
+    void *          cq_ring;
+    size_t          sq_ring_size;
+    size_t          cq_ring_size;
+    size_t          sqes_size;
+    int             fd;
+};
+#endif /* BTDISK_MMAP_URING */
+
+struct btdisk_mmap {
+    uint8_t **      segments;       /* Mapped segments, NULL if not yet */
+    uint64_t        size;           /* File size, next append offset */
+    pthread_mutex_t lock;           /* Segment mapping */
+    int             error;          /* First failed write errno, sticky */
+    int             fd;
+
+    /* Async I/O, io_uring or a pool of threads doing pread/pwrite */
+    struct btdisk_uring *ring;      /* NULL with the thread pool */
+    btdisk_aio_t ** queue;          /* Pool requests, a ring of 'depth' */
+    pthread_t *     workers;
+    uint32_t        nworkers;
+    uint32_t        depth;          /* Max requests in flight (0 no aio) */
+    uint32_t        inflight;
+    uint32_t        qhead;
+    uint32_t        qcount;
+    int             reaping;        /* A thread waits ring completions */
+    int             stop;
+    pthread_mutex_t aio_lock;
+    pthread_cond_t  aio_done;       /* Requests completed */
+    pthread_cond_t  aio_queued;     /* Pool requests queued */
+};
+
+#define __btdisk_mmap(disk)     ((struct btdisk_mmap *)((disk)->internal))
+
+/* pwrite() the whole buffer, returns the bytes written (short on error) */
+static uint32_t __mmap_pwrite (int fd,
+                               const void *data,
+                               uint32_t size,
+                               uint64_t offset)
+{
+    uint32_t written;
+    ssize_t n;
+
+    for (written = 0; written < size; written += n) {
+        n = pwrite(fd, (const uint8_t *)data + written,
+                   size - written, offset + written);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;
+            break;
+        }
+    }
+
+    return(written);
+}
+
+/* Writes return an offset only, the first failure is kept for sync() */
+static void __mmap_write_block (struct btdisk_mmap *m,
+                                const void *data,
+                                uint32_t size,
+                                uint64_t offset)
+{
+    int expected = 0;
+
+    if (__mmap_pwrite(m->fd, data, size, offset) != size) {
+        __atomic_compare_exchange_n(&(m->error), &expected, errno, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t __mmap_append (btdisk_t *disk,
+                               const void *data,
+                               uint32_t size)
+{
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+    uint64_t offset;
+
+    offset = __atomic_fetch_add(&(m->size), size, __ATOMIC_ACQ_REL);
+    __mmap_write_block(m, data, size, offset);
+
+    return(offset);
+}
+
+static uint64_t __mmap_write (btdisk_t *disk,
+                              uint64_t block_offset,
+                              uint32_t block_size,
+                              const void *data,
+                              uint32_t size)
+{
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+
+    /* New block, or (compressed) block grown over its slot */
+    if (block_offset == 0 || size > block_size)
+        return(__mmap_append(disk, data, size));
+
+    __mmap_write_block(m, data, size, block_offset);
+
+    return(block_offset);
+}
+
+static uint32_t __mmap_read (btdisk_t *disk,
+                             uint64_t offset,
+                             void *buffer,
+                             uint32_t size)
+{
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+
+    if (pread(m->fd, buffer, size, offset) != (ssize_t)size)
+        return(0);
+
+    return(size);
+}
+
+static uint64_t __mmap_erase (btdisk_t *disk,
+                              uint64_t offset,
+                              uint32_t size)
+{
+    /* Space is not reused, blocks may still be mapped */
+    return(offset);
+}
+
+static int __mmap_sync (btdisk_t *disk) {
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+    int error;
+
+    if (fdatasync(m->fd) < 0)
+        return(-1);
+
+    if ((error = __atomic_load_n(&(m->error), __ATOMIC_ACQUIRE)) != 0) {
+        errno = error;
+        return(-1);
+    }
+
+    return(0);
+}
+
+static const void *__mmap_map (btdisk_t *disk,
+                               uint64_t offset,
+                               uint32_t size)
+{
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+    uint64_t segment;
+    uint8_t *base;
+
+    /* Blocks across segments, or past the end of file, are read */
+    segment = offset >> BTDISK_MMAP_SEGMENT_SHIFT;
+    if (size == 0 || segment >= BTDISK_MMAP_SEGMENTS ||
+        ((offset + size - 1) >> BTDISK_MMAP_SEGMENT_SHIFT) != segment ||
+        (offset + size) > __atomic_load_n(&(m->size), __ATOMIC_ACQUIRE))
+    {
+        return(NULL);
+    }
+
+    if ((base = __atomic_load_n(&(m->segments[segment]), __ATOMIC_ACQUIRE)) == NULL) {
+        pthread_mutex_lock(&(m->lock));
+        if ((base = m->segments[segment]) == NULL) {
+            base = (uint8_t *) mmap(NULL, BTDISK_MMAP_SEGMENT_SIZE, PROT_READ,
+                                    MAP_SHARED, m->fd,
+                                    segment << BTDISK_MMAP_SEGMENT_SHIFT);
+            if (base == MAP_FAILED) {
+                pthread_mutex_unlock(&(m->lock));
+                return(NULL);
+            }
+            __atomic_store_n(&(m->segments[segment]), base, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&(m->lock));
+    }
+
+    return(base + (offset & BTDISK_MMAP_SEGMENT_MASK));
+}
+
+/* Async I/O.
+ *  Requests are queued under the aio lock. With io_uring one waiting
+ *  thread at a time enters the ring to reap completions for everybody,
+ *  the others wait on the condition. The thread pool workers just do
+ *  pread/pwrite. Submit waits while 'depth' requests are in flight.
+ */
+static uint32_t __aio_transfer (struct btdisk_mmap *m,
+                                btdisk_aio_t *aio)
+{
+    ssize_t n;
+
+    if (aio->write)
+        return(__mmap_pwrite(m->fd, aio->buffer, aio->size, aio->offset));
+
+    n = pread(m->fd, aio->buffer, aio->size, aio->offset);
+    return((n < 0) ? 0 : (uint32_t)n);
+}
+
+static void __aio_finish (struct btdisk_mmap *m,
+                          btdisk_aio_t *aio,
+                          uint32_t result)
+{
+    aio->result = result;
+    aio->done = 1;
+    m->inflight--;
+}
+
+#ifdef BTDISK_MMAP_URING
+static int __uring_enter (struct btdisk_uring *ring,
+                          uint32_t to_submit,
+                          uint32_t min_complete,
+                          uint32_t flags)
+{
+    return(syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                   min_complete, flags, NULL, 0));
+}
+
+static void __uring_close (struct btdisk_uring *ring) {
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+static void *__uring_mmap (struct btdisk_uring *ring,
+                           size_t size,
+                           off_t offset)
+{
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, offset);
+    return((p == MAP_FAILED) ? NULL : p);
+}
+
+static struct btdisk_uring *__uring_open (uint32_t depth) {
+    struct btdisk_uring *ring;
+    struct io_uring_params p;
+    uint8_t *sq;
+    uint8_t *cq;
+
+    if ((ring = (struct btdisk_uring *) calloc(1, sizeof(struct btdisk_uring))) == NULL)
+        return(NULL);
+
+    memset(&p, 0, sizeof(struct io_uring_params));
+    if ((ring->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0) {
+        free(ring);
+        return(NULL);
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = __uring_mmap(ring, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = __uring_mmap(ring, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes = __uring_mmap(ring, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL) {
+        __uring_close(ring);
+        return(NULL);
+    }
+
+    sq = (uint8_t *)ring->sq_ring;
+    ring->sq_head = (uint32_t *)(sq + p.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+    ring->sq_mask = (uint32_t *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + p.sq_off.array);
+
+    cq = (uint8_t *)ring->cq_ring;
+    ring->cq_head = (uint32_t *)(cq + p.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+    ring->cq_mask = (uint32_t *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return(ring);
+}
+
+/* SQEs queued and not yet consumed by the kernel */
+static uint32_t __uring_pending (struct btdisk_uring *ring) {
+    return(*(ring->sq_tail) - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static void __uring_push (struct btdisk_uring *ring,
+                          btdisk_aio_t *aio,
+                          int fd)
+{
+    struct io_uring_sqe *sqe;
+    uint32_t index;
+    uint32_t tail;
+
+    tail = *(ring->sq_tail);
+    index = tail & *(ring->sq_mask);
+    sqe = &(ring->sqes[index]);
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = aio->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)aio->buffer;
+    sqe->len = aio->size;
+    sqe->off = aio->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)aio;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void __uring_reap (struct btdisk_mmap *m) {
+    struct btdisk_uring *ring = m->ring;
+    struct io_uring_cqe *cqe;
+    uint32_t head;
+    uint32_t tail;
+
+    head = *(ring->cq_head);
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+        __aio_finish(m, (btdisk_aio_t *)(uintptr_t)cqe->user_data,
+                     (cqe->res < 0) ? 0 : (uint32_t)cqe->res);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif /* BTDISK_MMAP_URING */
+
+/* Wait for some completion, called and returns with the aio lock held */
+static void __aio_wait (struct btdisk_mmap *m) {
+#ifdef BTDISK_MMAP_URING
+    uint32_t pending;
+
+    if (m->ring != NULL && !m->reaping) {
+        /* Submit what a failed enter may have left in the ring, too */
+        pending = __uring_pending(m->ring);
+        m->reaping = 1;
+        pthread_mutex_unlock(&(m->aio_lock));
+        __uring_enter(m->ring, pending, 1, IORING_ENTER_GETEVENTS);
+        pthread_mutex_lock(&(m->aio_lock));
+        __uring_reap(m);
+        m->reaping = 0;
+        pthread_cond_broadcast(&(m->aio_done));
+        return;
+    }
+#endif
+    pthread_cond_wait(&(m->aio_done), &(m->aio_lock));
+}
+
+static void *__aio_worker (void *arg) {
+    struct btdisk_mmap *m = (struct btdisk_mmap *)arg;
+    btdisk_aio_t *aio;
+    uint32_t result;
+
+    pthread_mutex_lock(&(m->aio_lock));
+    for (;;) {
+        while (m->qcount == 0 && !m->stop)
+            pthread_cond_wait(&(m->aio_queued), &(m->aio_lock));
+
+        if (m->qcount == 0)
+            break;
+
+        aio = m->queue[m->qhead];
+        m->qhead = (m->qhead + 1) % m->depth;
+        m->qcount--;
+
+        pthread_mutex_unlock(&(m->aio_lock));
+        result = __aio_transfer(m, aio);
+        pthread_mutex_lock(&(m->aio_lock));
+
+        __aio_finish(m, aio, result);
+        pthread_cond_broadcast(&(m->aio_done));
+    }
+    pthread_mutex_unlock(&(m->aio_lock));
+
+    return(NULL);
+}
+
+static int __mmap_submit (btdisk_t *disk,
+                          btdisk_aio_t *aio,
+                          uint32_t count)
+{
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+    uint32_t i;
+
+    pthread_mutex_lock(&(m->aio_lock));
+    for (i = 0; i < count; ++i) {
+        while (m->inflight >= m->depth)
+            __aio_wait(m);
+
+        aio[i].result = 0;
+        aio[i].done = 0;
+        m->inflight++;
+
+#ifdef BTDISK_MMAP_URING
+        if (m->ring != NULL) {
+            __uring_push(m->ring, &(aio[i]), m->fd);
+            continue;
+        }
+#endif
+        m->queue[(m->qhead + m->qcount) % m->depth] = &(aio[i]);
+        m->qcount++;
+        pthread_cond_signal(&(m->aio_queued));
+    }
+
+#ifdef BTDISK_MMAP_URING
+    /* On failure the SQEs stay queued, the next reaper submits them */
+    if (m->ring != NULL)
+        __uring_enter(m->ring, __uring_pending(m->ring), 0, 0);
+#endif
+    pthread_mutex_unlock(&(m->aio_lock));
+
+    return(0);
+}
+
+static int __mmap_complete (btdisk_t *disk,
+                            btdisk_aio_t *aio,
+                            uint32_t count)
+{
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+    uint32_t i;
+    int err;
+
+    err = 0;
+    pthread_mutex_lock(&(m->aio_lock));
+    for (i = 0; i < count; ++i) {
+        while (!aio[i].done)
+            __aio_wait(m);
+
+        if (aio[i].result != aio[i].size)
+            err = 1;
+    }
+    pthread_mutex_unlock(&(m->aio_lock));
+
+    return(err);
+}
+
+static void __aio_close (struct btdisk_mmap *m) {
+    uint32_t i;
+
+    pthread_mutex_lock(&(m->aio_lock));
+    m->stop = 1;
+    pthread_cond_broadcast(&(m->aio_queued));
+    pthread_mutex_unlock(&(m->aio_lock));
+
+    for (i = 0; i < m->nworkers; ++i)
+        pthread_join(m->workers[i], NULL);
+
+#ifdef BTDISK_MMAP_URING
+    if (m->ring != NULL)
+        __uring_close(m->ring);
+#endif
+
+    if (m->workers != NULL)
+        free(m->workers);
+    if (m->queue != NULL)
+        free(m->queue);
+
+    m->ring = NULL;
+    m->workers = NULL;
+    m->queue = NULL;
+    m->nworkers = 0;
+    m->depth = 0;
+}
+
+int btdisk_mmap_open (btdisk_t *disk,
+                      const char *path,
+                      uint64_t reserved)
+{
+    struct btdisk_mmap *m;
+    struct stat st;
+
+    if ((m = (struct btdisk_mmap *) malloc(sizeof(struct btdisk_mmap))) == NULL)
+        return(1);
+
+    if (!(m->segments = (uint8_t **) calloc(BTDISK_MMAP_SEGMENTS, sizeof(uint8_t *)))) {
+        free(m);
+        return(2);
+    }
+
+    if ((m->fd = open(path, O_CREAT | O_RDWR, 0600)) < 0) {
+        free(m->segments);
+        free(m);
+        return(3);
+    }
+
+    if (fstat(m->fd, &st) < 0) {
+        close(m->fd);
+        free(m->segments);
+        free(m);
+        return(4);
+    }
+
+    m->size = ((uint64_t)st.st_size > reserved) ? (uint64_t)st.st_size : reserved;
+    pthread_mutex_init(&(m->lock), NULL);
+    m->error = 0;
+
+    m->ring = NULL;
+    m->queue = NULL;
+    m->workers = NULL;
+    m->nworkers = 0;
+    m->depth = 0;
+    m->inflight = 0;
+    m->qhead = 0;
+    m->qcount = 0;
+    m->reaping = 0;
+    m->stop = 0;
+    pthread_mutex_init(&(m->aio_lock), NULL);
+    pthread_cond_init(&(m->aio_done), NULL);
+    pthread_cond_init(&(m->aio_queued), NULL);
+
+    disk->append = __mmap_append;
+    disk->erase = __mmap_erase;
+    disk->write = __mmap_write;
+    disk->read = __mmap_read;
+    disk->sync = __mmap_sync;
+    disk->map = __mmap_map;
+    disk->submit = NULL;
+    disk->complete = NULL;
+    disk->internal = m;
+
+    return(0);
+}
+
+int btdisk_mmap_aio (btdisk_t *disk,
+                     uint32_t depth,
+                     uint32_t threads)
+{
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+
+    if (m->depth != 0 || depth == 0)
+        return(1);
+
+    m->depth = depth;
+    m->stop = 0;
+
+#ifdef BTDISK_MMAP_URING
+    if (threads == 0 && (m->ring = __uring_open(depth)) != NULL)
+        goto _aio_ready;
+#endif
+
+    if (threads == 0)
+        threads = (depth < BTDISK_MMAP_AIO_THREADS) ? depth : BTDISK_MMAP_AIO_THREADS;
+
+    m->queue = (btdisk_aio_t **) malloc(depth * sizeof(btdisk_aio_t *));
+    m->workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    if (m->queue == NULL || m->workers == NULL) {
+        __aio_close(m);
+        return(2);
+    }
+
+    for (; m->nworkers < threads; m->nworkers++) {
+        if (pthread_create(&(m->workers[m->nworkers]), NULL, __aio_worker, m)) {
+            __aio_close(m);
+            return(3);
+        }
+    }
+
+#ifdef BTDISK_MMAP_URING
+_aio_ready:
+#endif
+    disk->submit = __mmap_submit;
+    disk->complete = __mmap_complete;
+    return(0);
+}
+
+int btdisk_mmap_uring (btdisk_t *disk) {
+    return(__btdisk_mmap(disk)->ring != NULL);
+}
+
+void btdisk_mmap_close (btdisk_t *disk) {
+    struct btdisk_mmap *m = __btdisk_mmap(disk);
+    uint32_t i;
+
+    for (i = 0; i < BTDISK_MMAP_SEGMENTS; ++i) {
+        if (m->segments[i] != NULL)
+            munmap(m->segments[i], BTDISK_MMAP_SEGMENT_SIZE);
+    }
+
+    __aio_close(m);
+    pthread_cond_destroy(&(m->aio_queued));
+    pthread_cond_destroy(&(m->aio_done));
+    pthread_mutex_destroy(&(m->aio_lock));
+
+    pthread_mutex_destroy(&(m->lock));
+    close(m->fd);
+    free(m->segments);
+    free(m);
+    disk->internal = NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef _BTDISK_MMAP_H_
+#define _BTDISK_MMAP_H_
+
+#include <stdint.h>
+
+#include "btree.h"
+
+/*
+ * File disk driver. Blocks are written with pwrite(), new ones appended
+ * at the end of file, and read in place from a shared read-only mapping
+ * (btdisk_t map): clean nodes cost no copy, and every process opening
+ * the file shares the same page cache.
+ * The file is mapped in 64MiB segments, on first use, until close.
+ * Only the I/O callbacks are set, crc and compression are up to the caller.
+ * Appends start at 'reserved' on an empty (or shorter) file.
+ * Writes retry short and interrupted pwrite() calls. A write that still
+ * fails is not reported by append/write, whose offsets stay as if it
+ * succeeded: the first error is kept, and every later sync() fails with
+ * it (-1, errno set) until close. Sync after btree_sync() to know the
+ * tree reached the file.
+ */
+int     btdisk_mmap_open    (btdisk_t *disk,
+                             const char *path,
+                             uint64_t reserved);
+void    btdisk_mmap_close   (btdisk_t *disk);
+
+/*
+ * Async I/O (btdisk_t submit/complete), up to 'depth' requests in flight.
+ * io_uring when the kernel has it, or a pool of 'threads' doing pread()
+ * and pwrite() (threads 0: io_uring, or a pool of up to 8 threads).
+ * Clear disk map to have scans read ahead instead of faulting pages in.
+ * btdisk_mmap_uring() tells if requests go through io_uring.
+ */
+int     btdisk_mmap_aio     (btdisk_t *disk,
+                             uint32_t depth,
+                             uint32_t threads);
+int     btdisk_mmap_uring   (btdisk_t *disk);
+
+#endif /* !_BTDISK_MMAP_H_ */
@@ -12,16 +12,21 @@
  *         |__| |__| |__|     |__| |__| |__|     |__| |__| |__|
  */
 
+#define _GNU_SOURCE
 #define __BTREE_DEBUG
 #ifdef __BTREE_DEBUG
     #include <inttypes.h>
     #include <stdio.h>
 #endif /* !__BTREE_DEBUG */
 
+#include <pthread.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include "btree.h"
+#include "btcrc.h"
 
 /* ===========================================================================
  *  On-Disk Data Structure
@@ -31,7 +36,7 @@
 struct super_block {
     uint32_t   sb_magic;               /* BTree Super-Block Magic */
 
-    uint16_t   sb_format;              /* BTree Format (Unused) */
+    uint16_t   sb_format;              /* BTree Format (Key Coding)      */
     uint16_t   sb_node_magic;          /* BTree Node-Head Magic */
 
     uint32_t   sb_block_size;          /* BTree Block Size */
@@ -39,8 +44,8 @@ struct super_block {
     uint16_t   sb_key_size;            /* BTree Leaf Node Key Size */
     uint16_t   sb_fanout;              /* BTree Fanout */
     uint8_t    sb_height;              /* BTree Height */
-    uint8_t    sb_pad0;
-    uint32_t   sb_pad1;
+    uint8_t    sb_flags;               /* BTree Flags (Append-Only) */
+    uint32_t   sb_generation;          /* BTree Commit Generation */
 
     uint64_t   sb_item_count;          /* BTree Item Count */
     uint64_t   sb_node_count;          /* BTree Node Count */
@@ -51,6 +56,47 @@ struct super_block {
     uint32_t   sb_root_size;           /* BTree Root Block Size   */
 } __attribute__((packed));
 
+/* Blocks are never overwritten, each sync appends a new root and super */
+#define SUPER_FLAG_APPEND_ONLY      (1 << 0)
+/* Free blocks are tracked, the space-map header follows the super-block */
+#define SUPER_FLAG_SPACE_MAP        (1 << 1)
+
+/* Free-Space Map Header 64 byte, a bit per unit set if used */
+struct space_super {
+    uint32_t   ss_magic;               /* Space-Map Magic */
+    uint32_t   ss_crc;                 /* Space-Map Bitmap CRC */
+
+    uint32_t   ss_unit;                /* Space-Map Allocation Unit */
+    uint32_t   ss_size;                /* Space-Map Bitmap Size */
+    uint32_t   ss_slot;                /* Space-Map Bitmap Block Size */
+    uint32_t   ss_pad;
+
+    uint64_t   ss_units;               /* Space-Map Units covered */
+    uint64_t   ss_base;                /* Space-Map First managed Unit */
+    uint64_t   ss_free;                /* Space-Map Free Units */
+    uint64_t   ss_blocknr;             /* Space-Map Bitmap Block */
+    uint64_t   ss_reserved;
+} __attribute__((packed));
+
+#define SPACE_SUPER_MAGIC           (0x53504d50)
+
+/* Super-Anchor 32 byte, two in the super-block slot given to create/open
+ * of an append-only tree (never written by its syncs). The valid one with
+ * the newest generation points to the last super-block, each commit
+ * writes the other one.
+ */
+struct super_anchor {
+    uint32_t   sa_magic;               /* Super-Anchor Magic */
+    uint32_t   sa_crc;                 /* Super-Anchor CRC, from sa_home */
+
+    uint64_t   sa_home;                /* Offset of the anchor slot */
+    uint64_t   sa_offset;              /* Offset of the last super-block */
+    uint32_t   sa_generation;          /* Generation of the last super-block */
+    uint32_t   sa_pad;
+} __attribute__((packed));
+
+#define SUPER_ANCHOR_MAGIC          (0x53414e43)
+
 /* Node Header - 16 byte */
 struct node_head {
     uint32_t   nh_crc;                 /* BTree Node CRC */
@@ -70,6 +116,19 @@ struct item_head {
     uint32_t   ih_size;                /* BTree Leaf Item Size   */
 } __attribute__((packed));
 
+/* Item value is the node pointer of a blob block, np_size is the value size */
+#define ITEM_BLOB                   (1U << 31)
+
+/* Front-Coded Item Prefix - 2 byte, followed by key suffix and value */
+struct item_prefix {
+    uint16_t   ip_shared;              /* Bytes shared with the previous key */
+} __attribute__((packed));
+
+/* Variable-Size Item Key - 2 byte, followed by the key */
+struct item_key {
+    uint16_t   ik_size;                /* Key size */
+} __attribute__((packed));
+
 /* Node Pointer - 16 byte */
 struct node_pointer {
     uint64_t   np_blocknr;             /* BTree Iternal Node Pointer */
@@ -81,9 +140,14 @@ struct node_pointer {
  *  Data Structures size.
  */
 #define SUPER_BLOCK_SIZE            (sizeof(struct super_block))
+#define SPACE_SUPER_SIZE            (sizeof(struct space_super))
+#define SUPER_ANCHOR_SIZE           (sizeof(struct super_anchor))
+#define SUPER_ANCHOR_SLOTS          (2)
 #define NODE_POINTER_SIZE           (sizeof(struct node_pointer))
 #define NODE_HEAD_SIZE              (sizeof(struct node_head))
 #define ITEM_HEAD_SIZE              (sizeof(struct item_head))
+#define ITEM_PREFIX_SIZE            (sizeof(struct item_prefix))
+#define ITEM_KEY_SIZE               (sizeof(struct item_key))
 
 /* ===========================================================================
  *  Data Structure cast
@@ -92,6 +156,8 @@ struct node_pointer {
 #define NODE_POINTER(x)             ((struct node_pointer *)(x))
 #define NODE_HEAD(x)                ((struct node_head *)(x))
 #define ITEM_HEAD(x)                ((struct item_head *)(x))
+#define ITEM_PREFIX(x)              ((struct item_prefix *)(x))
+#define ITEM_KEY(x)                 ((struct item_key *)(x))
 
 /* ===========================================================================
  *  Super-Block Macros
@@ -104,7 +170,11 @@ struct node_pointer {
 #define __btree_fanout(btree)       (__btree_super(btree)->sb_fanout)
 #define __btree_format(btree)       (__btree_super(btree)->sb_format)
 #define __btree_key_size(btree)     (__btree_super(btree)->sb_key_size)
-#define __btree_item_size(btree)    (__btree_key_size(btree) + ITEM_HEAD_SIZE)
+#define __btree_is_coded(btree)     (__btree_format(btree) == BTREE_FORMAT_FRONT_CODED)
+#define __btree_is_varkey(btree)    (__btree_format(btree) == BTREE_FORMAT_VARIABLE)
+#define __btree_is_plain(btree)     (__btree_format(btree) == BTREE_FORMAT_PLAIN)
+#define __btree_item_size(btree)    (__btree_slot_key_size(btree) + ITEM_HEAD_SIZE)
+#define __btree_slot_key_size(btree) (__btree_is_plain(btree) ? __btree_key_size(btree) : 0)
 #define __btree_block_size(btree)   (__btree_super(btree)->sb_block_size)
 #define __btree_node_magic(btree)   (__btree_super(btree)->sb_node_magic)
 #define __btree_node_space(btree)   (__btree_block_size(btree) - NODE_HEAD_SIZE)
@@ -114,10 +184,26 @@ struct node_pointer {
 #define __btree_node_count(btree)   (__btree_super(btree)->sb_node_count)
 #define __btree_is_empty(btree)     (__btree_item_count(btree) == 0)
 #define __btree_is_null(btree)      (__btree_node_count(btree) == 0)
+#define __btree_generation(btree)   (__btree_super(btree)->sb_generation)
+#define __btree_is_append_only(btree)                                       \
+    (__btree_flags(btree) & SUPER_FLAG_APPEND_ONLY)
+#define __btree_has_space_map(btree)                                        \
+    (__btree_flags(btree) & SUPER_FLAG_SPACE_MAP)
 
 #define __btree_root_pointer(btree)                                          \
     NODE_POINTER((btree)->super + SUPER_BLOCK_SIZE - NODE_POINTER_SIZE)
 
+/* Keys ordered as memcmp() skip the compare callback */
+#define __btree_keycmp(btree, a, b)                                         \
+    ((btree)->memcmp_keys ?                                                 \
+        memcmp(a, b, __btree_key_size(btree)) :                             \
+        (btree)->keycmp((btree)->user_data, a, b))
+
+/* Key size is the max one for BTREE_FORMAT_VARIABLE, ask for the real one */
+#define __btree_key_len(btree, key)                                         \
+    (__btree_is_varkey(btree) ?                                             \
+        (btree)->keysize((btree)->user_data, key) : __btree_key_size(btree))
+
 /* ============================================================================
  * Node Levels
  */
@@ -147,6 +233,7 @@ struct node_pointer {
 #define NODE_FLAG_ON_DISK              (1 << 1)
 #define NODE_FLAG_UPDATE               (1 << 2)
 #define NODE_FLAG_NOSORT               (1 << 3)
+#define NODE_FLAG_MAPPED               (1 << 4)
 
 #define __node_has_flag(node, flag)    ((node)->flags & (flag))
 #define __node_set_flag(node, flag)    (node)->flags |= (flag)
@@ -156,11 +243,37 @@ struct node_pointer {
 #define __node_set_dirty(node)         __node_set_flag(node, NODE_FLAG_DIRTY)
 #define __node_set_clean(node)         __node_unset_flag(node, NODE_FLAG_DIRTY)
 
+/* Dirty leaves are counted, the background flusher starts from the count */
+#define __node_mark_dirty(btree, node)                                      \
+    do {                                                                    \
+        if (!__node_is_dirty(node)) {                                       \
+            __node_set_dirty(node);                                         \
+            if ((node)->pointers == NULL)                                   \
+                __atomic_add_fetch(&((btree)->dirty_leaves), 1,             \
+                                   __ATOMIC_RELAXED);                       \
+        }                                                                   \
+    } while (0)
+
+#define __node_mark_clean(btree, node)                                      \
+    do {                                                                    \
+        if (__node_is_dirty(node)) {                                        \
+            __node_set_clean(node);                                         \
+            if ((node)->pointers == NULL)                                   \
+                __atomic_sub_fetch(&((btree)->dirty_leaves), 1,             \
+                                   __ATOMIC_RELAXED);                       \
+        }                                                                   \
+    } while (0)
+
 #define __node_is_on_disk(node)        __node_has_flag(node, NODE_FLAG_ON_DISK)
 #define __node_set_on_disk(node)       __node_set_flag(node, NODE_FLAG_ON_DISK)
 
 #define __node_need_update(node)       __node_has_flag(node, NODE_FLAG_UPDATE)
 #define __node_set_to_update(node)     __node_set_flag(node, NODE_FLAG_UPDATE)
+#define __node_set_updated(node)       __node_unset_flag(node, NODE_FLAG_UPDATE)
+
+#define __node_is_mapped(node)         __node_has_flag(node, NODE_FLAG_MAPPED)
+#define __node_set_mapped(node)        __node_set_flag(node, NODE_FLAG_MAPPED)
+#define __node_set_unmapped(node)      __node_unset_flag(node, NODE_FLAG_MAPPED)
 
 #define __node_is_unsorted(node)       __node_has_flag(node, NODE_FLAG_NOSORT)
 #define __node_set_sorted(node)        __node_unset_flag(node, NODE_FLAG_NOSORT)
@@ -169,15 +282,26 @@ struct node_pointer {
 /* ============================================================================
  *  Twig Node Macros
  */
+/* Variable-size keys twigs are slotted, the pointer ends the item body */
 #define __twig_pointer(btree, node, index)                                  \
     ((struct node_pointer *)                                                \
-    ((((node)->data) + NODE_HEAD_SIZE) +                                    \
-     (__btree_fanout(btree) * __btree_prefix_size(btree)) +                 \
-     ((index) * NODE_POINTER_SIZE)))
+    (__btree_is_varkey(btree) ?                                             \
+        (__item_body(btree, node, index) +                                  \
+         __item_body_size(btree, node, index) - NODE_POINTER_SIZE) :        \
+        ((((node)->data) + NODE_HEAD_SIZE) +                                \
+         (__btree_fanout(btree) * __btree_prefix_size(btree)) +             \
+         ((index) * NODE_POINTER_SIZE))))
 
 #define __twig_key(btree, node, index)                                      \
-    ((((node)->data) + NODE_HEAD_SIZE) +                                    \
-     ((index) * __btree_prefix_size(btree)))
+    (__btree_is_varkey(btree) ?                                             \
+        (__item_body(btree, node, index) + ITEM_KEY_SIZE) :                 \
+        ((((node)->data) + NODE_HEAD_SIZE) +                                \
+         ((index) * __btree_prefix_size(btree))))
+
+#define __twig_key_len(btree, node, index)                                  \
+    (__btree_is_varkey(btree) ?                                             \
+        ITEM_KEY(__item_body(btree, node, index))->ik_size :                \
+        __btree_prefix_size(btree))
 
 #define __twig_split_target(btree, key, node_left, node_right)              \
     ((btree->keycmp(btree->user_data, key,                                  \
@@ -193,16 +317,27 @@ struct node_pointer {
 #define __twig_last_prev_key(btree, node)                                   \
     __twig_key(btree, node, __node_items(node) - 2)
 
-#define __twig_needed(btree)                                                \
+#define __twig_item_size(btree)                                             \
     (__btree_prefix_size(btree) + NODE_POINTER_SIZE)
 
+#define __twig_needed(btree, key)                                           \
+    (__btree_is_varkey(btree) ?                                             \
+        (ITEM_HEAD_SIZE + ITEM_KEY_SIZE + __btree_key_len(btree, key) +     \
+         NODE_POINTER_SIZE) :                                               \
+        __twig_item_size(btree))
+
 /* ============================================================================
  *  Leaf Node Macros
  */
-#define __leaf_key(btree, node, index)                                      \
+#define LEAF_RESTART_INTERVAL       (16)  /* Front-coded keys between restarts */
+
+#define __leaf_slot(btree, node, index)                                     \
     ((((node)->data) + NODE_HEAD_SIZE) +                                    \
-     ((index) * __btree_key_size(btree)) +                                  \
-     ((index) * ITEM_HEAD_SIZE))
+     ((index) * __btree_item_size(btree)))
+
+/* Fixed-size key format only, other formats keep the key in the item body */
+#define __leaf_key(btree, node, index)                                      \
+    __leaf_slot(btree, node, index)
 
 #define __leaf_split_target(btree, key, node_left, node_right)              \
     ((btree->keycmp(btree->user_data, key,                                  \
@@ -224,35 +359,319 @@ struct node_pointer {
 /* ============================================================================
  *  Item (Leaf node) Macros
  */
-#define __item_needed_size(btree, size)                                     \
-    (__btree_key_size(btree) + ITEM_HEAD_SIZE + (size))
+/* Front-coded items may also grow the next item key by a whole key */
+#define __item_needed_size(btree, key, size)                                \
+    (__btree_is_varkey(btree) ?                                             \
+        (ITEM_HEAD_SIZE + ITEM_KEY_SIZE + __btree_key_len(btree, key) +     \
+         (size)) :                                                          \
+        (__btree_key_size(btree) + ITEM_HEAD_SIZE + (size) +                \
+         (__btree_is_coded(btree) ?                                         \
+            (ITEM_PREFIX_SIZE + __btree_key_size(btree)) : 0)))
 
 #define __item_head(btree, node, index)                                     \
-    (ITEM_HEAD(__leaf_key(btree, node, index) + __btree_key_size(btree)))
+    (ITEM_HEAD(__leaf_slot(btree, node, index) + __btree_slot_key_size(btree)))
 
 #define __item_body(btree, node, index)                                     \
-    ((node)->data + (__item_head(btree, node, index)->ih_offset))
+    ((node)->data + (__item_head(btree, node, index)->ih_offset & ~ITEM_BLOB))
+
+#define __item_is_blob(btree, node, index)                                  \
+    (__item_head(btree, node, index)->ih_offset & ITEM_BLOB)
+
+#define __item_set_blob(btree, node, index, blob)                           \
+    do {                                                                    \
+        if (blob)                                                           \
+            __item_head(btree, node, index)->ih_offset |= ITEM_BLOB;        \
+        else                                                                \
+            __item_head(btree, node, index)->ih_offset &= ~ITEM_BLOB;       \
+    } while (0)
 
 #define __item_body_size(btree, node, index)                                \
     (__item_head(btree, node, index)->ih_size)
 
+#define __item_shared(btree, node, index)                                   \
+    (ITEM_PREFIX(__item_body(btree, node, index))->ip_shared)
+
+#define __item_varkey(btree, node, index)                                   \
+    (__item_body(btree, node, index) + ITEM_KEY_SIZE)
+
+/* Front-coded or variable-size key bytes in front of the value */
+#define __item_key_size(btree, node, index)                                 \
+    (__btree_is_coded(btree) ?                                              \
+        (ITEM_PREFIX_SIZE + __btree_key_size(btree) -                       \
+         __item_shared(btree, node, index)) :                               \
+     __btree_is_varkey(btree) ?                                             \
+        (ITEM_KEY_SIZE + ITEM_KEY(__item_body(btree, node, index))->ik_size) : 0)
+
+#define __item_value(btree, node, index)                                    \
+    (__item_body(btree, node, index) + __item_key_size(btree, node, index))
+
+#define __item_value_size(btree, node, index)                               \
+    (__item_body_size(btree, node, index) - __item_key_size(btree, node, index))
+
+/* Value size as inserted, blob values included */
+#define __item_data_size(btree, node, index)                                \
+    (__item_is_blob(btree, node, index) ?                                   \
+        NODE_POINTER(__item_value(btree, node, index))->np_size :           \
+        __item_value_size(btree, node, index))
+
+/* ===========================================================================
+ *  PRIVATE Operations (Stats)
+ *
+ *  Counters are relaxed atomic adds on a stripe of cache-line aligned
+ *  counters, a thread always uses the stripe of its id. Disk calls are
+ *  timed only when stats are on, the clock costs far less than the call.
+ */
+struct btstats_stripe {
+    uint64_t lookups;
+    uint64_t inserts;
+    uint64_t removes;
+    uint64_t leaf_splits;
+    uint64_t twig_splits;
+    uint64_t leaf_merges;
+    uint64_t twig_merges;
+    uint64_t disk_reads;
+    uint64_t disk_read_bytes;
+    uint64_t disk_writes;
+    uint64_t disk_write_bytes;
+    uint64_t read_latency[BTREE_STATS_BUCKETS];
+    uint64_t write_latency[BTREE_STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct btstats {
+    struct btstats_stripe * stripes;
+    uint32_t                mask;       /* Stripes - 1, power of two */
+};
+
+static uint32_t __btstats_threads = 0;
+static __thread uint32_t __btstats_thread_id = 0;
+
+#define __btstats_counter_add(counter, n)                                   \
+    __atomic_add_fetch(&(counter), n, __ATOMIC_RELAXED)
+
+#define __btstats_add(btree, field, n)                                      \
+    do {                                                                    \
+        if ((btree)->stats != NULL)                                         \
+            __btstats_counter_add(__btstats_stripe(btree)->field, n);       \
+    } while (0)
+
+#define __btstats_inc(btree, field)     __btstats_add(btree, field, 1)
+
+#define __btstats_merge(btree, level)                                       \
+    do {                                                                    \
+        if ((level) == LEAF_NODE_LEVEL)                                     \
+            __btstats_inc(btree, leaf_merges);                              \
+        else                                                                \
+            __btstats_inc(btree, twig_merges);                              \
+    } while (0)
+
+static struct btstats_stripe *__btstats_stripe (btree_t *btree) {
+    if (__btstats_thread_id == 0)
+        __btstats_thread_id = __atomic_add_fetch(&__btstats_threads, 1,
+                                                 __ATOMIC_RELAXED);
+    return(&(btree->stats->stripes[__btstats_thread_id & btree->stats->mask]));
+}
+
+static btstats_t *__btstats_alloc (uint32_t stripes) {
+    btstats_t *stats;
+    uint32_t n;
+    void *p;
+
+    for (n = 1; n < stripes && n < (1U << 16); n <<= 1);
+
+    if ((stats = (btstats_t *) malloc(sizeof(btstats_t))) == NULL)
+        return(NULL);
+
+    if (posix_memalign(&p, 64, n * sizeof(struct btstats_stripe))) {
+        free(stats);
+        return(NULL);
+    }
+
+    memset(p, 0, n * sizeof(struct btstats_stripe));
+    stats->stripes = (struct btstats_stripe *) p;
+    stats->mask = n - 1;
+    return(stats);
+}
+
+static void __btstats_free (btstats_t *stats) {
+    if (stats != NULL) {
+        free(stats->stripes);
+        free(stats);
+    }
+}
+
+/* Sum every stripe of 'stats' into 'total' */
+static void __btstats_sum (const btstats_t *stats,
+                           struct btstats_stripe *total)
+{
+    const uint64_t *src;
+    uint64_t *dst;
+    uint32_t i, j;
+
+    for (i = 0; i <= stats->mask; ++i) {
+        src = (const uint64_t *) &(stats->stripes[i]);
+        dst = (uint64_t *) total;
+        for (j = 0; j < sizeof(struct btstats_stripe) / 8; ++j)
+            dst[j] += __atomic_load_n(&(src[j]), __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t __btstats_now (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec);
+}
+
+/* Bucket 0 is under 1 usec, bucket i up to 2^i usec */
+static uint32_t __btstats_bucket (uint64_t nsec) {
+    uint64_t usec = nsec / 1000;
+    uint32_t bucket;
+
+    if (usec == 0)
+        return(0);
+
+    bucket = 64 - __builtin_clzll(usec);
+    return((bucket < BTREE_STATS_BUCKETS) ? bucket : BTREE_STATS_BUCKETS - 1);
+}
+
+static void __btstats_io (btree_t *btree,
+                          uint8_t write,
+                          uint32_t size,
+                          uint64_t start)
+{
+    struct btstats_stripe *stripe = __btstats_stripe(btree);
+    uint32_t bucket = __btstats_bucket(__btstats_now() - start);
+
+    if (write) {
+        __btstats_counter_add(stripe->disk_writes, 1);
+        __btstats_counter_add(stripe->disk_write_bytes, size);
+        __btstats_counter_add(stripe->write_latency[bucket], 1);
+    } else {
+        __btstats_counter_add(stripe->disk_reads, 1);
+        __btstats_counter_add(stripe->disk_read_bytes, size);
+        __btstats_counter_add(stripe->read_latency[bucket], 1);
+    }
+}
+
+static uint64_t __btstats_append (btree_t *btree,
+                                  const void *data,
+                                  uint32_t size)
+{
+    uint64_t offset;
+    uint64_t start;
+
+    if (btree->stats == NULL)
+        return(btree->disk->append(btree->disk, data, size));
+
+    start = __btstats_now();
+    offset = btree->disk->append(btree->disk, data, size);
+    __btstats_io(btree, 1, size, start);
+    return(offset);
+}
+
+static uint64_t __btstats_write (btree_t *btree,
+                                 uint64_t block_offset,
+                                 uint32_t block_size,
+                                 const void *data,
+                                 uint32_t size)
+{
+    uint64_t offset;
+    uint64_t start;
+
+    if (btree->stats == NULL)
+        return(btree->disk->write(btree->disk, block_offset, block_size, data, size));
+
+    start = __btstats_now();
+    offset = btree->disk->write(btree->disk, block_offset, block_size, data, size);
+    __btstats_io(btree, 1, size, start);
+    return(offset);
+}
+
+static uint32_t __btstats_read (btree_t *btree,
+                                uint64_t offset,
+                                void *data,
+                                uint32_t size)
+{
+    uint64_t start;
+    uint32_t rd;
+
+    if (btree->stats == NULL)
+        return(btree->disk->read(btree->disk, offset, data, size));
+
+    start = __btstats_now();
+    rd = btree->disk->read(btree->disk, offset, data, size);
+    __btstats_io(btree, 0, rd, start);
+    return(rd);
+}
+
+/* Async requests are counted when queued, with no latency */
+static int __btstats_submit (btree_t *btree,
+                             btdisk_aio_t *aio,
+                             uint32_t count)
+{
+    struct btstats_stripe *stripe;
+    uint32_t i;
+
+    if (btree->stats != NULL) {
+        stripe = __btstats_stripe(btree);
+        for (i = 0; i < count; ++i) {
+            if (aio[i].write) {
+                __btstats_counter_add(stripe->disk_writes, 1);
+                __btstats_counter_add(stripe->disk_write_bytes, aio[i].size);
+            } else {
+                __btstats_counter_add(stripe->disk_reads, 1);
+                __btstats_counter_add(stripe->disk_read_bytes, aio[i].size);
+            }
+        }
+    }
+
+    return(btree->disk->submit(btree->disk, aio, count));
+}
+
 /* ============================================================================
  *  BTree Disk Macros
  */
 #define __btdisk_append(btree, data, size)                                  \
-    (btree)->disk->append((btree)->disk, data, size)
+    __btstats_append(btree, data, size)
 
 #define __btdisk_write(btree, block_offset, block_size, data, size)         \
-    (btree)->disk->write((btree)->disk, block_offset, block_size, data, size)
+    __btstats_write(btree, block_offset, block_size, data, size)
 
 #define __btdisk_erase(btree, offset, size)                                 \
     (btree)->disk->erase((btree)->disk, offset, size)
 
 #define __btdisk_read(btree, offset, data, size)                            \
-    (btree)->disk->read((btree)->disk, offset, data, size)
+    __btstats_read(btree, offset, data, size)
+
+#define __btdisk_has_aio(btree)         ((btree)->disk->submit != NULL)
+
+#define __btdisk_submit(btree, aio, count)                                  \
+    __btstats_submit(btree, aio, count)
+
+#define __btdisk_complete(btree, aio, count)                                \
+    (btree)->disk->complete((btree)->disk, aio, count)
+
+/* Append-only trees keep every block a snapshot may still point to */
+#define __btree_disk_write(btree, block_offset, block_size, data, size)     \
+    (__btree_is_append_only(btree) ?                                        \
+        __btdisk_append(btree, data, size) :                                \
+        __btdisk_write(btree, block_offset, block_size, data, size))
+
+#define __btree_disk_erase(btree, offset, size)                             \
+    do {                                                                    \
+        if (!__btree_is_append_only(btree)) {                               \
+            if ((btree)->space != NULL)                                     \
+                __btspace_free(btree, offset, size);                        \
+            __btdisk_erase(btree, offset, size);                            \
+        }                                                                   \
+    } while (0)
+
+/* Disks without crc callbacks get the built-in CRC32C */
+#define __btdisk_crc_call(disk, func, data, size)                           \
+    (((disk)->func != NULL) ? (disk)->func(disk, data, size) :              \
+                              btcrc32c(0, data, size))
 
 #define __btdisk_crc(btree, func, data, size)                               \
-    (btree)->disk->func((btree)->disk, data, size)
+    __btdisk_crc_call((btree)->disk, func, data, size)
 
 #define __btdisk_crc_pointer(btree, data, size)                             \
     __btdisk_crc(btree, crc_pointer, data, size)
@@ -260,6 +679,12 @@ struct node_pointer {
 #define __btdisk_crc_block(btree, offset, data, size)                       \
     __btdisk_crc(btree, crc_block, ((uint8_t *)data)+offset, size-(offset))
 
+#define __btdisk_compress(btree, dst, src, size)                            \
+    (btree)->disk->compress((btree)->user_data, dst, src, size)
+
+#define __btdisk_decompress(btree, dst, src, size)                          \
+    (btree)->disk->decompress((btree)->user_data, dst, src, size)
+
 /* ===========================================================================
  *  In-Memory Data Structure
  */
@@ -272,6 +697,7 @@ struct btnode {
     unsigned int size;
     unsigned int flags;
     int          refs;
+    pthread_mutex_t lock;           /* Latch for data load and release */
 };
 
 struct btnode_place {
@@ -279,15 +705,18 @@ struct btnode_place {
     uint32_t    index;          /* Position of object in the node */
     uint32_t    size;           /* Size of object value */
     uint8_t     found;          /* True if object is found */
+    uint8_t     blob;           /* Value is the pointer of a blob */
 };
 
 struct btcache_node {
-    btcache_node_t *next;     /* Next pointer in LRU cache */
-    btcache_node_t *prev;     /* Prev pointer in LRU cache */
+    btcache_node_t *next;     /* Next pointer in cache queue */
+    btcache_node_t *prev;     /* Prev pointer in cache queue */
     btcache_node_t *hash;     /* Next pointer in Hash Table */
 
     uint64_t blocknr;           /* Node on disk data offset */
-    uint8_t *block;             /* Node on disk data block */
+    uint8_t *block;             /* Node on disk data block (NULL if ghost) */
+    uint8_t  queue;             /* Cache queue of the node */
+    uint8_t  readahead;         /* Read ahead, not yet looked up */
 };
 
 /* ===========================================================================
@@ -325,146 +754,534 @@ static const void *__index_search (btree_t *btree,
     return(NULL);
 }
 
+/* Fixed-size keys ordered as memcmp(): the search key is loaded once as
+ * big-endian 8 byte words and node keys are compared a word at a time,
+ * inline, without the keycmp() call. Node keys are followed by at least
+ * 8 bytes (item head, next key or twig pointers), so the last partial
+ * word is loaded whole and masked.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    #define __key_be64(x)           __builtin_bswap64(x)
+#else
+    #define __key_be64(x)           (x)
+#endif
+
+static inline uint64_t __key_load64 (const uint8_t *key,
+                                     uint64_t mask)
+{
+    uint64_t value;
+    memcpy(&value, key, 8);
+    return(__key_be64(value) & mask);
+}
+
+static inline int __key_wordcmp (const uint8_t *key,
+                                 const uint64_t *words,
+                                 uint32_t nwords,
+                                 uint64_t mask)
+{
+    uint64_t value;
+    uint32_t i;
+
+    for (i = 0; i < nwords; ++i) {
+        value = __key_load64(key + (i << 3), (i + 1 < nwords) ? UINT64_MAX : mask);
+        if (value != words[i])
+            return((value < words[i]) ? -1 : 1);
+    }
+    return(0);
+}
+
+static const void *__index_memcmp_search (const void *base,
+                                          uint32_t n,
+                                          uint32_t stride,
+                                          uint32_t size,
+                                          const void *key,
+                                          uint32_t *index)
+{
+    uint32_t nwords = (size + 7) >> 3;
+    uint64_t words[nwords];
+    uint8_t tail[8] = {0};
+    const uint8_t *mid;
+    uint64_t mask;
+    long low, high;
+    uint32_t w;
+    int cmp;
+    long i;
+
+    /* The search key may end right after its last byte */
+    w = size - ((nwords - 1) << 3);
+    mask = (w == 8) ? UINT64_MAX : ~(UINT64_MAX >> (w << 3));
+    for (w = 0; w + 1 < nwords; ++w)
+        words[w] = __key_load64((const uint8_t *)key + (w << 3), UINT64_MAX);
+    memcpy(tail, (const uint8_t *)key + (w << 3), size - (w << 3));
+    words[w] = __key_load64(tail, mask);
+
+    high = ((long)n) - 1;
+    low = 0;
+    for (i = ((low + high) >> 1); low <= high; i = ((low + high) >> 1)) {
+        mid = ((const uint8_t *)base) + (i * stride);
+        if (!(cmp = __key_wordcmp(mid, words, nwords, mask))) {
+            *index = i;
+            return(mid);
+        }
+
+        if (cmp < 0)
+            low = i + 1;
+        else
+            high = i - 1;
+    }
+
+    *index = low;
+    return(NULL);
+}
+
 /* ===========================================================================
- *  PRIVATE Operations (Node Twigs)
- *
- *  B-Tree Node Twig:
- *      +----+----+----+----+----+----+
- *      | K1 | K2 |    | P1 | P2 |    |
- *      +----+----+----+----+----+----+
+ *  PRIVATE Slotted Node Utils
  *
- * B-Tree Twig Node Split:
- *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
- *    | K1 | K2 | K3 | P1 | P2 | P3 |        |    |    |    |    |    |    |
- *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
- * Given 'node' (left one) is full, we allocate another node (the right one),
- * then we search for the median key (of the left node), all the keys and
- * pointers on the right of median_key are shifted to the right node.
- *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
- *    | K1 | K2 |    | P1 | P2 |    |        | K3 |    |    | P3 |    |    |
- *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
+ *  Leaves, and the twigs of BTREE_FORMAT_VARIABLE trees, are slotted:
+ *  the item heads grow from the node head, sorted by key, and the item
+ *  bodies grow backward from the end of the block.
+ *      +------+----+----+----+-----------------+----+----+----+
+ *      | head | I1 | I2 | I3 |      free       | B3 | B2 | B1 |
+ *      +------+----+----+----+-----------------+----+----+----+
  */
-static void __twig_replace (btree_t *btree,
-                            btnode_t *node,
-                            uint32_t index,
-                            const void *key,
-                            const void *value)
+static uint32_t __slot_body_size (btree_t *btree,
+                                  btnode_t *node,
+                                  uint32_t from,
+                                  uint32_t to)
 {
-    void *src;
+    uint32_t size = 0U;
+    uint32_t offset;
+    uint8_t *p;
 
-    /* Replace Key */
-    src = __twig_key(btree, node, index);
-    if (btree->prefix_keycpy != NULL) {
-        btree->prefix_keycpy(btree->user_data, src, key,
-                             __btree_prefix_size(btree));
-    } else {
-        memcpy(src, key, __btree_prefix_size(btree));
+    p = (uint8_t *)__item_head(btree, node, from);
+    offset = __btree_item_size(btree);
+    for (; from < to; ++from) {
+        size += ITEM_HEAD(p)->ih_size;
+        p += offset;
     }
 
-    /* Replace Pointer */
-    src = __twig_pointer(btree, node, index);
-    memcpy(src, value, NODE_POINTER_SIZE);
+    return(size);
+}
 
-    /* Mark Node as Dirty */
-    __node_set_dirty(node);
+static void __slot_move_offsets (btree_t *btree,
+                                 btnode_t *node,
+                                 uint32_t from,
+                                 uint32_t to,
+                                 int32_t diff)
+{
+    uint32_t offset;
+    uint8_t *p;
+
+    p = (uint8_t *)__item_head(btree, node, from);
+    offset = __btree_item_size(btree);
+    for (; from < to; ++from) {
+        ITEM_HEAD(p)->ih_offset += diff;
+        p += offset;
+    }
 }
 
-static void __twig_inline_replace (btree_t *btree,
-                                   btnode_t *node,
-                                   uint32_t index,
-                                   const void *value)
+/* Resize the body of item 'index', its end stays in place.
+ * Bodies are stored backward, item 'index' ends where 'index - 1' starts:
+ * the lower bodies are shifted, and the head of the body is lost.
+ */
+static uint8_t *__slot_resize (btree_t *btree,
+                               btnode_t *node,
+                               uint32_t index,
+                               uint32_t size)
 {
-    void *src;
+    struct node_head *header;
+    int32_t size_diff;
+    uint8_t *body;
+    uint8_t *low;
 
-    /* Replace Pointer */
-    src = __twig_pointer(btree, node, index);
-    memcpy(src, value, NODE_POINTER_SIZE);
+    header = __node_head(node);
+    body = __item_body(btree, node, index);
+    size_diff = (int32_t)__item_body_size(btree, node, index) - (int32_t)size;
+    low = __item_body(btree, node, header->nh_items - 1);
 
-    /* Mark Node as Dirty */
-    __node_set_dirty(node);
+    /* Move data */
+    memmove(low + size_diff, low, body - low);
+
+    /* Move Item Offsets */
+    __slot_move_offsets(btree, node, index, header->nh_items, size_diff);
+    __item_head(btree, node, index)->ih_size = size;
+    header->nh_free += size_diff;
+
+    return(body + size_diff);
 }
 
-static void __twig_insert (btree_t *btree,
-                           btnode_t *node,
-                           uint32_t index,
-                           const void *key,
-                           const void *value)
+/* Make room for item 'index' with a body of 'size' bytes */
+static uint8_t *__slot_insert (btree_t *btree,
+                               btnode_t *node,
+                               uint32_t index,
+                               uint32_t size)
 {
+    struct item_head item_head;
     struct node_head *header;
-    void *src, *dst;
-    uint32_t n;
+    void *src_body;
+    uint32_t length;
+    void *dst;
+    void *src;
 
     header = __node_head(node);
-    n = (header->nh_items - index);
+    src = __leaf_slot(btree, node, index);
 
-    /* Move Keys and Insert the new one */
-    src = __twig_key(btree, node, index);
-    dst = __twig_key(btree, node, index + 1);
-    memmove(dst, src, n * __btree_prefix_size(btree));
+    /* Setup Item Header */
+    item_head.ih_size = size;
+    item_head.ih_offset = (header->nh_free - size) + NODE_HEAD_SIZE +
+                          (header->nh_items * __btree_item_size(btree));
 
-    /* Copy key on node */
-    if (btree->prefix_keycpy != NULL) {
-        btree->prefix_keycpy(btree->user_data, src, key,
-                             __btree_prefix_size(btree));
-    } else {
-        memcpy(src, key, __btree_prefix_size(btree));
-    }
+    if (index < header->nh_items) {
+        /* Move Data */
+        length = __slot_body_size(btree, node, index, header->nh_items);
+        src_body = __item_body(btree, node, header->nh_items - 1);
+        dst = src_body - size;
+        memmove(dst, src_body, length);
 
-    /* Move Pointers and Insert the new one */
-    src = __twig_pointer(btree, node, index);
-    dst = __twig_pointer(btree, node, index + 1);
-    memmove(dst, src, n * NODE_POINTER_SIZE);
-    memcpy(src, value, NODE_POINTER_SIZE);
+        /* Setup Item Offset */
+        item_head.ih_offset = ((uint8_t *) dst - node->data) + length;
 
-    /* Move In-Memory Pointers */
-    src = &(node->pointers[index]);
-    dst = &(node->pointers[index + 1]);
-    memmove(dst, src, n * sizeof(btnode_t *));
+        /* Move Items Offset */
+        __slot_move_offsets(btree, node, index, header->nh_items, -size);
+
+        /* Move Keys */
+        dst = __leaf_slot(btree, node, index + 1);
+        length = (header->nh_items - index) * __btree_item_size(btree);
+        memmove(dst, src, length);
+    }
+
+    /* Write ItemHead */
+    memcpy(__item_head(btree, node, index), &item_head, ITEM_HEAD_SIZE);
 
-    /* Setup node header */
-    header->nh_free -= __twig_needed(btree);
+    /* Setup Node Header for New Item */
+    header->nh_free -= (__btree_item_size(btree) + size);
     header->nh_items++;
 
-    /* Mark Node as Dirty */
-    __node_set_dirty(node);
+    return(node->data + item_head.ih_offset);
 }
 
-static void __twig_remove (btree_t *btree,
+static void __slot_remove (btree_t *btree,
                            btnode_t *node,
                            uint32_t index)
 {
     struct node_head *header;
+    uint32_t body_size;
     void *src, *dst;
-    uint32_t n;
+    uint32_t size;
 
     header = __node_head(node);
+    body_size = __item_body_size(btree, node, index);
 
     if ((index + 1) < header->nh_items) {
-        n = (header->nh_items - index);
+        /* Move Data */
+        src = __item_body(btree, node, header->nh_items - 1);
+        size = __slot_body_size(btree, node, index + 1, header->nh_items);
+        dst = src + body_size;
+        memmove(dst, src, size);
+
+        /* Move Items Offset */
+        __slot_move_offsets(btree, node, index, header->nh_items, body_size);
 
         /* Move Keys */
-        src = __twig_key(btree, node, index + 1);
-        dst = __twig_key(btree, node, index);
+        dst = __leaf_slot(btree, node, index);
+        src = __leaf_slot(btree, node, index + 1);
+        size = (header->nh_items - index - 1) * __btree_item_size(btree);
+        memmove(dst, src, size);
+    }
+
+    /* Setup Node Header for Removed Item */
+    header->nh_free += (__btree_item_size(btree) + body_size);
+    header->nh_items--;
+}
+
+/* Move the items from 'left_key' to the end, into the empty 'right' node */
+static void __slot_split (btree_t *btree,
+                          btnode_t *left,
+                          btnode_t *right,
+                          uint32_t left_key)
+{
+    struct node_head *right_header;
+    struct node_head *left_header;
+    uint32_t right_key;
+    uint32_t size;
+    void *dst;
+    void *src;
+
+    right_header = __node_head(right);
+    left_header = __node_head(left);
+    right_key = left_header->nh_items - left_key;
+
+    /* Move Keys */
+    src = __leaf_slot(btree, left, left_key);
+    dst = __leaf_slot(btree, right, 0);
+    size = __btree_item_size(btree) * right_key;
+    memcpy(dst, src, size);
+
+    left_header->nh_free += size;
+    right_header->nh_free -= size;
+
+    /* Move Data */
+    src = __item_body(btree, left, left_header->nh_items - 1);
+    size = __slot_body_size(btree, left, left_key, left_header->nh_items);
+    dst = right->data + __btree_block_size(btree) - size;
+    memcpy(dst, src, size);
+
+    left_header->nh_free += size;
+    left_header->nh_items -= right_key;
+
+    right_header->nh_free -= size;
+    right_header->nh_items += right_key;
+
+    /* Update right data offsets */
+    size = __slot_body_size(btree, left, 0, left_key);
+    __slot_move_offsets(btree, right, 0, right_key, size);
+}
+
+/* Append the items of the 'right' node to the 'left' one */
+static void __slot_merge (btree_t *btree,
+                          btnode_t *left,
+                          btnode_t *right)
+{
+    struct node_head *header;
+    uint32_t left_body;
+    uint32_t index;
+    uint32_t body;
+    uint32_t size;
+    uint32_t n;
+
+    header = __node_head(right);
+    index = __node_items(left);
+    n = header->nh_items;
+
+    /* Append right Keys and Item Heads to the left node */
+    size = n * __btree_item_size(btree);
+    memcpy(__leaf_slot(btree, left, index), __leaf_slot(btree, right, 0), size);
+
+    /* Right bodies goes below the left ones */
+    left_body = __slot_body_size(btree, left, 0, index);
+    body = __slot_body_size(btree, right, 0, n);
+    memcpy(left->data + __btree_block_size(btree) - left_body - body,
+           __item_body(btree, right, n - 1), body);
+
+    __node_head(left)->nh_items += n;
+    __node_head(left)->nh_free -= size + body;
+    __slot_move_offsets(btree, left, index, index + n, -(int32_t)left_body);
+
+    header->nh_free = __btree_node_space(btree);
+    header->nh_items = 0;
+}
+
+/* Binary search on the item heads, for keys stored after an item_key */
+static struct item_head *__slot_search (btree_t *btree,
+                                        btnode_t *node,
+                                        const void *key,
+                                        compare_t cmp_func,
+                                        uint32_t *index)
+{
+    long low, high;
+    int cmp;
+    long i;
+
+    high = ((long)__node_items(node)) - 1;
+    low = 0;
+    for (i = ((low + high) >> 1); low <= high; i = ((low + high) >> 1)) {
+        cmp = cmp_func(btree->user_data, __item_varkey(btree, node, i), key);
+        if (!cmp) {
+            *index = i;
+            return(__item_head(btree, node, i));
+        }
+
+        if (cmp < 0)
+            low = i + 1;
+        else
+            high = i - 1;
+    }
+
+    *index = low;
+    return(NULL);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Node Twigs)
+ *
+ *  B-Tree Node Twig:
+ *      +----+----+----+----+----+----+
+ *      | K1 | K2 |    | P1 | P2 |    |
+ *      +----+----+----+----+----+----+
+ *
+ * B-Tree Twig Node Split:
+ *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
+ *    | K1 | K2 | K3 | P1 | P2 | P3 |        |    |    |    |    |    |    |
+ *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
+ * Given 'node' (left one) is full, we allocate another node (the right one),
+ * then we search for the median key (of the left node), all the keys and
+ * pointers on the right of median_key are shifted to the right node.
+ *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
+ *    | K1 | K2 |    | P1 | P2 |    |        | K3 |    |    | P3 |    |    |
+ *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
+ *
+ * BTREE_FORMAT_VARIABLE twigs are slotted like leaves, the item body is
+ * the key followed by the pointer, and the split is done by size.
+ */
+static void __twig_inline_replace (btree_t *btree,
+                                   btnode_t *node,
+                                   uint32_t index,
+                                   const void *value)
+{
+    void *src;
+
+    /* Replace Pointer */
+    src = __twig_pointer(btree, node, index);
+    memcpy(src, value, NODE_POINTER_SIZE);
+
+    /* Mark Node as Dirty */
+    __node_mark_dirty(btree, node);
+}
+
+static void __twig_key_replace (btree_t *btree,
+                                btnode_t *node,
+                                uint32_t index,
+                                const void *key)
+{
+    uint32_t size;
+    uint8_t *body;
+    void *src;
+
+    /* Replace Key */
+    src = __twig_key(btree, node, index);
+    if (src == key)
+        return;
+
+    if (__btree_is_varkey(btree)) {
+        /* Body end stays in place, and the pointer with it */
+        size = __btree_key_len(btree, key);
+        body = __slot_resize(btree, node, index,
+                             ITEM_KEY_SIZE + size + NODE_POINTER_SIZE);
+        ITEM_KEY(body)->ik_size = size;
+        memcpy(body + ITEM_KEY_SIZE, key, size);
+    } else if (btree->prefix_keycpy != NULL) {
+        btree->prefix_keycpy(btree->user_data, src, key,
+                             __btree_prefix_size(btree));
+    } else {
+        memcpy(src, key, __btree_prefix_size(btree));
+    }
+
+    /* Mark Node as Dirty */
+    __node_mark_dirty(btree, node);
+}
+
+static void __twig_insert (btree_t *btree,
+                           btnode_t *node,
+                           uint32_t index,
+                           const void *key,
+                           const void *value)
+{
+    struct node_head *header;
+    void *src, *dst;
+    uint32_t size;
+    uint8_t *body;
+    uint32_t n;
+
+    header = __node_head(node);
+    n = (header->nh_items - index);
+
+    if (__btree_is_varkey(btree)) {
+        /* Write Key and Pointer in the item body */
+        size = __btree_key_len(btree, key);
+        body = __slot_insert(btree, node, index,
+                             ITEM_KEY_SIZE + size + NODE_POINTER_SIZE);
+        ITEM_KEY(body)->ik_size = size;
+        memcpy(body + ITEM_KEY_SIZE, key, size);
+        memcpy(body + ITEM_KEY_SIZE + size, value, NODE_POINTER_SIZE);
+    } else {
+        /* Move Keys and Insert the new one */
+        src = __twig_key(btree, node, index);
+        dst = __twig_key(btree, node, index + 1);
         memmove(dst, src, n * __btree_prefix_size(btree));
 
-        /* Move Pointers */
-        src = __twig_pointer(btree, node, index + 1);
-        dst = __twig_pointer(btree, node, index);
+        /* Copy key on node */
+        if (btree->prefix_keycpy != NULL) {
+            btree->prefix_keycpy(btree->user_data, src, key,
+                                 __btree_prefix_size(btree));
+        } else {
+            memcpy(src, key, __btree_prefix_size(btree));
+        }
+
+        /* Move Pointers and Insert the new one */
+        src = __twig_pointer(btree, node, index);
+        dst = __twig_pointer(btree, node, index + 1);
         memmove(dst, src, n * NODE_POINTER_SIZE);
+        memcpy(src, value, NODE_POINTER_SIZE);
 
-        /* Move In-Memory Pointers */
-        src = &(node->pointers[index + 1]);
-        dst = &(node->pointers[index]);
-        memmove(dst, src, n * sizeof(btnode_t *));
+        /* Setup node header */
+        header->nh_free -= __twig_item_size(btree);
+        header->nh_items++;
     }
 
-    /* Setup node header */
-    header->nh_free -= __twig_needed(btree);
-    header->nh_items--;
+    /* Move In-Memory Pointers */
+    src = &(node->pointers[index]);
+    dst = &(node->pointers[index + 1]);
+    memmove(dst, src, n * sizeof(btnode_t *));
+
+    /* Mark Node as Dirty */
+    __node_mark_dirty(btree, node);
+}
+
+static void __twig_remove (btree_t *btree,
+                           btnode_t *node,
+                           uint32_t index)
+{
+    struct node_head *header;
+    void *src, *dst;
+    uint32_t n;
+
+    header = __node_head(node);
+    n = (header->nh_items - index - 1);
+
+    if (__btree_is_varkey(btree)) {
+        __slot_remove(btree, node, index);
+    } else {
+        if (n > 0) {
+            /* Move Keys */
+            src = __twig_key(btree, node, index + 1);
+            dst = __twig_key(btree, node, index);
+            memmove(dst, src, n * __btree_prefix_size(btree));
+
+            /* Move Pointers */
+            src = __twig_pointer(btree, node, index + 1);
+            dst = __twig_pointer(btree, node, index);
+            memmove(dst, src, n * NODE_POINTER_SIZE);
+        }
+
+        /* Setup node header */
+        header->nh_free += __twig_item_size(btree);
+        header->nh_items--;
+    }
+
+    /* Move In-Memory Pointers */
+    src = &(node->pointers[index + 1]);
+    dst = &(node->pointers[index]);
+    memmove(dst, src, n * sizeof(btnode_t *));
     node->pointers[header->nh_items] = NULL;
 
     /* Mark Node as Dirty */
-    __node_set_dirty(node);
+    __node_mark_dirty(btree, node);
+}
+
+/* Variable-size keys, first item of the right half splitting by size */
+static uint32_t __twig_split_index (btree_t *btree,
+                                    btnode_t *node)
+{
+    uint32_t half;
+    uint32_t size;
+    uint32_t i;
+
+    half = (__btree_node_space(btree) - __node_free(node)) >> 1;
+    size = 0;
+    for (i = 0; (i + 1) < __node_items(node) && size < half; ++i)
+        size += ITEM_HEAD_SIZE + __item_body_size(btree, node, i);
+
+    return((i > 0) ? i : 1);
 }
 
 static void __twig_split (btree_t *btree,
@@ -478,18 +1295,37 @@ static void __twig_split (btree_t *btree,
     void *mid;
 
     /* Initialize Key Info */
-    left_key = __node_items(left) >> 1;
+    if (__btree_is_varkey(btree))
+        left_key = __twig_split_index(btree, left);
+    else
+        left_key = __node_items(left) >> 1;
     right_key = __node_items(left) - left_key;
 
-    /* Right Neighbor - Copy Keys */
-    mid = __twig_key(btree, left, left_key);
-    rdst = __twig_key(btree, right, 0);
-    memcpy(rdst, mid, right_key * __btree_prefix_size(btree));
-
-    /* Right Neighbor - Copy Pointers */
-    mid = __twig_pointer(btree, left, left_key);
-    rdst = __twig_pointer(btree, right, 0);
-    memcpy(rdst, mid, right_key * NODE_POINTER_SIZE);
+    if (__btree_is_varkey(btree)) {
+        __slot_split(btree, left, right, left_key);
+    } else {
+        /* Right Neighbor - Copy Keys */
+        mid = __twig_key(btree, left, left_key);
+        rdst = __twig_key(btree, right, 0);
+        memcpy(rdst, mid, right_key * __btree_prefix_size(btree));
+
+        /* Right Neighbor - Copy Pointers */
+        mid = __twig_pointer(btree, left, left_key);
+        rdst = __twig_pointer(btree, right, 0);
+        memcpy(rdst, mid, right_key * NODE_POINTER_SIZE);
+
+        /* Right Neighbor - Adjust Header */
+        header = __node_head(right);
+        header->nh_items = right_key;
+        header->nh_free = __btree_node_space(btree) -
+                          (right_key * __twig_item_size(btree));
+
+        /* Left Neighbor - Adjust Header */
+        header = __node_head(left);
+        header->nh_items = left_key;
+        header->nh_free = __btree_node_space(btree) -
+                          (left_key * __twig_item_size(btree));
+    }
 
     /* Move In-Memory Pointers */
     mid = &(left->pointers[left_key]);
@@ -497,23 +1333,9 @@ static void __twig_split (btree_t *btree,
     memcpy(rdst, mid, right_key * sizeof(btnode_t *));
     memset(mid, 0, right_key * sizeof(btnode_t *));
 
-    /* Right Neighbor - Adjust Header */
-    header = __node_head(right);
-    header->nh_items = right_key;
-    header->nh_free = __btree_node_space(btree) -
-                     (right_key * __btree_prefix_size(btree)) -
-                     (right_key * NODE_POINTER_SIZE);
-
-    /* Left Neighbor - Adjust Header */
-    header = __node_head(left);
-    header->nh_items = left_key;
-    header->nh_free = __btree_node_space(btree) -
-                      (left_key * __btree_prefix_size(btree)) -
-                      (left_key * NODE_POINTER_SIZE);
-
     /* Mark left & right Node as Dirty */
-    __node_set_dirty(right);
-    __node_set_dirty(left);
+    __node_mark_dirty(btree, right);
+    __node_mark_dirty(btree, left);
 }
 
 static void __twig_merge (btree_t *btree,
@@ -521,31 +1343,50 @@ static void __twig_merge (btree_t *btree,
                           btnode_t *right)
 {
     struct node_head *header;
-    const void *value;
-    const void *key;
     uint32_t index;
-    uint32_t i;
+    uint32_t n;
 
     header = __node_head(right);
     index = __node_items(left);
+    n = header->nh_items;
 
-    for (i = 0; i < header->nh_items; ++i) {
-        key = __twig_key(btree, right, i);
-        value = __twig_pointer(btree, right, i);
-        __twig_insert(btree, left, index + i, key, value);
+    if (__btree_is_varkey(btree)) {
+        __slot_merge(btree, left, right);
+    } else {
+        /* Append right Keys and Pointers to the left node */
+        memcpy(__twig_key(btree, left, index), __twig_key(btree, right, 0),
+               n * __btree_prefix_size(btree));
+        memcpy(__twig_pointer(btree, left, index), __twig_pointer(btree, right, 0),
+               n * NODE_POINTER_SIZE);
+
+        __node_head(left)->nh_items += n;
+        __node_head(left)->nh_free -= n * __twig_item_size(btree);
+
+        /* Mark right node as dirty, (but you should delete it) */
+        header->nh_free = __btree_node_space(btree);
+        header->nh_items = 0;
     }
 
-    /* Mark right node as dirty, (but you should delete it) */
-    header->nh_free = __btree_node_space(btree);
-    header->nh_items = 0;
-    __node_set_dirty(left);
+    /* Move In-Memory Pointers */
+    memcpy(&(left->pointers[index]), &(right->pointers[0]),
+           n * sizeof(btnode_t *));
+    memset(&(right->pointers[0]), 0, n * sizeof(btnode_t *));
+
+    __node_mark_dirty(btree, left);
 }
 
 static int __twig_can_merge (btree_t *btree,
                              btnode_t *left,
                              btnode_t *right)
 {
-    return((__node_items(left) + __node_items(right)) <= __btree_fanout(btree));
+    uint32_t size;
+
+    if (!__btree_is_varkey(btree))
+        return((__node_items(left) + __node_items(right)) <= __btree_fanout(btree));
+
+    size  = __btree_node_space(btree) - __node_free(left);
+    size += __btree_node_space(btree) - __node_free(right);
+    return(size <= __btree_node_space(btree));
 }
 
 static struct node_pointer *__twig_index_search (btree_t *btree,
@@ -553,6 +1394,24 @@ static struct node_pointer *__twig_index_search (btree_t *btree,
                                                  const void *key,
                                                  uint32_t *index)
 {
+    if (__btree_is_varkey(btree)) {
+        if (__slot_search(btree, node, key, btree->prefix_keycmp, index))
+            return(__twig_pointer(btree, node, *index));
+        return(NULL);
+    }
+
+    if (btree->memcmp_keys) {
+        if (__index_memcmp_search(__twig_first_key(btree, node),
+                                  __node_items(node),
+                                  __btree_prefix_size(btree),
+                                  __btree_prefix_size(btree),
+                                  key, index))
+        {
+            return(__twig_pointer(btree, node, *index));
+        }
+        return(NULL);
+    }
+
     if (__index_search(btree,
                        __twig_first_key(btree, node),
                        __node_items(node),
@@ -632,69 +1491,268 @@ static void __twig_debug (btree_t *btree,
  *    | K1 | K2 |    |    | D1 | D2 |        | K3 |    |    |    |    | D3 |
  *    +----+----+----+----+----+----+        +----+----+----+----+----+----+
  */
-static uint32_t __leaf_body_size (btree_t *btree,
-                                  btnode_t *node,
-                                  uint32_t from,
-                                  uint32_t to)
+/* ===========================================================================
+ *  PRIVATE Operations (Node Leaf, Front-Coded Keys)
+ *
+ *  With BTREE_FORMAT_FRONT_CODED the leaf slots hold only the item head,
+ *  and the key is stored in the item body, in front of the value:
+ *      +--------+----------------------------+-------+
+ *      | shared | key[shared:key_size]       | value |
+ *      +--------+----------------------------+-------+
+ *  'shared' is the number of leading bytes taken from the previous key.
+ *  Restart items (shared = 0) have the full key: the first item of a
+ *  node is always a restart, and a run is at most LEAF_RESTART_INTERVAL
+ *  items long. Search bisects on restart keys and scans a single run.
+ */
+static uint32_t __leaf_coded_lcp (btree_t *btree,
+                                  const uint8_t *a,
+                                  const uint8_t *b)
 {
-    uint32_t size = 0U;
-    uint32_t offset;
-    uint8_t *p;
+    uint32_t key_size;
+    uint32_t i;
 
-    p = (uint8_t *)__item_head(btree, node, from);
-    offset = __btree_item_size(btree);
-    for (; from < to; ++from) {
-        size += ITEM_HEAD(p)->ih_size;
-        p += offset;
-    }
+    key_size = __btree_key_size(btree);
+    for (i = 0; i < key_size && a[i] == b[i]; ++i);
+    return(i);
+}
 
-    return(size);
+/* Restart item of the run that contains 'index' */
+static uint32_t __leaf_coded_restart (btree_t *btree,
+                                      btnode_t *node,
+                                      uint32_t index)
+{
+    while (index > 0 && __item_shared(btree, node, index) != 0)
+        index--;
+    return(index);
 }
 
-static void __leaf_move_offsets (btree_t *btree,
-                                 btnode_t *node,
-                                 uint32_t from,
-                                 uint32_t to,
-                                 int32_t diff)
+/* Apply the key suffix of item 'index' to the previous key in 'key' */
+static void __leaf_coded_apply (btree_t *btree,
+                                btnode_t *node,
+                                uint32_t index,
+                                uint8_t *key)
 {
-    uint32_t offset;
-    uint8_t *p;
+    const uint8_t *body;
+    uint32_t shared;
 
-    p = (uint8_t *)__item_head(btree, node, from);
-    offset = __btree_item_size(btree);
-    for (; from < to; ++from) {
-        ITEM_HEAD(p)->ih_offset += diff;
-        p += offset;
-    }
+    body = __item_body(btree, node, index);
+    shared = ITEM_PREFIX(body)->ip_shared;
+    memcpy(key + shared, body + ITEM_PREFIX_SIZE, __btree_key_size(btree) - shared);
 }
 
-static void __leaf_replace (btree_t *btree,
-                            btnode_t *node,
-                            uint32_t index,
-                            const void *value,
-                            uint32_t size)
+/* Rebuild the full key of item 'index' */
+static void __leaf_coded_key (btree_t *btree,
+                              btnode_t *node,
+                              uint32_t index,
+                              uint8_t *key)
 {
-    struct node_head *header;
-    uint32_t old_size;
-    long size_diff;
-    void *dst;
+    uint32_t i;
 
-    header = __node_head(node);
-    dst = __item_body(btree, node, index);
+    for (i = __leaf_coded_restart(btree, node, index); i <= index; ++i)
+        __leaf_coded_apply(btree, node, i, key);
+}
 
-    old_size = __item_body_size(btree, node, index);
-    size_diff = size - old_size;
-    header->nh_free += size_diff;
+/* Encode the key of item 'index' against 'prev' (NULL for a restart) */
+static void __leaf_coded_encode (btree_t *btree,
+                                 btnode_t *node,
+                                 uint32_t index,
+                                 const uint8_t *key,
+                                 const uint8_t *prev)
+{
+    uint32_t value_size;
+    uint32_t shared;
+    uint8_t *body;
 
-    /* Move data */
-    memmove(dst + old_size, dst + size,
-            __leaf_body_size(btree, node, index, header->nh_items - 1));
+    shared = (prev != NULL) ? __leaf_coded_lcp(btree, prev, key) : 0;
+    value_size = __item_value_size(btree, node, index);
+    body = __slot_resize(btree, node, index, ITEM_PREFIX_SIZE +
+                         __btree_key_size(btree) - shared + value_size);
 
-    /* Move Item Offsets */
-    __leaf_move_offsets(btree, node, index, header->nh_items, size_diff);
+    ITEM_PREFIX(body)->ip_shared = shared;
+    memcpy(body + ITEM_PREFIX_SIZE, key + shared, __btree_key_size(btree) - shared);
+}
+
+static void __leaf_coded_insert (btree_t *btree,
+                                 btnode_t *node,
+                                 uint32_t index,
+                                 const void *key,
+                                 const void *value,
+                                 uint32_t data_size)
+{
+    uint8_t prev[__btree_key_size(btree)];
+    uint8_t next[__btree_key_size(btree)];
+    uint32_t key_size;
+    uint32_t restart;
+    uint32_t shared;
+    uint32_t items;
+    uint32_t end;
+    int relink;
+    uint8_t *body;
+
+    key_size = __btree_key_size(btree);
+    items = __node_items(node);
+
+    /* The next item is coded against the new key, unless it's a restart */
+    relink = (index < items && __item_shared(btree, node, index) != 0);
+
+    /* Start a new run if the run of the previous item is full */
+    shared = 0;
+    if (index > 0) {
+        restart = __leaf_coded_restart(btree, node, index - 1);
+        for (end = index; end < items && __item_shared(btree, node, end) != 0; ++end);
+
+        __leaf_coded_key(btree, node, index - 1, prev);
+        if (relink) {
+            memcpy(next, prev, key_size);
+            __leaf_coded_apply(btree, node, index, next);
+        }
+
+        if ((end - restart) < LEAF_RESTART_INTERVAL)
+            shared = __leaf_coded_lcp(btree, prev, key);
+    }
+
+    body = __slot_insert(btree, node, index,
+                         ITEM_PREFIX_SIZE + key_size - shared + data_size);
+    ITEM_PREFIX(body)->ip_shared = shared;
+    memcpy(body + ITEM_PREFIX_SIZE, (const uint8_t *)key + shared, key_size - shared);
+    memcpy(body + ITEM_PREFIX_SIZE + key_size - shared, value, data_size);
+
+    if (relink)
+        __leaf_coded_encode(btree, node, index + 1, next, key);
+}
+
+static void __leaf_coded_remove (btree_t *btree,
+                                 btnode_t *node,
+                                 uint32_t index)
+{
+    uint8_t prev[__btree_key_size(btree)];
+    uint8_t next[__btree_key_size(btree)];
+    int restart;
+    int relink;
+
+    /* The next item takes the place of a removed restart */
+    relink = ((index + 1) < __node_items(node) &&
+              __item_shared(btree, node, index + 1) != 0);
+    restart = (__item_shared(btree, node, index) == 0);
+
+    if (relink) {
+        if (!restart)
+            __leaf_coded_key(btree, node, index - 1, prev);
+        __leaf_coded_key(btree, node, index + 1, next);
+    }
+
+    __slot_remove(btree, node, index);
+
+    if (relink)
+        __leaf_coded_encode(btree, node, index, next, restart ? NULL : prev);
+}
+
+static struct item_head *__leaf_coded_search (btree_t *btree,
+                                              btnode_t *node,
+                                              const void *key,
+                                              uint32_t *index)
+{
+    uint8_t buffer[__btree_key_size(btree)];
+    uint32_t restart;
+    uint32_t high;
+    uint32_t low;
+    uint32_t mid;
+    uint32_t i;
+    int cmp;
+
+    /* Find the first item whose run starts with a key bigger than key */
+    low = 0;
+    high = __node_items(node);
+    while (low < high) {
+        mid = (low + high) >> 1;
+        restart = __leaf_coded_restart(btree, node, mid);
+        cmp = __btree_keycmp(btree,
+                             __item_body(btree, node, restart) + ITEM_PREFIX_SIZE,
+                             key);
+        if (!cmp) {
+            *index = restart;
+            return(__item_head(btree, node, restart));
+        }
+
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = restart;
+    }
+
+    if (low == 0) {
+        *index = 0;
+        return(NULL);
+    }
+
+    /* Scan the run before it */
+    for (i = __leaf_coded_restart(btree, node, low - 1); i < low; ++i) {
+        __leaf_coded_apply(btree, node, i, buffer);
+        if ((cmp = __btree_keycmp(btree, buffer, key)) >= 0) {
+            *index = i;
+            return(cmp ? NULL : __item_head(btree, node, i));
+        }
+    }
+
+    *index = low;
+    return(NULL);
+}
+
+/* Last key of a node, front-coded leaf keys are rebuilt into 'buffer' */
+static const void *__leaf_last_key_copy (btree_t *btree,
+                                         btnode_t *node,
+                                         uint8_t *buffer)
+{
+    if (__btree_is_varkey(btree))
+        return(__item_varkey(btree, node, __node_items(node) - 1));
+
+    if (!__btree_is_coded(btree))
+        return(__leaf_last_key(btree, node));
+
+    __leaf_coded_key(btree, node, __node_items(node) - 1, buffer);
+    return(buffer);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Node Leaf Items)
+ *
+ *  A replaced or removed blob value takes its blob block with it, the
+ *  caller flags the items that get a blob pointer as value.
+ */
+static void __btblob_erase (btree_t *btree,
+                            const void *data);
+
+static void __leaf_replace (btree_t *btree,
+                            btnode_t *node,
+                            uint32_t index,
+                            const void *value,
+                            uint32_t size)
+{
+    uint8_t head[ITEM_PREFIX_SIZE + ITEM_KEY_SIZE + __btree_key_size(btree)];
+    uint32_t head_size;
+    uint32_t old_size;
+    uint8_t *body;
+
+    if (__item_is_blob(btree, node, index)) {
+        __btblob_erase(btree, __item_value(btree, node, index));
+        __item_set_blob(btree, node, index, 0);
+    }
+
+    /* Front-coded or variable-size key stays in front of the value */
+    head_size = __item_key_size(btree, node, index);
+    old_size = __item_body_size(btree, node, index) - head_size;
+    memcpy(head, __item_body(btree, node, index), head_size);
+
+    body = __slot_resize(btree, node, index, head_size + size);
+    memcpy(body, head, head_size);
+    memcpy(body + head_size, value, size);
+
+    /* Update Super-Block stored data size */
+    __btree_super(btree)->sb_stored_data -= old_size;
+    __btree_super(btree)->sb_stored_data += size;
 
     /* Mark node as dirty */
-    __node_set_dirty(node);
+    __node_mark_dirty(btree, node);
 }
 
 static void __leaf_inline_replace (btree_t *btree,
@@ -705,12 +1763,17 @@ static void __leaf_inline_replace (btree_t *btree,
 {
     void *dst;
 
+    if (__item_is_blob(btree, node, index)) {
+        __btblob_erase(btree, __item_value(btree, node, index));
+        __item_set_blob(btree, node, index, 0);
+    }
+
     /* Replace Key Body */
-    dst = __item_body(btree, node, index);
+    dst = __item_value(btree, node, index);
     memcpy(dst, value, size);
 
     /* Mark Node as Dirty */
-    __node_set_dirty(node);
+    __node_mark_dirty(btree, node);
 }
 
 static void __leaf_insert (btree_t *btree,
@@ -720,173 +1783,117 @@ static void __leaf_insert (btree_t *btree,
                            const void *value,
                            uint32_t data_size)
 {
-    struct item_head item_head;
-    struct node_head *header;
-    void *src_body;
-    uint32_t size;
-    void *dst;
-    void *src;
-
-    header = __node_head(node);
-    src = __leaf_key(btree, node, index);
-
-    /* Setup Item Header */
-    item_head.ih_size = data_size;
-    item_head.ih_offset = (header->nh_free - data_size) + NODE_HEAD_SIZE +
-                          (header->nh_items * __btree_item_size(btree));
-
-    if (index < header->nh_items) {
-        /* Move Data */
-        size = __leaf_body_size(btree, node, index, header->nh_items);
-        src_body = __item_body(btree, node, header->nh_items - 1);
-        dst = src_body - data_size;
-        memmove(dst, src_body, size);
-
-        /* Setup Item Offset */
-        item_head.ih_offset = ((uint8_t *) dst - node->data) + size;
-
-        /* Move Items Offset */
-        __leaf_move_offsets(btree, node, index, header->nh_items, -data_size);
-
-        /* Move Keys */
-        dst = __leaf_key(btree, node, index + 1);
-        size = (header->nh_items - index) * __btree_item_size(btree);
-        memmove(dst, src, size);
+    uint32_t key_size;
+    uint8_t *body;
+
+    if (__btree_is_coded(btree)) {
+        __leaf_coded_insert(btree, node, index, key, value, data_size);
+    } else if (__btree_is_varkey(btree)) {
+        /* Write Key Size, Key and Data */
+        key_size = __btree_key_len(btree, key);
+        body = __slot_insert(btree, node, index,
+                             ITEM_KEY_SIZE + key_size + data_size);
+        ITEM_KEY(body)->ik_size = key_size;
+        memcpy(body + ITEM_KEY_SIZE, key, key_size);
+        memcpy(body + ITEM_KEY_SIZE + key_size, value, data_size);
+    } else {
+        /* Write Key and Data */
+        body = __slot_insert(btree, node, index, data_size);
+        memcpy(__leaf_key(btree, node, index), key, __btree_key_size(btree));
+        memcpy(body, value, data_size);
     }
 
-    /* Write Key, ItemHead and Data */
-    memcpy(src, key, __btree_key_size(btree));
-    memcpy(src + __btree_key_size(btree), &item_head, ITEM_HEAD_SIZE);
-    memcpy(node->data + item_head.ih_offset, value, data_size);
-
-    /* Setup Node Header for New Item */
-    header->nh_free -= (__btree_item_size(btree) + data_size);
-    header->nh_items++;
-
     /* Update Super-Block with One more Item, and update stored data size */
     __btree_super(btree)->sb_item_count++;
     __btree_super(btree)->sb_stored_data += data_size;
 
     /* Mark Node as Dirty */
-    __node_set_dirty(node);
+    __node_mark_dirty(btree, node);
 }
 
 static void __leaf_remove (btree_t *btree,
                            btnode_t *node,
                            uint32_t index)
 {
-
-    struct node_head *header;
     uint32_t data_size;
-    void *src, *dst;
-    uint32_t size;
-
-    header = __node_head(node);
-    data_size = __item_body_size(btree, node, index);
-
-    if ((index + 1) < header->nh_items) {
-        /* Move Data */
-        src = __item_body(btree, node, header->nh_items - 1);
-        size = __leaf_body_size(btree, node, index + 1, header->nh_items);
-        dst = src + data_size;
-        memmove(dst, src, size);
-
-        /* Move Items Offset */
-        __leaf_move_offsets(btree, node, index, header->nh_items, data_size);
 
-        /* Move Keys */
-        dst = __leaf_key(btree, node, index);
-        src = __leaf_key(btree, node, index + 1);
-        size = (header->nh_items - index) * __btree_item_size(btree);
-        memmove(dst, src, size);
-    }
+    if (__item_is_blob(btree, node, index))
+        __btblob_erase(btree, __item_value(btree, node, index));
 
-    /* Setup Node Header for New Item */
-    header->nh_free += (__btree_item_size(btree) + data_size);
-    header->nh_items--;
+    data_size = __item_value_size(btree, node, index);
+    if (__btree_is_coded(btree))
+        __leaf_coded_remove(btree, node, index);
+    else
+        __slot_remove(btree, node, index);
 
-    /* Update Super-Block with One more Item, and update stored data size */
+    /* Update Super-Block with One less Item, and update stored data size */
     __btree_super(btree)->sb_item_count--;
     __btree_super(btree)->sb_stored_data -= data_size;
 
     /* Mark Node as Dirty */
-    __node_set_dirty(node);
+    __node_mark_dirty(btree, node);
 }
 
 static void __leaf_split (btree_t *btree,
                           btnode_t *left,
-                          btnode_t *right)
+                          btnode_t *right,
+                          uint32_t left_key)
 {
-    struct node_head *right_header;
-    struct node_head *left_header;
-    uint32_t right_key;
-    uint32_t left_key;
-    uint32_t size;
-    void *dst;
-    void *src;
-
-    /* Initialize Key Info */
-    right_header = __node_head(right);
-    left_header = __node_head(left);
-    left_key = (left_header->nh_items >> 1);
-    right_key = left_header->nh_items - left_key;
-
-    /* Move Keys */
-    src = __leaf_key(btree, left, left_key);
-    dst = __leaf_key(btree, right, 0);
-    size = __btree_item_size(btree) * right_key;
-    memcpy(dst, src, size);
-
-    left_header->nh_free += size;
-    right_header->nh_free -= size;
+    uint8_t key[__btree_key_size(btree)];
+    int restart;
 
-    /* Move Data */
-    src = __item_body(btree, left, left_header->nh_items - 1);
-    size = __leaf_body_size(btree, left, left_key, left_header->nh_items);
-    dst = right->data + __btree_block_size(btree) - size;
-    memcpy(dst, src, size);
+    if (__node_items(left) == left_key)
+        return;
 
-    left_header->nh_free += size;
-    left_header->nh_items -= right_key;
+    /* First right item becomes a restart */
+    restart = (__btree_is_coded(btree) && __item_shared(btree, left, left_key) != 0);
+    if (restart)
+        __leaf_coded_key(btree, left, left_key, key);
 
-    right_header->nh_free -= size;
-    right_header->nh_items += right_key;
+    __slot_split(btree, left, right, left_key);
 
-    /* Update right data offsets */
-    size = __leaf_body_size(btree, left, 0, left_key);
-    __leaf_move_offsets(btree, right, 0, right_key, size);
+    if (restart)
+        __leaf_coded_encode(btree, right, 0, key, NULL);
 
     /* Mark left & right Node as Dirty */
-    __node_set_dirty(right);
-    __node_set_dirty(left);
+    __node_mark_dirty(btree, right);
+    __node_mark_dirty(btree, left);
 }
 
 static void __leaf_merge (btree_t *btree,
                           btnode_t *left,
                           btnode_t *right)
 {
-    struct item_head *item_head;
-    struct node_head *header;
-    const void *key;
+    uint8_t prev[__btree_key_size(btree)];
+    uint8_t next[__btree_key_size(btree)];
     uint32_t index;
-    uint32_t i;
+    uint32_t size;
+    uint32_t run;
+    uint32_t n;
+    int relink;
 
-    header = __node_head(right);
     index = __node_items(left);
+    if ((n = __node_items(right)) == 0)
+        return;
 
-    for (i = 0; i < header->nh_items; ++i) {
-        item_head = __item_head(btree, right, i);
-        key = __leaf_key(btree, right, i);
-
-        __leaf_insert(btree, left, index + i, key,
-                      right->data + item_head->ih_offset,
-                      item_head->ih_size);
+    /* Code the right restart against the left last key, if runs fit */
+    relink = 0;
+    if (__btree_is_coded(btree) && index > 0) {
+        run = index - __leaf_coded_restart(btree, left, index - 1);
+        for (size = 1; size < n && __item_shared(btree, right, size) != 0; ++size);
+        if ((relink = ((run + size) <= LEAF_RESTART_INTERVAL))) {
+            __leaf_coded_key(btree, left, index - 1, prev);
+            __leaf_coded_key(btree, right, 0, next);
+        }
     }
 
-    /* Mark right node as dirty, (but you should delete it) */
-    header->nh_free = __btree_node_space(btree);
-    header->nh_items = 0;
-    __node_set_dirty(left);
+    /* Right node is left empty, (but you should delete it) */
+    __slot_merge(btree, left, right);
+
+    if (relink)
+        __leaf_coded_encode(btree, left, index, next, prev);
+
+    __node_mark_dirty(btree, left);
 }
 
 static int __leaf_can_merge (btree_t *btree,
@@ -895,10 +1902,8 @@ static int __leaf_can_merge (btree_t *btree,
 {
     uint32_t size;
 
-    size  = __leaf_body_size(btree, right, 0, __node_items(right));
-    size += __leaf_body_size(btree, left, 0, __node_items(left));
-    size += __btree_item_size(btree);
-    size += __btree_item_size(btree);
+    size  = __btree_node_space(btree) - __node_free(left);
+    size += __btree_node_space(btree) - __node_free(right);
 
     return(size <= __btree_node_space(btree));
 }
@@ -908,6 +1913,24 @@ static struct item_head *__leaf_index_search (btree_t *btree,
                                               const void *key,
                                               uint32_t *index)
 {
+    if (__btree_is_coded(btree))
+        return(__leaf_coded_search(btree, node, key, index));
+
+    if (__btree_is_varkey(btree))
+        return(__slot_search(btree, node, key, btree->keycmp, index));
+
+    if (btree->memcmp_keys) {
+        if (__index_memcmp_search(__leaf_first_key(btree, node),
+                                  __node_items(node),
+                                  __btree_key_size(btree) + ITEM_HEAD_SIZE,
+                                  __btree_key_size(btree),
+                                  key, index))
+        {
+            return(__item_head(btree, node, *index));
+        }
+        return(NULL);
+    }
+
     if (__index_search(btree,
                        __leaf_first_key(btree, node),
                        __node_items(node),
@@ -930,8 +1953,9 @@ static int __leaf_search (btree_t *btree,
     struct item_head *head;
 
     if ((head = __leaf_index_search(btree, node, key, &(place->index)))) {
-        place->value = __item_body(btree, node, place->index);
-        place->size = head->ih_size;
+        place->value = __item_value(btree, node, place->index);
+        place->size = __item_value_size(btree, node, place->index);
+        place->blob = !!(head->ih_offset & ITEM_BLOB);
     }
 
     return((place->found = (head != NULL)));
@@ -943,6 +1967,7 @@ static void __leaf_debug (btree_t *btree,
                           btree_key_debug_t key_debug,
                           btree_data_debug_t data_debug)
 {
+    uint8_t buffer[__btree_key_size(btree)];
     struct item_head *item_head;
     struct node_head *header;
     const void *body;
@@ -960,13 +1985,25 @@ static void __leaf_debug (btree_t *btree,
 
     for (i = 0; i < header->nh_items; ++i) {
         item_head = __item_head(btree, node, i);
-        body = __item_body(btree, node, i);
-        key = __leaf_key(btree, node, i);
+        body = __item_value(btree, node, i);
+        if (__btree_is_coded(btree)) {
+            __leaf_coded_apply(btree, node, i, buffer);
+            key = buffer;
+        } else if (__btree_is_varkey(btree)) {
+            key = __item_varkey(btree, node, i);
+        } else {
+            key = __leaf_key(btree, node, i);
+        }
 
         printf("(%3u:", i);
         key_debug(btree->user_data, key);
-        printf("[%4u:%4u:", item_head->ih_offset, item_head->ih_size);
-        data_debug(btree->user_data, body, item_head->ih_size);
+        printf("[%4u:%4u:", item_head->ih_offset & ~ITEM_BLOB, item_head->ih_size);
+        if (__item_is_blob(btree, node, i)) {
+            printf("blob %"PRIu64":%u", NODE_POINTER(body)->np_blocknr,
+                   NODE_POINTER(body)->np_size);
+        } else {
+            data_debug(btree->user_data, body, __item_value_size(btree, node, i));
+        }
         printf("]) ");
     }
 
@@ -976,102 +2013,185 @@ static void __leaf_debug (btree_t *btree,
 
 /* ===========================================================================
  *  PRIVATE Block Cache
+ *
+ *  The cache keeps clean blocks that no in-memory node is using, a lookup
+ *  hands the block over to the node and the node gives it back on release.
+ *  With 2Q a block given back goes to the IN fifo, unless its blocknr is
+ *  a GHOST (it was looked up, or pushed out of IN, not long ago) then it
+ *  goes to the HOT lru. Eviction takes from IN while it is above a quarter
+ *  of the cache, so a scan recycles IN and leaves HOT alone.
+ *  With LRU every block goes to HOT and there are no ghosts.
+ *  Blocks read ahead by a scan go to IN too, but they are not yet seen:
+ *  the lookup, or the eviction, of one of them leaves no ghost.
  */
+#define BTCACHE_HASH_MUL                (0x9e3779b97f4a7c15ULL)
+
 #define __btcache_can_add(btree, cache)          ((cache)->size != 0)
-#define __btcache_hash(btree, cache, blocknr)    ((blocknr) % (cache)->size)
+#define __btcache_hash(cache, blocknr)                                      \
+    ((uint32_t)(((blocknr) * BTCACHE_HASH_MUL) >> 32) & (cache)->mask)
 
-static btcache_node_t *__btcache_add_node (btree_t *btree,
-                                             btcache_t *cache)
-{
-    btcache_node_t *node;
+#define __btcache_used(cache)                                               \
+    ((cache)->count[BTCACHE_QUEUE_HOT] +                                    \
+     (cache)->count[BTCACHE_QUEUE_IN] +                                     \
+     (cache)->count[BTCACHE_QUEUE_PINNED])
 
-    if ((node = (btcache_node_t *) malloc(sizeof(btcache_node_t))) == NULL)
-        return(NULL);
+#define __btcache_in_max(cache)         (((cache)->size >> 2) + 1)
+#define __btcache_ghost_max(cache)      (((cache)->size >> 1) + 1)
 
-    node->hash = NULL;
-    node->block = NULL;
+#define __btcache_is_pinned(cache, block)                                   \
+    ((cache)->pin_level != 0 &&                                             \
+     NODE_HEAD(block)->nh_level >= (cache)->pin_level)
+
+/* Link node at the head (most recent) of the queue */
+static void __btcache_link (btcache_t *cache,
+                            btcache_node_t *node,
+                            uint8_t queue)
+{
+    btcache_node_t *head;
 
-    if (cache->head != NULL) {
-        node->next = cache->head;
-        node->prev = cache->head->prev;
-        cache->head->prev = node;
-        node->prev->next = node;
+    if ((head = cache->queues[queue]) != NULL) {
+        node->next = head;
+        node->prev = head->prev;
+        head->prev->next = node;
+        head->prev = node;
     } else {
         node->next = node;
         node->prev = node;
     }
 
-    cache->head = node;
-    cache->used++;
-
-    return(node);
+    cache->queues[queue] = node;
+    cache->count[queue]++;
+    node->queue = queue;
 }
 
-static void __btcache_unhash (btree_t *btree,
-                              btcache_t *cache,
+static void __btcache_unlink (btcache_t *cache,
                               btcache_node_t *node)
 {
-    btcache_node_t *p;
-    uint32_t index;
+    uint8_t queue = node->queue;
 
-    index = __btcache_hash(btree, cache, node->blocknr);
-    if ((p = cache->table[index]) == node) {
-        cache->table[index] = NULL;
+    if (node->next == node) {
+        cache->queues[queue] = NULL;
     } else {
-        for (; p != NULL; p = p->hash) {
-            if (p->hash == node) {
-                p->hash = node->hash;
-                break;
-            }
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        if (cache->queues[queue] == node)
+            cache->queues[queue] = node->next;
+    }
+
+    cache->count[queue]--;
+}
+
+static btcache_node_t *__btcache_find (btcache_t *cache,
+                                       uint64_t blocknr)
+{
+    btcache_node_t *p;
+
+    p = cache->table[__btcache_hash(cache, blocknr)];
+    while (p != NULL && p->blocknr != blocknr)
+        p = p->hash;
+
+    return(p);
+}
+
+static void __btcache_unhash (btcache_t *cache,
+                              btcache_node_t *node)
+{
+    btcache_node_t **p;
+
+    p = &(cache->table[__btcache_hash(cache, node->blocknr)]);
+    for (; *p != NULL; p = &((*p)->hash)) {
+        if (*p == node) {
+            *p = node->hash;
+            break;
         }
     }
 }
 
-static void __btcache_eject (btree_t *btree,
-                             btcache_t *cache,
+/* Drop the node from hash and queue, and keep it for reuse */
+static void __btcache_node_free (btcache_t *cache,
+                                 btcache_node_t *node)
+{
+    __btcache_unhash(cache, node);
+    __btcache_unlink(cache, node);
+
+    node->hash = cache->free;
+    cache->free = node;
+}
+
+/* Node data is gone, remember only the blocknr */
+static void __btcache_ghost (btcache_t *cache,
                              btcache_node_t *node)
 {
-    /* Unlink hash */
-    __btcache_unhash(btree, cache, node);
+    __btcache_unlink(cache, node);
+    node->block = NULL;
+    __btcache_link(cache, node, BTCACHE_QUEUE_GHOST);
 
-    if (cache->head->prev != node) {
-        btcache_node_t *tail;
+    if (cache->count[BTCACHE_QUEUE_GHOST] > __btcache_ghost_max(cache))
+        __btcache_node_free(cache, cache->queues[BTCACHE_QUEUE_GHOST]->prev);
+}
 
-        node->prev->next = node->next;
-        node->next->prev = node->prev;
+/* Free the oldest block of IN or HOT, pinned blocks stay */
+static int __btcache_evict (btcache_t *cache) {
+    btcache_node_t *node;
+
+    if (cache->queues[BTCACHE_QUEUE_IN] != NULL &&
+        (cache->count[BTCACHE_QUEUE_IN] >= __btcache_in_max(cache) ||
+         cache->queues[BTCACHE_QUEUE_HOT] == NULL))
+    {
+        node = cache->queues[BTCACHE_QUEUE_IN]->prev;
+    } else if (cache->queues[BTCACHE_QUEUE_HOT] != NULL) {
+        node = cache->queues[BTCACHE_QUEUE_HOT]->prev;
+    } else {
+        return(1);
+    }
 
-        if (cache->head == node)
-            cache->head = node->next;
+    free(node->block);
+    cache->evictions++;
 
-        tail = cache->head->prev;
-        tail->next = node;
-        node->next = cache->head;
-        node->prev = tail;
-        cache->head->prev = node;
+    if (cache->type == BTCACHE_2Q && node->queue == BTCACHE_QUEUE_IN &&
+        !node->readahead)
+    {
+        __btcache_ghost(cache, node);
     }
+    else
+        __btcache_node_free(cache, node);
 
-    /* Mark block as free */
-    node->block = NULL;
+    return(0);
 }
 
 static int __btcache_open (btree_t *btree,
                            btcache_t *cache,
-                           uint32_t size)
+                           uint32_t size,
+                           btcache_type_t type,
+                           uint8_t pin_level)
 {
-    if (size == 0) {
-        cache->size = 0;
+    uint32_t buckets;
+
+    pthread_mutex_init(&(cache->lock), NULL);
+    memset(cache->queues, 0, sizeof(cache->queues));
+    memset(cache->count, 0, sizeof(cache->count));
+    cache->table = NULL;
+    cache->free = NULL;
+    cache->type = type;
+    cache->pin_level = pin_level;
+    cache->hits = 0U;
+    cache->misses = 0U;
+    cache->evictions = 0U;
+    cache->mask = 0U;
+    cache->size = 0U;
+
+    if (size == 0)
         return(1);
-    }
 
-    if (!(cache->table = (btcache_node_t **) malloc(size * sizeof(btcache_node_t *))))
+    /* Room for blocks and ghosts, power of two to mask the hash */
+    for (buckets = 2; buckets < size + (size >> 1) + 1; buckets <<= 1);
+
+    if (!(cache->table = (btcache_node_t **) malloc(buckets * sizeof(btcache_node_t *))))
         return(2);
 
-    memset(cache->table, 0, size * sizeof(btcache_node_t *));
-    cache->head = NULL;
+    memset(cache->table, 0, buckets * sizeof(btcache_node_t *));
+    cache->mask = buckets - 1;
     cache->size = size;
-    cache->used = 0U;
-
-    __btcache_add_node(btree, cache);
 
     return(0);
 }
@@ -1081,86 +2201,686 @@ static void __btcache_close (btree_t *btree,
 {
     btcache_node_t *next;
     btcache_node_t *p;
+    uint32_t i;
 
+    pthread_mutex_destroy(&(cache->lock));
     if (cache->size == 0)
         return;
 
-    if (cache->head != NULL) {
-        p = cache->head;
-        do {
-            next = p->next;
-
-            if (p->block)
+    for (i = 0; i < BTCACHE_QUEUES; ++i) {
+        while ((p = cache->queues[i]) != NULL) {
+            __btcache_unlink(cache, p);
+            if (p->block != NULL)
                 free(p->block);
             free(p);
+        }
+    }
 
-            p = next;
-        } while (p != cache->head);
+    for (p = cache->free; p != NULL; p = next) {
+        next = p->hash;
+        free(p);
     }
 
     free(cache->table);
 }
 
+/* Give the block to the cache, it is freed if it can't be kept.
+ * A block read ahead is dropped if the cache already has one.
+ */
 static int __btcache_add (btree_t *btree,
                           btcache_t *cache,
                           uint64_t blocknr,
-                          uint8_t *block)
+                          uint8_t *block,
+                          int readahead)
 {
     btcache_node_t *node;
+    uint8_t queue;
     uint32_t index;
 
-    node = cache->head->prev;
-    if (cache->head->block == NULL || cache->used >= cache->size) {
-        cache->head = node;
+    pthread_mutex_lock(&(cache->lock));
+    if ((node = __btcache_find(cache, blocknr)) != NULL) {
+        if (readahead && node->block != NULL) {
+            pthread_mutex_unlock(&(cache->lock));
+            free(block);
+            return(1);
+        }
 
-        if (node->block != NULL) {
-            __btcache_unhash(btree, cache, node);
+        /* Seen not long ago (or a stale copy), it's a hot block */
+        if (node->block != NULL)
             free(node->block);
-        }
+        __btcache_unlink(cache, node);
+        node->block = NULL;
+        queue = BTCACHE_QUEUE_HOT;
     } else {
-        if ((node = __btcache_add_node(btree, cache)) == NULL)
-            return(1);
+        queue = (cache->type == BTCACHE_2Q) ? BTCACHE_QUEUE_IN : BTCACHE_QUEUE_HOT;
     }
 
-    /* Setup Node */
-    node->blocknr = blocknr;
-    node->block = block;
+    if (__btcache_is_pinned(cache, block))
+        queue = BTCACHE_QUEUE_PINNED;
+
+    while (__btcache_used(cache) >= cache->size) {
+        if (__btcache_evict(cache))
+            goto _add_failed;
+    }
+
+    if (node == NULL) {
+        if ((node = cache->free) != NULL) {
+            cache->free = node->hash;
+        } else if ((node = (btcache_node_t *) malloc(sizeof(btcache_node_t))) == NULL) {
+            goto _add_failed;
+        }
+
+        /* Insert node into hashtable */
+        node->blocknr = blocknr;
+        index = __btcache_hash(cache, blocknr);
+        node->hash = cache->table[index];
+        cache->table[index] = node;
+    }
 
-    /* Insert node into hashtable */
-    index = __btcache_hash(btree, cache, blocknr);
-    node->hash = cache->table[index];
-    cache->table[index] = node;
+    node->block = block;
+    node->readahead = (readahead && queue != BTCACHE_QUEUE_HOT);
+    __btcache_link(cache, node, queue);
+    pthread_mutex_unlock(&(cache->lock));
 
     return(0);
+
+_add_failed:
+    /* The ghost found was already unlinked from its queue */
+    if (node != NULL) {
+        __btcache_unhash(cache, node);
+        node->hash = cache->free;
+        cache->free = node;
+    }
+    pthread_mutex_unlock(&(cache->lock));
+    free(block);
+    return(1);
 }
 
-uint8_t *__btcache_lookup (btree_t *btree,
-                           btcache_t *cache,
-                           uint64_t blocknr)
+static uint8_t *__btcache_lookup (btree_t *btree,
+                                  btcache_t *cache,
+                                  uint64_t blocknr)
 {
-    btcache_node_t *p;
+    btcache_node_t *node;
     uint8_t *block;
 
     if (cache->size == 0)
         return(NULL);
 
-    p = cache->table[__btcache_hash(btree, cache, blocknr)];
-    while (p != NULL) {
-        if (p->blocknr == blocknr) {
-            block = p->block;
-            __btcache_eject(btree, cache, p);
-            return(block);
+    block = NULL;
+    pthread_mutex_lock(&(cache->lock));
+    if ((node = __btcache_find(cache, blocknr)) != NULL && node->block != NULL) {
+        block = node->block;
+        cache->hits++;
+
+        /* 2Q remembers the blocknr, it comes back as a hot block */
+        if (cache->type == BTCACHE_2Q && node->queue != BTCACHE_QUEUE_PINNED &&
+            !node->readahead)
+        {
+            __btcache_ghost(cache, node);
+        } else {
+            __btcache_node_free(cache, node);
         }
-        p = p->hash;
+    } else {
+        cache->misses++;
     }
+    pthread_mutex_unlock(&(cache->lock));
 
-    return(NULL);
+    return(block);
 }
 
-/* ===========================================================================
- *  PRIVATE Operations (Node)
- */
-#define __btree_leaf_node_alloc(btree)                                      \
+static int __btcache_contains (btree_t *btree,
+                               btcache_t *cache,
+                               uint64_t blocknr)
+{
+    btcache_node_t *node;
+    int found;
+
+    pthread_mutex_lock(&(cache->lock));
+    node = __btcache_find(cache, blocknr);
+    found = (node != NULL && node->block != NULL);
+    pthread_mutex_unlock(&(cache->lock));
+
+    return(found);
+}
+
+static void __btcache_remove (btree_t *btree,
+                              btcache_t *cache,
+                              uint64_t blocknr)
+{
+    btcache_node_t *node;
+
+    if (cache->size == 0)
+        return;
+
+    pthread_mutex_lock(&(cache->lock));
+    if ((node = __btcache_find(cache, blocknr)) != NULL) {
+        if (node->block != NULL)
+            free(node->block);
+        __btcache_node_free(cache, node);
+    }
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Free-Space Map)
+ *
+ *  A bit per allocation unit, set if used. Units past the map, and below
+ *  'base' (written before the map was enabled), are taken as used. Every
+ *  block from 'base' on starts a unit and owns all the units it touches,
+ *  appends are padded to the next unit.
+ */
+struct btspace {
+    uint8_t *  map;                     /* Bitmap, a bit per unit */
+    uint8_t *  zero;                    /* Unit of padding */
+    uint64_t   capacity;                /* Bitmap bytes allocated */
+    uint64_t   units;                   /* Units covered by the bitmap */
+    uint64_t   base;                    /* First managed unit */
+    uint64_t   cursor;                  /* Next-fit search start */
+    uint64_t   free;                    /* Free units */
+    uint64_t   blocknr;                 /* Bitmap block on disk */
+    uint32_t   slot;                    /* Bitmap block size */
+    uint32_t   unit;                    /* Allocation unit */
+};
+
+#define __btspace_units(space, size)                                        \
+    (((uint64_t)(size) + (space)->unit - 1) / (space)->unit)
+
+#define __btspace_bytes(units)          (((units) + 7) >> 3)
+
+#define __btspace_is_used(space, i)                                         \
+    ((space)->map[(i) >> 3] & (1U << ((i) & 7)))
+
+static btspace_t *__btspace_alloc (uint32_t unit) {
+    btspace_t *space;
+
+    if ((space = (btspace_t *) calloc(1, sizeof(btspace_t))) == NULL)
+        return(NULL);
+
+    if ((space->zero = (uint8_t *) calloc(1, unit)) == NULL) {
+        free(space);
+        return(NULL);
+    }
+
+    space->unit = unit;
+    space->base = UINT64_MAX;
+    return(space);
+}
+
+static void __btspace_close (btree_t *btree) {
+    btspace_t *space = btree->space;
+
+    if (space != NULL) {
+        free(space->map);
+        free(space->zero);
+        free(space);
+        btree->space = NULL;
+    }
+}
+
+/* Cover 'units' units, the new ones are used until freed */
+static int __btspace_grow (btspace_t *space,
+                           uint64_t units)
+{
+    uint64_t capacity;
+    uint8_t *map;
+
+    if (units <= space->units)
+        return(0);
+
+    capacity = __btspace_bytes(units);
+    if (capacity > space->capacity) {
+        if (capacity < (space->capacity << 1))
+            capacity = space->capacity << 1;
+
+        if ((map = (uint8_t *) realloc(space->map, capacity)) == NULL)
+            return(-1);
+
+        memset(map + space->capacity, 0xff, capacity - space->capacity);
+        space->map = map;
+        space->capacity = capacity;
+    }
+
+    space->units = units;
+    return(0);
+}
+
+static void __btspace_mark (btspace_t *space,
+                            uint64_t first,
+                            uint64_t last,
+                            int used)
+{
+    uint8_t *byte;
+    uint8_t bit;
+
+    for (; first < last; ++first) {
+        byte = space->map + (first >> 3);
+        bit = 1U << (first & 7);
+        if (used && !(*byte & bit)) {
+            *byte |= bit;
+            space->free--;
+        } else if (!used && (*byte & bit)) {
+            *byte &= ~bit;
+            space->free++;
+        }
+    }
+}
+
+/* Next-fit, the first run of 'count' free units from 'hint' (0 if none) */
+static uint64_t __btspace_find (btspace_t *space,
+                                uint64_t hint,
+                                uint64_t count)
+{
+    uint64_t scanned;
+    uint64_t run;
+    uint64_t i;
+
+    if (space->free < count || space->base >= space->units)
+        return(0);
+
+    if (hint < space->base || hint >= space->units)
+        hint = space->base;
+
+    run = 0;
+    i = hint;
+    for (scanned = space->base; scanned < space->units; ++scanned) {
+        /* Runs don't wrap around the end */
+        if (i >= space->units) {
+            i = space->base;
+            run = 0;
+        }
+
+        if ((i & 7) == 0 && space->map[i >> 3] == 0xff) {
+            scanned += 7;
+            i += 8;
+            run = 0;
+            continue;
+        }
+
+        if (__btspace_is_used(space, i))
+            run = 0;
+        else if (++run == count)
+            return(i + 1 - count);
+        i++;
+    }
+
+    return(0);
+}
+
+/* Append to the disk, padded so the next append starts a unit */
+static uint64_t __btspace_pad (btree_t *btree,
+                               uint64_t end)
+{
+    btspace_t *space = btree->space;
+    uint32_t pad;
+
+    if ((pad = (space->unit - (end % space->unit)) % space->unit) > 0) {
+        __btdisk_append(btree, space->zero, pad);
+        end += pad;
+    }
+    return(end);
+}
+
+static uint64_t __btspace_append (btree_t *btree,
+                                  const void *data,
+                                  uint32_t size)
+{
+    btspace_t *space = btree->space;
+    uint64_t offset;
+    uint64_t end;
+
+    /* Blocks must start a unit, the disk end may not be on one before
+     * the first append after the map is enabled: pad it (an empty append
+     * tells where the end is).
+     */
+    if (space->base == UINT64_MAX)
+        __btspace_pad(btree, __btdisk_append(btree, space->zero, 0));
+
+    offset = __btdisk_append(btree, data, size);
+    end = __btspace_pad(btree, offset + size);
+
+    /* The first block, reused space starts from here (0 is no block) */
+    if (space->base == UINT64_MAX)
+        space->base = (offset / space->unit) + (offset == 0);
+
+    if (!__btspace_grow(space, end / space->unit))
+        __btspace_mark(space, offset / space->unit, end / space->unit, 1);
+    space->cursor = end / space->unit;
+    return(offset);
+}
+
+/* Take a free run for 'size' bytes near 'hint' (0 for next-fit) */
+static uint64_t __btspace_take (btspace_t *space,
+                                uint64_t hint,
+                                uint64_t size)
+{
+    uint64_t count;
+    uint64_t first;
+
+    count = __btspace_units(space, size);
+    first = __btspace_find(space, hint ? (hint / space->unit) : space->cursor, count);
+    if (first == 0)
+        return(0);
+
+    __btspace_mark(space, first, first + count, 1);
+    space->cursor = first + count;
+    return(first * space->unit);
+}
+
+/* Write a new block in free space near 'hint', or append it */
+static uint64_t __btspace_write (btree_t *btree,
+                                 uint64_t hint,
+                                 const void *data,
+                                 uint32_t size)
+{
+    btspace_t *space = btree->space;
+    uint64_t offset;
+
+    if ((offset = __btspace_take(space, hint, size)) == 0)
+        return(__btspace_append(btree, data, size));
+
+    return(__btdisk_write(btree, offset, __btspace_units(space, size) * space->unit,
+                          data, size));
+}
+
+/* Write the images packed at unit boundaries in 'buffer' ('offsets' from
+ * its start, 'skip' ones not there): as one run if a free one fits them
+ * all, otherwise each in the first hole that fits it and the rest are
+ * appended at once. 'offsets' are turned into disk offsets.
+ */
+static void __btspace_write_batch (btree_t *btree,
+                                   uint64_t hint,
+                                   const uint8_t *buffer,
+                                   uint64_t size,
+                                   uint64_t *offsets,
+                                   const uint8_t *skip,
+                                   uint32_t count)
+{
+    btspace_t *space = btree->space;
+    uint64_t offset;
+    uint64_t start;
+    uint64_t end;
+    uint32_t i, j;
+
+    if ((offset = __btspace_take(space, hint, size)) != 0) {
+        __btdisk_write(btree, offset, size, buffer, size);
+        for (i = 0; i < count; ++i) {
+            if (!skip[i])
+                offsets[i] += offset;
+        }
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (skip[i])
+            continue;
+
+        for (j = i + 1; j < count && skip[j]; ++j);
+        end = (j < count) ? offsets[j] : size;
+        if ((offset = __btspace_take(space, hint, end - offsets[i])) == 0)
+            break;
+
+        __btdisk_write(btree, offset, end - offsets[i],
+                       buffer + offsets[i], end - offsets[i]);
+        offsets[i] = offset;
+    }
+
+    if (i < count) {
+        start = offsets[i];
+        offset = __btspace_append(btree, buffer + start, size - start);
+        for (; i < count; ++i) {
+            if (!skip[i])
+                offsets[i] = offset + (offsets[i] - start);
+        }
+    }
+}
+
+static void __btspace_free (btree_t *btree,
+                            uint64_t offset,
+                            uint32_t size)
+{
+    btspace_t *space = btree->space;
+    uint64_t first;
+    uint64_t last;
+
+    /* The block may come back under this number, holding other data */
+    __btcache_remove(btree, &(btree->cache), offset);
+
+    first = __btspace_units(space, offset);
+    last = __btspace_units(space, offset + size);
+    if (first < space->base || first >= last || __btspace_grow(space, last))
+        return;
+
+    __btspace_mark(space, first, last, 0);
+}
+
+/* Write the bitmap, and its header next to the super-block */
+static int __btspace_commit (btree_t *btree) {
+    btspace_t *space = btree->space;
+    struct space_super header;
+    uint64_t offset;
+    uint64_t count;
+    uint8_t *zero;
+    uint32_t size;
+
+    /* The bitmap block takes its own units, with room to grow in place.
+     * Appending it grows the map, the size is checked again.
+     */
+    while (space->blocknr == 0 || (size = __btspace_bytes(space->units)) > space->slot) {
+        if (space->blocknr != 0)
+            __btspace_free(btree, space->blocknr, space->slot);
+
+        size = __btspace_bytes(space->units);
+        count = __btspace_units(space, ((uint64_t)size << 1) + 1);
+        if ((offset = __btspace_take(space, 0, count * space->unit)) == 0) {
+            if ((zero = (uint8_t *) calloc(count, space->unit)) == NULL)
+                return(-1);
+            offset = __btspace_append(btree, zero, count * space->unit);
+            free(zero);
+        }
+
+        space->blocknr = offset;
+        space->slot = count * space->unit;
+    }
+
+    __btdisk_write(btree, space->blocknr, space->slot, space->map, size);
+
+    memset(&header, 0, SPACE_SUPER_SIZE);
+    header.ss_magic = SPACE_SUPER_MAGIC;
+    header.ss_crc = __btdisk_crc_pointer(btree, space->map, size);
+    header.ss_unit = space->unit;
+    header.ss_size = size;
+    header.ss_slot = space->slot;
+    header.ss_units = space->units;
+    header.ss_base = space->base;
+    header.ss_free = space->free;
+    header.ss_blocknr = space->blocknr;
+    __btdisk_write(btree, btree->super_offset + SUPER_BLOCK_SIZE,
+                   SPACE_SUPER_SIZE, &header, SPACE_SUPER_SIZE);
+    return(0);
+}
+
+static int __btspace_load (btree_t *btree) {
+    struct space_super header;
+    btspace_t *space;
+    uint64_t i;
+
+    if (!__btdisk_read(btree, btree->super_offset + SUPER_BLOCK_SIZE,
+                       &header, SPACE_SUPER_SIZE))
+    {
+        return(-1);
+    }
+
+    if (header.ss_magic != SPACE_SUPER_MAGIC || header.ss_unit == 0 ||
+        header.ss_size != __btspace_bytes(header.ss_units) ||
+        header.ss_size > header.ss_slot)
+    {
+        fprintf(stderr, "assert: __btspace_load() bad header.\n");
+        return(-2);
+    }
+
+    if ((space = __btspace_alloc(header.ss_unit)) == NULL)
+        return(-3);
+
+    btree->space = space;
+    if (__btspace_grow(space, header.ss_units))
+        return(-4);
+
+    if (header.ss_size > 0 &&
+        (!__btdisk_read(btree, header.ss_blocknr, space->map, header.ss_size) ||
+         __btdisk_crc_pointer(btree, space->map, header.ss_size) != header.ss_crc))
+    {
+        fprintf(stderr, "assert: __btspace_load() bitmap crc mismatch.\n");
+        return(-5);
+    }
+
+    /* Units past the map are used, count the free ones */
+    for (i = header.ss_units; i < (space->capacity << 3); ++i)
+        space->map[i >> 3] |= (1U << (i & 7));
+    for (i = 0; i < space->units; ++i)
+        space->free += !__btspace_is_used(space, i);
+
+    space->base = header.ss_base;
+    space->cursor = header.ss_base;
+    space->blocknr = header.ss_blocknr;
+    space->slot = header.ss_slot;
+    return(0);
+}
+
+/* Bytes a block can take in place, the whole of its units once managed */
+static uint32_t __btree_block_slot (btree_t *btree,
+                                    uint64_t blocknr,
+                                    uint32_t block_size)
+{
+    btspace_t *space = btree->space;
+
+    if (space == NULL || __btspace_units(space, blocknr) < space->base)
+        return(block_size);
+    return(__btspace_units(space, block_size) * space->unit);
+}
+
+/* Write a node block: in place if it fits its slot, otherwise through the
+ * space map (its old block freed) or appended.
+ */
+static uint64_t __btree_block_write (btree_t *btree,
+                                     uint64_t blocknr,
+                                     uint32_t block_size,
+                                     uint64_t hint,
+                                     const void *data,
+                                     uint32_t size)
+{
+    uint32_t slot;
+
+    slot = __btree_block_slot(btree, blocknr, block_size);
+    if (btree->space == NULL || (blocknr != 0 && size <= slot))
+        return(__btree_disk_write(btree, blocknr, slot, data, size));
+
+    if (blocknr != 0)
+        __btspace_free(btree, blocknr, block_size);
+    return(__btspace_write(btree, hint, data, size));
+}
+
+#define __btree_block_append(btree, hint, data, size)                       \
+    ((btree)->space != NULL ?                                               \
+        __btspace_write(btree, hint, data, size) :                          \
+        __btdisk_append(btree, data, size))
+
+/* ===========================================================================
+ *  PRIVATE Operations (Blobs)
+ *
+ *  Values over the blob threshold are written to a block of their own
+ *  on insert, the leaf item value is the node pointer of the block.
+ *  Blobs are never rewritten, a new value gets a new block and the old
+ *  one is erased with its item. They bypass the block cache.
+ */
+#define __btblob_needed(btree, size)                                        \
+    ((btree)->blob_threshold > 0 && (size) > (btree)->blob_threshold)
+
+/* Size of the value in the leaf */
+#define __btblob_inline_size(btree, size)                                   \
+    (__btblob_needed(btree, size) ? NODE_POINTER_SIZE : (size))
+
+static void __btblob_write (btree_t *btree,
+                            const void *value,
+                            uint32_t size,
+                            struct node_pointer *pointer)
+{
+    pointer->np_crc = __btdisk_crc_pointer(btree, value, size);
+    pointer->np_size = size;
+    pointer->np_blocknr = __btree_block_append(btree, 0, value, size);
+}
+
+static void __btblob_erase (btree_t *btree,
+                            const void *data)
+{
+    struct node_pointer pointer;
+
+    memcpy(&pointer, data, NODE_POINTER_SIZE);
+    __btree_disk_erase(btree, pointer.np_blocknr, pointer.np_size);
+}
+
+/* Read the blob of pointer 'data', up to '*size' bytes into 'buffer',
+ * '*size' is set to the bytes copied. The whole blob is read to check
+ * its crc.
+ */
+static int __btblob_read (btree_t *btree,
+                          const void *data,
+                          void *buffer,
+                          uint32_t *size)
+{
+    struct node_pointer pointer;
+    const uint8_t *block;
+    uint8_t *temp = NULL;
+
+    memcpy(&pointer, data, NODE_POINTER_SIZE);
+
+    block = NULL;
+    if (!btree->writer && btree->disk->map != NULL)
+        block = btree->disk->map(btree->disk, pointer.np_blocknr, pointer.np_size);
+
+    if (block == NULL) {
+        if (*size < pointer.np_size) {
+            if ((temp = (uint8_t *) malloc(pointer.np_size)) == NULL) {
+                perror("malloc()");
+                return(1);
+            }
+        }
+
+        block = (temp != NULL) ? temp : (uint8_t *)buffer;
+        if (__btdisk_read(btree, pointer.np_blocknr, (uint8_t *)block,
+                          pointer.np_size) != pointer.np_size)
+        {
+            fprintf(stderr, "assert: blob read failed\n");
+            free(temp);
+            return(2);
+        }
+    }
+
+    if (__btdisk_crc_pointer(btree, block, pointer.np_size) != pointer.np_crc) {
+        fprintf(stderr, "assert: blob->crc failed\n");
+        free(temp);
+        return(3);
+    }
+
+    if (*size > pointer.np_size)
+        *size = pointer.np_size;
+    if (block != buffer)
+        memcpy(buffer, block, *size);
+
+    free(temp);
+    return(0);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Node)
+ *
+ *  Readers run concurrently under the tree read lock, so the in-memory
+ *  state they touch is latched: node refs are atomic, a child slot is
+ *  filled under the parent latch, and a leaf moves its data to (or from)
+ *  the block cache under its own latch. Twigs keep their data until the
+ *  tree is synced, which lets readers walk them without any latch.
+ *  Writers hold the tree write lock and see no concurrent readers.
+ */
+#define __btree_leaf_node_alloc(btree)                                      \
     __btnode_alloc(btree, LEAF_NODE_LEVEL)
 
 #define __btnode_level_alloc(btree, level)                                  \
@@ -1168,6 +2888,20 @@ uint8_t *__btcache_lookup (btree_t *btree,
         __btnode_leaf_alloc(btree) :                                        \
         __btnode_internal_alloc(btree)
 
+#define __btnode_is_twig(node)          ((node)->pointers != NULL)
+
+#define __btnode_ref(node)                                                  \
+    __atomic_add_fetch(&((node)->refs), 1, __ATOMIC_ACQ_REL)
+
+#define __btnode_unref(node)                                                \
+    __atomic_sub_fetch(&((node)->refs), 1, __ATOMIC_ACQ_REL)
+
+#define __btnode_load(ptr)              __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define __btnode_store(ptr, value)      __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+
+#define __btnode_lock(node)             pthread_mutex_lock(&((node)->lock))
+#define __btnode_unlock(node)           pthread_mutex_unlock(&((node)->lock))
+
 static btnode_t *__btnode_internal_alloc (btree_t *btree) {
     btnode_t *node;
     uint32_t size;
@@ -1184,6 +2918,7 @@ static btnode_t *__btnode_internal_alloc (btree_t *btree) {
     node->flags = 0;
     node->size = 0;
     node->refs = 1;
+    pthread_mutex_init(&(node->lock), NULL);
 
     return(node);
 }
@@ -1200,10 +2935,16 @@ static btnode_t *__btnode_leaf_alloc (btree_t *btree) {
     node->flags = 0;
     node->size = 0;
     node->refs = 1;
+    pthread_mutex_init(&(node->lock), NULL);
 
     return(node);
 }
 
+static void __btnode_destroy (btnode_t *node) {
+    pthread_mutex_destroy(&(node->lock));
+    free(node);
+}
+
 static btnode_t *__btnode_alloc (btree_t *btree,
                                  uint8_t level)
 {
@@ -1215,7 +2956,7 @@ static btnode_t *__btnode_alloc (btree_t *btree,
 
     /* Allocate Node Data */
     if ((node->data = (uint8_t *) malloc(__btree_block_size(btree))) == NULL) {
-        free(node);
+        __btnode_destroy(node);
         return(NULL);
     }
 
@@ -1236,107 +2977,281 @@ static btnode_t *__btnode_alloc (btree_t *btree,
 static void __btnode_release (btree_t *btree,
                               btnode_t *node)
 {
-    if (node->refs <= 0) {
-        fprintf(stderr, "assert: Node Release: %p %d\n", node, node->refs);
-        abort();
-    }
+    int refs;
 
-    if (--(node->refs) > 0)
+    /* Twigs stay in memory, no one else can drop the data */
+    if (__btnode_is_twig(node)) {
+        if ((refs = __btnode_unref(node)) < 0) {
+            fprintf(stderr, "assert: Node Release: %p %d\n", node, refs + 1);
+            abort();
+        }
         return;
+    }
+
+    __btnode_lock(node);
+    if ((refs = __btnode_unref(node)) < 0) {
+        fprintf(stderr, "assert: Node Release: %p %d\n", node, refs + 1);
+        abort();
+    }
 
-    if (!__node_is_dirty(node) && __btcache_can_add(btree, &(btree->cache))) {
-        __btcache_add(btree, &(btree->cache), node->blocknr, node->data);
-        node->data = NULL;
+    /* Read-ahead peeks at leaf data without the latch */
+    if (refs == 0 && __node_is_mapped(node)) {
+        /* The mapping is the cache */
+        __node_set_unmapped(node);
+        __btnode_store(&(node->data), NULL);
+    } else if (refs == 0 && !__node_is_dirty(node) &&
+               __btcache_can_add(btree, &(btree->cache)))
+    {
+        __btcache_add(btree, &(btree->cache), node->blocknr, node->data, 0);
+        __btnode_store(&(node->data), NULL);
     }
+    __btnode_unlock(node);
 }
 
 static int __btnode_free (btree_t *btree,
                           btnode_t *node)
 {
-    if (node->data != NULL)
-        __btnode_release(btree, node);
-    free(node);
+    if (node->data != NULL && !__node_is_mapped(node)) {
+        if (!__node_is_dirty(node) && __btcache_can_add(btree, &(btree->cache)))
+            __btcache_add(btree, &(btree->cache), node->blocknr, node->data, 0);
+        else
+            free(node->data);
+    }
+    __node_mark_clean(btree, node);
+    __btnode_destroy(node);
     return(0);
 }
 
 static int __btnode_remove (btree_t *btree,
                             btnode_t *node)
 {
-    if (__node_is_on_disk(node))
-        __btdisk_erase(btree, node->blocknr, node->size);
+    if (__node_is_on_disk(node)) {
+        __btcache_remove(btree, &(btree->cache), node->blocknr);
+        __btree_disk_erase(btree, node->blocknr, node->size);
+    }
 
-    if (node->data != NULL)
+    if (node->data != NULL && !__node_is_mapped(node))
         free(node->data);
 
-    free(node);
+    __node_mark_clean(btree, node);
+    __btnode_destroy(node);
     return(0);
 }
 
-static btnode_t *__btnode_read (btree_t *btree,
-                                btnode_t *node,
-                                struct node_pointer *pointer)
+/* Check a block as read from disk, 'raw' holds the pointer np_size bytes.
+ * A compressed block is expanded into 'block', otherwise raw is the block.
+ * nh_crc is checked on expanded blocks, or on every block in verify mode.
+ */
+static int __btnode_verify (btree_t *btree,
+                            struct node_pointer *pointer,
+                            const uint8_t *raw,
+                            uint8_t *block)
 {
-    uint8_t *block;
-    uint32_t crc;
-
-    if (node->data != NULL)
-        return(node);
-
-    if ((node->data = __btcache_lookup(btree, &(btree->cache), pointer->np_blocknr)) != NULL)
-        return(node);
-
-    node->blocknr = pointer->np_blocknr;
-    node->size = pointer->np_size;
-    node->flags = 0;
+    uint32_t block_size;
 
-    if ((node->data = (uint8_t *) malloc(__btree_block_size(btree))) == NULL) {
-        perror("malloc()");
-        return(NULL);
+    block_size = __btree_block_size(btree);
+    if (__btdisk_crc_pointer(btree, raw, pointer->np_size) != pointer->np_crc) {
+        fprintf(stderr, "assert: pointer->crc failed\n");
+        return(-4);
     }
 
-    block = node->data;
-    if (!__btdisk_read(btree, pointer->np_blocknr, block, pointer->np_size)) {
-        fprintf(stderr, "assert: btree disk read\n");
-        goto _read_error;
-    }
+    if (pointer->np_size < block_size) {
+        if (btree->disk->decompress == NULL) {
+            fprintf(stderr, "assert: compressed block, no decompress()\n");
+            return(-1);
+        }
 
-    crc = __btdisk_crc_pointer(btree, block, pointer->np_size);
-    if (pointer->np_crc != crc) {
-        fprintf(stderr, "assert: pointer->crc failed\n");
-        goto _read_error;
+        if (__btdisk_decompress(btree, block, raw, pointer->np_size) != block_size) {
+            fprintf(stderr, "assert: decompress() failed\n");
+            return(-5);
+        }
+    } else if (!(btree->verify & BTREE_VERIFY_NODE)) {
+        /* The pointer crc already covers every byte of the node */
+        return(0);
     }
 
-    crc = __btdisk_crc_block(btree, NODE_CRC_OFFSET, block, pointer->np_size);
-    if (__node_crc(node) != crc) {
+    if (NODE_HEAD(block)->nh_crc !=
+        __btdisk_crc_block(btree, NODE_CRC_OFFSET, block, block_size))
+    {
         fprintf(stderr, "assert: node_crc() failed\n");
-        goto _read_error;
+        return(-6);
     }
 
-    return(node);
-
-_read_error:
-    node->data = NULL;
-    free(block);
-    return(NULL);
+    return(0);
 }
 
-static btnode_t *__btnode_fetch (btree_t *btree,
-                                 uint8_t level,
-                                 struct node_pointer *pointer)
+/* Read a compressed block from disk and expand it into 'block' */
+static int __btnode_read_compressed (btree_t *btree,
+                                     struct node_pointer *pointer,
+                                     uint8_t *block)
 {
-    btnode_t *node;
-
-    if ((node = __btnode_level_alloc(btree, level)) == NULL)
-        return(NULL);
+    uint8_t *zblock;
+    int err;
+
+    if ((zblock = (uint8_t *) malloc(pointer->np_size)) == NULL) {
+        perror("malloc()");
+        return(-2);
+    }
+
+    if (!__btdisk_read(btree, pointer->np_blocknr, zblock, pointer->np_size)) {
+        fprintf(stderr, "assert: btree disk read\n");
+        err = -3;
+    } else {
+        err = __btnode_verify(btree, pointer, zblock, block);
+    }
+
+    free(zblock);
+    return(err);
+}
+
+/* Give the writer its own copy of a node used in place from the mapping.
+ * Readers are out (write lock), the mapped block stays valid for them.
+ */
+static int __btnode_unmap (btree_t *btree,
+                           btnode_t *node)
+{
+    uint8_t *block;
+
+    if ((block = (uint8_t *) malloc(__btree_block_size(btree))) == NULL)
+        return(-1);
+
+    memcpy(block, node->data, __btree_block_size(btree));
+    __node_set_unmapped(node);
+    __btnode_store(&(node->data), block);
+    return(0);
+}
+
+/* Point node data in the disk mapping, uncompressed blocks only */
+static int __btnode_map (btree_t *btree,
+                         btnode_t *node,
+                         struct node_pointer *pointer)
+{
+    uint32_t block_size;
+    uint8_t *block;
+
+    block_size = __btree_block_size(btree);
+    if (pointer->np_size != block_size)
+        return(1);
+
+    block = (uint8_t *) btree->disk->map(btree->disk, pointer->np_blocknr, block_size);
+    if (block == NULL)
+        return(1);
+
+    if (__btnode_verify(btree, pointer, block, block))
+        return(-1);
+
+    __node_set_mapped(node);
+    __btnode_store(&(node->data), block);
+    return(0);
+}
+
+/* Load node data, the caller holds the node latch (or the only reference) */
+static btnode_t *__btnode_read (btree_t *btree,
+                                btnode_t *node,
+                                struct node_pointer *pointer)
+{
+    uint32_t block_size;
+    uint8_t *block;
+    int err;
+
+    if (node->data != NULL) {
+        if (btree->writer && __node_is_mapped(node) && __btnode_unmap(btree, node))
+            return(NULL);
+        return(node);
+    }
+
+    node->blocknr = pointer->np_blocknr;
+    node->size = pointer->np_size;
+    __node_set_on_disk(node);
+
+    if ((block = __btcache_lookup(btree, &(btree->cache), pointer->np_blocknr)) != NULL) {
+        __btnode_store(&(node->data), block);
+        return(node);
+    }
+
+    block_size = __btree_block_size(btree);
+    if (pointer->np_size == 0 || pointer->np_size > block_size) {
+        fprintf(stderr, "assert: pointer->size %u\n", pointer->np_size);
+        return(NULL);
+    }
+
+    /* Readers use the block in place, no copy */
+    if (!btree->writer && btree->disk->map != NULL) {
+        if ((err = __btnode_map(btree, node, pointer)) < 0)
+            return(NULL);
+        if (err == 0)
+            return(node);
+    }
+
+    if ((block = (uint8_t *) malloc(block_size)) == NULL) {
+        perror("malloc()");
+        return(NULL);
+    }
+
+    /* Blocks smaller than block size are compressed */
+    if (pointer->np_size < block_size) {
+        if (__btnode_read_compressed(btree, pointer, block))
+            goto _read_error;
+    } else {
+        if (!__btdisk_read(btree, pointer->np_blocknr, block, block_size)) {
+            fprintf(stderr, "assert: btree disk read\n");
+            goto _read_error;
+        }
+
+        if (__btnode_verify(btree, pointer, block, block))
+            goto _read_error;
+    }
+
+    /* Publish data only when complete, twig readers don't take the latch */
+    __btnode_store(&(node->data), block);
+    return(node);
+
+_read_error:
+    free(block);
+    return(NULL);
+}
+
+static btnode_t *__btnode_fetch (btree_t *btree,
+                                 uint8_t level,
+                                 struct node_pointer *pointer)
+{
+    btnode_t *node;
+
+    if ((node = __btnode_level_alloc(btree, level)) == NULL)
+        return(NULL);
 
     if (__btnode_read(btree, node, pointer) == NULL) {
-        free(node);
+        __btnode_destroy(node);
         return(NULL);
     }
 
     return(node);
 }
 
+/* Take a reference to an in-memory node, loading its data if needed */
+static btnode_t *__btnode_acquire (btree_t *btree,
+                                   btnode_t *node,
+                                   struct node_pointer *pointer)
+{
+    /* The writer takes the latch path, it may need to unmap the twig */
+    if (__btnode_is_twig(node) && __btnode_load(&(node->data)) != NULL &&
+        !(btree->writer && __node_is_mapped(node)))
+    {
+        __btnode_ref(node);
+        return(node);
+    }
+
+    __btnode_lock(node);
+    __btnode_ref(node);
+    if (__btnode_read(btree, node, pointer) == NULL) {
+        __btnode_unref(node);
+        __btnode_unlock(node);
+        return(NULL);
+    }
+    __btnode_unlock(node);
+    return(node);
+}
+
 static btnode_t *__btnode_fetch_twig (btree_t *btree,
                                       btnode_t *node,
                                       uint32_t index)
@@ -1344,29 +3259,41 @@ static btnode_t *__btnode_fetch_twig (btree_t *btree,
     btnode_t *child;
     uint8_t level;
 
-    if ((child = node->pointers[index]) != NULL) {
-        child->refs++;
-        return(__btnode_read(btree, child, __twig_pointer(btree, node, index)));
+    if ((child = __btnode_load(&(node->pointers[index]))) == NULL) {
+        __btnode_lock(node);
+        if ((child = node->pointers[index]) == NULL) {
+            level = __node_level(node) - 1;
+            child = __btnode_fetch(btree, level, __twig_pointer(btree, node, index));
+            if (child != NULL)
+                __btnode_store(&(node->pointers[index]), child);
+            __btnode_unlock(node);
+            return(child);
+        }
+        __btnode_unlock(node);
     }
 
-    level = __node_level(node) + 1;
-    child = __btnode_fetch(btree, level, __twig_pointer(btree, node, index));
-    node->pointers[index] = child;
-    return(child);
+    return(__btnode_acquire(btree, child, __twig_pointer(btree, node, index)));
 }
 
 static btnode_t *__btree_fetch_root (btree_t *btree)
 {
+    btnode_t *root;
     uint8_t level;
 
-    if (btree->root != NULL) {
-        btree->root->refs++;
-        return(__btnode_read(btree, btree->root, __btree_root_pointer(btree)));
+    if ((root = __btnode_load(&(btree->root))) == NULL) {
+        pthread_mutex_lock(&(btree->latch));
+        if ((root = btree->root) == NULL) {
+            level = __btree_height(btree) - 1;
+            root = __btnode_fetch(btree, level, __btree_root_pointer(btree));
+            if (root != NULL)
+                __btnode_store(&(btree->root), root);
+            pthread_mutex_unlock(&(btree->latch));
+            return(root);
+        }
+        pthread_mutex_unlock(&(btree->latch));
     }
 
-    level = __btree_height(btree);
-    btree->root = __btnode_fetch(btree, level, __btree_root_pointer(btree));
-    return(btree->root);
+    return(__btnode_acquire(btree, root, __btree_root_pointer(btree)));
 }
 
 /* ===========================================================================
@@ -1416,803 +3343,4160 @@ static btnode_t *__btree_lookup_level (btree_t *btree,
     return(NULL);
 }
 
-static btnode_t *__btnode_fetch_right (btree_t *btree,
-                                       btnode_t *node)
+/* ===========================================================================
+ *  PRIVATE Operations (Path)
+ *
+ *  A path keeps a reference to every node from the root down to the leaf,
+ *  indexed by node level, and the item position used in each of them.
+ *  Twig keys are the last key of the pointed sub-tree (or bigger), so
+ *  splits and merges can update the parents without a new lookup.
+ */
+#define __btnode_last_key(btree, node, buffer)                              \
+    (__node_is_leaf(node) ? __leaf_last_key_copy(btree, node, buffer) :     \
+                            __twig_last_key(btree, node))
+
+static void __btpath_release (btree_t *btree,
+                              btpath_t *path)
 {
-    return(NULL);
+    uint32_t level;
+
+    for (level = 1; level <= path->levels; ++level) {
+        if (path->nodes[level] != NULL) {
+            __btnode_release(btree, path->nodes[level]);
+            path->nodes[level] = NULL;
+        }
+    }
+
+    path->levels = 0;
 }
 
-static btnode_t *__btnode_fetch_left (btree_t *btree,
-                                      btnode_t *node)
+static void __btpath_touch (btree_t *btree,
+                            btpath_t *path)
 {
-    return(NULL);
+    uint32_t level;
+
+    for (level = TWIG_NODE_LEVEL; level <= path->levels; ++level)
+        __node_set_to_update(path->nodes[level]);
 }
 
-/* ===========================================================================
- *  PRIVATE Operations (Node Internal Update)
- */
-static void __btree_twigs_update (btree_t *btree,
-                                  btnode_t *node,
-                                  const void *old_key,
-                                  const void *new_key)
+static btnode_t *__btpath_descend (btree_t *btree,
+                                   btpath_t *path,
+                                   uint32_t level,
+                                   const void *key,
+                                   btnode_place_t *place)
 {
-    struct node_pointer *pointer;
-    btnode_place_t place;
-    uint32_t level;
+    btnode_t *node;
 
-    level = __node_level(node);
+    node = path->nodes[level];
     while (1) {
-        if (!(node = __btree_lookup_level(btree, old_key, ++level, &place)))
-            break;
-
-        __node_set_to_update(node);
-        if (place.found) {
-            pointer = __twig_pointer(btree, node, place.index);
-            __twig_replace(btree, node, place.index, new_key, pointer);
+        if (__node_is_leaf(node)) {
+            __leaf_search(btree, node, key, place);
+            path->index[level] = place->index;
+            return(node);
         }
 
-        __btnode_release(btree, node);
-    }
-}
+        __twig_search(btree, node, key, place);
+        if (place->index >= __node_items(node))
+            place->index = __node_items(node) - 1;
+        path->index[level] = place->index;
 
-static void __btree_twigs_insert_update (btree_t *btree,
-                                         btnode_t *node,
-                                         uint32_t index,
-                                         const void *new_key)
-{
-    const void *last_key;
+        if ((node = __btnode_fetch_twig(btree, node, place->index)) == NULL)
+            return(NULL);
 
-    if (__node_is_leaf(node))
-        last_key = __leaf_last_key(btree, node);
-    else
-        last_key = __twig_last_key(btree, node);
+        path->nodes[--level] = node;
+    }
 
-    if (index == __node_items(node))
-        __btree_twigs_update(btree, node, last_key, new_key);
-    else
-        __btree_twigs_update(btree, node, last_key, last_key);
+    return(NULL);
 }
 
-static void __btree_twigs_remove_update (btree_t *btree,
-                                         btnode_t *node,
-                                         uint32_t index)
+static btnode_t *__btpath_lookup (btree_t *btree,
+                                  btpath_t *path,
+                                  const void *key,
+                                  btnode_place_t *place)
 {
-    const void *last_key;
-    const void *new_key;
+    btnode_t *node;
 
-    if (__node_is_leaf(node)) {
-        last_key = __leaf_last_key(btree, node);
-        new_key = __leaf_last_prev_key(btree, node);
-    } else {
-        last_key = __twig_last_key(btree, node);
-        new_key = __twig_last_prev_key(btree, node);
-    }
+    path->levels = 0;
+    if ((node = __btree_fetch_root(btree)) == NULL)
+        return(NULL);
 
-    if (index == (__node_items(node) - 1))
-        __btree_twigs_update(btree, node, last_key, new_key);
-    else
-        __btree_twigs_update(btree, node, last_key, last_key);
-}
+    path->levels = __node_level(node);
+    path->nodes[path->levels] = node;
+    if ((node = __btpath_descend(btree, path, path->levels, key, place)) == NULL)
+        __btpath_release(btree, path);
 
+    return(node);
+}
 
 /* ===========================================================================
  *  PRIVATE Operations (Node Insert)
  */
-static btnode_t *__btree_grow (btree_t *btree) {
+static int __btpath_split (btree_t *btree,
+                           btpath_t *path,
+                           uint32_t level,
+                           btnode_t *right);
+
+static btnode_t *__btree_grow (btree_t *btree,
+                               btpath_t *path)
+{
+    uint8_t last_key[__btree_key_size(btree)];
     struct node_pointer pointer = {0, 0, 0};
-    btnode_t *new_root;
     btnode_t *old_root;
-    const void *key;
-    uint32_t height;
+    btnode_t *root;
+    uint32_t level;
 
-    height = __btree_height(btree);
-    if ((new_root = __btnode_alloc(btree, height)) == NULL)
+    level = path->levels + 1;
+    if (level >= BTREE_MAX_HEIGHT)
         return(NULL);
 
-    if (height > 1) {
-        old_root = __btree_fetch_root(btree);
-
-        if (__node_is_leaf(old_root))
-            key = __leaf_last_key(btree, old_root);
-        else
-            key = __twig_last_key(btree, old_root);
+    if ((root = __btnode_alloc(btree, level)) == NULL)
+        return(NULL);
 
-        /* Insert old root as child of new root */
-        __twig_insert(btree, new_root, 0, key, &pointer);
-        new_root->pointers[0] = old_root;
+    /* Insert old root as child of new root */
+    old_root = path->nodes[path->levels];
+    __twig_insert(btree, root, 0, __btnode_last_key(btree, old_root, last_key), &pointer);
+    root->pointers[0] = old_root;
 
-        __btnode_release(btree, old_root);
-    }
+    /* Set new root, the path owns the allocation reference */
+    path->nodes[level] = root;
+    path->index[level] = 0;
+    path->levels = level;
 
-    /* Set new root */
-    btree->root = new_root;
+    btree->root = root;
     __btree_super(btree)->sb_height++;
 
-    return(new_root);
+    return(root);
 }
 
-static int __btree_insert_node (btree_t *btree,
-                                btnode_t *node)
+/* Split the twig of the path at 'level' if it has less than 'needed' free */
+static int __btpath_twig_room (btree_t *btree,
+                               btpath_t *path,
+                               uint32_t level,
+                               uint32_t needed)
 {
-    struct node_pointer value = {0, 0, 0};
-    btnode_place_t place;
-    btnode_t *twig_right;
-    btnode_t *twig_node;
-    btnode_t *target;
-    const void *last_key;
-    const void *key;
-    uint32_t index;
+    btnode_t *right;
+    btnode_t *node;
+    uint32_t nleft;
 
-    if (__node_is_leaf(node))
-        key = __leaf_last_key(btree, node);
-    else
-        key = __twig_last_key(btree, node);
+    node = path->nodes[level];
+    if (__node_free(node) >= needed)
+        return(0);
 
-    if (!(twig_node = __btree_lookup_level(btree, key,
-                                           __node_level(node) + 1,
-                                           &place)))
-    {
-        if ((twig_node = __btree_grow(btree)) == NULL)
-            return(1);
+    if ((right = __btnode_alloc(btree, level)) == NULL)
+        return(1);
 
-        __twig_index_search(btree, twig_node, key, &index);
-        __twig_insert(btree, twig_node, index, key, &value);
-        twig_node->pointers[index] = node;
+    __twig_split(btree, node, right);
+    if (__btpath_split(btree, path, level, right)) {
+        __twig_merge(btree, node, right);
+        __btree_super(btree)->sb_node_count--;
+        __btnode_remove(btree, right);
+        return(2);
+    }
+    __btstats_inc(btree, twig_splits);
 
-        __btnode_release(btree, twig_node);
-        return(0);
+    /* Keep the path on the half that contains our item */
+    nleft = __node_items(node);
+    if (path->index[level] >= nleft) {
+        __btnode_release(btree, node);
+        path->nodes[level] = right;
+        path->index[level] -= nleft;
+        path->index[level + 1]++;
+    } else {
+        __btnode_release(btree, right);
     }
 
-    /* Ok, this twig has space */
-    if (__node_free(twig_node) >= __twig_needed(btree)) {
-        __twig_index_search(btree, twig_node, key, &index);
-        __btree_twigs_insert_update(btree, twig_node, index, key);
-        __twig_insert(btree, twig_node, index, key, &value);
+    return(0);
+}
+
+/* Key is bigger than the twig keys on the path from 'level' up, raise them */
+static int __btpath_raise (btree_t *btree,
+                           btpath_t *path,
+                           uint32_t level,
+                           const void *key)
+{
+    const void *twig_key;
+    uint32_t key_size;
+    uint32_t old_size;
+    btnode_t *node;
 
-        twig_node->pointers[index] = node;
-        __btnode_release(btree, twig_node);
-        return(0);
-    }
+    for (; level <= path->levels; ++level) {
+        node = path->nodes[level];
+        twig_key = __twig_key(btree, node, path->index[level]);
+        if (btree->prefix_keycmp(btree->user_data, twig_key, key) >= 0)
+            break;
 
-    /* if place.index < node.nitems - split twig */
-    if (place.index < __node_items(twig_node)) {
-        if (!(twig_right = __btnode_alloc(btree, __node_level(twig_node)))) {
-            __btnode_release(btree, twig_node);
-            return(2);
+        /* Variable-size keys may grow */
+        if (__btree_is_varkey(btree)) {
+            key_size = __btree_key_len(btree, key);
+            old_size = __twig_key_len(btree, node, path->index[level]);
+            if (key_size > old_size &&
+                __btpath_twig_room(btree, path, level, key_size - old_size))
+            {
+                return(1);
+            }
         }
 
-        __twig_split(btree, twig_node, twig_right);
-        __btree_twigs_update(btree, twig_node,
-                            __twig_last_key(btree, twig_right),
-                            __twig_last_key(btree, twig_node));
+        __twig_key_replace(btree, path->nodes[level], path->index[level], key);
+    }
+
+    return(0);
+}
+
+/* Link 'node' in the parent, right after the node of the path at 'level' */
+static int __btpath_insert_after (btree_t *btree,
+                                  btpath_t *path,
+                                  uint32_t level,
+                                  const void *key,
+                                  btnode_t *node)
+{
+    struct node_pointer pointer = {0, 0, 0};
+    btnode_t *parent;
+    uint32_t index;
+
+    if (level == path->levels && __btree_grow(btree, path) == NULL)
+        return(1);
 
-        /* Insert Key/Value into target node */
-        target = __twig_split_target(btree, key, twig_node, twig_right);
-        last_key = __twig_last_key(btree, target);
+    if (__btpath_twig_room(btree, path, level + 1, __twig_needed(btree, key)))
+        return(2);
 
-        __twig_index_search(btree, target, key, &index);
-        __btree_twigs_insert_update(btree, target, index, key);
-        __twig_insert(btree, target, index, key, &value);
-        target->pointers[index] = node;
+    parent = path->nodes[level + 1];
+    index = path->index[level + 1] + 1;
 
-        if (__btree_insert_node(btree, twig_right)) {
-            __twig_remove(btree, target, index);
-            __twig_merge(btree, twig_node, twig_right);
-            __btnode_release(btree, twig_node);
-            __btnode_free(btree, twig_right);
-            return(3);
-        }
+    __twig_insert(btree, parent, index, key, &pointer);
+    parent->pointers[index] = node;
 
-        __btnode_release(btree, twig_right);
-    } else {
-        if (!(twig_right = __btnode_alloc(btree, __node_level(twig_node)))) {
-            __btnode_release(btree, twig_node);
-            return(4);
-        }
+    /* Appended to a twig split in half, its own twig key may be smaller */
+    if ((index + 1) == __node_items(parent) &&
+        __btpath_raise(btree, path, level + 2, key))
+    {
+        return(3);
+    }
 
-        __twig_insert(btree, twig_right, 0, key, &value);
-        twig_right->pointers[0] = node;
+    return(0);
+}
 
-        if (__btree_insert_node(btree, twig_right)) {
-            __btnode_release(btree, twig_node);
-            __btnode_free(btree, twig_right);
-            return(5);
-        }
+/* Node at 'level' of the path was split, link the 'right' half */
+static int __btpath_split (btree_t *btree,
+                           btpath_t *path,
+                           uint32_t level,
+                           btnode_t *right)
+{
+    uint8_t twig_key[__btree_prefix_size(btree)];
+    uint8_t last_key[__btree_key_size(btree)];
+    const void *left_key;
+    btnode_t *parent;
+    uint32_t old_size;
+    uint32_t needed;
+    uint32_t index;
 
-        __btnode_release(btree, twig_right);
+    /* New root, the left half is linked with its last key */
+    if (level == path->levels) {
+        return(__btpath_insert_after(btree, path, level,
+                                     __btnode_last_key(btree, right, last_key),
+                                     right) ? 1 : 0);
     }
 
-    __btnode_release(btree, twig_node);
+    /* Right half takes the old twig key, left one its new last key */
+    parent = path->nodes[level + 1];
+    index = path->index[level + 1];
+    old_size = __twig_key_len(btree, parent, index);
+    memcpy(twig_key, __twig_key(btree, parent, index), old_size);
+    left_key = __btnode_last_key(btree, path->nodes[level], last_key);
+
+    /* Make room for both at once, a parent split in between
+     * would see the two halves with the same twig key.
+     */
+    needed = __twig_needed(btree, twig_key);
+    if (__btree_is_varkey(btree) && __btree_key_len(btree, left_key) > old_size)
+        needed += __btree_key_len(btree, left_key) - old_size;
+
+    if (__btpath_twig_room(btree, path, level + 1, needed))
+        return(1);
+
+    if (__btpath_insert_after(btree, path, level, twig_key, right))
+        return(2);
 
+    __twig_key_replace(btree, path->nodes[level + 1], path->index[level + 1],
+                       left_key);
     return(0);
 }
 
+static uint32_t __leaf_used_size (btree_t *btree,
+                                  btnode_t *node,
+                                  uint32_t from,
+                                  uint32_t to)
+{
+    return(__slot_body_size(btree, node, from, to) +
+           (to - from) * __btree_item_size(btree));
+}
+
+/* A 'blob' value is erased if it doesn't make it into a node */
 static int __btree_leaf_split_insert (btree_t *btree,
-                                      btnode_t *node_left,
+                                      btpath_t *path,
                                       const void *key,
                                       const void *value,
-                                      uint32_t size)
+                                      uint32_t size,
+                                      int blob)
 {
     btnode_t *node_right;
-    uint32_t size_needed;
-    const void *last_key;
-    btnode_t *target;
+    btnode_t *node_mid;
+    uint32_t needed;
+    uint32_t space;
+    uint32_t index;
+    uint32_t split;
+    btnode_t *node;
+    uint32_t items;
+
+    node = path->nodes[LEAF_NODE_LEVEL];
+    index = path->index[LEAF_NODE_LEVEL];
+    items = __node_items(node);
+    needed = __item_needed_size(btree, key, size);
+    space = __btree_node_space(btree);
+
+    /* Split in half, or at the insert point if the item doesn't fit */
+    split = items >> 1;
+    if ((index < split && __leaf_used_size(btree, node, 0, split) + needed > space) ||
+        (index > split && __leaf_used_size(btree, node, split, items) + needed > space))
+    {
+        split = index;
+    }
 
-    /* Create the new right node */
-    if ((node_right = __btree_leaf_node_alloc(btree)) == NULL)
+    if ((node_right = __btnode_alloc(btree, LEAF_NODE_LEVEL)) == NULL) {
+        if (blob)
+            __btblob_erase(btree, value);
         return(1);
-
-    /* Split original node */
-    __leaf_split(btree, node_left, node_right);
-    __btree_twigs_update(btree, node_left,
-                         __leaf_last_key(btree, node_right),
-                         __leaf_last_key(btree, node_left));
-
-    /* Insert right node into the tree or rollback */
-    if (__btree_insert_node(btree, node_right)) {
-        __leaf_merge(btree, node_left, node_right);
-        __btnode_free(btree, node_right);
-        return(2);
     }
 
-    /* Calculate Item needed size */
-    size_needed = __item_needed_size(btree, size);
+    __leaf_split(btree, node, node_right, split);
 
-    /* Check key node */
-    target = __leaf_split_target(btree, key, node_left, node_right);
-    last_key = __leaf_last_key(btree, target);
-
-    if (__node_free(target) < size_needed) {
-        /* TODO - Do better
-         * Allocate an inner node between left and right.
-         */
-         if ((target = __btree_leaf_node_alloc(btree)) == NULL) {
-            __btnode_release(btree, node_right);
-            return(3);
-         }
+    node_mid = NULL;
+    if (index < split || (index == split && __node_free(node) >= needed)) {
+        __leaf_insert(btree, node, index, key, value, size);
+        __item_set_blob(btree, node, index, blob);
+    } else if (__node_free(node_right) >= needed) {
+        __leaf_insert(btree, node_right, index - split, key, value, size);
+        __item_set_blob(btree, node_right, index - split, blob);
+    } else {
+        /* Item doesn't fit in any half, give it a node on its own */
+        if ((node_mid = __btnode_alloc(btree, LEAF_NODE_LEVEL)) == NULL) {
+            __leaf_merge(btree, node, node_right);
+            __btree_super(btree)->sb_node_count--;
+            __btnode_remove(btree, node_right);
+            if (blob)
+                __btblob_erase(btree, value);
+            return(2);
+        }
+        __leaf_insert(btree, node_mid, 0, key, value, size);
+        __item_set_blob(btree, node_mid, 0, blob);
+    }
 
-        __btree_twigs_insert_update(btree, target, 0, key);
-        __leaf_insert(btree, target, 0, key, value, size);
+    if (__btpath_split(btree, path, LEAF_NODE_LEVEL, node_right)) {
+        __leaf_merge(btree, node, node_right);
+        __btree_super(btree)->sb_node_count--;
+        __btnode_remove(btree, node_right);
+        if (node_mid != NULL) {
+            __leaf_remove(btree, node_mid, 0);
+            __btree_super(btree)->sb_node_count--;
+            __btnode_remove(btree, node_mid);
+        }
+        return(3);
+    }
+    __btnode_release(btree, node_right);
 
-        if (__btree_insert_node(btree, target)) {
-            __btnode_release(btree, node_right);
-            __btnode_free(btree, target);
+    if (node_mid != NULL) {
+        if (__btpath_insert_after(btree, path, LEAF_NODE_LEVEL, key, node_mid)) {
+            __leaf_remove(btree, node_mid, 0);
+            __btree_super(btree)->sb_node_count--;
+            __btnode_remove(btree, node_mid);
             return(4);
         }
-    } else {
-        uint32_t index;
-
-        __leaf_index_search(btree, target, key, &index);
-        __btree_twigs_insert_update(btree, target, 0, key);
-        __leaf_insert(btree, target, index, key, value, size);
+        __btnode_release(btree, node_mid);
+        __btstats_inc(btree, leaf_splits);
     }
 
-    __btnode_release(btree, node_right);
+    __btstats_inc(btree, leaf_splits);
     return(0);
 }
 
-/* ===========================================================================
- *  PRIVATE Operations (Node Remove)
- */
-static int __btree_remove_node (btree_t *btree,
-                                btnode_t *node)
+static int __btree_leaf_insert (btree_t *btree,
+                                btpath_t *path,
+                                btnode_place_t *place,
+                                const void *key,
+                                const void *value,
+                                uint32_t size)
 {
-    btnode_place_t place;
-    const void *last_key;
-    btnode_t *parent;
-    uint32_t level;
-    int node_freed;
+    struct node_pointer pointer;
+    uint32_t free_space;
+    btnode_t *node;
+    int blob;
 
-    if (__node_is_leaf(node))
-        last_key = __leaf_last_key(btree, node);
-    else
-        last_key = __twig_last_key(btree, node);
+    node = path->nodes[LEAF_NODE_LEVEL];
 
-    level = __node_level(node) + 1;
-    if ((parent = __btree_lookup_level(btree, last_key, level, &place))) {
-        if (__node_items(parent) == 1) {
-            node_freed = __btree_remove_node(btree, parent);
-        } else {
-            node_freed = 0;
+    /* Large values go to a blob, the leaf keeps its pointer */
+    if ((blob = __btblob_needed(btree, size))) {
+        __btblob_write(btree, value, size, &pointer);
+        value = &pointer;
+        size = NODE_POINTER_SIZE;
+    }
 
-            __btree_twigs_remove_update(btree, parent, place.index);
-            __twig_remove(btree, parent, place.index);
+    /* Inline Replace: Same size for old and new value */
+    if (place->found && place->size == size) {
+        __leaf_inline_replace(btree, node, place->index, value, size);
+        __item_set_blob(btree, node, place->index, blob);
+        __btpath_touch(btree, path);
+        return(0);
+    }
+
+    /* We consider node free space without this key, that we've to replace */
+    free_space  = __node_free(node);
+    free_space += (place->found) ? place->size : 0U;
+
+    if (place->found) {
+        if (free_space >= size) {
+            __leaf_replace(btree, node, place->index, value, size);
+            __item_set_blob(btree, node, place->index, blob);
+            __btpath_touch(btree, path);
+            return(0);
         }
 
-        if (__node_is_leaf(node))
-            __leaf_remove(btree, node, 0);
-        else
-            __twig_remove(btree, node, 0);
+        __leaf_remove(btree, node, place->index);
+    }
+
+    if (place->index == __node_items(node) &&
+        __btpath_raise(btree, path, TWIG_NODE_LEVEL, key))
+    {
+        if (blob)
+            __btblob_erase(btree, &pointer);
+        return(-1);
+    }
+
+    __btpath_touch(btree, path);
+
+    /* Node has enough space to contains key/value */
+    if (__node_free(node) >= __item_needed_size(btree, key, size)) {
+        __leaf_insert(btree, node, place->index, key, value, size);
+        __item_set_blob(btree, node, place->index, blob);
+        return(0);
+    }
+
+    /* There's no enough space for key/value, split node! */
+    return(__btree_leaf_split_insert(btree, path, key, value, size, blob));
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Node Remove)
+ */
+static void __btree_shrink (btree_t *btree,
+                            btpath_t *path)
+{
+    btnode_t *child;
+    btnode_t *root;
+
+    /* Decrease BTree level while the root has a single child */
+    while (path->levels > LEAF_NODE_LEVEL) {
+        root = path->nodes[path->levels];
+        if (__node_items(root) != 1)
+            break;
+
+        if ((child = __btnode_fetch_twig(btree, root, 0)) == NULL)
+            break;
+
+        if (path->nodes[path->levels - 1] != NULL)
+            __btnode_release(btree, path->nodes[path->levels - 1]);
+        path->nodes[path->levels - 1] = child;
 
+        /* New root must be written to update the super-block pointer */
+        __node_mark_dirty(btree, child);
+
+        btree->root = child;
+        root->pointers[0] = NULL;
+        path->nodes[path->levels] = NULL;
+        path->levels--;
+
+        __btree_super(btree)->sb_height--;
         __btree_super(btree)->sb_node_count--;
-        __btnode_remove(btree, node);
+        __btnode_remove(btree, root);
+    }
+}
 
-        if (!node_freed)
-            __btnode_release(btree, parent);
-        return(1);
-    } else if (__node_is_internal(node)) {
-        __btree_twigs_remove_update(btree, node, place.index);
-        __twig_remove(btree, node, place.index);
+static int __btnode_underflow (btree_t *btree,
+                               btnode_t *node)
+{
+    if (__node_is_leaf(node) || __btree_is_varkey(btree))
+        return(__node_free(node) > (__btree_node_space(btree) -
+                                    (__btree_node_space(btree) >> 2)));
+    return(__node_items(node) < (__btree_fanout(btree) >> 2));
+}
+
+static int __btnode_can_merge (btree_t *btree,
+                               btnode_t *left,
+                               btnode_t *right)
+{
+    if (__node_is_leaf(left))
+        return(__leaf_can_merge(btree, left, right));
+    return(__twig_can_merge(btree, left, right));
+}
+
+static void __btnode_merge (btree_t *btree,
+                            btnode_t *left,
+                            btnode_t *right)
+{
+    if (__node_is_leaf(left))
+        __leaf_merge(btree, left, right);
+    else
+        __twig_merge(btree, left, right);
+}
+
+/* Twig item 'to' points to the node of item 'from', that is dropped */
+static void __twig_pointer_move (btree_t *btree,
+                                 btnode_t *node,
+                                 uint32_t from,
+                                 uint32_t to)
+{
+    btnode_t *child;
+
+    __twig_inline_replace(btree, node, to, __twig_pointer(btree, node, from));
+    child = node->pointers[to];
+    node->pointers[to] = node->pointers[from];
+    node->pointers[from] = child;
+}
+
+/* Node at 'level' of the path has lost an item.
+ * The merged node takes the twig item of the right one, so twig keys
+ * are only removed, and never grow.
+ */
+static void __btpath_rebalance (btree_t *btree,
+                                btpath_t *path,
+                                uint32_t level)
+{
+    btnode_t *sibling;
+    btnode_t *parent;
+    btnode_t *node;
+    uint32_t index;
+
+    for (; level < path->levels; ++level) {
+        node = path->nodes[level];
+        parent = path->nodes[level + 1];
+        index = path->index[level + 1];
+
+        if (__node_items(node) == 0) {
+            /* Node is empty, drop it */
+            path->nodes[level] = NULL;
+        } else if (!__btnode_underflow(btree, node)) {
+            break;
+        } else if ((index + 1) < __node_items(parent)) {
+            /* Merge the right sibling into this node */
+            if ((sibling = __btnode_fetch_twig(btree, parent, index + 1)) == NULL)
+                break;
+
+            if (!__btnode_can_merge(btree, node, sibling)) {
+                __btnode_release(btree, sibling);
+                break;
+            }
+
+            /* Left node takes the twig item of the right one */
+            __btnode_merge(btree, node, sibling);
+            __btstats_merge(btree, level);
+            __twig_pointer_move(btree, parent, index, index + 1);
+            node = sibling;
+        } else if (index > 0) {
+            /* Merge this node into the left sibling */
+            if ((sibling = __btnode_fetch_twig(btree, parent, index - 1)) == NULL)
+                break;
+
+            if (!__btnode_can_merge(btree, sibling, node)) {
+                __btnode_release(btree, sibling);
+                break;
+            }
+
+            __btnode_merge(btree, sibling, node);
+            __btstats_merge(btree, level);
+            __twig_pointer_move(btree, parent, index - 1, index);
+
+            /* Path moves on the surviving node */
+            path->nodes[level] = sibling;
+            path->index[level + 1] = --index;
+        } else {
+            break;
+        }
+
+        /* Remove node from the parent, and from the disk */
+        __twig_remove(btree, parent, index);
+        __btree_super(btree)->sb_node_count--;
+        __btnode_remove(btree, node);
     }
-    return(0);
+
+    __btree_shrink(btree, path);
 }
 
 /* ===========================================================================
- *  PRIVATE Operations (Node Sync)
+ *  PRIVATE Operations (Range Remove)
+ *
+ *  Twig item i covers the keys in (K[i-1], K[i]], so the children between
+ *  the ones crossing the bounds are dropped whole, with no rebalance.
+ *  Leaves are read once to keep the super-block item counts, the twigs
+ *  of the boundary paths are rebalanced when the range is gone.
  */
-static int __btree_sync (btree_t *btree,
-                         btnode_t *node,
-                         struct node_pointer *pointer)
+static int __btree_drop_subtree (btree_t *btree,
+                                 btnode_t *node,
+                                 uint32_t index)
 {
-    uint32_t block_size;
-    uint8_t *block;
+    uint64_t data_size;
+    btnode_t *child;
+    uint32_t i;
 
-    if (node->refs != 1) {
-        fprintf(stderr, "node %p refs %d\n", node, node->refs);
-        abort();
+    if ((child = __btnode_fetch_twig(btree, node, index)) == NULL)
+        return(-1);
+
+    if (__node_is_internal(child)) {
+        /* From the right, a failed read leaves a smaller twig */
+        for (i = __node_items(child); i > 0; --i) {
+            if (__btree_drop_subtree(btree, child, i - 1)) {
+                __btnode_release(btree, child);
+                return(-2);
+            }
+        }
+    } else {
+        data_size = 0;
+        for (i = 0; i < __node_items(child); ++i) {
+            data_size += __item_value_size(btree, child, i);
+            if (__item_is_blob(btree, child, i))
+                __btblob_erase(btree, __item_value(btree, child, i));
+        }
+
+        __btree_super(btree)->sb_item_count -= __node_items(child);
+        __btree_super(btree)->sb_stored_data -= data_size;
     }
 
-    if (__node_is_internal(node)) {
-        btnode_t *child;
-        uint32_t i;
-        int errno;
+    __twig_remove(btree, node, index);
+    __btree_super(btree)->sb_node_count--;
+    __btnode_remove(btree, child);
+    return(0);
+}
 
-        if (!__node_need_update(node) && !__node_is_dirty(node))
-            return(1);
+static int __btree_remove_range_node (btree_t *btree,
+                                      btnode_t *node,
+                                      const void *key_lo,
+                                      const void *key_hi);
+
+/* Child 'index' crosses a bound, it is dropped if nothing is left */
+static int __btree_remove_range_child (btree_t *btree,
+                                       btnode_t *node,
+                                       uint32_t index,
+                                       const void *key_lo,
+                                       const void *key_hi)
+{
+    btnode_t *child;
+    int err;
 
-        for (i = 0; i < __node_items(node); ++i) {
-            if ((child = __btnode_fetch_twig(btree, node, i)) == NULL)
-                return(-1);
+    if ((child = __btnode_fetch_twig(btree, node, index)) == NULL)
+        return(-1);
 
-            errno = __btree_sync(btree, child, pointer);
-            __btnode_release(btree, child);
+    err = __btree_remove_range_node(btree, child, key_lo, key_hi);
+    if (__node_items(child) > 0) {
+        __btnode_release(btree, child);
+        return(err);
+    }
 
-            if (errno < 0)
-                return(errno);
+    __twig_remove(btree, node, index);
+    __btree_super(btree)->sb_node_count--;
+    __btnode_remove(btree, child);
+    return(err);
+}
 
-            if (errno > 0)
-                continue;
+/* Remove the keys in [key_lo, key_hi) below 'node', NULL bounds are open */
+static int __btree_remove_range_node (btree_t *btree,
+                                      btnode_t *node,
+                                      const void *key_lo,
+                                      const void *key_hi)
+{
+    btnode_place_t place;
+    uint32_t first;
+    uint32_t last;
+    uint32_t i;
 
-            __twig_inline_replace(btree, node, i, pointer);
+    if (__node_is_leaf(node)) {
+        first = 0;
+        last = __node_items(node);
+        if (key_lo != NULL) {
+            __leaf_search(btree, node, key_lo, &place);
+            first = place.index;
+        }
+        if (key_hi != NULL) {
+            __leaf_search(btree, node, key_hi, &place);
+            last = place.index;
         }
+
+        for (i = last; i > first; --i)
+            __leaf_remove(btree, node, i - 1);
+        return(0);
     }
 
-    if (!__node_is_dirty(node))
-        return(2);
+    __node_set_to_update(node);
 
-    /* TODO: compress node->data
-     */
-    block = node->data;
-    block_size = __btree_block_size(btree);
+    /* Children before 'first' are below key_lo, 'last' crosses key_hi */
+    first = 0;
+    last = __node_items(node);
+    if (key_lo != NULL)
+        __twig_index_search(btree, node, key_lo, &first);
+    if (key_hi != NULL)
+        __twig_index_search(btree, node, key_hi, &last);
 
-    /* Setup Node Flags */
-    __node_set_on_disk(node);
-    __node_set_clean(node);
-    __node_head(node)->nh_crc = __btdisk_crc_block(btree, NODE_CRC_OFFSET, block, block_size);
+    if (key_lo != NULL && key_hi != NULL && first == last) {
+        if (first == __node_items(node))
+            return(0);
+        return(__btree_remove_range_child(btree, node, first, key_lo, key_hi));
+    }
 
-    /* Setup Internal Node Pointer */
-    pointer->np_crc = __btdisk_crc_pointer(btree, block, block_size);
-    pointer->np_size = block_size;
-    pointer->np_blocknr = __btdisk_write(btree, node->blocknr, node->size,
-                                         block, block_size);
+    /* From the right, the indexes on the left stay valid */
+    if (key_hi != NULL && last < __node_items(node) &&
+        __btree_remove_range_child(btree, node, last, NULL, key_hi))
+    {
+        return(-1);
+    }
 
-    /* Setup Blocknr to in-memory node */
-    node->blocknr = pointer->np_blocknr;
-    node->size = pointer->np_size;
+    for (i = last; i > (first + (key_lo != NULL)); --i) {
+        if (__btree_drop_subtree(btree, node, i - 1))
+            return(-2);
+    }
 
+    if (key_lo != NULL && first < __node_items(node))
+        return(__btree_remove_range_child(btree, node, first, key_lo, NULL));
     return(0);
 }
 
 /* ===========================================================================
- *  PRIVATE Operations (In-Memory Node Release)
+ *  PRIVATE Operations (Batch)
+ *
+ *  Batches are visited in key order, so the next key is often in the
+ *  leaf (or in the sub-tree) already held by the path.
  */
-static void __btree_mem_nodes_release (btree_t *btree,
-                                       btnode_t *node)
+static int __batch_keycmp (btree_t *btree,
+                           const void **keys,
+                           uint32_t a,
+                           uint32_t b)
 {
-    if (node->refs != 0) {
-        fprintf(stderr, "assert: __btree_mem_nodes_release refs != 1 %p %d\n", node, node->refs);
-        abort();
+    int cmp;
+
+    /* Same keys keep the batch order, the last one wins on insert */
+    if ((cmp = btree->keycmp(btree->user_data, keys[a], keys[b])) != 0)
+        return(cmp);
+    return((a < b) ? -1 : (a > b));
+}
+
+static void __batch_sift_down (btree_t *btree,
+                               const void **keys,
+                               uint32_t *index,
+                               uint32_t root,
+                               uint32_t count)
+{
+    uint32_t child;
+    uint32_t tmp;
+
+    while ((child = (root << 1) + 1) < count) {
+        if ((child + 1) < count &&
+            __batch_keycmp(btree, keys, index[child], index[child + 1]) < 0)
+        {
+            child++;
+        }
+
+        if (__batch_keycmp(btree, keys, index[root], index[child]) >= 0)
+            break;
+
+        tmp = index[root];
+        index[root] = index[child];
+        index[child] = tmp;
+        root = child;
     }
+}
 
-    if (node->pointers != NULL) {
-        btnode_t *child;
-        uint32_t i;
+/* Heap-Sort the batch positions by key */
+static uint32_t *__batch_sort (btree_t *btree,
+                               const void **keys,
+                               uint32_t count)
+{
+    uint32_t *index;
+    uint32_t tmp;
+    uint32_t i;
 
-        for (i = 0; i < __btree_fanout(btree); ++i) {
-            if ((child = node->pointers[i]) == NULL)
-                continue;
+    if ((index = (uint32_t *) malloc(count * sizeof(uint32_t))) == NULL)
+        return(NULL);
 
-            __btree_mem_nodes_release(btree, child);
-        }
+    for (i = 0; i < count; ++i)
+        index[i] = i;
+
+    for (i = count >> 1; i > 0; --i)
+        __batch_sift_down(btree, keys, index, i - 1, count);
+
+    for (i = count; i > 1; --i) {
+        tmp = index[0];
+        index[0] = index[i - 1];
+        index[i - 1] = tmp;
+        __batch_sift_down(btree, keys, index, 0, i - 1);
     }
 
-    if (node->data != NULL) {
-        printf("NOT FREED %p %d\n", node, node->refs);
+    return(index);
+}
+
+/* Move the path to a key bigger than the previous one, climbing only
+ * the levels that don't cover the new key.
+ */
+static btnode_t *__btpath_seek_next (btree_t *btree,
+                                     btpath_t *path,
+                                     const void *key,
+                                     btnode_place_t *place)
+{
+    const void *twig_key;
+    btnode_t *node;
+    uint32_t level;
+    uint32_t i;
+
+    /* Root covers every key */
+    for (level = TWIG_NODE_LEVEL; level < path->levels; ++level) {
+        node = path->nodes[level];
+        twig_key = __twig_last_key(btree, node);
+        if (btree->prefix_keycmp(btree->user_data, twig_key, key) >= 0)
+            break;
     }
 
-    __btnode_free(btree, node);
+    if (level > path->levels)
+        level = path->levels;
+
+    for (i = LEAF_NODE_LEVEL; i < level; ++i) {
+        __btnode_release(btree, path->nodes[i]);
+        path->nodes[i] = NULL;
+    }
+
+    if ((node = __btpath_descend(btree, path, level, key, place)) == NULL)
+        __btpath_release(btree, path);
+
+    return(node);
 }
 
 /* ===========================================================================
- *  PUBLIC Operations
+ *  PRIVATE Operations (Node Sync)
  */
-int btree_create_prefix (btree_t *btree,
-                         btdisk_t *disk,
-                         uint32_t cache_size,
-                         uint64_t super_offset,
-                         uint32_t block_size,
-                         uint8_t format,
-                         uint32_t prefix_size,
-                         uint32_t key_size,
-                         uint32_t btree_magic,
-                         uint16_t node_magic,
-                         memcopy_t prefix_keycpy,
-                         compare_t prefix_keycmp,
-                         compare_t keycmp,
-                         void *user_data)
+/* Compute node checksums and the pointer to the block, ready to be written.
+ * Returns the block to write: the node data or its compressed image.
+ */
+static const uint8_t *__btnode_seal (btree_t *btree,
+                                     btnode_t *node,
+                                     struct node_pointer *pointer)
 {
-    struct super_block *super;
+    uint32_t block_size;
+    uint8_t *block;
+    uint32_t size;
 
-    /* Block size must be larger than:
-     *      NODE_HEAD + (ITEM_HEAD + KEY + VALUE) * n
-     */
-    if (block_size < (NODE_HEAD_SIZE + 4 * (ITEM_HEAD_SIZE + (key_size << 2))))
-        return(1);
+    block = node->data;
+    block_size = __btree_block_size(btree);
 
-    /* Initialize In-Memory Btree */
-    btree->prefix_keycpy = prefix_keycpy;
-    btree->prefix_keycmp = prefix_keycmp;
-    btree->keycmp = keycmp;
-    btree->user_data = user_data;
-    btree->super_offset = super_offset;
-    btree->root = NULL;
-    btree->disk = disk;
+    /* Setup Node Flags */
+    __node_set_on_disk(node);
+    __node_mark_clean(btree, node);
+    __node_head(node)->nh_crc = __btdisk_crc_block(btree, NODE_CRC_OFFSET, block, block_size);
 
-    /* Initialize B*Tree Super-Block */
-    super = __btree_super(btree);
-    super->sb_magic = btree_magic;
-    super->sb_node_magic = node_magic;
+    /* Keep the compressed image only if it's smaller than the block */
+    size = block_size;
+    if (btree->zblock != NULL) {
+        size = __btdisk_compress(btree, btree->zblock, block, block_size);
+        if (size > 0 && size < block_size)
+            block = btree->zblock;
+        else
+            size = block_size;
+    }
 
-    super->sb_block_size = block_size;
-    super->sb_prefix_size = prefix_size;
-    super->sb_key_size = key_size;
-    super->sb_height = LEAF_NODE_LEVEL;
-    super->sb_format = format;
+    /* Setup Internal Node Pointer */
+    pointer->np_crc = __btdisk_crc_pointer(btree, block, size);
+    pointer->np_size = size;
+    return(block);
+}
 
-    super->sb_item_count = 0U;
-    super->sb_node_count = 0U;
-    super->sb_stored_data = 0U;
+/* Write the dirty children of a twig, sealed, as a single batch.
+ * Blocks that fit their slot are rewritten in place, queued together as
+ * async writes when the disk has them, the others are written with one
+ * call: appended, or to a free run near the twig with a space map (each
+ * image padded to a unit). The children references are released.
+ * Per-child state is on the heap, twigs of large blocks have thousands.
+ */
+static int __btree_sync_batch (btree_t *btree,
+                               btnode_t *node,
+                               btnode_t **children,
+                               const uint32_t *index,
+                               uint32_t count)
+{
+    struct node_pointer *pointers;
+    const uint8_t *block;
+    uint32_t block_size;
+    uint64_t append_size;
+    uint32_t image_size;
+    uint64_t *offsets;
+    uint8_t *inplace;
+    btdisk_aio_t *aio;
+    uint8_t *buffer;
+    btnode_t *child;
+    uint32_t slot;
+    uint64_t base;
+    uint32_t naio;
+    uint32_t i;
+    int err;
 
-    super->sb_root = 0U;
-    super->sb_root_size = 0U;
-    super->sb_root_crc = 0U;
+    if (count == 0)
+        return(0);
+
+    block_size = __btree_block_size(btree);
+    if (btree->space != NULL)
+        block_size = __btspace_units(btree->space, block_size) * btree->space->unit;
+
+    buffer = (uint8_t *) malloc((size_t)count * block_size);
+    aio = (btdisk_aio_t *) malloc((size_t)count * (sizeof(btdisk_aio_t) +
+                                  sizeof(uint64_t) + sizeof(struct node_pointer) + 1));
+    if (buffer == NULL || aio == NULL) {
+        for (i = 0; i < count; ++i)
+            __btnode_release(btree, children[i]);
+        free(buffer);
+        free(aio);
+        return(-1);
+    }
+
+    offsets = (uint64_t *)(aio + count);
+    pointers = (struct node_pointer *)(offsets + count);
+    inplace = (uint8_t *)(pointers + count);
+
+    /* Appended images are packed from the start of the buffer, compressed
+     * images written in place take a slot from its end.
+     */
+    err = 0;
+    naio = 0;
+    append_size = 0;
+    for (i = 0; i < count; ++i) {
+        child = children[i];
+        block = __btnode_seal(btree, child, &(pointers[i]));
+
+        slot = __btree_block_slot(btree, child->blocknr, child->size);
+        inplace[i] = (!__btree_is_append_only(btree) && child->blocknr != 0 &&
+                      pointers[i].np_size <= slot);
+        if (!inplace[i]) {
+            image_size = pointers[i].np_size;
+            if (btree->space != NULL) {
+                if (child->blocknr != 0)
+                    __btspace_free(btree, child->blocknr, child->size);
+                image_size = __btspace_units(btree->space, image_size) * btree->space->unit;
+                memset(buffer + append_size + pointers[i].np_size, 0,
+                       image_size - pointers[i].np_size);
+            }
+
+            memcpy(buffer + append_size, block, pointers[i].np_size);
+            offsets[i] = append_size;
+            append_size += image_size;
+        } else if (__btdisk_has_aio(btree)) {
+            if (block == btree->zblock) {
+                block = buffer + (size_t)(count - 1 - naio) * block_size;
+                memcpy((uint8_t *)block, btree->zblock, pointers[i].np_size);
+            }
+            aio[naio].buffer = (uint8_t *)block;
+            aio[naio].offset = child->blocknr;
+            aio[naio].size = pointers[i].np_size;
+            aio[naio].write = 1;
+            naio++;
+            offsets[i] = child->blocknr;
+        } else {
+            offsets[i] = __btdisk_write(btree, child->blocknr, slot,
+                                        block, pointers[i].np_size);
+        }
+    }
+
+    if (naio > 0 && __btdisk_submit(btree, aio, naio)) {
+        /* None queued, none of the in-place images is written */
+        for (i = 0; i < naio; ++i)
+            aio[i].result = 0;
+        err = -1;
+        naio = 0;
+    }
+
+    base = 0;
+    if (append_size > 0 && btree->space != NULL)
+        __btspace_write_batch(btree, node->blocknr, buffer, append_size,
+                              offsets, inplace, count);
+    else if (append_size > 0)
+        base = __btdisk_append(btree, buffer, append_size);
+
+    if (naio > 0 && __btdisk_complete(btree, aio, naio))
+        err = -1;
+
+    naio = 0;
+    for (i = 0; i < count; ++i) {
+        child = children[i];
+
+        /* Async write not done: the twig keeps the old pointer, and the
+         * child dirty again is rewritten by the next sync.
+         */
+        if (inplace[i] && __btdisk_has_aio(btree) &&
+            aio[naio++].result != pointers[i].np_size)
+        {
+            __node_mark_dirty(btree, child);
+            __btnode_release(btree, child);
+            err = -1;
+            continue;
+        }
+
+        pointers[i].np_blocknr = inplace[i] ? offsets[i] : (base + offsets[i]);
+
+        /* Setup Blocknr to in-memory node */
+        child->blocknr = pointers[i].np_blocknr;
+        child->size = pointers[i].np_size;
+
+        __twig_inline_replace(btree, node, index[i], &(pointers[i]));
+        __btnode_release(btree, child);
+    }
+
+    free(buffer);
+    free(aio);
+    return(err);
+}
+
+/* Sync the subtree below a twig, bottom up, a batch of siblings at once */
+static int __btree_sync_children (btree_t *btree,
+                                  btnode_t *node)
+{
+    btnode_t **children;
+    btnode_t *child;
+    uint32_t *index;
+    uint32_t count;
+    uint32_t i;
+    int err;
+
+    /* Sized by the fanout, once per level: kept off the stack */
+    children = (btnode_t **) malloc((size_t)__node_items(node) *
+                                    (sizeof(btnode_t *) + sizeof(uint32_t)));
+    if (children == NULL)
+        return(-1);
+    index = (uint32_t *)(children + __node_items(node));
+
+    count = 0;
+    for (i = 0; i < __node_items(node); ++i) {
+        /* Nodes not in memory, or untouched, are already on disk */
+        if ((child = node->pointers[i]) == NULL)
+            continue;
+
+        if (!__node_is_dirty(child) && !__node_need_update(child))
+            continue;
+
+        if ((child = __btnode_fetch_twig(btree, node, i)) == NULL)
+            goto _sync_error;
+
+        if (child->refs != 1) {
+            fprintf(stderr, "node %p refs %d\n", child, child->refs);
+            abort();
+        }
+
+        if (__node_is_internal(child)) {
+            if (__btree_sync_children(btree, child)) {
+                __btnode_release(btree, child);
+                goto _sync_error;
+            }
+            __node_set_updated(child);
+        }
+
+        if (!__node_is_dirty(child)) {
+            __btnode_release(btree, child);
+            continue;
+        }
+
+        children[count] = child;
+        index[count] = i;
+        count++;
+    }
+
+    err = count ? __btree_sync_batch(btree, node, children, index, count) : 0;
+    free(children);
+    return(err);
+
+_sync_error:
+    while (count--)
+        __btnode_release(btree, children[count]);
+    free(children);
+    return(-1);
+}
+
+static int __btree_sync (btree_t *btree,
+                         btnode_t *node,
+                         struct node_pointer *pointer)
+{
+    const uint8_t *block;
+
+    if (node->refs != 1) {
+        fprintf(stderr, "node %p refs %d\n", node, node->refs);
+        abort();
+    }
+
+    if (__node_is_internal(node)) {
+        if (!__node_need_update(node) && !__node_is_dirty(node))
+            return(1);
+
+        if (__btree_sync_children(btree, node))
+            return(-1);
+
+        __node_set_updated(node);
+    }
+
+    if (!__node_is_dirty(node))
+        return(2);
+
+    block = __btnode_seal(btree, node, pointer);
+    pointer->np_blocknr = __btree_block_write(btree, node->blocknr, node->size, 0,
+                                              block, pointer->np_size);
+
+    /* Setup Blocknr to in-memory node */
+    node->blocknr = pointer->np_blocknr;
+    node->size = pointer->np_size;
+
+    return(0);
+}
+
+/* Give the node a new block on the next sync, the old one is freed */
+static void __btnode_relocate (btree_t *btree,
+                               btnode_t *node)
+{
+    if (node->blocknr != 0) {
+        __btree_disk_erase(btree, node->blocknr, node->size);
+        node->blocknr = 0;
+        node->size = 0;
+    }
+    __node_mark_dirty(btree, node);
+}
+
+/* Relocate the subtree below 'node', written a twig of leaves at a time
+ * so they don't pile up in memory. Twigs are written by the next sync.
+ */
+static int __btree_compact (btree_t *btree,
+                            btnode_t *node)
+{
+    btnode_t *child;
+    uint32_t i;
+
+    for (i = 0; i < __node_items(node); ++i) {
+        if ((child = __btnode_fetch_twig(btree, node, i)) == NULL)
+            return(-1);
+
+        __btnode_relocate(btree, child);
+        if (__node_is_internal(child) && __btree_compact(btree, child)) {
+            __btnode_release(btree, child);
+            return(-2);
+        }
+        __btnode_release(btree, child);
+    }
+
+    if (__node_is_twig(node))
+        return(__btree_sync_children(btree, node));
+    return(0);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Bulk Load)
+ *
+ *  Nodes are filled from the leftmost leaf, one open node per level.
+ *  When a node is full it is written with append() and its last key is
+ *  added to the open node of the level above, so every block is written
+ *  once and the file grows sequentially.
+ */
+struct btree_bulk {
+    btnode_t *nodes[BTREE_MAX_HEIGHT];  /* Open node of each level */
+    uint64_t  count[BTREE_MAX_HEIGHT];  /* Nodes already written per level */
+    uint32_t  leaf_space;               /* Leaf bytes to fill */
+    uint32_t  twig_items;               /* Twig items to fill */
+    uint32_t  twig_space;               /* Twig bytes to fill (varkey) */
+};
+
+static int __btree_bulk_add (btree_t *btree,
+                             struct btree_bulk *bulk,
+                             uint32_t level,
+                             const void *key,
+                             struct node_pointer *pointer);
+
+/* Write the open node of 'level' and link it to the level above */
+static int __btree_bulk_flush (btree_t *btree,
+                               struct btree_bulk *bulk,
+                               uint32_t level)
+{
+    uint8_t last_key[__btree_key_size(btree)];
+    struct node_pointer pointer;
+    struct node_head *header;
+    const uint8_t *block;
+    btnode_t *node;
+
+    node = bulk->nodes[level];
+    block = __btnode_seal(btree, node, &pointer);
+    pointer.np_blocknr = __btree_block_append(btree, 0, block, pointer.np_size);
+    bulk->count[level]++;
+
+    if (__btree_bulk_add(btree, bulk, level + 1,
+                         __btnode_last_key(btree, node, last_key), &pointer))
+    {
+        return(-1);
+    }
+
+    /* Reuse the node buffer for the next one */
+    header = __node_head(node);
+    header->nh_items = 0;
+    header->nh_free = __btree_node_space(btree);
+    return(0);
+}
+
+/* Open twig is full, by item count or by size for variable-size keys */
+static int __btree_bulk_twig_full (btree_t *btree,
+                                   struct btree_bulk *bulk,
+                                   btnode_t *node,
+                                   const void *key)
+{
+    uint32_t needed;
+
+    if (!__btree_is_varkey(btree))
+        return(__node_items(node) >= bulk->twig_items);
+
+    needed = __twig_needed(btree, key);
+    return(__node_items(node) >= 2 &&
+           (__node_free(node) < needed ||
+            (__btree_node_space(btree) - __node_free(node) + needed) > bulk->twig_space));
+}
+
+static int __btree_bulk_add (btree_t *btree,
+                             struct btree_bulk *bulk,
+                             uint32_t level,
+                             const void *key,
+                             struct node_pointer *pointer)
+{
+    btnode_t *node;
+
+    if (level >= BTREE_MAX_HEIGHT)
+        return(-1);
+
+    if ((node = bulk->nodes[level]) == NULL) {
+        if ((node = __btnode_alloc(btree, level)) == NULL)
+            return(-2);
+        bulk->nodes[level] = node;
+    } else if (__btree_bulk_twig_full(btree, bulk, node, key)) {
+        if (__btree_bulk_flush(btree, bulk, level))
+            return(-3);
+    }
+
+    __twig_insert(btree, node, __node_items(node), key, pointer);
+    return(0);
+}
+
+/* Write the open nodes, the last one left alone on its level is the root */
+static int __btree_bulk_finish (btree_t *btree,
+                                struct btree_bulk *bulk)
+{
+    struct super_block *super;
+    struct node_pointer pointer;
+    const uint8_t *block;
+    btnode_t *node;
+    uint32_t level;
+
+    super = __btree_super(btree);
+    for (level = LEAF_NODE_LEVEL; level < BTREE_MAX_HEIGHT; ++level) {
+        if ((node = bulk->nodes[level]) == NULL)
+            return(-1);
+
+        if (bulk->count[level] == 0 && bulk->nodes[level + 1] == NULL)
+            break;
+
+        if (__btree_bulk_flush(btree, bulk, level))
+            return(-2);
+    }
+
+    block = __btnode_seal(btree, node, &pointer);
+    pointer.np_blocknr = __btree_block_append(btree, 0, block, pointer.np_size);
+
+    super->sb_root = pointer.np_blocknr;
+    super->sb_root_size = pointer.np_size;
+    super->sb_root_crc = pointer.np_crc;
+    super->sb_height = level + 1;
+    return(0);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (In-Memory Node Release)
+ */
+static void __btree_mem_nodes_release (btree_t *btree,
+                                       btnode_t *node)
+{
+    if (node->refs != 0) {
+        fprintf(stderr, "assert: __btree_mem_nodes_release refs != 1 %p %d\n", node, node->refs);
+        abort();
+    }
+
+    if (node->pointers != NULL) {
+        btnode_t *child;
+        uint32_t i;
+
+        for (i = 0; i < __btree_fanout(btree); ++i) {
+            if ((child = node->pointers[i]) == NULL)
+                continue;
+
+            __btree_mem_nodes_release(btree, child);
+        }
+    }
+
+    __btnode_free(btree, node);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Locking)
+ *
+ *  The write lock holder is flagged as the writer, it works on private
+ *  copies of the nodes that readers use in place from the disk mapping.
+ *  Cursors check the version to know that a writer ran since they moved.
+ */
+#define __btree_wrlock(btree)                                               \
+    do {                                                                    \
+        pthread_rwlock_wrlock(&((btree)->lock));                            \
+        (btree)->writer = 1;                                                \
+        (btree)->version++;                                                 \
+    } while (0)
+
+#define __btree_wrunlock(btree)                                             \
+    do {                                                                    \
+        (btree)->writer = 0;                                                \
+        pthread_rwlock_unlock(&((btree)->lock));                            \
+    } while (0)
+
+static void __btree_lock_init (btree_t *btree) {
+    pthread_rwlockattr_t attr;
+
+    /* Readers must not starve the writer */
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif /* __GLIBC__ */
+    pthread_rwlock_init(&(btree->lock), &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    pthread_mutex_init(&(btree->latch), NULL);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Compression)
+ */
+/* Scratch block for compressed writes, only used by the (exclusive) writer */
+static int __btree_zblock_alloc (btree_t *btree) {
+    btree->zblock = NULL;
+    if (btree->disk->compress == NULL)
+        return(0);
+
+    if ((btree->zblock = (uint8_t *) malloc(__btree_block_size(btree))) == NULL)
+        return(5);
+
+    return(0);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Super-Anchor)
+ *
+ *  Append-only syncs move btree->super_offset, the super-block slot of
+ *  create/open (the home) is left to two anchors to the last one. Open
+ *  at the home follows the newest anchor whose super-block is there, a
+ *  torn anchor write falls back to the previous commit.
+ */
+static int __btanchor_valid (btree_t *btree,
+                             const struct super_anchor *anchor,
+                             uint64_t home)
+{
+    return(anchor->sa_magic == SUPER_ANCHOR_MAGIC && anchor->sa_home == home &&
+           anchor->sa_crc == __btdisk_crc_pointer(btree, &(anchor->sa_home),
+                                                  SUPER_ANCHOR_SIZE - 8));
+}
+
+static void __btanchor_write (btree_t *btree) {
+    struct super_anchor anchor;
+    uint32_t slot;
+
+    anchor.sa_magic = SUPER_ANCHOR_MAGIC;
+    anchor.sa_home = btree->anchor_offset;
+    anchor.sa_offset = btree->super_offset;
+    anchor.sa_generation = __btree_generation(btree);
+    anchor.sa_pad = 0;
+    anchor.sa_crc = __btdisk_crc_pointer(btree, &(anchor.sa_home),
+                                         SUPER_ANCHOR_SIZE - 8);
+
+    slot = anchor.sa_generation % SUPER_ANCHOR_SLOTS;
+    __btdisk_write(btree, btree->anchor_offset + slot * SUPER_ANCHOR_SIZE,
+                   SUPER_ANCHOR_SIZE, &anchor, SUPER_ANCHOR_SIZE);
+}
+
+/* btree->super was just read at 'home', move to the super-block its
+ * anchors point to. A super-block is the home of in-place trees only,
+ * appended ones are snapshots, never anchored.
+ */
+static int __btanchor_load (btree_t *btree,
+                            uint64_t home)
+{
+    struct super_anchor anchors[SUPER_ANCHOR_SLOTS];
+    struct super_anchor anchor;
+    uint8_t super[SUPER_BLOCK_SIZE];
+    uint32_t i, n;
+
+    btree->anchor_offset = home;
+    memcpy(anchors, btree->super, SUPER_BLOCK_SIZE);
+
+    /* Keep the valid anchors, newest first */
+    n = 0;
+    for (i = 0; i < SUPER_ANCHOR_SLOTS; ++i) {
+        if (__btanchor_valid(btree, &(anchors[i]), home))
+            anchors[n++] = anchors[i];
+    }
+
+    if (n == 0) {
+        btree->anchored = !__btree_is_append_only(btree);
+        return(0);
+    }
+
+    if (n > 1 && anchors[1].sa_generation > anchors[0].sa_generation) {
+        anchor = anchors[0];
+        anchors[0] = anchors[1];
+        anchors[1] = anchor;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (__btdisk_read(btree, anchors[i].sa_offset, super, SUPER_BLOCK_SIZE) &&
+            SUPER_BLOCK(super)->sb_generation == anchors[i].sa_generation)
+        {
+            memcpy(btree->super, super, SUPER_BLOCK_SIZE);
+            btree->super_offset = anchors[i].sa_offset;
+            btree->anchored = 1;
+            return(0);
+        }
+    }
+
+    fprintf(stderr, "assert: __btanchor_load() no super-block.\n");
+    return(10);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Create/Open)
+ */
+static int __btree_create (btree_t *btree,
+                           btdisk_t *disk,
+                           uint32_t cache_size,
+                           uint64_t super_offset,
+                           uint32_t block_size,
+                           uint8_t format,
+                           uint32_t prefix_size,
+                           uint32_t key_size,
+                           uint32_t btree_magic,
+                           uint16_t node_magic,
+                           keysize_t keysize,
+                           memcopy_t prefix_keycpy,
+                           compare_t prefix_keycmp,
+                           compare_t keycmp,
+                           void *user_data)
+{
+    struct super_block *super;
+    uint32_t twig_item;
+
+    if (format > BTREE_FORMAT_VARIABLE)
+        return(2);
+
+    twig_item = prefix_size + NODE_POINTER_SIZE;
+    if (format == BTREE_FORMAT_VARIABLE) {
+        /* Twigs are split by size, a half must fit a new item and a key */
+        if (key_size > UINT16_MAX ||
+            block_size < (NODE_HEAD_SIZE + 6 * (ITEM_HEAD_SIZE + ITEM_KEY_SIZE + twig_item)))
+        {
+            return(1);
+        }
+        twig_item = ITEM_HEAD_SIZE + ITEM_KEY_SIZE + NODE_POINTER_SIZE;
+    } else if (block_size < (NODE_HEAD_SIZE + 4 * (ITEM_HEAD_SIZE + (key_size << 2)))) {
+        /* Block size must be larger than:
+         *      NODE_HEAD + (ITEM_HEAD + KEY + VALUE) * n
+         */
+        return(1);
+    }
+
+    /* Initialize In-Memory Btree */
+    btree->prefix_keycpy = prefix_keycpy;
+    btree->prefix_keycmp = prefix_keycmp;
+    btree->keycmp = keycmp;
+    btree->keysize = keysize;
+    btree->user_data = user_data;
+    btree->super_offset = super_offset;
+    btree->anchor_offset = super_offset;
+    btree->anchored = 1;
+    btree->root = NULL;
+    btree->disk = disk;
+    btree->readonly = 0;
+    btree->writer = 0;
+    btree->version = 0;
+    btree->verify = 0;
+    btree->memcmp_keys = 0;
+    btree->blob_threshold = 0;
+    btree->dirty_leaves = 0;
+    btree->flusher = NULL;
+    btree->wal = NULL;
+    btree->space = NULL;
+    btree->stats = NULL;
+    __btree_lock_init(btree);
+
+    /* Initialize B*Tree Super-Block */
+    super = __btree_super(btree);
+    super->sb_magic = btree_magic;
+    super->sb_node_magic = node_magic;
+
+    super->sb_block_size = block_size;
+    super->sb_prefix_size = prefix_size;
+    super->sb_key_size = key_size;
+    super->sb_height = LEAF_NODE_LEVEL;
+    super->sb_format = format;
+    super->sb_flags = 0U;
+    super->sb_generation = 0U;
+
+    super->sb_item_count = 0U;
+    super->sb_node_count = 0U;
+    super->sb_stored_data = 0U;
+
+    super->sb_root = 0U;
+    super->sb_root_size = 0U;
+    super->sb_root_crc = 0U;
+
+    /* Calculate Fanout, the max for variable-size keys */
+    super->sb_fanout = __btree_node_space(btree) / twig_item;
+
+    /* Initialize block cache */
+    __btcache_open(btree, &(btree->cache), cache_size,
+                   BTCACHE_2Q, TWIG_NODE_LEVEL);
+
+    /* Stats are on by default, with no counters the tree just works */
+    btree->stats = __btstats_alloc(1);
+    return(__btree_zblock_alloc(btree));
+}
+
+static int __btree_open (btree_t *btree,
+                         btdisk_t *disk,
+                         uint32_t cache_size,
+                         uint64_t super_offset,
+                         uint32_t btree_magic,
+                         uint16_t node_magic,
+                         keysize_t keysize,
+                         memcopy_t prefix_keycpy,
+                         compare_t prefix_keycmp,
+                         compare_t keycmp,
+                         void *user_data)
+{
+    int err;
+
+    /* Initialize In-Memory Btree */
+    btree->prefix_keycpy = prefix_keycpy;
+    btree->prefix_keycmp = prefix_keycmp;
+    btree->keycmp = keycmp;
+    btree->keysize = keysize;
+    btree->user_data = user_data;
+    btree->super_offset = super_offset;
+    btree->anchor_offset = super_offset;
+    btree->anchored = 1;
+    btree->root = NULL;
+    btree->disk = disk;
+    btree->readonly = 0;
+    btree->writer = 0;
+    btree->version = 0;
+    btree->verify = 0;
+    btree->memcmp_keys = 0;
+    btree->blob_threshold = 0;
+    btree->dirty_leaves = 0;
+    btree->flusher = NULL;
+    btree->wal = NULL;
+    btree->space = NULL;
+    btree->stats = NULL;
+    __btree_lock_init(btree);
+
+    /* Initialize block cache */
+    __btcache_open(btree, &(btree->cache), cache_size,
+                   BTCACHE_2Q, TWIG_NODE_LEVEL);
+
+    if (!__btdisk_read(btree, super_offset, btree->super, SUPER_BLOCK_SIZE))
+        return(1);
+
+    if ((err = __btanchor_load(btree, super_offset)) != 0)
+        return(err);
+
+    if (__btree_magic(btree) != btree_magic) {
+        fprintf(stderr, "assert: __btree_magic() failed.\n");
+        return(3);
+    }
+
+    if (__btree_node_magic(btree) != node_magic) {
+        fprintf(stderr, "assert: __btree_node_magic() failed.\n");
+        return(4);
+    }
+
+    if (__btree_format(btree) > BTREE_FORMAT_VARIABLE) {
+        fprintf(stderr, "assert: __btree_format() unknown.\n");
+        return(6);
+    }
+
+    if (__btree_is_varkey(btree) != (keysize != NULL)) {
+        fprintf(stderr, "assert: __btree_format() variable-size keys mismatch.\n");
+        return(7);
+    }
+
+    if (__btree_has_space_map(btree) && __btspace_load(btree)) {
+        __btspace_close(btree);
+        return(9);
+    }
+
+    btree->stats = __btstats_alloc(1);
+    return(__btree_zblock_alloc(btree));
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Read-Ahead)
+ *
+ *  A cursor with an async disk keeps the reads of the next leaves of its
+ *  twig in flight, in scan order. A leaf read ahead is checked and given
+ *  to the block cache just before the cursor steps on it, the cursor then
+ *  finds it there (a block read ahead is not made hot by the lookup).
+ */
+#define BTREE_READAHEAD             (8)
+
+struct btreadahead {
+    struct node_pointer pointers[BTREE_READAHEAD];
+    btdisk_aio_t        aio[BTREE_READAHEAD];
+    btnode_t *          twig;       /* Twig of the leaves read ahead */
+    int64_t             next;       /* Next twig item to read ahead */
+    uint32_t            head;       /* Oldest read in flight */
+    uint32_t            count;      /* Reads in flight */
+    int                 dir;        /* Scan direction */
+};
+
+/* Wait the oldest read ahead and give the block to the cache */
+static void __btreadahead_land (btree_t *btree,
+                                btreadahead_t *ra)
+{
+    struct node_pointer *pointer;
+    btdisk_aio_t *aio;
+    uint8_t *block;
+    uint8_t *raw;
+
+    pointer = &(ra->pointers[ra->head]);
+    aio = &(ra->aio[ra->head]);
+    ra->head = (ra->head + 1) % BTREE_READAHEAD;
+    ra->count--;
+
+    raw = (uint8_t *)aio->buffer;
+    if (__btdisk_complete(btree, aio, 1)) {
+        free(raw);
+        return;
+    }
+
+    /* On a bad block the cursor reads it again, and reports it */
+    block = raw;
+    if (pointer->np_size < __btree_block_size(btree)) {
+        if ((block = (uint8_t *) malloc(__btree_block_size(btree))) == NULL) {
+            free(raw);
+            return;
+        }
+        if (__btnode_verify(btree, pointer, raw, block)) {
+            free(block);
+            block = NULL;
+        }
+        free(raw);
+    } else if (__btnode_verify(btree, pointer, raw, block)) {
+        free(raw);
+        block = NULL;
+    }
+
+    if (block != NULL)
+        __btcache_add(btree, &(btree->cache), pointer->np_blocknr, block, 1);
+}
+
+static void __btreadahead_drain (btree_t *btree,
+                                 btreadahead_t *ra)
+{
+    while (ra->count > 0)
+        __btreadahead_land(btree, ra);
+    ra->twig = NULL;
+}
+
+/* Wait the reads in flight and throw them away, a writer ran since they
+ * were queued and the blocks may be free, or reused by other nodes.
+ */
+static void __btreadahead_drop (btree_t *btree,
+                                btreadahead_t *ra)
+{
+    btdisk_aio_t *aio;
+
+    while (ra->count > 0) {
+        aio = &(ra->aio[ra->head]);
+        ra->head = (ra->head + 1) % BTREE_READAHEAD;
+        ra->count--;
+
+        __btdisk_complete(btree, aio, 1);
+        free(aio->buffer);
+    }
+    ra->twig = NULL;
+}
+
+/* Land the reads up to the leaf the cursor is going to */
+static void __btreadahead_wait (btree_t *btree,
+                                btreadahead_t *ra,
+                                uint64_t blocknr)
+{
+    uint32_t i;
+
+    for (i = 0; i < ra->count; ++i) {
+        if (ra->pointers[(ra->head + i) % BTREE_READAHEAD].np_blocknr == blocknr)
+            break;
+    }
+
+    if (i < ra->count) {
+        for (i += 1; i > 0; --i)
+            __btreadahead_land(btree, ra);
+    }
+}
+
+/* Queue the reads of the next leaves not in memory, nor in the cache */
+static void __btreadahead_fill (btree_t *btree,
+                                btreadahead_t *ra,
+                                btnode_t *twig,
+                                uint32_t index,
+                                int dir)
+{
+    struct node_pointer *pointer;
+    btdisk_aio_t *aio;
+    btnode_t *child;
+    uint32_t first;
+    uint32_t slot;
+    uint32_t n;
+
+    if (dir != ra->dir) {
+        __btreadahead_drain(btree, ra);
+        ra->dir = dir;
+    }
+
+    if (ra->twig != twig || (ra->next - (int64_t)index) * dir < 1) {
+        ra->twig = twig;
+        ra->next = (int64_t)index + dir;
+    }
+
+    n = 0;
+    first = (ra->head + ra->count) % BTREE_READAHEAD;
+    while (ra->count < BTREE_READAHEAD &&
+           ra->next >= 0 && ra->next < __node_items(twig) &&
+           (ra->next - (int64_t)index) * dir <= BTREE_READAHEAD)
+    {
+        pointer = __twig_pointer(btree, twig, ra->next);
+        child = __btnode_load(&(twig->pointers[ra->next]));
+        ra->next += dir;
+
+        if (child != NULL && __btnode_load(&(child->data)) != NULL)
+            continue;
+
+        if (pointer->np_size == 0 || pointer->np_size > __btree_block_size(btree))
+            continue;
+
+        if (__btcache_contains(btree, &(btree->cache), pointer->np_blocknr))
+            continue;
+
+        slot = (ra->head + ra->count) % BTREE_READAHEAD;
+        aio = &(ra->aio[slot]);
+        if ((aio->buffer = malloc(pointer->np_size)) == NULL)
+            break;
+
+        memcpy(&(ra->pointers[slot]), pointer, sizeof(struct node_pointer));
+        aio->offset = pointer->np_blocknr;
+        aio->size = pointer->np_size;
+        aio->write = 0;
+        ra->count++;
+        n++;
+    }
+
+    /* The new slots may wrap around the ring, two submits at most */
+    while (n > 0) {
+        slot = (first + n <= BTREE_READAHEAD) ? n : (BTREE_READAHEAD - first);
+        if (__btdisk_submit(btree, &(ra->aio[first]), slot)) {
+            /* Not queued, drop them from the ring */
+            for (; n > 0; --n) {
+                ra->count--;
+                free(ra->aio[(ra->head + ra->count) % BTREE_READAHEAD].buffer);
+            }
+            break;
+        }
+        first = (first + slot) % BTREE_READAHEAD;
+        n -= slot;
+    }
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Write-Ahead Log)
+ *
+ *  Inserts and removes are logged under the tree write lock, in the order
+ *  they are applied. The writer then waits for its record to be on the
+ *  log: the first waiter becomes the leader, takes every buffered record
+ *  and writes them with one append() and one sync(), the others wait for
+ *  it. Records carry the tree generation, btree_sync() commits the next
+ *  one, so only records of the generation on disk are replayed on open.
+ *  The log starts with two head slots, the newest valid one has the first
+ *  live record: checkpoints move it before erasing, and open moves it
+ *  past a torn tail, where the log goes on.
+ */
+#define WAL_RECORD_INSERT           (1)
+#define WAL_RECORD_REMOVE           (2)
+#define WAL_RECORD_REMOVE_RANGE     (3)
+
+/* WAL Record Header - 24 byte */
+struct wal_record {
+    uint32_t   wr_crc;                 /* Record CRC (after this field) */
+    uint32_t   wr_size;                /* Record Size, Header included */
+    uint64_t   wr_lsn;                 /* Log Sequence Number */
+    uint32_t   wr_generation;          /* BTree Generation when logged */
+    uint16_t   wr_key_size;            /* Key Size, Value follows the Key */
+    uint8_t    wr_type;                /* Insert, Remove or Remove Range */
+    uint8_t    wr_pad;
+} __attribute__((packed));
+
+/* WAL Head - 32 byte, two slots written in turn */
+struct wal_head {
+    uint32_t   wh_magic;               /* WAL Head Magic */
+    uint32_t   wh_crc;                 /* WAL Head CRC, from wh_start */
+    uint64_t   wh_start;               /* First live record */
+    uint64_t   wh_seq;                 /* Head writes, slot is seq % 2 */
+    uint64_t   wh_pad;
+} __attribute__((packed));
+
+#define WAL_HEAD_MAGIC              (0x57414c48)
+#define WAL_HEAD_SIZE               (sizeof(struct wal_head))
+#define WAL_HEAD_SLOTS              (2)
+
+#define WAL_RECORD_SIZE             (sizeof(struct wal_record))
+#define WAL_RECORD(x)               ((struct wal_record *)(x))
+
+#define __btwal_crc(wal, record)                                            \
+    __btdisk_crc_call((wal)->log, crc_pointer, ((uint8_t *)(record)) + 4,   \
+                      (record)->wr_size - 4)
+
+struct btwal_buffer {
+    uint8_t * data;
+    uint32_t  used;
+    uint32_t  size;
+    uint64_t  lsn;                  /* Last record in the buffer */
+    uint32_t  generation;           /* Generation of the last record */
+};
+
+struct btwal {
+    btdisk_t *          log;                /* Log Disk Driver */
+    struct btwal_buffer buffers[2];         /* Filling and being written */
+    uint8_t             active;             /* Buffer taking new records */
+    uint8_t             flushing;           /* A leader writes the other */
+    uint8_t             running;            /* Checkpoint thread running */
+    int                 error;              /* Log failed, sticky */
+
+    uint64_t            lsn;                /* Last record logged */
+    uint64_t            flushed_lsn;        /* Last record on the log */
+    uint32_t            flushed_generation; /* Generation of flushed_lsn */
+
+    uint64_t            start;              /* Log range since checkpoint */
+    uint64_t            end;
+    uint64_t            head_offset;        /* Head slots, log_offset */
+    uint64_t            head_seq;           /* Last head written */
+    uint64_t            logged;             /* Bytes since checkpoint */
+    uint64_t            checkpoint_size;    /* Checkpoint every (0 never) */
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      flushed;            /* flushed_lsn moved */
+    pthread_cond_t      wakeup;             /* Time for a checkpoint */
+    pthread_t           thread;
+};
+
+static int      __btree_flush     (btree_t *btree);
+static int      __btree_insert    (btree_t *btree,
+                                   const void *key,
+                                   const void *value,
+                                   uint32_t size);
+static int      __btree_remove    (btree_t *btree,
+                                   const void *key);
+static int      __btree_remove_range (btree_t *btree,
+                                      const void *key_lo,
+                                      const void *key_hi);
+
+/* Buffer a record, the caller holds the tree write lock.
+ * Remove Range records carry the bounds as key and value, NULL if open.
+ * Returns the record lsn, to wait for with __btwal_commit().
+ */
+static uint64_t __btwal_log (btree_t *btree,
+                             uint8_t type,
+                             const void *key,
+                             const void *value,
+                             uint32_t size)
+{
+    struct btwal_buffer *buffer;
+    struct wal_record *record;
+    btwal_t *wal = btree->wal;
+    uint32_t key_size;
+    uint32_t rsize;
+    uint8_t *data;
+
+    if (wal == NULL)
+        return(0);
+
+    key_size = (key != NULL) ? __btree_key_len(btree, key) : 0;
+
+    pthread_mutex_lock(&(wal->lock));
+    buffer = &(wal->buffers[wal->active]);
+    if (size > (UINT32_MAX - WAL_RECORD_SIZE - key_size - buffer->used)) {
+        /* Past the 32-bit record size (or group buffer), same as no memory */
+        wal->error = -3;
+        pthread_mutex_unlock(&(wal->lock));
+        return(wal->lsn + 1);
+    }
+
+    rsize = WAL_RECORD_SIZE + key_size + size;
+    if ((buffer->used + rsize) > buffer->size) {
+        uint32_t n = buffer->size << 1;
+
+        if (n < (buffer->used + rsize))
+            n = buffer->used + rsize;
+
+        if ((data = (uint8_t *) realloc(buffer->data, n)) == NULL) {
+            /* The change is applied but it can't be made durable */
+            wal->error = -3;
+            pthread_mutex_unlock(&(wal->lock));
+            return(wal->lsn + 1);
+        }
+
+        buffer->data = data;
+        buffer->size = n;
+    }
+
+    record = WAL_RECORD(buffer->data + buffer->used);
+    record->wr_size = rsize;
+    record->wr_lsn = ++(wal->lsn);
+    record->wr_generation = __btree_generation(btree);
+    record->wr_key_size = key_size;
+    record->wr_type = type;
+    record->wr_pad = 0;
+
+    data = buffer->data + buffer->used + WAL_RECORD_SIZE;
+    if (key_size > 0)
+        memcpy(data, key, key_size);
+    if (size > 0)
+        memcpy(data + key_size, value, size);
+    record->wr_crc = __btwal_crc(wal, record);
+
+    buffer->used += rsize;
+    buffer->lsn = record->wr_lsn;
+    buffer->generation = record->wr_generation;
+    pthread_mutex_unlock(&(wal->lock));
+
+    return(record->wr_lsn);
+}
+
+/* Wait for 'lsn' to be on the log, writing the group if no one else is */
+static int __btwal_commit (btwal_t *wal,
+                           uint64_t lsn)
+{
+    struct btwal_buffer *buffer;
+    uint64_t offset;
+    int err;
+
+    pthread_mutex_lock(&(wal->lock));
+    while (wal->flushed_lsn < lsn && !wal->error) {
+        if (wal->flushing) {
+            pthread_cond_wait(&(wal->flushed), &(wal->lock));
+            continue;
+        }
+
+        /* Leader, new records go to the other buffer while this is written */
+        buffer = &(wal->buffers[wal->active]);
+        wal->active ^= 1;
+        wal->flushing = 1;
+        pthread_mutex_unlock(&(wal->lock));
+
+        offset = wal->log->append(wal->log, buffer->data, buffer->used);
+        err = (wal->log->sync != NULL) ? wal->log->sync(wal->log) : 0;
+
+        pthread_mutex_lock(&(wal->lock));
+        if (err) {
+            wal->error = -2;
+        } else {
+            if (wal->start == wal->end)
+                wal->start = offset;
+            wal->end = offset + buffer->used;
+            wal->logged += buffer->used;
+            wal->flushed_lsn = buffer->lsn;
+            wal->flushed_generation = buffer->generation;
+        }
+
+        buffer->used = 0;
+        wal->flushing = 0;
+        pthread_cond_broadcast(&(wal->flushed));
+
+        if (wal->checkpoint_size > 0 && wal->logged >= wal->checkpoint_size)
+            pthread_cond_signal(&(wal->wakeup));
+    }
+    err = wal->error;
+    pthread_mutex_unlock(&(wal->lock));
+
+    return(err);
+}
+
+/* Point replay to 'start', synced, the other slot keeps the previous */
+static int __btwal_head_write (btwal_t *wal,
+                               uint64_t start)
+{
+    struct wal_head head;
+
+    head.wh_magic = WAL_HEAD_MAGIC;
+    head.wh_start = start;
+    head.wh_seq = ++(wal->head_seq);
+    head.wh_pad = 0;
+    head.wh_crc = __btdisk_crc_call(wal->log, crc_pointer, &(head.wh_start),
+                                    WAL_HEAD_SIZE - 8);
+
+    wal->log->write(wal->log,
+                    wal->head_offset + (head.wh_seq % WAL_HEAD_SLOTS) * WAL_HEAD_SIZE,
+                    WAL_HEAD_SIZE, &head, WAL_HEAD_SIZE);
+    return((wal->log->sync != NULL) ? wal->log->sync(wal->log) : 0);
+}
+
+/* Where replay starts: the newest valid head, or past the slots */
+static uint64_t __btwal_head_load (btwal_t *wal) {
+    struct wal_head heads[WAL_HEAD_SLOTS];
+    uint64_t start;
+    uint64_t first;
+    uint32_t i;
+
+    first = wal->head_offset + WAL_HEAD_SLOTS * WAL_HEAD_SIZE;
+    start = first;
+    wal->head_seq = 0;
+    if (wal->log->read(wal->log, wal->head_offset, heads, sizeof(heads)) != sizeof(heads))
+        return(start);
+
+    for (i = 0; i < WAL_HEAD_SLOTS; ++i) {
+        if (heads[i].wh_magic == WAL_HEAD_MAGIC && heads[i].wh_seq > wal->head_seq &&
+            heads[i].wh_start >= first &&
+            heads[i].wh_crc == __btdisk_crc_call(wal->log, crc_pointer,
+                                                 &(heads[i].wh_start),
+                                                 WAL_HEAD_SIZE - 8))
+        {
+            wal->head_seq = heads[i].wh_seq;
+            start = heads[i].wh_start;
+        }
+    }
+    return(start);
+}
+
+/* The tree was committed, the log written so far is no longer needed.
+ * The commit is made durable and the head moved past the range before
+ * it is erased, an erase may leave a hole replay can't cross.
+ */
+static void __btwal_checkpoint (btree_t *btree) {
+    btwal_t *wal = btree->wal;
+
+    pthread_mutex_lock(&(wal->lock));
+    if (wal->start != wal->end &&
+        wal->flushed_generation < __btree_generation(btree) &&
+        (btree->disk->sync == NULL || !btree->disk->sync(btree->disk)) &&
+        !__btwal_head_write(wal, wal->end))
+    {
+        if (wal->log->erase != NULL)
+            wal->log->erase(wal->log, wal->start, wal->end - wal->start);
+        wal->start = wal->end;
+    }
+    wal->logged = 0;
+    pthread_mutex_unlock(&(wal->lock));
+}
+
+static void *__btwal_checkpoint_thread (void *arg) {
+    btree_t *btree = (btree_t *)arg;
+    btwal_t *wal = btree->wal;
+
+    pthread_mutex_lock(&(wal->lock));
+    while (wal->running) {
+        if (wal->logged < wal->checkpoint_size) {
+            pthread_cond_wait(&(wal->wakeup), &(wal->lock));
+            continue;
+        }
+
+        /* Don't spin on a failing sync, wait for the next round */
+        wal->logged = 0;
+        pthread_mutex_unlock(&(wal->lock));
+        btree_sync(btree);
+        pthread_mutex_lock(&(wal->lock));
+    }
+    pthread_mutex_unlock(&(wal->lock));
+
+    return(NULL);
+}
+
+/* Read the body of a record, the buffer doubles only while the log has
+ * data, so a torn size at the tail does not allocate gigabytes.
+ */
+static int __btwal_replay_read (btwal_t *wal,
+                                uint64_t offset,
+                                uint8_t **data,
+                                uint32_t *data_size,
+                                uint32_t rsize)
+{
+    uint32_t loaded;
+    uint32_t chunk;
+    uint8_t *grown;
+
+    loaded = WAL_RECORD_SIZE;
+    while (loaded < rsize) {
+        if (loaded == *data_size) {
+            chunk = (*data_size < (rsize >> 1)) ? (*data_size << 1) : rsize;
+            if ((grown = (uint8_t *) realloc(*data, chunk)) == NULL)
+                return(-1);
+            *data = grown;
+            *data_size = chunk;
+        }
+
+        chunk = ((rsize < *data_size) ? rsize : *data_size) - loaded;
+        if (wal->log->read(wal->log, offset + loaded, *data + loaded, chunk) != chunk)
+            return(-2);
+        loaded += chunk;
+    }
+    return(0);
+}
+
+/* Apply the records of the generation on disk (or newer) to the tree.
+ * Scan stops at the first record that is torn, corrupted or out of order.
+ */
+static int __btwal_replay (btree_t *btree,
+                           btwal_t *wal,
+                           uint64_t offset,
+                           uint64_t *end)
+{
+    struct wal_record *record;
+    uint32_t data_size;
+    uint32_t rsize;
+    uint32_t size;
+    uint8_t *data;
+    uint64_t lsn;
+    int count;
+
+    /* Values spilled to blobs are logged whole, whatever the threshold is
+     * now (it is not on disk): the buffer grows on demand, up to the log.
+     */
+    data_size = WAL_RECORD_SIZE + __btree_key_size(btree) + __btree_block_size(btree);
+    if ((data = (uint8_t *) malloc(data_size)) == NULL)
+        return(-1);
+
+    lsn = 0;
+    count = 0;
+    record = WAL_RECORD(data);
+    while (wal->log->read(wal->log, offset, data, WAL_RECORD_SIZE) == WAL_RECORD_SIZE) {
+        rsize = record->wr_size;
+        if (rsize < WAL_RECORD_SIZE || record->wr_lsn <= lsn ||
+            record->wr_key_size > (rsize - WAL_RECORD_SIZE) ||
+            (record->wr_key_size == 0 && record->wr_type != WAL_RECORD_REMOVE_RANGE))
+        {
+            break;
+        }
+
+        if (__btwal_replay_read(wal, offset, &data, &data_size, rsize))
+            break;
+        record = WAL_RECORD(data);
+
+        if (record->wr_crc != __btwal_crc(wal, record))
+            break;
+
+        if (record->wr_type != WAL_RECORD_INSERT &&
+            record->wr_type != WAL_RECORD_REMOVE &&
+            record->wr_type != WAL_RECORD_REMOVE_RANGE)
+        {
+            break;
+        }
+
+        lsn = record->wr_lsn;
+        offset += rsize;
+
+        /* Already in the tree, committed by a checkpoint */
+        if (record->wr_generation < __btree_generation(btree))
+            continue;
+
+        if (record->wr_type == WAL_RECORD_INSERT) {
+            size = rsize - WAL_RECORD_SIZE - record->wr_key_size;
+            if (__btree_insert(btree, data + WAL_RECORD_SIZE,
+                               data + WAL_RECORD_SIZE + record->wr_key_size,
+                               size) == 1 &&
+                btree->blob_threshold == 0 && size > NODE_POINTER_SIZE)
+            {
+                /* Logged as a blob, no threshold set yet: still a blob */
+                btree->blob_threshold = size - 1;
+                __btree_insert(btree, data + WAL_RECORD_SIZE,
+                               data + WAL_RECORD_SIZE + record->wr_key_size,
+                               size);
+                btree->blob_threshold = 0;
+            }
+        } else if (record->wr_type == WAL_RECORD_REMOVE) {
+            __btree_remove(btree, data + WAL_RECORD_SIZE);
+        } else {
+            __btree_remove_range(btree,
+                (record->wr_key_size > 0) ? data + WAL_RECORD_SIZE : NULL,
+                (rsize > WAL_RECORD_SIZE + record->wr_key_size) ?
+                    data + WAL_RECORD_SIZE + record->wr_key_size : NULL);
+        }
+        count++;
+    }
+
+    free(data);
+    wal->lsn = lsn;
+    wal->flushed_lsn = lsn;
+    *end = offset;
+    return(count);
+}
+
+static void __btwal_free (btwal_t *wal) {
+    pthread_mutex_destroy(&(wal->lock));
+    pthread_cond_destroy(&(wal->flushed));
+    pthread_cond_destroy(&(wal->wakeup));
+    if (wal->buffers[0].data != NULL)
+        free(wal->buffers[0].data);
+    if (wal->buffers[1].data != NULL)
+        free(wal->buffers[1].data);
+    free(wal);
+}
+
+/* Stop the checkpoint thread, call it without the tree lock */
+static void __btwal_stop (btree_t *btree) {
+    btwal_t *wal = btree->wal;
+
+    pthread_mutex_lock(&(wal->lock));
+    if (!wal->running) {
+        pthread_mutex_unlock(&(wal->lock));
+        return;
+    }
+    wal->running = 0;
+    pthread_cond_signal(&(wal->wakeup));
+    pthread_mutex_unlock(&(wal->lock));
+
+    pthread_join(wal->thread, NULL);
+}
+
+/* ===========================================================================
+ *  PRIVATE Operations (Background Flusher)
+ *
+ *  Writers wake the flusher when the dirty leaves pass the budget. It takes
+ *  the write lock for a batch of leaves at a time, of the next twig in key
+ *  order, and writes them as btree_sync() would: the leaves are clean and
+ *  cached, the twig dirty, so the next sync writes the twigs and the rest.
+ */
+struct btflusher {
+    btree_t *       btree;          /* B*Tree to write */
+    uint64_t        budget;         /* Dirty leaf bytes to wake up at */
+    uint32_t        hand;           /* Next twig to look at, in key order */
+    uint8_t         running;        /* Flusher thread running */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;         /* Dirty leaves over the budget */
+    pthread_t       thread;
+};
+
+/* Leaves written per lock hold, writers wait for one batch at most */
+#define BTFLUSHER_BATCH             (16)
+
+#define __btflusher_dirty_bytes(btree)                                      \
+    (__atomic_load_n(&((btree)->dirty_leaves), __ATOMIC_RELAXED) *          \
+     __btree_block_size(btree))
+
+/* Find the first twig with dirty leaves, from the twig 'hand' on in key
+ * order. The hand moves past it, twigs are written in turn as by a clock.
+ */
+static btnode_t *__btflusher_pick (btnode_t *node,
+                                   uint32_t *twigs,
+                                   uint32_t hand)
+{
+    btnode_t *child;
+    uint32_t i;
+
+    if (__node_is_twig(node)) {
+        if ((*twigs)++ < hand)
+            return(NULL);
+
+        for (i = 0; i < __node_items(node); ++i) {
+            if ((child = node->pointers[i]) != NULL && __node_is_dirty(child))
+                return(node);
+        }
+        return(NULL);
+    }
+
+    /* Internal nodes in memory, sync skips the same untouched ones */
+    for (i = 0; i < __node_items(node); ++i) {
+        if ((child = node->pointers[i]) == NULL)
+            continue;
+
+        if (!__node_is_dirty(child) && !__node_need_update(child))
+            continue;
+
+        if ((child = __btflusher_pick(child, twigs, hand)) != NULL)
+            return(child);
+    }
+    return(NULL);
+}
+
+/* Write a batch of dirty leaves of the next twig, 1 if there are none */
+static int __btflusher_flush (btree_t *btree,
+                              btflusher_t *flusher)
+{
+    btnode_t *children[BTFLUSHER_BATCH];
+    uint32_t index[BTFLUSHER_BATCH];
+    btnode_t *child;
+    btnode_t *twig;
+    uint32_t twigs;
+    uint32_t count;
+    uint32_t i;
+
+    if (btree->root == NULL || !__node_is_internal(btree->root))
+        return(1);
+
+    twigs = 0;
+    if ((twig = __btflusher_pick(btree->root, &twigs, flusher->hand)) == NULL) {
+        /* Past the last twig, start over */
+        twigs = 0;
+        if (flusher->hand == 0 ||
+            (twig = __btflusher_pick(btree->root, &twigs, 0)) == NULL)
+        {
+            flusher->hand = 0;
+            return(1);
+        }
+    }
+
+    count = 0;
+    for (i = 0; i < __node_items(twig) && count < BTFLUSHER_BATCH; ++i) {
+        if ((child = twig->pointers[i]) == NULL || !__node_is_dirty(child))
+            continue;
+
+        if ((child = __btnode_fetch_twig(btree, twig, i)) == NULL) {
+            while (count--)
+                __btnode_release(btree, children[count]);
+            return(-1);
+        }
+
+        children[count] = child;
+        index[count] = i;
+        count++;
+    }
+
+    /* Stay on the twig until its leaves are all written */
+    flusher->hand = twigs - (count == BTFLUSHER_BATCH);
+    return(__btree_sync_batch(btree, twig, children, index, count) ? -1 : 0);
+}
+
+static void *__btflusher_thread (void *arg) {
+    btflusher_t *flusher = (btflusher_t *)arg;
+    btree_t *btree = flusher->btree;
+    uint64_t budget;
+    int idle = 0;
+    int err;
+
+    pthread_mutex_lock(&(flusher->lock));
+    while (flusher->running) {
+        /* Nothing left to write alone, wait for the next writer */
+        if (idle || __btflusher_dirty_bytes(btree) <= flusher->budget) {
+            idle = 0;
+            pthread_cond_wait(&(flusher->wakeup), &(flusher->lock));
+            continue;
+        }
+
+        budget = flusher->budget >> 1;
+        pthread_mutex_unlock(&(flusher->lock));
+
+        /* A twig at a time, writers get the lock in between */
+        do {
+            __btree_wrlock(btree);
+            err = __btflusher_flush(btree, flusher);
+            __btree_wrunlock(btree);
+            sched_yield();
+        } while (!err && __btflusher_dirty_bytes(btree) > budget &&
+                 __atomic_load_n(&(flusher->running), __ATOMIC_RELAXED));
+        idle = (err != 0);
+
+        pthread_mutex_lock(&(flusher->lock));
+    }
+    pthread_mutex_unlock(&(flusher->lock));
+
+    return(NULL);
+}
+
+static btflusher_t *__btflusher_alloc (btree_t *btree,
+                                       uint64_t budget)
+{
+    btflusher_t *flusher;
+
+    if ((flusher = (btflusher_t *) malloc(sizeof(btflusher_t))) == NULL)
+        return(NULL);
+
+    flusher->btree = btree;
+    flusher->budget = budget;
+    flusher->hand = 0;
+    flusher->running = 1;
+    pthread_mutex_init(&(flusher->lock), NULL);
+    pthread_cond_init(&(flusher->wakeup), NULL);
+
+    if (pthread_create(&(flusher->thread), NULL, __btflusher_thread, flusher)) {
+        pthread_cond_destroy(&(flusher->wakeup));
+        pthread_mutex_destroy(&(flusher->lock));
+        free(flusher);
+        return(NULL);
+    }
+
+    return(flusher);
+}
+
+/* Stop the flusher thread, call it without the tree lock */
+static void __btflusher_free (btflusher_t *flusher) {
+    pthread_mutex_lock(&(flusher->lock));
+    __atomic_store_n(&(flusher->running), 0, __ATOMIC_RELAXED);
+    pthread_cond_signal(&(flusher->wakeup));
+    pthread_mutex_unlock(&(flusher->lock));
+
+    pthread_join(flusher->thread, NULL);
+    pthread_cond_destroy(&(flusher->wakeup));
+    pthread_mutex_destroy(&(flusher->lock));
+    free(flusher);
+}
+
+/* Wake the flusher once the dirty leaves pass the budget, under the lock.
+ * A writer that finds twice the budget (the flusher is behind) writes a
+ * batch itself, so the budget holds on a busy or single cpu.
+ */
+static void __btflusher_kick (btree_t *btree) {
+    btflusher_t *flusher = btree->flusher;
+    uint64_t dirty;
+
+    if (flusher == NULL)
+        return;
+
+    if ((dirty = __btflusher_dirty_bytes(btree)) <= flusher->budget)
+        return;
+
+    if (dirty > (flusher->budget << 1))
+        __btflusher_flush(btree, flusher);
+
+    pthread_mutex_lock(&(flusher->lock));
+    pthread_cond_signal(&(flusher->wakeup));
+    pthread_mutex_unlock(&(flusher->lock));
+}
+
+/* ===========================================================================
+ *  PUBLIC Operations
+ */
+int btree_prefix_create (btree_t *btree,
+                         btdisk_t *disk,
+                         uint32_t cache_size,
+                         uint64_t super_offset,
+                         uint32_t block_size,
+                         uint8_t format,
+                         uint32_t prefix_size,
+                         uint32_t key_size,
+                         uint32_t btree_magic,
+                         uint16_t node_magic,
+                         memcopy_t prefix_keycpy,
+                         compare_t prefix_keycmp,
+                         compare_t keycmp,
+                         void *user_data)
+{
+    /* Variable-size keys need a keysize(), see btree_varkey_create() */
+    if (format == BTREE_FORMAT_VARIABLE)
+        return(2);
+
+    return(__btree_create(btree, disk, cache_size, super_offset,
+                          block_size, format, prefix_size, key_size,
+                          btree_magic, node_magic, NULL,
+                          prefix_keycpy, prefix_keycmp, keycmp,
+                          user_data));
+}
+
+int btree_create (btree_t *btree,
+                  btdisk_t *disk,
+                  uint32_t cache_size,
+                  uint64_t super_offset,
+                  uint32_t block_size,
+                  uint8_t format,
+                  uint32_t key_size,
+                  uint32_t btree_magic,
+                  uint16_t node_magic,
+                  compare_t keycmp,
+                  void *user_data)
+{
+    return(btree_prefix_create(btree, disk, cache_size,
+                               super_offset,
+                               block_size, format,
+                               key_size, key_size,
+                               btree_magic, node_magic,
+                               NULL, keycmp, keycmp,
+                               user_data));
+}
+
+int btree_varkey_create (btree_t *btree,
+                         btdisk_t *disk,
+                         uint32_t cache_size,
+                         uint64_t super_offset,
+                         uint32_t block_size,
+                         uint32_t max_key_size,
+                         uint32_t btree_magic,
+                         uint16_t node_magic,
+                         keysize_t keysize,
+                         compare_t keycmp,
+                         void *user_data)
+{
+    if (keysize == NULL)
+        return(2);
+
+    return(__btree_create(btree, disk, cache_size, super_offset,
+                          block_size, BTREE_FORMAT_VARIABLE,
+                          max_key_size, max_key_size,
+                          btree_magic, node_magic, keysize,
+                          NULL, keycmp, keycmp,
+                          user_data));
+}
+
+int btree_prefix_open (btree_t *btree,
+                       btdisk_t *disk,
+                       uint32_t cache_size,
+                       uint64_t super_offset,
+                       uint32_t btree_magic,
+                       uint16_t node_magic,
+                       memcopy_t prefix_keycpy,
+                       compare_t prefix_keycmp,
+                       compare_t keycmp,
+                       void *user_data)
+{
+    return(__btree_open(btree, disk, cache_size,
+                        super_offset, btree_magic, node_magic,
+                        NULL, prefix_keycpy, prefix_keycmp,
+                        keycmp, user_data));
+}
+
+int btree_open (btree_t *btree,
+                btdisk_t *disk,
+                uint32_t cache_size,
+                uint64_t super_offset,
+                uint32_t btree_magic,
+                uint16_t node_magic,
+                compare_t keycmp,
+                void *user_data)
+{
+    return(btree_prefix_open(btree, disk, cache_size,
+                             super_offset, btree_magic, node_magic,
+                             NULL, keycmp,
+                             keycmp, user_data));
+}
+
+int btree_varkey_open (btree_t *btree,
+                       btdisk_t *disk,
+                       uint32_t cache_size,
+                       uint64_t super_offset,
+                       uint32_t btree_magic,
+                       uint16_t node_magic,
+                       keysize_t keysize,
+                       compare_t keycmp,
+                       void *user_data)
+{
+    if (keysize == NULL)
+        return(2);
+
+    return(__btree_open(btree, disk, cache_size,
+                        super_offset, btree_magic, node_magic,
+                        keysize, NULL, keycmp,
+                        keycmp, user_data));
+}
+
+/* Write the super-block, its root is the new commit.
+ * Append-only trees leave the previous super-block (and snapshot) intact.
+ */
+static void __btree_super_commit (btree_t *btree) {
+    if (btree->space != NULL)
+        __btspace_commit(btree);
+
+    __btree_generation(btree)++;
+    btree->super_offset = __btree_disk_write(btree,
+                                             btree->super_offset,
+                                             SUPER_BLOCK_SIZE,
+                                             btree->super,
+                                             SUPER_BLOCK_SIZE);
+
+    if (btree->anchored && __btree_is_append_only(btree))
+        __btanchor_write(btree);
+}
+
+static int __btree_flush (btree_t *btree) {
+    struct node_pointer pointer;
+    struct super_block *super;
+    btnode_t *node;
+    int errno;
+
+    if (btree->root == NULL)
+        return(0);
+
+    node = __btree_fetch_root(btree);
+    errno = __btree_sync(btree, node, &pointer);
+    __btnode_release(btree, node);
+
+    if (errno < 0)
+        return(-1);
+
+    if (errno > 0)
+        return(1);
+
+    super = __btree_super(btree);
+    super->sb_root = pointer.np_blocknr;
+    super->sb_root_size = pointer.np_size;
+    super->sb_root_crc = pointer.np_crc;
+
+    __btree_super_commit(btree);
+
+    /* Free In-Memory Nodes */
+    __btree_mem_nodes_release(btree, btree->root);
+    btree->root = NULL;
+
+    return(0);
+}
+
+int btree_close (btree_t *btree) {
+    if (btree->flusher != NULL) {
+        __btflusher_free(btree->flusher);
+        btree->flusher = NULL;
+    }
+
+    if (btree->wal != NULL)
+        __btwal_stop(btree);
+
+    __btree_wrlock(btree);
+    if (__btree_flush(btree) < 0) {
+        __btree_wrunlock(btree);
+        return(-1);
+    }
+
+    /* Every record is in the tree now */
+    if (btree->wal != NULL) {
+        __btwal_checkpoint(btree);
+        __btwal_free(btree->wal);
+        btree->wal = NULL;
+    }
+
+    /* Free In-Memory Nodes */
+    if (btree->root != NULL) {
+        __btree_mem_nodes_release(btree, btree->root);
+        btree->root = NULL;
+    }
+    __btree_wrunlock(btree);
+
+    __btcache_close(btree, &(btree->cache));
+    __btspace_close(btree);
+    __btstats_free(btree->stats);
+    btree->stats = NULL;
+    if (btree->zblock != NULL)
+        free(btree->zblock);
+    pthread_rwlock_destroy(&(btree->lock));
+    pthread_mutex_destroy(&(btree->latch));
+    return(0);
+}
+
+int btree_sync (btree_t *btree) {
+    int err;
+
+    __btree_wrlock(btree);
+    err = __btree_flush(btree);
+    if (err >= 0 && btree->wal != NULL)
+        __btwal_checkpoint(btree);
+    __btree_wrunlock(btree);
+
+    return(err);
+}
+
+int btree_flusher_setup (btree_t *btree,
+                         uint64_t dirty_bytes)
+{
+    btflusher_t *flusher;
+
+    if (btree->readonly)
+        return(-1);
+
+    __btree_wrlock(btree);
+    if ((flusher = btree->flusher) != NULL && dirty_bytes > 0) {
+        /* Already running, only the budget changes */
+        pthread_mutex_lock(&(flusher->lock));
+        flusher->budget = dirty_bytes;
+        pthread_cond_signal(&(flusher->wakeup));
+        pthread_mutex_unlock(&(flusher->lock));
+        __btree_wrunlock(btree);
+        return(0);
+    }
+    btree->flusher = NULL;
+    __btree_wrunlock(btree);
+
+    /* The thread may be waiting for the tree lock */
+    if (flusher != NULL)
+        __btflusher_free(flusher);
+
+    if (dirty_bytes == 0)
+        return(0);
+
+    if ((flusher = __btflusher_alloc(btree, dirty_bytes)) == NULL)
+        return(1);
+
+    __btree_wrlock(btree);
+    btree->flusher = flusher;
+    __btree_wrunlock(btree);
+    return(0);
+}
+
+int btree_wal_open (btree_t *btree,
+                    btdisk_t *log,
+                    uint64_t log_offset,
+                    uint64_t checkpoint_size)
+{
+    uint8_t zero[WAL_HEAD_SLOTS * WAL_HEAD_SIZE];
+    uint64_t start;
+    uint64_t tail;
+    uint64_t end;
+    btwal_t *wal;
+    int count;
+
+    if (btree->readonly)
+        return(-1);
+
+    if (btree->wal != NULL)
+        return(1);
+
+    /* Appends go on from the driver end, past the head slots */
+    memset(zero, 0, sizeof(zero));
+    tail = log->append(log, zero, 0);
+    if (log_offset == 0 || tail < log_offset)
+        return(5);
+
+    if ((wal = (btwal_t *) malloc(sizeof(btwal_t))) == NULL)
+        return(2);
+
+    memset(wal, 0, sizeof(btwal_t));
+    wal->log = log;
+    wal->head_offset = log_offset;
+    wal->checkpoint_size = checkpoint_size;
+    pthread_mutex_init(&(wal->lock), NULL);
+    pthread_cond_init(&(wal->flushed), NULL);
+    pthread_cond_init(&(wal->wakeup), NULL);
+
+    __btree_wrlock(btree);
+    start = __btwal_head_load(wal);
+    if ((count = __btwal_replay(btree, wal, start, &end)) < 0 ||
+        (count > 0 && __btree_flush(btree) < 0))
+    {
+        __btree_wrunlock(btree);
+        __btwal_free(wal);
+        return(3);
+    }
+
+    /* A new log, reserve the head slots */
+    if (tail < start) {
+        tail = log->append(log, zero, start - tail) + (start - tail);
+    }
+
+    /* Replayed records are committed, and anything past them is a torn
+     * write: the log goes on from the tail, replay starts there.
+     */
+    if (tail != start) {
+        if ((btree->disk->sync != NULL && btree->disk->sync(btree->disk)) ||
+            __btwal_head_write(wal, tail))
+        {
+            __btree_wrunlock(btree);
+            __btwal_free(wal);
+            return(6);
+        }
+
+        if (log->erase != NULL)
+            log->erase(log, start, tail - start);
+    }
+
+    wal->start = tail;
+    wal->end = tail;
+    btree->wal = wal;
+    __btree_wrunlock(btree);
+
+    if (checkpoint_size > 0) {
+        wal->running = 1;
+        if (pthread_create(&(wal->thread), NULL, __btwal_checkpoint_thread, btree)) {
+            wal->running = 0;
+            return(4);
+        }
+    }
+
+    return(0);
+}
+
+int btree_append_only (btree_t *btree) {
+    if (btree->readonly)
+        return(-1);
+
+    /* Freed blocks get reused, a snapshot could still point to them */
+    if (btree->space != NULL)
+        return(1);
+
+    /* Persisted by the next sync, blocks already on disk can stay */
+    __btree_wrlock(btree);
+    __btree_flags(btree) |= SUPER_FLAG_APPEND_ONLY;
+    __btree_wrunlock(btree);
+
+    return(0);
+}
+
+int btree_space_map (btree_t *btree,
+                     uint32_t unit)
+{
+    if (btree->readonly)
+        return(-1);
+
+    if (__btree_is_append_only(btree))
+        return(1);
+
+    if (unit == 0)
+        unit = __btree_block_size(btree);
+
+    __btree_wrlock(btree);
+    if (btree->space == NULL) {
+        if ((btree->space = __btspace_alloc(unit)) == NULL) {
+            __btree_wrunlock(btree);
+            return(2);
+        }
+
+        /* Persisted by the next sync, with the bitmap */
+        __btree_flags(btree) |= SUPER_FLAG_SPACE_MAP;
+    }
+    __btree_wrunlock(btree);
+
+    return(0);
+}
+
+int btree_compact (btree_t *btree) {
+    btnode_t *root;
+    int err;
+
+    if (btree->readonly)
+        return(-1);
+
+    __btree_wrlock(btree);
+    if (__btree_is_null(btree) && btree->root == NULL) {
+        __btree_wrunlock(btree);
+        return(0);
+    }
+
+    if ((root = __btree_fetch_root(btree)) == NULL) {
+        __btree_wrunlock(btree);
+        return(-2);
+    }
+
+    /* New blocks are laid out from the lowest free run, in write order */
+    if (btree->space != NULL)
+        btree->space->cursor = btree->space->base;
+
+    __btnode_relocate(btree, root);
+    err = __node_is_internal(root) ? __btree_compact(btree, root) : 0;
+    __btnode_release(btree, root);
+
+    if (!err && __btree_flush(btree) < 0)
+        err = -3;
+    __btree_wrunlock(btree);
+
+    return(err);
+}
+
+int btree_snapshot_open (btree_t *snapshot,
+                         btree_t *btree,
+                         uint32_t cache_size,
+                         uint64_t super_offset)
+{
+    int err;
+
+    if (!__btree_is_append_only(btree))
+        return(8);
+
+    /* Blocks of an append-only tree never change, no lock is shared */
+    err = __btree_open(snapshot, btree->disk, cache_size, super_offset,
+                       __btree_magic(btree), __btree_node_magic(btree),
+                       btree->keysize, btree->prefix_keycpy,
+                       btree->prefix_keycmp, btree->keycmp,
+                       btree->user_data);
+    if (err)
+        return(err);
+
+    if (!__btree_is_append_only(snapshot)) {
+        btree_close(snapshot);
+        return(8);
+    }
+
+    snapshot->readonly = 1;
+    snapshot->verify = btree->verify;
+    snapshot->memcmp_keys = btree->memcmp_keys;
+    return(0);
+}
+
+void btree_verify (btree_t *btree,
+                   uint8_t flags)
+{
+    __btree_wrlock(btree);
+    btree->verify = flags;
+    __btree_wrunlock(btree);
+}
+
+int btree_blob_setup (btree_t *btree,
+                      uint32_t threshold)
+{
+    /* The blob pointer must be smaller than the values it replaces */
+    if (threshold > 0 && threshold < NODE_POINTER_SIZE)
+        return(1);
+
+    __btree_wrlock(btree);
+    btree->blob_threshold = threshold;
+    __btree_wrunlock(btree);
+    return(0);
+}
+
+int btree_memcmp_keys (btree_t *btree) {
+    if (__btree_is_varkey(btree))
+        return(1);
+
+    __btree_wrlock(btree);
+    btree->memcmp_keys = 1;
+    __btree_wrunlock(btree);
+    return(0);
+}
+
+int btree_cache_setup (btree_t *btree,
+                       btcache_type_t type,
+                       uint8_t pin_level)
+{
+    uint32_t size;
+    int err;
+
+    if (type != BTCACHE_LRU && type != BTCACHE_2Q)
+        return(1);
+
+    /* Cached blocks are clean, start over with an empty cache */
+    __btree_wrlock(btree);
+    size = btree->cache.size;
+    __btcache_close(btree, &(btree->cache));
+    err = __btcache_open(btree, &(btree->cache), size, type, pin_level);
+    __btree_wrunlock(btree);
+
+    return((err > 1) ? 2 : 0);
+}
+
+void btree_cache_stats (btree_t *btree,
+                        btcache_stats_t *stats)
+{
+    btcache_t *cache = &(btree->cache);
+
+    pthread_mutex_lock(&(cache->lock));
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->used = __btcache_used(cache);
+    stats->pinned = cache->count[BTCACHE_QUEUE_PINNED];
+    stats->size = cache->size;
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+int btree_stats_setup (btree_t *btree,
+                       uint32_t stripes)
+{
+    struct btstats_stripe *total;
+    btstats_t *stats = NULL;
+    btstats_t *old;
+
+    if (stripes > 0 && (stats = __btstats_alloc(stripes)) == NULL)
+        return(1);
+
+    /* Counters so far move to the first stripe of the new ones */
+    __btree_wrlock(btree);
+    old = btree->stats;
+    if (old != NULL && stats != NULL) {
+        total = &(stats->stripes[0]);
+        __btstats_sum(old, total);
+    }
+    btree->stats = stats;
+    __btree_wrunlock(btree);
+
+    __btstats_free(old);
+    return(0);
+}
+
+void btree_stats (btree_t *btree,
+                  btree_stats_t *stats)
+{
+    struct btstats_stripe total;
+    btcache_stats_t cache;
+    uint64_t capacity;
+    uint64_t used;
+
+    memset(&total, 0, sizeof(struct btstats_stripe));
+    btree_cache_stats(btree, &cache);
+
+    pthread_rwlock_rdlock(&(btree->lock));
+    if (btree->stats != NULL)
+        __btstats_sum(btree->stats, &total);
+
+    stats->items = __btree_item_count(btree);
+    stats->nodes = __btree_node_count(btree);
+    stats->height = __btree_height(btree) - LEAF_NODE_LEVEL;
+
+    /* Leaf bytes over the space of every node, twig bytes aren't counted */
+    used = __btree_stored_size(btree) +
+           __btree_item_count(btree) * __btree_item_size(btree);
+    capacity = __btree_node_count(btree) * __btree_node_space(btree);
+    pthread_rwlock_unlock(&(btree->lock));
+
+    stats->fill = (capacity > 0) ? (uint32_t)((used * 100) / capacity) : 0;
+    if (stats->fill > 100)
+        stats->fill = 100;
+
+    stats->lookups = total.lookups;
+    stats->inserts = total.inserts;
+    stats->removes = total.removes;
+    stats->leaf_splits = total.leaf_splits;
+    stats->twig_splits = total.twig_splits;
+    stats->leaf_merges = total.leaf_merges;
+    stats->twig_merges = total.twig_merges;
+    stats->cache_hits = cache.hits;
+    stats->cache_misses = cache.misses;
+    stats->disk_reads = total.disk_reads;
+    stats->disk_read_bytes = total.disk_read_bytes;
+    stats->disk_writes = total.disk_writes;
+    stats->disk_write_bytes = total.disk_write_bytes;
+    memcpy(stats->read_latency, total.read_latency, sizeof(total.read_latency));
+    memcpy(stats->write_latency, total.write_latency, sizeof(total.write_latency));
+}
+
+static int __btree_bulk_load (btree_t *btree,
+                              btree_bulk_next_t next,
+                              void *user_data,
+                              uint8_t fill_factor)
+{
+    uint8_t super[SUPER_BLOCK_SIZE];
+    struct node_pointer pointer;
+    struct btree_bulk bulk;
+    uint8_t *last_key;
+    const void *value;
+    const void *key;
+    uint32_t needed;
+    uint32_t level;
+    btnode_t *leaf;
+    uint32_t size;
+    int err = 0;
+
+    /* Bulk load builds the tree from scratch */
+    if (!__btree_is_null(btree) || btree->root != NULL)
+        return(1);
+
+    if (fill_factor == 0 || fill_factor > 100)
+        fill_factor = 100;
+
+    memset(&bulk, 0, sizeof(struct btree_bulk));
+    bulk.leaf_space = (__btree_node_space(btree) * fill_factor) / 100;
+    bulk.twig_items = (__btree_fanout(btree) * fill_factor) / 100;
+    bulk.twig_space = bulk.leaf_space;
+    if (bulk.twig_items < 2)
+        bulk.twig_items = 2;
+
+    if ((last_key = (uint8_t *) malloc(__btree_key_size(btree))) == NULL)
+        return(2);
+
+    /* Keep the super-block to restore it on failure */
+    memcpy(super, btree->super, SUPER_BLOCK_SIZE);
+
+    while (!next(user_data, &key, &value, &size)) {
+        needed = __item_needed_size(btree, key, __btblob_inline_size(btree, size));
+        if (needed > __btree_node_space(btree) ||
+            __btree_key_len(btree, key) > __btree_key_size(btree))
+        {
+            err = 3;
+            break;
+        }
+
+        if ((leaf = bulk.nodes[LEAF_NODE_LEVEL]) == NULL) {
+            if ((leaf = __btree_leaf_node_alloc(btree)) == NULL) {
+                err = 4;
+                break;
+            }
+            bulk.nodes[LEAF_NODE_LEVEL] = leaf;
+        } else {
+            /* Keys must be sorted and unique */
+            if (btree->keycmp(btree->user_data, last_key, key) >= 0) {
+                err = 5;
+                break;
+            }
+
+            if (__node_free(leaf) < needed ||
+                (__btree_node_space(btree) - __node_free(leaf) + needed) > bulk.leaf_space)
+            {
+                if (__btree_bulk_flush(btree, &bulk, LEAF_NODE_LEVEL)) {
+                    err = 6;
+                    break;
+                }
+            }
+        }
+
+        if (__btblob_needed(btree, size)) {
+            __btblob_write(btree, value, size, &pointer);
+            __leaf_insert(btree, leaf, __node_items(leaf), key, &pointer, NODE_POINTER_SIZE);
+            __item_set_blob(btree, leaf, __node_items(leaf) - 1, 1);
+        } else {
+            __leaf_insert(btree, leaf, __node_items(leaf), key, value, size);
+        }
+        memcpy(last_key, key, __btree_key_len(btree, key));
+    }
+
+    if (!err && bulk.nodes[LEAF_NODE_LEVEL] != NULL) {
+        if (__btree_bulk_finish(btree, &bulk)) {
+            err = 7;
+        } else {
+            /* Every node written, plus the root */
+            __btree_super(btree)->sb_node_count = 1;
+            for (level = LEAF_NODE_LEVEL; level < BTREE_MAX_HEIGHT; ++level)
+                __btree_super(btree)->sb_node_count += bulk.count[level];
+
+            __btree_super_commit(btree);
+        }
+    }
+
+    if (err)
+        memcpy(btree->super, super, SUPER_BLOCK_SIZE);
+
+    /* Release node buffers, blocks are already on disk */
+    for (level = LEAF_NODE_LEVEL; level < BTREE_MAX_HEIGHT; ++level) {
+        if (bulk.nodes[level] != NULL) {
+            __node_mark_clean(btree, bulk.nodes[level]);
+            free(bulk.nodes[level]->data);
+            __btnode_destroy(bulk.nodes[level]);
+        }
+    }
+
+    free(last_key);
+    return(err);
+}
+
+static int __btree_insert (btree_t *btree,
+                           const void *key,
+                           const void *value,
+                           uint32_t size)
+{
+    struct node_pointer pointer;
+    btnode_place_t place;
+    btpath_t path;
+    btnode_t *node;
+    int err;
+
+    /* Item must fit in an empty leaf, with a key not over the max size */
+    if (__item_needed_size(btree, key, __btblob_inline_size(btree, size)) >
+            __btree_node_space(btree) ||
+        __btree_key_len(btree, key) > __btree_key_size(btree))
+    {
+        return(1);
+    }
+
+    /* If there's no root, add a new one and add this first key/value */
+    if (__btree_is_null(btree)) {
+        if ((node = __btree_leaf_node_alloc(btree)) == NULL)
+            return(2);
+
+        btree->root = node;
+        __btree_super(btree)->sb_height = LEAF_NODE_LEVEL + 1;
+
+        if (__btblob_needed(btree, size)) {
+            __btblob_write(btree, value, size, &pointer);
+            __leaf_insert(btree, node, 0, key, &pointer, NODE_POINTER_SIZE);
+            __item_set_blob(btree, node, 0, 1);
+        } else {
+            __leaf_insert(btree, node, 0, key, value, size);
+        }
+        __btnode_release(btree, node);
+        __btstats_inc(btree, inserts);
+        return(0);
+    }
+
+    /* Lookup Leaf node, keeping the path to the root */
+    if (__btpath_lookup(btree, &path, key, &place) == NULL)
+        return(3);
+
+    err = __btree_leaf_insert(btree, &path, &place, key, value, size);
+    __btpath_release(btree, &path);
+
+    if (err)
+        return(4);
+
+    __btstats_inc(btree, inserts);
+    return(0);
+}
+
+static int __btree_remove (btree_t *btree,
+                           const void *key)
+{
+    btnode_place_t place;
+    btpath_t path;
+    btnode_t *node;
+
+    if (__btree_is_null(btree))
+        return(1);
+
+    if ((node = __btpath_lookup(btree, &path, key, &place)) == NULL)
+        return(1);
+
+    if (!place.found) {
+        __btpath_release(btree, &path);
+        return(2);
+    }
+
+    __leaf_remove(btree, node, place.index);
+    __btpath_touch(btree, &path);
+    __btpath_rebalance(btree, &path, LEAF_NODE_LEVEL);
+    __btpath_release(btree, &path);
+
+    __btstats_inc(btree, removes);
+    return(0);
+}
+
+static int __btree_remove_range (btree_t *btree,
+                                 const void *key_lo,
+                                 const void *key_hi)
+{
+    const void *bounds[2] = {key_lo, key_hi};
+    btnode_place_t place;
+    uint64_t items;
+    btnode_t *root;
+    btnode_t *leaf;
+    uint32_t level;
+    btpath_t path;
+    int err;
+    int i;
+
+    if (__btree_is_null(btree))
+        return(0);
+
+    if (key_lo != NULL && key_hi != NULL &&
+        btree->keycmp(btree->user_data, key_lo, key_hi) >= 0)
+    {
+        return(0);
+    }
+
+    if ((root = __btree_fetch_root(btree)) == NULL)
+        return(1);
+
+    items = __btree_item_count(btree);
+    err = __btree_remove_range_node(btree, root, key_lo, key_hi);
+    __btstats_add(btree, removes, items - __btree_item_count(btree));
+
+    /* Every sub-tree is gone, start over from an empty leaf */
+    if (__node_is_internal(root) && __node_items(root) == 0) {
+        if ((leaf = __btree_leaf_node_alloc(btree)) == NULL) {
+            __btnode_release(btree, root);
+            return(2);
+        }
+
+        __node_mark_dirty(btree, leaf);
+        btree->root = leaf;
+        __btree_super(btree)->sb_height = LEAF_NODE_LEVEL + 1;
+        __btree_super(btree)->sb_node_count--;
+        __btnode_remove(btree, root);
+        __btnode_release(btree, leaf);
+        return(err ? 3 : 0);
+    }
+    __btnode_release(btree, root);
+
+    /* Nodes left on the bounds may be under-filled */
+    for (i = 0; i < 2; ++i) {
+        if (bounds[i] == NULL)
+            continue;
+
+        if (__btpath_lookup(btree, &path, bounds[i], &place) == NULL)
+            return(4);
+
+        __btpath_touch(btree, &path);
+        for (level = LEAF_NODE_LEVEL; level < path.levels; ++level) {
+            if (path.nodes[level] != NULL)
+                __btpath_rebalance(btree, &path, level);
+        }
+        __btpath_release(btree, &path);
+    }
+
+    return(err ? 3 : 0);
+}
+
+static uint32_t __btree_lookup (btree_t *btree,
+                                const void *key,
+                                void *buffer,
+                                uint32_t size)
+{
+    btnode_place_t place;
+    btnode_t *node;
+    uint32_t x;
+
+    if (__btree_is_null(btree))
+        return(0);
+
+    if ((node = __btree_lookup_leaf(btree, key, &place)) == NULL)
+        return(0);
+
+    if (!place.found) {
+        __btnode_release(btree, node);
+        return(0);
+    }
+
+    if (place.blob) {
+        x = size;
+        if (__btblob_read(btree, place.value, buffer, &x))
+            x = 0;
+    } else {
+        x = (size > place.size) ? place.size : size;
+        memcpy(buffer, place.value, x);
+    }
+
+    __btnode_release(btree, node);
+    return(x);
+}
+
+int btree_bulk_load (btree_t *btree,
+                     btree_bulk_next_t next,
+                     void *user_data,
+                     uint8_t fill_factor)
+{
+    int err;
+
+    /* Snapshots are read-only */
+    if (btree->readonly)
+        return(-1);
+
+    __btree_wrlock(btree);
+    err = __btree_bulk_load(btree, next, user_data, fill_factor);
+    __btree_wrunlock(btree);
+
+    return(err);
+}
+
+int btree_insert (btree_t *btree,
+                  const void *key,
+                  const void *value,
+                  uint32_t size)
+{
+    uint64_t lsn = 0;
+    int err;
+
+    /* Snapshots are read-only */
+    if (btree->readonly)
+        return(-1);
+
+    __btree_wrlock(btree);
+    if (!(err = __btree_insert(btree, key, value, size)))
+        lsn = __btwal_log(btree, WAL_RECORD_INSERT, key, value, size);
+    __btflusher_kick(btree);
+    __btree_wrunlock(btree);
+
+    /* Wait for the record on the log, along with the other writers */
+    if (lsn > 0)
+        err = __btwal_commit(btree->wal, lsn);
+
+    return(err);
+}
+
+int btree_remove (btree_t *btree,
+                  const void *key)
+{
+    uint64_t lsn = 0;
+    int err;
+
+    /* Snapshots are read-only */
+    if (btree->readonly)
+        return(-1);
+
+    __btree_wrlock(btree);
+    if (!(err = __btree_remove(btree, key)))
+        lsn = __btwal_log(btree, WAL_RECORD_REMOVE, key, NULL, 0);
+    __btflusher_kick(btree);
+    __btree_wrunlock(btree);
+
+    if (lsn > 0)
+        err = __btwal_commit(btree->wal, lsn);
+
+    return(err);
+}
+
+int btree_remove_range (btree_t *btree,
+                        const void *key_lo,
+                        const void *key_hi)
+{
+    uint64_t lsn = 0;
+    int err;
+
+    /* Snapshots are read-only */
+    if (btree->readonly)
+        return(-1);
+
+    /* An open bound is logged with no key */
+    __btree_wrlock(btree);
+    if (!(err = __btree_remove_range(btree, key_lo, key_hi))) {
+        lsn = __btwal_log(btree, WAL_RECORD_REMOVE_RANGE, key_lo, key_hi,
+                          (key_hi != NULL) ? __btree_key_len(btree, key_hi) : 0);
+    }
+    __btflusher_kick(btree);
+    __btree_wrunlock(btree);
+
+    if (lsn > 0)
+        err = __btwal_commit(btree->wal, lsn);
+
+    return(err);
+}
+
+uint32_t btree_contains (btree_t *btree,
+                         const void *key)
+{
+    btnode_place_t place;
+    btnode_t *node;
+
+    pthread_rwlock_rdlock(&(btree->lock));
+    place.found = 0;
+    if (!__btree_is_null(btree)) {
+        if ((node = __btree_lookup_leaf(btree, key, &place)) != NULL)
+            __btnode_release(btree, node);
+    }
+    __btstats_inc(btree, lookups);
+    pthread_rwlock_unlock(&(btree->lock));
+
+    return(place.found);
+}
+
+uint32_t btree_lookup (btree_t *btree,
+                       const void *key,
+                       void *buffer,
+                       uint32_t size)
+{
+    uint32_t x;
+
+    pthread_rwlock_rdlock(&(btree->lock));
+    x = __btree_lookup(btree, key, buffer, size);
+    __btstats_inc(btree, lookups);
+    pthread_rwlock_unlock(&(btree->lock));
+
+    return(x);
+}
+
+static int __btree_insert_batch (btree_t *btree,
+                                 uint32_t count,
+                                 const void **keys,
+                                 const void **values,
+                                 const uint32_t *sizes,
+                                 uint64_t *lsn)
+{
+    btnode_place_t place;
+    uint64_t node_count;
+    uint32_t *index;
+    btpath_t path;
+    btnode_t *node;
+    uint32_t i, k;
+    int err = 0;
+
+    /* Every item must fit in an empty leaf */
+    for (i = 0; i < count; ++i) {
+        if (__item_needed_size(btree, keys[i], __btblob_inline_size(btree, sizes[i])) >
+                __btree_node_space(btree) ||
+            __btree_key_len(btree, keys[i]) > __btree_key_size(btree))
+        {
+            return(1);
+        }
+    }
+
+    if (count == 0)
+        return(0);
+
+    if ((index = __batch_sort(btree, keys, count)) == NULL)
+        return(2);
+
+    path.levels = 0;
+    for (i = 0; i < count; ++i) {
+        k = index[i];
+
+        /* Empty tree, or the last insert has changed the tree shape */
+        if (__btree_is_null(btree)) {
+            if ((err = __btree_insert(btree, keys[k], values[k], sizes[k])))
+                break;
+            *lsn = __btwal_log(btree, WAL_RECORD_INSERT, keys[k], values[k], sizes[k]);
+            continue;
+        }
+
+        if (path.levels == 0)
+            node = __btpath_lookup(btree, &path, keys[k], &place);
+        else
+            node = __btpath_seek_next(btree, &path, keys[k], &place);
+
+        if (node == NULL) {
+            err = 3;
+            break;
+        }
+
+        node_count = __btree_node_count(btree);
+        if (__btree_leaf_insert(btree, &path, &place, keys[k], values[k], sizes[k])) {
+            err = 4;
+            break;
+        }
+        __btstats_inc(btree, inserts);
+        *lsn = __btwal_log(btree, WAL_RECORD_INSERT, keys[k], values[k], sizes[k]);
+
+        if (node_count != __btree_node_count(btree))
+            __btpath_release(btree, &path);
+    }
+
+    __btpath_release(btree, &path);
+    free(index);
+    return(err);
+}
+
+static uint32_t __btree_lookup_batch (btree_t *btree,
+                                      uint32_t count,
+                                      const void **keys,
+                                      void **buffers,
+                                      uint32_t *sizes)
+{
+    btnode_place_t place;
+    uint32_t *index;
+    uint32_t found;
+    btpath_t path;
+    btnode_t *node;
+    uint32_t i, k;
+
+    if (__btree_is_null(btree) || count == 0) {
+        for (i = 0; i < count; ++i)
+            sizes[i] = 0;
+        return(0);
+    }
+
+    if ((index = __batch_sort(btree, keys, count)) == NULL)
+        return(0);
+
+    found = 0;
+    path.levels = 0;
+    for (i = 0; i < count; ++i) {
+        k = index[i];
+
+        if (path.levels == 0)
+            node = __btpath_lookup(btree, &path, keys[k], &place);
+        else
+            node = __btpath_seek_next(btree, &path, keys[k], &place);
+
+        if (node == NULL || !place.found) {
+            sizes[k] = 0;
+            continue;
+        }
+
+        if (place.blob) {
+            if (__btblob_read(btree, place.value, buffers[k], &(sizes[k]))) {
+                sizes[k] = 0;
+                continue;
+            }
+        } else {
+            if (sizes[k] > place.size)
+                sizes[k] = place.size;
+            memcpy(buffers[k], place.value, sizes[k]);
+        }
+        found++;
+    }
+
+    __btpath_release(btree, &path);
+    free(index);
+    return(found);
+}
+
+int btree_insert_batch (btree_t *btree,
+                        uint32_t count,
+                        const void **keys,
+                        const void **values,
+                        const uint32_t *sizes)
+{
+    uint64_t lsn = 0;
+    int err;
+
+    /* Snapshots are read-only */
+    if (btree->readonly)
+        return(-1);
+
+    __btree_wrlock(btree);
+    err = __btree_insert_batch(btree, count, keys, values, sizes, &lsn);
+    __btflusher_kick(btree);
+    __btree_wrunlock(btree);
+
+    /* One wait for the whole batch, even if only a part was inserted */
+    if (lsn > 0) {
+        int wal_err;
+
+        if ((wal_err = __btwal_commit(btree->wal, lsn)))
+            err = wal_err;
+    }
+
+    return(err);
+}
+
+uint32_t btree_lookup_batch (btree_t *btree,
+                             uint32_t count,
+                             const void **keys,
+                             void **buffers,
+                             uint32_t *sizes)
+{
+    uint32_t found;
+
+    pthread_rwlock_rdlock(&(btree->lock));
+    found = __btree_lookup_batch(btree, count, keys, buffers, sizes);
+    __btstats_add(btree, lookups, count);
+    pthread_rwlock_unlock(&(btree->lock));
+
+    return(found);
+}
+
+/* ===========================================================================
+ *  PUBLIC Cursor Operations
+ *
+ *  A cursor moves under the tree read lock with the path of the current
+ *  item, so moving to the next (or previous) leaf climbs only the levels
+ *  that have run out of items. The leaf it lands on is copied and both the
+ *  path and the lock are let go: writers, the cursor thread too, run
+ *  between moves. Moves inside the copy take no lock, the next leaf is
+ *  found again from the key of the item the cursor is on.
+ */
+#define __btcursor_leaf(cursor)             ((cursor)->leaf)
+#define __btcursor_index(cursor)            ((cursor)->index)
+
+#define __btcursor_path_leaf(cursor)                                        \
+    ((cursor)->path.nodes[LEAF_NODE_LEVEL])
+
+#define __btcursor_path_index(cursor)                                       \
+    ((cursor)->path.index[LEAF_NODE_LEVEL])
+
+/* Keep the next leaves of the scan in flight, if the disk is async */
+static void __btcursor_readahead (btree_cursor_t *cursor,
+                                  int dir)
+{
+    btpath_t *path = &(cursor->path);
+
+    if (cursor->readahead != NULL && path->levels >= TWIG_NODE_LEVEL) {
+        __btreadahead_fill(cursor->btree, cursor->readahead,
+                           path->nodes[TWIG_NODE_LEVEL],
+                           path->index[TWIG_NODE_LEVEL], dir);
+    }
+}
+
+/* Follow the first (or last) item of every node below 'level' */
+static int __btpath_edge (btree_t *btree,
+                          btpath_t *path,
+                          uint32_t level,
+                          int last)
+{
+    btnode_t *node;
+
+    while (level > LEAF_NODE_LEVEL) {
+        node = __btnode_fetch_twig(btree, path->nodes[level], path->index[level]);
+        if (node == NULL)
+            return(-1);
+
+        level--;
+        if (path->nodes[level] != NULL)
+            __btnode_release(btree, path->nodes[level]);
+        path->nodes[level] = node;
+        path->index[level] = last ? (__node_items(node) - 1) : 0;
+    }
+
+    return(0);
+}
+
+/* Take the read lock, reads ahead of a tree changed since are dropped */
+static void __btcursor_lock (btree_cursor_t *cursor) {
+    btree_t *btree = cursor->btree;
+
+    pthread_rwlock_rdlock(&(btree->lock));
+    if (cursor->readahead != NULL && cursor->version != btree->version)
+        __btreadahead_drop(btree, cursor->readahead);
+}
+
+/* Copy the leaf of a successful move, then let go of the path and lock */
+static int __btcursor_unlock (btree_cursor_t *cursor,
+                              int err)
+{
+    btree_t *btree = cursor->btree;
+
+    cursor->valid = (err == 0);
+    if (cursor->valid) {
+        memcpy(__btcursor_leaf(cursor)->data, __btcursor_path_leaf(cursor)->data,
+               __btree_block_size(btree));
+        __btcursor_index(cursor) = __btcursor_path_index(cursor);
+    }
+
+    __btpath_release(btree, &(cursor->path));
+    cursor->version = btree->version;
+    pthread_rwlock_unlock(&(btree->lock));
+    return(err);
+}
+
+static int __btcursor_edge (btree_cursor_t *cursor,
+                            int last)
+{
+    btree_t *btree = cursor->btree;
+    btpath_t *path = &(cursor->path);
+    btnode_t *root;
+
+    if (cursor->readahead != NULL)
+        __btreadahead_drain(btree, cursor->readahead);
+
+    if (__btree_is_null(btree))
+        return(1);
+
+    if ((root = __btree_fetch_root(btree)) == NULL)
+        return(-1);
 
-    /* Calculate Fanout */
-    super->sb_fanout = __btree_node_space(btree) /
-                       (__btree_prefix_size(btree)+NODE_POINTER_SIZE);
+    path->levels = __node_level(root);
+    path->nodes[path->levels] = root;
+    if (__node_items(root) == 0) {
+        __btpath_release(btree, path);
+        return(1);
+    }
 
-    /* Initialize block cache */
-    __btcache_open(btree, &(btree->cache), cache_size);
+    path->index[path->levels] = last ? (__node_items(root) - 1) : 0;
+    if (__btpath_edge(btree, path, path->levels, last)) {
+        __btpath_release(btree, path);
+        return(-1);
+    }
 
+    __btcursor_readahead(cursor, last ? -1 : 1);
     return(0);
 }
 
-int btree_create (btree_t *btree,
-                  btdisk_t *disk,
-                  uint32_t cache_size,
-                  uint64_t super_offset,
-                  uint32_t block_size,
-                  uint8_t format,
-                  uint32_t key_size,
-                  uint32_t btree_magic,
-                  uint16_t node_magic,
-                  compare_t keycmp,
-                  void *user_data)
-{
-    return(btree_create_prefix(btree, disk, cache_size,
-                               super_offset,
-                               block_size, format,
-                               key_size, key_size,
-                               btree_magic, node_magic,
-                               NULL, keycmp, keycmp,
-                               user_data));
-}
-
-int btree_prefix_open (btree_t *btree,
-                       btdisk_t *disk,
-                       uint32_t cache_size,
-                       uint64_t super_offset,
-                       uint32_t btree_magic,
-                       uint16_t node_magic,
-                       memcopy_t prefix_keycpy,
-                       compare_t prefix_keycmp,
-                       compare_t keycmp,
-                       void *user_data)
+/* Move the path one item forward (dir > 0) or backward (dir < 0), from
+ * the node at 'level' up.
+ */
+static int __btcursor_step (btree_cursor_t *cursor,
+                            uint32_t level,
+                            int dir)
 {
-    /* Initialize In-Memory Btree */
-    btree->prefix_keycpy = prefix_keycpy;
-    btree->prefix_keycmp = prefix_keycmp;
-    btree->keycmp = keycmp;
-    btree->user_data = user_data;
-    btree->super_offset = super_offset;
-    btree->root = NULL;
-    btree->disk = disk;
-
-    /* Initialize block cache */
-    __btcache_open(btree, &(btree->cache), cache_size);
+    btree_t *btree = cursor->btree;
+    btpath_t *path = &(cursor->path);
+    int64_t index;
+
+    /* Climb up to the first node that has a sibling item */
+    for (; level <= path->levels; ++level) {
+        index = (int64_t)path->index[level] + dir;
+        if (index >= 0 && index < __node_items(path->nodes[level]))
+            break;
+    }
 
-    if (!__btdisk_read(btree, super_offset, btree->super, SUPER_BLOCK_SIZE))
+    if (level > path->levels) {
+        __btpath_release(btree, path);
         return(1);
+    }
 
-    if (__btree_magic(btree) != btree_magic) {
-        fprintf(stderr, "assert: __btree_magic() failed.\n");
-        return(3);
+    /* ...and go down again on the sibling edge */
+    path->index[level] = (uint32_t)index;
+    if (level == TWIG_NODE_LEVEL && cursor->readahead != NULL) {
+        __btreadahead_wait(btree, cursor->readahead,
+            __twig_pointer(btree, path->nodes[level], index)->np_blocknr);
     }
 
-    if (__btree_node_magic(btree) != node_magic) {
-        fprintf(stderr, "assert: __btree_node_magic() failed.\n");
-        return(4);
+    if (__btpath_edge(btree, path, level, dir < 0)) {
+        __btpath_release(btree, path);
+        return(-1);
     }
 
+    if (level > LEAF_NODE_LEVEL)
+        __btcursor_readahead(cursor, dir);
     return(0);
 }
 
-int btree_open (btree_t *btree,
-                btdisk_t *disk,
-                uint32_t cache_size,
-                uint64_t super_offset,
-                uint32_t btree_magic,
-                uint16_t node_magic,
-                compare_t keycmp,
-                void *user_data)
+static int __btcursor_seek (btree_cursor_t *cursor,
+                            const void *key)
 {
-    return(btree_prefix_open(btree, disk, cache_size,
-                             super_offset, btree_magic, node_magic,
-                             NULL, keycmp,
-                             keycmp, user_data));
-}
+    btree_t *btree = cursor->btree;
+    btnode_place_t place;
+    btnode_t *node;
 
-int btree_close (btree_t *btree) {
-    if (btree_sync(btree) < 0)
+    if (cursor->readahead != NULL)
+        __btreadahead_drain(btree, cursor->readahead);
+
+    if (__btree_is_null(btree))
+        return(1);
+
+    if ((node = __btpath_lookup(btree, &(cursor->path), key, &place)) == NULL)
         return(-1);
 
-    /* Free In-Memory Nodes */
-    if (btree->root != NULL) {
-        __btree_mem_nodes_release(btree, btree->root);
-        btree->root = NULL;
+    __btcursor_readahead(cursor, 1);
+
+    /* Every key of this leaf is smaller than key, move to the next one */
+    if (place.index >= __node_items(node)) {
+        if (__node_items(node) == 0) {
+            __btpath_release(btree, &(cursor->path));
+            return(1);
+        }
+        __btcursor_path_index(cursor) = __node_items(node) - 1;
+        return(__btcursor_step(cursor, LEAF_NODE_LEVEL, 1));
     }
 
-    __btcache_close(btree, &(btree->cache));
     return(0);
 }
 
-int btree_sync (btree_t *btree) {
-    struct node_pointer pointer;
-    struct super_block *super;
+/* Path down to the twig of the leaf holding 'key', 1 if the root is a leaf */
+static int __btpath_lookup_twig (btree_t *btree,
+                                 btpath_t *path,
+                                 const void *key)
+{
+    btnode_place_t place;
     btnode_t *node;
-    int errno;
-
-    if (btree->root == NULL)
-        return(0);
-
-    node = __btree_fetch_root(btree);
-    errno = __btree_sync(btree, node, &pointer);
-    __btnode_release(btree, node);
+    uint32_t level;
 
-    if (errno < 0)
+    path->levels = 0;
+    if ((node = __btree_fetch_root(btree)) == NULL)
         return(-1);
 
-    if (errno > 0)
+    level = __node_level(node);
+    path->levels = level;
+    path->nodes[level] = node;
+    if (level == LEAF_NODE_LEVEL) {
+        __btpath_release(btree, path);
         return(1);
+    }
 
-    super = __btree_super(btree);
-    super->sb_root = pointer.np_blocknr;
-    super->sb_root_size = pointer.np_size;
-    super->sb_root_crc = pointer.np_crc;
+    while (1) {
+        __twig_search(btree, node, key, &place);
+        if (place.index >= __node_items(node))
+            place.index = __node_items(node) - 1;
+        path->index[level] = place.index;
 
-    btree->super_offset = __btdisk_write(btree,
-                                         btree->super_offset, SUPER_BLOCK_SIZE,
-                                         super, SUPER_BLOCK_SIZE);
+        if (level == TWIG_NODE_LEVEL)
+            return(0);
 
-    /* Free In-Memory Nodes */
-    __btree_mem_nodes_release(btree, btree->root);
-    btree->root = NULL;
+        if ((node = __btnode_fetch_twig(btree, node, place.index)) == NULL) {
+            __btpath_release(btree, path);
+            return(-1);
+        }
+        path->nodes[--level] = node;
+    }
 
     return(0);
 }
 
-int btree_insert (btree_t *btree,
-                    const void *key,
-                    const void *value,
-                    uint32_t size)
+/* Find the path of the current item again and step from there. With no
+ * writer since the move the copy is the leaf, the step starts from its
+ * twig. Otherwise the leaf is searched, a removed item leaves the path
+ * on the next one.
+ */
+static int __btcursor_relocate (btree_cursor_t *cursor,
+                                int dir)
 {
+    btree_t *btree = cursor->btree;
     btnode_place_t place;
-    btnode_t *node_right;
-    uint32_t size_needed;
-    uint32_t free_space;
     btnode_t *node;
+    uint32_t items;
+    int err;
 
-    /* If there's no root, add a new one and add this first key/value */
-    if (btree->root == NULL) {
-        if ((node = __btree_grow(btree)) == NULL)
-            return(1);
+    if (__btree_is_null(btree))
+        return(1);
 
-        __leaf_insert(btree, node, 0, key, value, size);
-        __btnode_release(btree, node);
-        return(0);
+    if (cursor->version == btree->version) {
+        if ((err = __btpath_lookup_twig(btree, &(cursor->path), btree_cursor_key(cursor))))
+            return(err);
+        return(__btcursor_step(cursor, TWIG_NODE_LEVEL, dir));
     }
 
-    /* Lookup Leaf node */
-    node = __btree_lookup_leaf(btree, key, &place);
-
-    if (node == NULL) {
-        printf("ASSERT: __leaf_lookup must be not null\n");
-        abort();
+    node = __btpath_lookup(btree, &(cursor->path), btree_cursor_key(cursor), &place);
+    if (node == NULL)
         return(-1);
-    }
 
-    if (!__node_is_leaf(node)) {
-        printf("ASSERT: node is not leaf!\n");
-        abort();
-        return(-2);
-    }
+    if (!place.found) {
+        items = __node_items(node);
+        if (dir > 0 && place.index < items)
+            return(0);
 
-    /* We consider node free space without this key, that we've to replace */
-    size_needed = __item_needed_size(btree, size);
-    free_space  = __node_free(node);
-    free_space += (place.found) ? __item_needed_size(btree, place.size) : 0U;
-
-    if (node != NULL && place.size == size) {
-        /* Inline Replace: Same size for old and new value */
-        __leaf_inline_replace(btree, node, place.index, value, size);
-    } else if (free_space >= size_needed) {
-        /* Node has enough space to contains key/value */
-        if (place.found) {
-            __leaf_replace(btree, node, place.index, value, size);
-        } else {
-            __btree_twigs_insert_update(btree, node, place.index, key);
-            __leaf_insert(btree, node, place.index, key, value, size);
+        if (dir < 0 && place.index > 0) {
+            __btcursor_path_index(cursor) = place.index - 1;
+            return(0);
         }
-    } else if (place.index < __node_items(node)) {
-        /* There's no enough space for key/value
-         * but we've to insert between x and y item. Split node!
-         */
-        if (place.found)
-            __leaf_remove(btree, node, place.index);   /* TODO: DO BETTER! */
 
-        if (__btree_leaf_split_insert(btree, node, key, value, size)) {
-            __btnode_release(btree, node);
-            return(2);
+        if (items == 0) {
+            __btpath_release(btree, &(cursor->path));
+            return(1);
         }
+        __btcursor_path_index(cursor) = (dir > 0) ? (items - 1) : 0;
     }
-#if 0
-    else if ((node_right = __btnode_fetch_right(btree, node)) != NULL &&
-               __node_free(node_right) >= size_needed)
-    {
-        /* Hei, right node has space for us */
-        if (place.found)
-            __leaf_remove(btree, node, place.index);
 
-        __leaf_insert(btree, node_right, 0U, key, value, size);
-    }
-#endif
-    else {
-        /* There's no enough space for key/value,
-         * but I can append key on a new node.
-         */
-        if (place.found)
-            __leaf_remove(btree, node, place.index);
+    return(__btcursor_step(cursor, LEAF_NODE_LEVEL, dir));
+}
 
-        /* Alloc new Node */
-        if ((node_right = __btree_leaf_node_alloc(btree)) == NULL) {
-            __btnode_release(btree, node);
-            return(3);
-        }
+/* Inside the leaf copy no lock is taken */
+static int __btcursor_advance (btree_cursor_t *cursor,
+                               int dir)
+{
+    int64_t index;
 
-        /* Add item to New Node */
-        __leaf_insert(btree, node_right, 0U, key, value, size);
+    if (!cursor->valid)
+        return(1);
 
-        /* Insert Node into the tree */
-        if (__btree_insert_node(btree, node_right)) {
-            __btnode_release(btree, node);
-            __btnode_free(btree, node_right);
-            return(4);
-        }
+    index = (int64_t)__btcursor_index(cursor) + dir;
+    if (index >= 0 && index < __node_items(__btcursor_leaf(cursor))) {
+        __btcursor_index(cursor) = (uint32_t)index;
+        return(0);
+    }
+
+    __btcursor_lock(cursor);
+    return(__btcursor_unlock(cursor, __btcursor_relocate(cursor, dir)));
+}
 
-        __btnode_release(btree, node_right);
+/* Copy the value of item 'index' of 'node' into the cursor buffer */
+static const void *__btcursor_value_copy (btree_cursor_t *cursor,
+                                          btnode_t *node,
+                                          uint32_t index,
+                                          uint32_t *size)
+{
+    uint32_t value_size;
+    uint8_t *value;
+
+    value_size = __item_data_size(cursor->btree, node, index);
+    if (value_size > cursor->value_size) {
+        if ((value = (uint8_t *) realloc(cursor->value, value_size)) == NULL)
+            return(NULL);
+        cursor->value = value;
+        cursor->value_size = value_size;
     }
 
-    __btnode_release(btree, node);
+    if (!__item_is_blob(cursor->btree, node, index)) {
+        memcpy(cursor->value, __item_value(cursor->btree, node, index), value_size);
+    } else if (__btblob_read(cursor->btree, __item_value(cursor->btree, node, index),
+                             cursor->value, &value_size))
+    {
+        return(NULL);
+    }
 
-    return(0);
+    if (size != NULL)
+        *size = value_size;
+    return(cursor->value);
 }
 
-int btree_remove (btree_t *btree,
-                    const void *key)
+int btree_cursor_open (btree_cursor_t *cursor,
+                       btree_t *btree)
 {
-    btnode_place_t place;
-    btnode_t *node;
+    memset(&(cursor->path), 0, sizeof(btpath_t));
+    cursor->btree = btree;
+    cursor->leaf = NULL;
+    cursor->key = NULL;
+    cursor->readahead = NULL;
+    cursor->value = NULL;
+    cursor->value_size = 0;
+    cursor->index = 0;
+    cursor->version = 0;
+    cursor->valid = 0;
+
+    /* Every move copies the leaf it lands on */
+    if ((cursor->leaf = __btnode_leaf_alloc(btree)) == NULL)
+        return(1);
 
-    if ((node = __btree_lookup_leaf(btree, key, &place)) == NULL) {
+    if ((cursor->leaf->data = (uint8_t *) malloc(__btree_block_size(btree))) == NULL) {
+        btree_cursor_close(cursor);
         return(1);
     }
 
-    if (!place.found) {
-        __btnode_release(btree, node);
-        return(2);
+    /* Front-coded keys are rebuilt in the cursor */
+    if (__btree_is_coded(btree)) {
+        if ((cursor->key = (uint8_t *) malloc(__btree_key_size(btree))) == NULL) {
+            btree_cursor_close(cursor);
+            return(1);
+        }
     }
 
-    if (!__node_is_leaf(node)) {
-        fprintf(stderr, "ASSERT: Node is not leaf\n");
-        abort();
-        return(3);
-    }
+    /* Scans read the next leaves ahead, through the block cache */
+    if (__btdisk_has_aio(btree) && btree->cache.size > 0)
+        cursor->readahead = (btreadahead_t *) calloc(1, sizeof(btreadahead_t));
 
-    if (__node_items(node) == 1) {
-        if (__btree_node_count(btree) > 1) {
-            btnode_t *root;
+    return(0);
+}
 
-            if (!__btree_remove_node(btree, node)) {
-                fprintf(stderr, "assert: node not removed\n");
-                abort();
-                return(4);
-            }
+void btree_cursor_close (btree_cursor_t *cursor) {
+    cursor->valid = 0;
 
-            /* Decrease BTree level */
-            root = __btree_fetch_root(btree);
-            if (__node_items(root) == 1) {
-                btnode_t *child;
+    if (cursor->readahead != NULL) {
+        __btcursor_lock(cursor);
+        __btreadahead_drain(cursor->btree, cursor->readahead);
+        pthread_rwlock_unlock(&(cursor->btree->lock));
 
-                child = __btnode_fetch_twig(btree, root, 0);
-                btree->root = child;
-                __btree_super(btree)->sb_height--;
-                __btree_super(btree)->sb_node_count--;
-                __btnode_remove(btree, root);
-                __btnode_release(btree, child);
-            } else {
-                __btnode_release(btree, root);
-            }
-        } else {
-            __leaf_remove(btree, node, 0);
-            __btnode_release(btree, node);
-        }
+        free(cursor->readahead);
+        cursor->readahead = NULL;
+    }
 
-        return(0);
+    if (cursor->leaf != NULL) {
+        free(cursor->leaf->data);
+        __btnode_destroy(cursor->leaf);
+        cursor->leaf = NULL;
     }
 
-    /* TODO ALL THE TWIG UPDATES ARE WRONG
-     * - leaf_last_key() before remove is not a good idea.
-     */
-    __btree_twigs_remove_update(btree, node, place.index);
-    __leaf_remove(btree, node, place.index);
+    if (cursor->key != NULL) {
+        free(cursor->key);
+        cursor->key = NULL;
+    }
 
-    __btnode_release(btree, node);
+    if (cursor->value != NULL) {
+        free(cursor->value);
+        cursor->value = NULL;
+        cursor->value_size = 0;
+    }
+}
 
-    return(0);
+int btree_cursor_seek (btree_cursor_t *cursor,
+                       const void *key)
+{
+    __btcursor_lock(cursor);
+    return(__btcursor_unlock(cursor, __btcursor_seek(cursor, key)));
 }
 
-uint32_t btree_lookup (btree_t *btree,
-                         const void *key,
-                         void *buffer,
-                         uint32_t size)
+int btree_cursor_first (btree_cursor_t *cursor) {
+    __btcursor_lock(cursor);
+    return(__btcursor_unlock(cursor, __btcursor_edge(cursor, 0)));
+}
+
+int btree_cursor_last (btree_cursor_t *cursor) {
+    __btcursor_lock(cursor);
+    return(__btcursor_unlock(cursor, __btcursor_edge(cursor, 1)));
+}
+
+int btree_cursor_next (btree_cursor_t *cursor) {
+    return(__btcursor_advance(cursor, 1));
+}
+
+int btree_cursor_prev (btree_cursor_t *cursor) {
+    return(__btcursor_advance(cursor, -1));
+}
+
+const void *btree_cursor_key (btree_cursor_t *cursor) {
+    if (!cursor->valid)
+        return(NULL);
+
+    if (__btree_is_coded(cursor->btree)) {
+        __leaf_coded_key(cursor->btree, __btcursor_leaf(cursor),
+                         __btcursor_index(cursor), cursor->key);
+        return(cursor->key);
+    }
+
+    if (__btree_is_varkey(cursor->btree)) {
+        return(__item_varkey(cursor->btree, __btcursor_leaf(cursor),
+                             __btcursor_index(cursor)));
+    }
+
+    return(__leaf_key(cursor->btree, __btcursor_leaf(cursor),
+                      __btcursor_index(cursor)));
+}
+
+/* Blob values are read into the cursor buffer, valid until the next call.
+ * The blob of the copy is gone if a writer ran since the move, the item
+ * is looked up again.
+ */
+const void *btree_cursor_value (btree_cursor_t *cursor,
+                                uint32_t *size)
 {
+    btree_t *btree = cursor->btree;
     btnode_place_t place;
+    const void *value;
     btnode_t *node;
-    uint32_t x;
+    uint32_t index;
 
-    if ((node = __btree_lookup_leaf(btree, key, &place)) == NULL)
-        return(0);
+    if (!cursor->valid)
+        return(NULL);
 
-    if (!place.found) {
-        __btnode_release(btree, node);
+    node = __btcursor_leaf(cursor);
+    index = __btcursor_index(cursor);
+
+    if (!__item_is_blob(btree, node, index)) {
+        if (size != NULL)
+            *size = __item_value_size(btree, node, index);
+        return(__item_value(btree, node, index));
+    }
+
+    pthread_rwlock_rdlock(&(btree->lock));
+    if (cursor->version == btree->version) {
+        value = __btcursor_value_copy(cursor, node, index, size);
+    } else {
+        node = __btpath_lookup(btree, &(cursor->path), btree_cursor_key(cursor), &place);
+        value = NULL;
+        if (node != NULL && place.found)
+            value = __btcursor_value_copy(cursor, node, place.index, size);
+        __btpath_release(btree, &(cursor->path));
+    }
+    pthread_rwlock_unlock(&(btree->lock));
+
+    return(value);
+}
+
+/* Value size, with no blob read */
+uint32_t btree_cursor_value_size (btree_cursor_t *cursor) {
+    if (!cursor->valid)
         return(0);
+
+    return(__item_data_size(cursor->btree, __btcursor_leaf(cursor),
+                            __btcursor_index(cursor)));
+}
+
+static int __btree_range (btree_t *btree,
+                          const void *key_lo,
+                          const void *key_hi,
+                          btree_range_t func,
+                          void *user_data,
+                          int values)
+{
+    btree_cursor_t cursor;
+    const void *value;
+    const void *key;
+    uint32_t size;
+    int ret = 0;
+    int err;
+
+    if (btree_cursor_open(&cursor, btree))
+        return(-1);
+
+    if (key_lo != NULL)
+        err = btree_cursor_seek(&cursor, key_lo);
+    else
+        err = btree_cursor_first(&cursor);
+
+    while (err == 0) {
+        key = btree_cursor_key(&cursor);
+        if (key_hi != NULL && btree->keycmp(btree->user_data, key, key_hi) >= 0)
+            break;
+
+        if (values) {
+            if ((value = btree_cursor_value(&cursor, &size)) == NULL) {
+                err = -1;
+                break;
+            }
+        } else {
+            value = NULL;
+            size = btree_cursor_value_size(&cursor);
+        }
+
+        if ((ret = func(user_data, key, value, size)) != 0)
+            break;
+
+        err = btree_cursor_next(&cursor);
     }
 
-    x = (size > place.size) ? place.size : size;
-    memcpy(buffer, place.value, x);
+    btree_cursor_close(&cursor);
 
-    __btnode_release(btree, node);
-    return(x);
+    /* Scan I/O error, or the value returned by the stopping callback */
+    return((err < 0) ? err : ret);
+}
+
+int btree_range (btree_t *btree,
+                 const void *key_lo,
+                 const void *key_hi,
+                 btree_range_t func,
+                 void *user_data)
+{
+    return(__btree_range(btree, key_lo, key_hi, func, user_data, 1));
+}
+
+/* Key-only scan, blob values are never read */
+int btree_range_keys (btree_t *btree,
+                      const void *key_lo,
+                      const void *key_hi,
+                      btree_range_t func,
+                      void *user_data)
+{
+    return(__btree_range(btree, key_lo, key_hi, func, user_data, 0));
 }
 
 #ifdef __BTREE_DEBUG
@@ -2255,8 +7539,13 @@ void btree_debug (btree_t *btree,
     printf(" - Nodes:  %"PRIu64"\n", __btree_node_count(btree));
     printf(" - Stored: %"PRIu64"\n", __btree_stored_size(btree));
 
+    if (__btree_is_null(btree))
+        return;
+
+    pthread_rwlock_rdlock(&(btree->lock));
     node = __btree_fetch_root(btree);
     __btree_debug(btree, node, key_debug, data_debug);
     __btnode_release(btree, node);
+    pthread_rwlock_unlock(&(btree->lock));
 }
 #endif /* !__BTREE_DEBUG */
@@ -1,13 +1,20 @@
 #ifndef _BTREE_H_
 #define _BTREE_H_
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 typedef struct btnode btnode_t;
+typedef struct btwal btwal_t;
+typedef struct btreadahead btreadahead_t;
+typedef struct btspace btspace_t;
+typedef struct btstats btstats_t;
+typedef struct btflusher btflusher_t;
 
 typedef struct btdisk btdisk_t;
 
+/* append() returns the offset the data starts at, the disk end if empty */
 typedef uint64_t (*btdisk_append_t) (btdisk_t *disk,
                                      const void *data,
                                      uint32_t size);
@@ -26,7 +33,35 @@ typedef uint32_t (*btdisk_read_t)   (btdisk_t *disk,
 typedef uint32_t (*btdisk_crc_t)    (btdisk_t *disk,
                                      const void *data,
                                      uint32_t size);
+typedef int      (*btdisk_sync_t)   (btdisk_t *disk);
+typedef const void *(*btdisk_map_t) (btdisk_t *disk,
+                                     uint64_t offset,
+                                     uint32_t size);
+
+/* Asynchronous block I/O request.
+ * submit() queues 'count' requests, waiting for room in the device queue
+ * if needed, non-zero if none could be queued. complete() waits until
+ * all of them are done, non-zero if any of them is short.
+ * The tree syncs the dirty children of a twig as one batch, and cursors
+ * keep the reads of the next leaves in flight.
+ */
+typedef struct btdisk_aio {
+    void *   buffer;                /* Data to write, or buffer to read */
+    uint64_t offset;                /* Disk offset */
+    uint32_t size;                  /* Request size */
+    uint32_t result;                /* Bytes transferred, on completion */
+    uint8_t  write;                 /* Write request, read if zero */
+    uint8_t  done;                  /* Completed (driver owned) */
+} btdisk_aio_t;
+
+typedef int      (*btdisk_aio_op_t) (btdisk_t *disk,
+                                     btdisk_aio_t *aio,
+                                     uint32_t count);
 
+/* Compression callbacks get the btree user data.
+ * compress() returns the compressed size, 0 if the block doesn't shrink,
+ * 'dst' is as large as the block. decompress() returns the block size.
+ */
 typedef uint32_t (*decompress_t)  (void *user_data,
                                    void *dst,
                                    const void *src,
@@ -43,34 +78,117 @@ typedef void (*memcopy_t)         (void *user_data,
 typedef int (*compare_t)          (void *user_data,
                                    const void *a,
                                    const void *b);
+typedef uint32_t (*keysize_t)     (void *user_data,
+                                   const void *key);
 
 struct btdisk {
     btdisk_append_t append;         /* Disk Append Function */
     btdisk_erase_t  erase;          /* Disk Erase Function */
     btdisk_write_t  write;          /* Disk Write Function */
     btdisk_read_t   read;           /* Disk Read Function */
+    btdisk_sync_t   sync;           /* Disk Sync, fsync() (NULL if unused) */
+    btdisk_map_t    map;            /* Block in a mapping, read-only, valid
+                                       until close (NULL if unused) */
+    btdisk_aio_op_t submit;         /* Queue async I/O (NULL if unused) */
+    btdisk_aio_op_t complete;       /* Wait async I/O (NULL if unused) */
 
-    btdisk_crc_t    crc_pointer;    /* CRC Pointer */
-    btdisk_crc_t    crc_block;      /* CRC Block */
+    btdisk_crc_t    crc_pointer;    /* CRC Pointer (NULL for CRC32C) */
+    btdisk_crc_t    crc_block;      /* CRC Block (NULL for CRC32C) */
 
-    decompress_t    decompress;
-    compress_t      compress;
+    decompress_t    decompress;     /* Block Decompress (NULL if unused) */
+    compress_t      compress;       /* Block Compress (NULL if unused) */
 
     void *          internal;       /* Disk Internal Data */
 };
 
 typedef struct btcache_node btcache_node_t;
 
+/* Block cache replacement policies.
+ * BTCACHE_2Q keeps blocks seen once in a small FIFO and moves them to the
+ * LRU only when they come back, so a single large scan can't flush the
+ * blocks that are reused. Blocks at or above 'pin_level' are never evicted.
+ */
+typedef enum btcache_type {
+    BTCACHE_LRU = 0,                /* Least recently released out first */
+    BTCACHE_2Q  = 1,                /* Scan resistant 2Q (default) */
+} btcache_type_t;
+
+/* Disk latency, bucket i counts the calls under 2^i usec (and over the
+ * previous bucket), the last one everything slower.
+ */
+#define BTREE_STATS_BUCKETS     (24)
+
+typedef struct btree_stats {
+    uint64_t lookups;               /* Point lookups (batch keys included) */
+    uint64_t inserts;               /* Inserted or replaced items */
+    uint64_t removes;               /* Removed items (ranges included) */
+    uint64_t leaf_splits;
+    uint64_t twig_splits;
+    uint64_t leaf_merges;
+    uint64_t twig_merges;
+    uint64_t cache_hits;            /* Block cache, as btree_cache_stats() */
+    uint64_t cache_misses;
+    uint64_t disk_reads;            /* Read calls (async included) */
+    uint64_t disk_read_bytes;
+    uint64_t disk_writes;           /* Append and write calls */
+    uint64_t disk_write_bytes;
+    uint64_t read_latency[BTREE_STATS_BUCKETS];
+    uint64_t write_latency[BTREE_STATS_BUCKETS];
+    uint64_t items;                 /* Super-Block item count */
+    uint64_t nodes;                 /* Super-Block node count */
+    uint32_t height;                /* Levels, 1 for a single leaf */
+    uint32_t fill;                  /* Average node fill %, estimated */
+} btree_stats_t;
+
+typedef struct btcache_stats {
+    uint64_t hits;                  /* Lookups served from the cache */
+    uint64_t misses;                /* Lookups that went to disk */
+    uint64_t evictions;             /* Blocks dropped to make room */
+    uint32_t used;                  /* Cached blocks */
+    uint32_t pinned;                /* Cached blocks that can't be evicted */
+    uint32_t size;                  /* Max cached blocks */
+} btcache_stats_t;
+
+#define BTCACHE_QUEUE_HOT       (0) /* LRU, blocks seen twice */
+#define BTCACHE_QUEUE_IN        (1) /* FIFO, blocks seen once */
+#define BTCACHE_QUEUE_PINNED    (2) /* Internal levels, never evicted */
+#define BTCACHE_QUEUE_GHOST     (3) /* Recently seen blocknrs, no data */
+#define BTCACHE_QUEUES          (4)
+
 typedef struct btcache {
-    btcache_node_t **table;
-    btcache_node_t * head;
-    uint32_t           used;
-    uint32_t           size;
+    btcache_node_t **table;                     /* Hash, power of two */
+    btcache_node_t * queues[BTCACHE_QUEUES];    /* Queue heads (MRU) */
+    btcache_node_t * free;                      /* Unused nodes */
+    uint32_t         count[BTCACHE_QUEUES];     /* Nodes in each queue */
+    uint32_t         mask;                      /* Hash buckets - 1 */
+    uint32_t         size;                      /* Max cached blocks */
+    btcache_type_t   type;                      /* Replacement policy */
+    uint8_t          pin_level;                 /* Pin from level (0 none) */
+    uint64_t         hits;
+    uint64_t         misses;
+    uint64_t         evictions;
+    pthread_mutex_t  lock;
 } btcache_t;
 
+#define BTREE_MAX_HEIGHT      (32)
+
+/* B*Tree on-disk formats, selected with btree_create() 'format'.
+ * BTREE_FORMAT_VARIABLE is created by btree_varkey_create().
+ */
+#define BTREE_FORMAT_PLAIN          (0)   /* Fixed-size leaf keys */
+#define BTREE_FORMAT_FRONT_CODED    (1)   /* Leaf keys front-coded by run */
+#define BTREE_FORMAT_VARIABLE       (2)   /* Variable-size keys, slotted nodes */
+
+typedef struct btpath {
+    btnode_t *nodes[BTREE_MAX_HEIGHT];  /* Nodes from leaf (1) up to root */
+    uint32_t  index[BTREE_MAX_HEIGHT];  /* Item position in each node */
+    uint8_t   levels;                   /* Root level */
+} btpath_t;
+
 typedef struct btree {
     uint8_t   super[64];          /* B*Tree Super-Block */
     uint64_t  super_offset;       /* B*Tree Super-Offset */
+    uint64_t  anchor_offset;      /* Super-Offset of create/open (home) */
     btcache_t cache;
 
     btdisk_t *disk;               /* B*Tree Disk Driver */
@@ -78,9 +196,27 @@ typedef struct btree {
     memcopy_t prefix_keycpy;      /* Prefix Key from key */
     compare_t prefix_keycmp;      /* Prefix Key compare */
     compare_t keycmp;             /* Key compare */
+    keysize_t keysize;            /* Key size (variable-size keys) */
 
     btnode_t *root;               /* B*Tree Root */
 
+    pthread_rwlock_t lock;        /* Readers share, writers exclusive */
+    pthread_mutex_t  latch;       /* Root load latch */
+
+    uint8_t * zblock;             /* Compression scratch block */
+    uint8_t   readonly;           /* Snapshot, writes are rejected */
+    uint8_t   anchored;           /* Home anchors the last super-block */
+    uint8_t   writer;             /* Write lock holder is running */
+    uint8_t   verify;             /* BTREE_VERIFY_* checks on read */
+    uint8_t   memcmp_keys;        /* Keys ordered as memcmp() */
+    uint32_t  blob_threshold;     /* Values over it go to blobs (0 off) */
+    uint64_t  dirty_leaves;       /* Leaves changed since written */
+    uint64_t  version;            /* Bumped by every write lock holder */
+    btflusher_t * flusher;        /* Background leaf writer (NULL if off) */
+    btwal_t * wal;                /* Write-Ahead Log (NULL if unused) */
+    btspace_t * space;            /* Free-Space Map (NULL if unused) */
+    btstats_t * stats;            /* Operation counters (NULL if off) */
+
     void *    user_data;          /* B*Tree User-Data */
 } btree_t;
 
@@ -102,6 +238,7 @@ int         btree_prefix_create   (btree_t *btree,
                                    uint64_t super_offset,
                                    uint32_t block_size,
                                    uint8_t format,
+                                   uint32_t prefix_size,
                                    uint32_t key_size,
                                    uint32_t btree_magic,
                                    uint16_t node_magic,
@@ -130,10 +267,141 @@ int         btree_prefix_open     (btree_t *btree,
                                    compare_t keycmp,
                                    void *user_data);
 
+int         btree_varkey_create   (btree_t *btree,
+                                   btdisk_t *disk,
+                                   uint32_t cache_size,
+                                   uint64_t super_offset,
+                                   uint32_t block_size,
+                                   uint32_t max_key_size,
+                                   uint32_t btree_magic,
+                                   uint16_t node_magic,
+                                   keysize_t keysize,
+                                   compare_t keycmp,
+                                   void *user_data);
+
+int         btree_varkey_open     (btree_t *btree,
+                                   btdisk_t *disk,
+                                   uint32_t cache_size,
+                                   uint64_t super_offset,
+                                   uint32_t btree_magic,
+                                   uint16_t node_magic,
+                                   keysize_t keysize,
+                                   compare_t keycmp,
+                                   void *user_data);
+
 int         btree_close           (btree_t *btree);
 
+/* Log inserts and removes to 'log', a writer returns once its record is
+ * synced, a whole group of writers shares one sync(). Records after the
+ * last btree_sync() are replayed on open. A checkpoint (btree_sync) runs
+ * in background every 'checkpoint_size' log bytes (0 never) and erase()s
+ * the log range it made useless, erased ranges are never read again.
+ * 'log_offset' (not 0) keeps two 32 byte head slots with the offset of
+ * the first live record, the log append()s from its end on, at or past
+ * 'log_offset' (5 otherwise). Past a torn tail the log goes on from the
+ * end, replay skips it.
+ * Use it with btree_append_only(), a crash during an in-place sync can
+ * leave a tree no log can fix.
+ */
+int         btree_wal_open        (btree_t *btree,
+                                   btdisk_t *log,
+                                   uint64_t log_offset,
+                                   uint64_t checkpoint_size);
+
+/* Blocks are never overwritten: each sync appends the new nodes and a
+ * super-block, btree->super_offset moves to it. The super-block slot of
+ * create/open is not written again, it keeps two anchors to the last
+ * synced super-block instead: open it at that same offset. Every past
+ * btree->super_offset is a snapshot of its commit, a tree opened there
+ * is not anchored (its super_offset must be saved after each sync).
+ */
+int         btree_append_only     (btree_t *btree);
+
+/* Read-only view of the commit whose super-block is at 'super_offset',
+ * the anchored home offset gives the last synced commit.
+ */
+int         btree_snapshot_open   (btree_t *snapshot,
+                                   btree_t *btree,
+                                   uint32_t cache_size,
+                                   uint64_t super_offset);
+
+/* Track free blocks in a bitmap of 'unit' bytes (0 for the block size),
+ * new nodes take freed space near their twig before the disk grows.
+ * Units smaller than the block pack compressed nodes, but fragment.
+ * The map header follows the 64 byte super-block, 128 bytes at
+ * super_offset must be reserved. Persisted by the next sync, space
+ * written before is never reused. Not for append-only trees.
+ */
+int         btree_space_map       (btree_t *btree,
+                                   uint32_t unit);
+
+/* Rewrite every node in key order, the leaves of each twig as one run,
+ * so scans read the disk sequentially. The old blocks are freed.
+ */
+int         btree_compact         (btree_t *btree);
+
+/* Every block read is checked against the crc of its pointer, and the
+ * node crc (nh_crc) of compressed blocks once expanded. BTREE_VERIFY_NODE
+ * checks nh_crc of uncompressed blocks too, a second pass on the node.
+ */
+#define BTREE_VERIFY_NODE     (1 << 0)
+
+void        btree_verify          (btree_t *btree,
+                                   uint8_t flags);
+
+/* Keys (and prefixes) of fixed size are ordered as memcmp() does, the
+ * searches inside a node skip keycmp() and compare 8 bytes at a time.
+ */
+int         btree_memcmp_keys     (btree_t *btree);
+
+/* Values larger than 'threshold' bytes are written to a block of their
+ * own, the leaf keeps a pointer to it. Blobs are read back only when the
+ * value is, a scan of the keys doesn't touch them. Zero (the default)
+ * keeps every value in the leaves. Existing blobs are read either way.
+ * Replayed values are inserted again, set it before btree_wal_open(): a
+ * value that fits no leaf is replayed to a blob anyway.
+ */
+int         btree_blob_setup      (btree_t *btree,
+                                   uint32_t threshold);
+
+int         btree_cache_setup     (btree_t *btree,
+                                   btcache_type_t type,
+                                   uint8_t pin_level);
+void        btree_cache_stats     (btree_t *btree,
+                                   btcache_stats_t *stats);
+
+/* Counters are on from create/open, shared by every thread. 'stripes'
+ * gives threads their own (cache-line) counters, up to that many, so
+ * concurrent readers don't contend on them. Zero turns stats off.
+ */
+int         btree_stats_setup     (btree_t *btree,
+                                   uint32_t stripes);
+void        btree_stats           (btree_t *btree,
+                                   btree_stats_t *stats);
+
 int         btree_sync            (btree_t *btree);
 
+/* Write dirty leaves in background once they take more than 'dirty_bytes'
+ * (in blocks), a few leaves per lock hold, down to half the budget. Writers
+ * finding twice the budget write a batch themselves. btree_sync() has only
+ * the rest of the tree to write. Zero stops the flusher.
+ * Leaves hot enough to change between flushes are written more than once.
+ * Like the log, use it with btree_append_only(): leaves rewritten in place
+ * before a sync break the last synced tree.
+ */
+int         btree_flusher_setup   (btree_t *btree,
+                                   uint64_t dirty_bytes);
+
+typedef int (*btree_bulk_next_t)  (void *user_data,
+                                   const void **key,
+                                   const void **value,
+                                   uint32_t *size);
+
+int         btree_bulk_load       (btree_t *btree,
+                                   btree_bulk_next_t next,
+                                   void *user_data,
+                                   uint8_t fill_factor);
+
 int         btree_insert          (btree_t *btree,
                                    const void *key,
                                    const void *value,
@@ -141,6 +409,25 @@ int         btree_insert          (btree_t *btree,
 int         btree_remove          (btree_t *btree,
                                    const void *key);
 
+/* Remove the keys in [key_lo, key_hi), NULL bounds are open. Sub-trees
+ * inside the range are dropped whole and their blocks erased, only the
+ * nodes on the bounds are rebalanced.
+ */
+int         btree_remove_range    (btree_t *btree,
+                                   const void *key_lo,
+                                   const void *key_hi);
+
+int         btree_insert_batch    (btree_t *btree,
+                                   uint32_t count,
+                                   const void **keys,
+                                   const void **values,
+                                   const uint32_t *sizes);
+uint32_t    btree_lookup_batch    (btree_t *btree,
+                                   uint32_t count,
+                                   const void **keys,
+                                   void **buffers,
+                                   uint32_t *sizes);
+
 uint32_t    btree_contains        (btree_t *btree,
                                    const void *key);
 
@@ -149,6 +436,60 @@ uint32_t    btree_lookup          (btree_t *btree,
                                    void *buffer,
                                    uint32_t bufsize);
 
+typedef struct btree_cursor {
+    btree_t *       btree;        /* B*Tree to iterate */
+    btpath_t        path;         /* Root to Leaf path, while moving */
+    btnode_t *      leaf;         /* Copy of the leaf of the current item */
+    uint8_t *       key;          /* Key buffer, for front-coded leaves */
+    btreadahead_t * readahead;    /* Next leaves being read (NULL if not) */
+    uint8_t *       value;        /* Value buffer, for blob values */
+    uint32_t        value_size;   /* Value buffer size */
+    uint32_t        index;        /* Current item in the leaf copy */
+    uint64_t        version;      /* Tree version of the leaf copy */
+    int             valid;        /* Cursor is on an item */
+} btree_cursor_t;
+
+typedef int (*btree_range_t)      (void *user_data,
+                                   const void *key,
+                                   const void *value,
+                                   uint32_t size);
+
+/* A cursor holds no lock between calls. A move takes the read lock just
+ * to copy the leaf it lands on, the items of that leaf are then walked
+ * as they were, and the next leaf is looked up again from the last key.
+ * The thread owning the cursor may insert and remove while it is open,
+ * btree_range() callbacks too. Keys and values are valid until the next
+ * move, a removed blob value is read as NULL.
+ */
+int         btree_cursor_open     (btree_cursor_t *cursor,
+                                   btree_t *btree);
+void        btree_cursor_close    (btree_cursor_t *cursor);
+
+int         btree_cursor_seek     (btree_cursor_t *cursor,
+                                   const void *key);
+int         btree_cursor_first    (btree_cursor_t *cursor);
+int         btree_cursor_last     (btree_cursor_t *cursor);
+int         btree_cursor_next     (btree_cursor_t *cursor);
+int         btree_cursor_prev     (btree_cursor_t *cursor);
+
+const void *btree_cursor_key      (btree_cursor_t *cursor);
+const void *btree_cursor_value    (btree_cursor_t *cursor,
+                                   uint32_t *size);
+uint32_t    btree_cursor_value_size (btree_cursor_t *cursor);
+
+int         btree_range           (btree_t *btree,
+                                   const void *key_lo,
+                                   const void *key_hi,
+                                   btree_range_t func,
+                                   void *user_data);
+
+/* As btree_range(), 'func' gets a NULL value and the value size */
+int         btree_range_keys      (btree_t *btree,
+                                   const void *key_lo,
+                                   const void *key_hi,
+                                   btree_range_t func,
+                                   void *user_data);
+
 #ifdef __BTREE_DEBUG
 typedef void (*btree_data_debug_t) (void *user_data,
                                     const void *data,
@@ -1,6 +1,7 @@
 #define _XOPEN_SOURCE 500
 //#define __BTREE_DEBUG
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,6 +9,9 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "btdisk_mmap.h"
+#include "btcodec.h"
+#include "btcrc.h"
 #include "btree.h"
 
 #if 1
@@ -25,6 +29,24 @@
 #endif
 
 #define TEST_WRITE      1
+#define TEST_COMPRESS   1
+#define TEST_FORMAT     BTREE_FORMAT_FRONT_CODED
+#define TEST_VARKEY     1
+#define TEST_SNAPSHOT   1
+#define TEST_WAL        1
+#define TEST_MMAP       1
+#define TEST_AIO        1
+#define TEST_SPACE      1
+#define TEST_BLOB       1
+#define TEST_FLUSHER    1
+
+#define __VARKEY_BLOCKSZ    (1024)
+#define __VARKEY_MAXSZ      (64)
+
+#define __BLOB_THRESHOLD    (64)
+#define __BLOB_MAXSZ        (__BLOCKSZ * 4)
+
+#define __WAL_OFFSET        (512)
 
 struct btdisk_data {
     uint64_t offset;
@@ -44,6 +66,19 @@ static int __keycmp (void *user_data,
     return(memcmp(a, b, __KEYSZ));
 }
 
+static uint32_t __varkey_size (void *user_data,
+                               const void *key)
+{
+    return(strlen((const char *)key) + 1);
+}
+
+static int __varkey_cmp (void *user_data,
+                         const void *a,
+                         const void *b)
+{
+    return(strcmp((const char *)a, (const char *)b));
+}
+
 #ifdef __BTREE_DEBUG
 static void __data_debug (void *user_data, const void *body, uint32_t size) {
     char buffer[256];
@@ -88,8 +123,9 @@ static uint64_t __btdisk_write (btdisk_t *disk,
     struct btdisk_data *dd = (struct btdisk_data *)disk->internal;
     ssize_t wr;
 
-    if (block_offset == 0)
-        block_offset = dd->offset;
+    /* New block, or (compressed) block grown over its slot */
+    if (block_offset == 0 || size > block_size)
+        return(__btdisk_append(disk, data, size));
 
     printf("__btdisk_write: %u - %"PRIu64"\n", size, block_offset);
     if ((wr = pwrite(dd->fd, data, size, block_offset)) != size) {
@@ -97,7 +133,6 @@ static uint64_t __btdisk_write (btdisk_t *disk,
         printf(" - Return Code %ld offset %"PRIu64" size %u\n",
                wr, block_offset, size);
     }
-    dd->offset += size;
 
     return(block_offset);
 }
@@ -115,6 +150,7 @@ static uint32_t __btdisk_read (btdisk_t *disk,
         perror("pread()");
         printf(" - Return Code %ld offset %"PRIu64" size %u\n",
                rd, offset, size);
+        return((rd < 0) ? 0 : rd);
     }
 
     return(size);
@@ -173,6 +209,46 @@ static void __test_lookup (btree_t *btree,
     printf("[TIME] Lookup %.5f\n", (etime - stime) / 1000000.0f);
 }
 
+static void __test_lookup_batch (btree_t *btree,
+                                 uint32_t from,
+                                 uint32_t to)
+{
+    char lkvalues[__NKEYS][__VALUESZ + 1];
+    char keys[__NKEYS][__KEYSZ + 1];
+    const void *pkeys[__NKEYS];
+    void *buffers[__NKEYS];
+    uint32_t sizes[__NKEYS];
+    char value[__VALUESZ + 1];
+    uint64_t stime, etime;
+    uint32_t count;
+    uint32_t size;
+    uint32_t i, n;
+
+    printf("Lookup Batch from %u to %u\n", from, to);
+    stime = time_micros();
+
+    /* Keys in reverse order, the batch sorts them */
+    for (n = 0, i = to; i > from; ++n) {
+        snprintf(keys[n], __KEYSZ + 1, "K-%08d", --i);
+        pkeys[n] = keys[n];
+        buffers[n] = lkvalues[n];
+        sizes[n] = __VALUESZ;
+    }
+
+    if ((count = btree_lookup_batch(btree, n, pkeys, buffers, sizes)) != n)
+        printf(" - Lookup Batch Failed %u found, expected %u\n", count, n);
+
+    for (n = 0, i = to; i > from; ++n) {
+        --i;
+        size = snprintf(value, __VALUESZ + 1, "V-%08d-%04d", i << 2, i);
+        if (sizes[n] != size || memcmp(value, lkvalues[n], size))
+            printf(" - Lookup Batch something wrong: %s %u %u\n", keys[n], size, sizes[n]);
+    }
+
+    etime = time_micros();
+    printf("[TIME] Lookup Batch %.5f\n", (etime - stime) / 1000000.0f);
+}
+
 static void __test_insert (btree_t *btree,
                            uint32_t from,
                            uint32_t to,
@@ -224,6 +300,194 @@ static void __test_remove (btree_t *btree,
     printf("[TIME] Remove %.5f\n", (etime - stime) / 1000000.0f);
 }
 
+static int __range_count (void *user_data,
+                          const void *key,
+                          const void *value,
+                          uint32_t size)
+{
+    (*((uint32_t *)user_data))++;
+    return(0);
+}
+
+static void __test_remove_range (btree_t *btree,
+                                 uint32_t from,
+                                 uint32_t to)
+{
+    char key_lo[__KEYSZ + 1];
+    char key_hi[__KEYSZ + 1];
+    uint64_t stime, etime;
+    uint32_t count;
+
+    printf("Remove Range from %u to %u\n", from, to);
+    stime = time_micros();
+
+    snprintf(key_lo, __KEYSZ + 1, "K-%08d", from);
+    snprintf(key_hi, __KEYSZ + 1, "K-%08d", to);
+    if (btree_remove_range(btree, key_lo, key_hi))
+        printf(" - Remove Range Failed\n");
+
+    count = 0;
+    if (btree_range(btree, key_lo, key_hi, __range_count, &count) || count != 0)
+        printf(" - Remove Range left %u items\n", count);
+
+    etime = time_micros();
+    printf("[TIME] Remove Range %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static void __test_scan (btree_t *btree,
+                         uint32_t from,
+                         uint32_t to)
+{
+    char value[__VALUESZ + 1];
+    char key[__KEYSZ + 1];
+    char key_hi[__KEYSZ + 1];
+    btree_cursor_t cursor;
+    uint64_t stime, etime;
+    const void *lkvalue;
+    uint32_t lksize, size;
+    uint32_t count;
+    uint32_t i;
+
+    printf("Scan from %u to %u\n", from, to);
+    stime = time_micros();
+
+    /* Forward scan, every key in order */
+    i = from;
+    snprintf(key, __KEYSZ + 1, "K-%08d", from);
+    btree_cursor_open(&cursor, btree);
+    if (!btree_cursor_seek(&cursor, key)) {
+        do {
+            snprintf(key, __KEYSZ + 1, "K-%08d", i);
+            size = snprintf(value, __VALUESZ + 1, "V-%08d-%04d", i << 2, i);
+            lkvalue = btree_cursor_value(&cursor, &lksize);
+            if (memcmp(btree_cursor_key(&cursor), key, __KEYSZ) ||
+                lksize != size || memcmp(value, lkvalue, size))
+            {
+                printf(" - Scan something wrong: %s %u %u\n", key, size, lksize);
+                break;
+            }
+        } while (++i < to && !btree_cursor_next(&cursor));
+    }
+    btree_cursor_close(&cursor);
+
+    if (i != to)
+        printf(" - Scan Failed at %u\n", i);
+
+    /* Range [from, to) with callback */
+    count = 0;
+    snprintf(key, __KEYSZ + 1, "K-%08d", from);
+    snprintf(key_hi, __KEYSZ + 1, "K-%08d", to);
+    if (btree_range(btree, key, key_hi, __range_count, &count) || count != (to - from))
+        printf(" - Range Failed %u items, expected %u\n", count, to - from);
+
+    etime = time_micros();
+    printf("[TIME] Scan %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static int __range_remove (void *user_data,
+                           const void *key,
+                           const void *value,
+                           uint32_t size)
+{
+    return(btree_remove((btree_t *)user_data, key));
+}
+
+/* Writes from the thread that has a cursor open, and from range callbacks */
+static void __test_cursor_write (btree_t *btree,
+                                 uint32_t from,
+                                 uint32_t to)
+{
+    char key[__KEYSZ + 1];
+    char key_hi[__KEYSZ + 1];
+    btree_cursor_t cursor;
+    uint64_t stime, etime;
+    uint32_t count;
+    uint32_t i;
+
+    printf("Cursor Write from %u to %u\n", from, to);
+    stime = time_micros();
+
+    /* Remove the odd keys behind the cursor, the scan goes on */
+    i = from;
+    snprintf(key, __KEYSZ + 1, "K-%08d", from);
+    btree_cursor_open(&cursor, btree);
+    if (!btree_cursor_seek(&cursor, key)) {
+        do {
+            snprintf(key, __KEYSZ + 1, "K-%08d", i);
+            if (memcmp(btree_cursor_key(&cursor), key, __KEYSZ)) {
+                printf(" - Cursor Write something wrong: %s\n", key);
+                break;
+            }
+
+            if ((i & 1) && btree_remove(btree, key)) {
+                printf(" - Cursor Remove Failed - %s\n", key);
+                break;
+            }
+        } while (++i < to && !btree_cursor_next(&cursor));
+    }
+    btree_cursor_close(&cursor);
+
+    if (i != to)
+        printf(" - Cursor Write Failed at %u\n", i);
+
+    /* ...and the even ones from the range callback */
+    snprintf(key, __KEYSZ + 1, "K-%08d", from);
+    snprintf(key_hi, __KEYSZ + 1, "K-%08d", to);
+    if (btree_range(btree, key, key_hi, __range_remove, btree))
+        printf(" - Range Remove Failed\n");
+
+    count = 0;
+    if (btree_range(btree, key, key_hi, __range_count, &count) || count != 0)
+        printf(" - Cursor Write left %u items\n", count);
+
+    etime = time_micros();
+    printf("[TIME] Cursor Write %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+struct bulk_data {
+    char value[__VALUESZ + 1];
+    char key[__KEYSZ + 1];
+    uint32_t next;
+    uint32_t to;
+};
+
+static int __bulk_next (void *user_data,
+                        const void **key,
+                        const void **value,
+                        uint32_t *size)
+{
+    struct bulk_data *bulk = (struct bulk_data *)user_data;
+    uint32_t i;
+
+    if ((i = bulk->next++) >= bulk->to)
+        return(1);
+
+    snprintf(bulk->key, __KEYSZ + 1, "K-%08d", i);
+    *size = snprintf(bulk->value, __VALUESZ + 1, "V-%08d-%04d", i << 2, i);
+    *key = bulk->key;
+    *value = bulk->value;
+    return(0);
+}
+
+static void __test_bulk_load (btree_t *btree,
+                              uint32_t to,
+                              uint8_t fill_factor)
+{
+    struct bulk_data bulk;
+    uint64_t stime, etime;
+
+    printf("Bulk Load from 0 to %u Fill %u%%\n", to, fill_factor);
+    stime = time_micros();
+
+    bulk.next = 0;
+    bulk.to = to;
+    if (btree_bulk_load(btree, __bulk_next, &bulk, fill_factor))
+        printf(" - Failed\n");
+
+    etime = time_micros();
+    printf("[TIME] Bulk Load %.5f\n", (etime - stime) / 1000000.0f);
+}
+
 static void __test_sync (btree_t *btree) {
     uint64_t stime, etime;
 
@@ -237,6 +501,883 @@ static void __test_sync (btree_t *btree) {
     printf("[TIME] Sync %.5f\n", (etime - stime) / 1000000.0f);
 }
 
+/* Path-like keys, of different size and with long shared prefixes */
+static void __varkey (char *key, uint32_t i) {
+    static const char *dirs[] = {
+        "/usr/share/doc",
+        "/usr/share/locale/it/LC_MESSAGES",
+        "/var/log",
+        "/home/user/src/carthage/btree",
+    };
+
+    snprintf(key, __VARKEY_MAXSZ, "%s/%x.%s", dirs[(i >> 1) & 3], i, (i & 8) ? "txt" : "c");
+}
+
+static void __test_varkey (btdisk_t *disk,
+                           struct btdisk_data *data)
+{
+    char lkvalue[__VALUESZ + 1];
+    char value[__VALUESZ + 1];
+    char key[__VARKEY_MAXSZ];
+    uint64_t super_offset;
+    uint64_t stime, etime;
+    btree_t btree;
+    uint32_t count;
+    uint32_t size;
+    uint32_t i;
+
+    printf("Variable-Size Keys %u\n", __NKEYS);
+    stime = time_micros();
+
+    data->offset = 512U + 64U;
+    super_offset = data->offset - 64U;
+    if (btree_varkey_create(&btree, disk, __CACHESZ, super_offset,
+                            __VARKEY_BLOCKSZ, __VARKEY_MAXSZ,
+                            0xf5bc2eac, 0xb4e6,
+                            __varkey_size, __varkey_cmp, NULL))
+    {
+        printf(" - btree_varkey_create(): Failed\n");
+        return;
+    }
+
+    for (i = 0; i < __NKEYS; ++i) {
+        __varkey(key, i);
+        size = snprintf(value, __VALUESZ + 1, "V-%08d-%04d", i << 2, i);
+        if (btree_insert(&btree, key, value, size))
+            printf(" - Insert Failed %s\n", key);
+    }
+
+    /* Remove half of the keys, then look them all up */
+    for (i = 0; i < __NKEYS; i += 2) {
+        __varkey(key, i);
+        if (btree_remove(&btree, key))
+            printf(" - Remove Failed %s\n", key);
+    }
+
+    btree_sync(&btree);
+    super_offset = btree.super_offset;
+    btree_close(&btree);
+
+    if (btree_varkey_open(&btree, disk, __CACHESZ, super_offset,
+                          0xf5bc2eac, 0xb4e6,
+                          __varkey_size, __varkey_cmp, NULL))
+    {
+        printf(" - btree_varkey_open(): Failed\n");
+        return;
+    }
+
+    for (i = 0; i < __NKEYS; ++i) {
+        __varkey(key, i);
+        size = snprintf(value, __VALUESZ + 1, "V-%08d-%04d", i << 2, i);
+        count = btree_lookup(&btree, key, lkvalue, __VALUESZ);
+        if ((i & 1) && (count != size || memcmp(value, lkvalue, size)))
+            printf(" - Lookup Failed %s\n", key);
+        else if (!(i & 1) && count != 0)
+            printf(" - Lookup Removed Key %s\n", key);
+    }
+
+    /* Every key under the same directory */
+    count = 0;
+    if (btree_range(&btree, "/var/log/", "/var/log0", __range_count, &count) ||
+        count != (__NKEYS >> 3))
+    {
+        printf(" - Range Failed %u items\n", count);
+    }
+
+    btree_close(&btree);
+
+    etime = time_micros();
+    printf("[TIME] Variable-Size Keys %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static void __test_snapshot (btdisk_t *disk, struct btdisk_data *data) {
+    char key[__KEYSZ + 1];
+    uint64_t snap_offset;
+    uint64_t home_offset;
+    uint64_t stime, etime;
+    btree_t snapshot;
+    btree_t btree;
+
+    printf("Append-Only Snapshot %u\n", __NKEYS);
+    stime = time_micros();
+
+    data->offset = 512U + 64U;
+    home_offset = data->offset - 64U;
+    if (btree_create(&btree, disk, __CACHESZ, home_offset,
+                     __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                     0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_create(): Failed\n");
+        return;
+    }
+
+    if (btree_append_only(&btree))
+        printf(" - btree_append_only(): Failed\n");
+
+    /* First commit, the snapshot */
+    __test_insert(&btree, 0, __NKEYS >> 1, 1);
+    btree_sync(&btree);
+    snap_offset = btree.super_offset;
+
+    /* Second commit, on top of the first */
+    __test_remove(&btree, 0, 10, 1);
+    __test_insert(&btree, __NKEYS >> 1, __NKEYS, 1);
+    btree_sync(&btree);
+
+    if (btree_snapshot_open(&snapshot, &btree, __CACHESZ, snap_offset)) {
+        printf(" - btree_snapshot_open(): Failed\n");
+        btree_close(&btree);
+        return;
+    }
+
+    /* The snapshot sees only the first commit */
+    __test_lookup(&snapshot, 0, __NKEYS >> 1, 1);
+    snprintf(key, __KEYSZ + 1, "K-%08d", __NKEYS >> 1);
+    if (btree_contains(&snapshot, key))
+        printf(" - Snapshot sees a later commit %s\n", key);
+    if (btree_insert(&snapshot, key, key, __KEYSZ) != -1)
+        printf(" - Snapshot Insert not rejected\n");
+
+    /* Writes keep going on the tree */
+    __test_insert(&btree, __NKEYS, __NKEYS + 10, 1);
+    __test_lookup(&btree, 10, __NKEYS + 10, 1);
+    __test_lookup(&snapshot, 0, __NKEYS >> 1, 1);
+
+    btree_close(&snapshot);
+    btree_close(&btree);
+
+    /* The home offset anchors the last commit, the close */
+    if (btree_open(&btree, disk, __CACHESZ, home_offset,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed at home\n");
+        return;
+    }
+
+    __test_lookup(&btree, 10, __NKEYS + 10, 1);
+    snprintf(key, __KEYSZ + 1, "K-%08d", 0);
+    if (btree_contains(&btree, key))
+        printf(" - Anchor opened an old commit %s\n", key);
+
+    /* Older super-blocks are still snapshots */
+    if (btree_snapshot_open(&snapshot, &btree, __CACHESZ, snap_offset)) {
+        printf(" - btree_snapshot_open(): Failed after reopen\n");
+    } else {
+        __test_lookup(&snapshot, 0, __NKEYS >> 1, 1);
+        btree_close(&snapshot);
+    }
+
+    /* One more commit moves the anchor again */
+    __test_remove(&btree, __NKEYS, __NKEYS + 10, 1);
+    btree_close(&btree);
+
+    if (btree_open(&btree, disk, __CACHESZ, home_offset,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed at home\n");
+        return;
+    }
+
+    snprintf(key, __KEYSZ + 1, "K-%08d", __NKEYS);
+    if (btree_contains(&btree, key))
+        printf(" - Anchor opened an old commit %s\n", key);
+    __test_lookup(&btree, 10, __NKEYS, 1);
+    btree_close(&btree);
+
+    etime = time_micros();
+    printf("[TIME] Append-Only Snapshot %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static int __btdisk_sync (btdisk_t *disk) {
+    struct btdisk_data *dd = (struct btdisk_data *)disk->internal;
+    return(fsync(dd->fd));
+}
+
+/* Erased log ranges read back as zeros, nothing there to replay */
+static uint64_t __btdisk_log_erase (btdisk_t *disk,
+                                  uint64_t offset,
+                                  uint32_t size)
+{
+    struct btdisk_data *dd = (struct btdisk_data *)disk->internal;
+    uint8_t zero[512];
+    uint32_t n;
+    uint32_t i;
+
+    memset(zero, 0, sizeof(zero));
+    for (i = 0; i < size; i += n) {
+        n = (size - i < sizeof(zero)) ? (size - i) : sizeof(zero);
+        if (pwrite(dd->fd, zero, n, offset + i) != n)
+            perror("pwrite()");
+    }
+
+    return(offset);
+}
+
+/* The child died before close, go on from where it left the files */
+static int __test_crashed (pid_t pid,
+                           struct btdisk_data *data,
+                           struct btdisk_data *log_data)
+{
+    if (pid < 0 || waitpid(pid, NULL, 0) != pid) {
+        perror("fork()");
+        return(-1);
+    }
+
+    data->offset = lseek(data->fd, 0, SEEK_END);
+    log_data->offset = lseek(log_data->fd, 0, SEEK_END);
+    return(0);
+}
+
+static void __test_wal (btdisk_t *disk, struct btdisk_data *data) {
+    struct btdisk_data log_data;
+    uint64_t stime, etime;
+    btree_t btree;
+    btdisk_t log;
+    pid_t pid;
+
+    printf("Write-Ahead Log %u\n", __NKEYS);
+    stime = time_micros();
+
+    memcpy(&log, disk, sizeof(btdisk_t));
+    log.sync = __btdisk_sync;
+    log.erase = __btdisk_log_erase;
+    log.internal = &log_data;
+    log_data.offset = __WAL_OFFSET;
+    if ((log_data.fd = open("test-wal.log", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return;
+    }
+
+    data->offset = 512U + 64U;
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        if (btree_create(&btree, disk, __CACHESZ, data->offset - 64U,
+                         __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                         0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+        {
+            printf(" - btree_create(): Failed\n");
+            _exit(1);
+        }
+
+        btree_append_only(&btree);
+        if (btree_wal_open(&btree, &log, __WAL_OFFSET, 0))
+            printf(" - btree_wal_open(): Failed\n");
+
+        /* Checkpoint the first half */
+        __test_insert(&btree, 0, __NKEYS >> 1, 1);
+        btree_sync(&btree);
+
+        /* Only on the log, then a crash in the middle of a record */
+        __test_insert(&btree, __NKEYS >> 1, __NKEYS, 1);
+        __test_remove(&btree, 0, 10, 1);
+        __test_remove_range(&btree, 10, 20);
+        log.append(&log, "torn", 4);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    if (__test_crashed(pid, data, &log_data)) {
+        close(log_data.fd);
+        return;
+    }
+
+    /* Replay up to the torn record, the log goes on past it */
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        if (btree_open(&btree, disk, __CACHESZ, 512U,
+                       0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+        {
+            printf(" - btree_open(): Failed\n");
+            _exit(1);
+        }
+
+        if (btree_wal_open(&btree, &log, __WAL_OFFSET, 0))
+            printf(" - btree_wal_open(): Replay Failed\n");
+
+        __test_lookup(&btree, 20, __NKEYS, 1);
+        if (btree_contains(&btree, "K-00000015"))
+            printf(" - Remove Range not replayed\n");
+
+        /* A checkpoint erases the replayed range, then a crash again */
+        __test_remove(&btree, 20, 25, 1);
+        btree_sync(&btree);
+        __test_remove(&btree, 25, 30, 1);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    if (__test_crashed(pid, data, &log_data)) {
+        close(log_data.fd);
+        return;
+    }
+
+    if (btree_open(&btree, disk, __CACHESZ, 512U,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed\n");
+        close(log_data.fd);
+        return;
+    }
+
+    if (btree_wal_open(&btree, &log, __WAL_OFFSET, 0))
+        printf(" - btree_wal_open(): Replay Failed\n");
+
+    __test_lookup(&btree, 30, __NKEYS, 1);
+    if (btree_contains(&btree, "K-00000022"))
+        printf(" - Checkpoint lost\n");
+    if (btree_contains(&btree, "K-00000027"))
+        printf(" - Records past the torn tail not replayed\n");
+    __test_remove(&btree, 30, 31, 1);
+    btree_close(&btree);
+    close(log_data.fd);
+
+    etime = time_micros();
+    printf("[TIME] Write-Ahead Log %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static void __test_flusher (btdisk_t *disk, struct btdisk_data *data) {
+    btree_stats_t stats;
+    uint64_t super_offset;
+    uint64_t stime, etime;
+    btree_t btree;
+    uint32_t wait;
+
+    printf("Background Flusher %u\n", __NKEYS);
+    stime = time_micros();
+
+    data->offset = 512U + 64U;
+    if (btree_create(&btree, disk, __CACHESZ, data->offset - 64U,
+                     __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                     0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_create(): Failed\n");
+        return;
+    }
+
+    btree_append_only(&btree);
+    if (btree_flusher_setup(&btree, 2 * __BLOCKSZ))
+        printf(" - btree_flusher_setup(): Failed\n");
+
+    /* Leaves are written with no sync, while the keys go in */
+    __test_insert(&btree, 0, __NKEYS, 1);
+    __test_remove(&btree, 0, __NKEYS, 3);
+    for (wait = 0; wait < 1000; ++wait) {
+        btree_stats(&btree, &stats);
+        if (stats.disk_writes > 0)
+            break;
+        usleep(1000);
+    }
+    if (stats.disk_writes == 0)
+        printf(" - Flusher wrote no leaf\n");
+
+    /* Writers past twice the budget write a batch themselves */
+    if (btree.dirty_leaves > 8)
+        printf(" - Dirty leaves over budget %"PRIu64"\n", btree.dirty_leaves);
+
+    /* Budget changes in place, the sync writes what is left */
+    if (btree_flusher_setup(&btree, 64 * __BLOCKSZ))
+        printf(" - btree_flusher_setup(): Budget Failed\n");
+    __test_insert(&btree, 0, __NKEYS, 3);
+    btree_sync(&btree);
+    if (btree.dirty_leaves != 0)
+        printf(" - Dirty leaves after sync %"PRIu64"\n", btree.dirty_leaves);
+    super_offset = btree.super_offset;
+    __test_lookup(&btree, 0, __NKEYS, 1);
+
+    if (btree_flusher_setup(&btree, 0))
+        printf(" - btree_flusher_setup(): Stop Failed\n");
+    btree_close(&btree);
+
+    if (btree_open(&btree, disk, __CACHESZ, super_offset,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed\n");
+        return;
+    }
+    __test_lookup(&btree, 0, __NKEYS, 1);
+    btree_close(&btree);
+
+    etime = time_micros();
+    printf("[TIME] Background Flusher %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static void __test_space (btdisk_t *disk, struct btdisk_data *data) {
+    uint64_t stime, etime;
+    uint64_t loaded;
+    btree_t btree;
+    uint32_t i;
+
+    printf("Free-Space Map %u\n", __NKEYS);
+    stime = time_micros();
+
+    /* The space-map header follows the super-block, the disk end is not
+     * on a unit: the first append pads it.
+     */
+    data->offset = 512U + 128U + 8U;
+    if (btree_create(&btree, disk, __CACHESZ, 512U,
+                     __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                     0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_create(): Failed\n");
+        return;
+    }
+
+    if (btree_space_map(&btree, 64))
+        printf(" - btree_space_map(): Failed\n");
+    if (btree_append_only(&btree) != 1)
+        printf(" - btree_append_only(): Not rejected\n");
+
+    __test_insert(&btree, 0, __NKEYS, 1);
+    btree_sync(&btree);
+    loaded = data->offset;
+
+    /* Removed and rewritten nodes leave space the next rounds reuse */
+    for (i = 0; i < 4; ++i) {
+        __test_remove(&btree, 0, __NKEYS, 2);
+        btree_sync(&btree);
+        __test_insert(&btree, 0, __NKEYS, 2);
+        btree_sync(&btree);
+    }
+
+    if ((data->offset - loaded) > (loaded - 512U))
+        printf(" - Disk grew %"PRIu64" bytes after load of %"PRIu64"\n",
+               data->offset - loaded, loaded - 512U);
+
+    if (btree_compact(&btree))
+        printf(" - btree_compact(): Failed\n");
+    __test_lookup(&btree, 0, __NKEYS, 1);
+    __test_scan(&btree, 0, __NKEYS);
+    btree_close(&btree);
+
+    /* The map is loaded back, reuse goes on */
+    if (btree_open(&btree, disk, __CACHESZ, 512U,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed\n");
+        return;
+    }
+
+    loaded = data->offset;
+    __test_remove(&btree, 0, __NKEYS, 2);
+    btree_sync(&btree);
+    __test_insert(&btree, 0, __NKEYS, 2);
+    __test_lookup(&btree, 0, __NKEYS, 1);
+    btree_close(&btree);
+
+    if (data->offset > loaded + (__BLOCKSZ << 2))
+        printf(" - Disk grew %"PRIu64" bytes after open\n", data->offset - loaded);
+
+    etime = time_micros();
+    printf("[TIME] Free-Space Map %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+/* Every third value is a blob, larger than a block, 'round' changes them */
+static uint32_t __blob_value (uint8_t *value,
+                              uint32_t i,
+                              uint32_t round)
+{
+    uint32_t size;
+    uint32_t j;
+
+    size = ((i + round) % 3) ? 16 : (__BLOB_MAXSZ - (i % __BLOB_THRESHOLD));
+    for (j = 0; j < size; ++j)
+        value[j] = (uint8_t)(i * 31 + j + round);
+    return(size);
+}
+
+static void __test_blob_lookup (btree_t *btree,
+                                uint32_t from,
+                                uint32_t to,
+                                uint32_t step,
+                                uint32_t round)
+{
+    uint8_t lkvalue[__BLOB_MAXSZ];
+    uint8_t value[__BLOB_MAXSZ];
+    char key[__KEYSZ + 1];
+    uint32_t lksize, size;
+
+    for (; from < to; from += step) {
+        snprintf(key, __KEYSZ + 1, "K-%08d", from);
+        size = __blob_value(value, from, round);
+        if (!(lksize = btree_lookup(btree, key, lkvalue, sizeof(lkvalue)))) {
+            printf(" - Blob Lookup Failed %s\n", key);
+        } else if (lksize != size || memcmp(value, lkvalue, size)) {
+            printf(" - Blob Lookup something wrong: %s %u %u\n", key, size, lksize);
+        }
+    }
+}
+
+static void __test_blob (btdisk_t *disk, struct btdisk_data *data) {
+    struct btdisk_data log_data;
+    uint8_t value[__BLOB_MAXSZ];
+    char key[__KEYSZ + 1];
+    btree_cursor_t cursor;
+    uint64_t stime, etime;
+    btree_stats_t before;
+    btree_stats_t after;
+    const void *lkvalue;
+    uint32_t lksize;
+    uint32_t count;
+    uint32_t size;
+    btree_t btree;
+    btdisk_t log;
+    pid_t pid;
+    uint32_t i;
+
+    printf("Blob %u\n", __NKEYS);
+    stime = time_micros();
+
+    data->offset = 512U + 64U;
+    if (btree_create(&btree, disk, __CACHESZ, data->offset - 64U,
+                     __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                     0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_create(): Failed\n");
+        return;
+    }
+
+    if (btree_blob_setup(&btree, __BLOB_THRESHOLD))
+        printf(" - btree_blob_setup(): Failed\n");
+
+    for (i = 0; i < __NKEYS; ++i) {
+        snprintf(key, __KEYSZ + 1, "K-%08d", i);
+        size = __blob_value(value, i, 0);
+        if (btree_insert(&btree, key, value, size))
+            printf(" - Blob Insert Failed %s\n", key);
+    }
+    __test_blob_lookup(&btree, 0, __NKEYS, 1, 0);
+    btree_sync(&btree);
+
+    /* Key-only scans read no blob, only leaves (at most a block each) */
+    btree_stats(&btree, &before);
+    count = 0;
+    if (btree_range_keys(&btree, NULL, NULL, __range_count, &count) || count != __NKEYS)
+        printf(" - Blob Range Keys %u items\n", count);
+    btree_stats(&btree, &after);
+    if ((after.disk_read_bytes - before.disk_read_bytes) >
+        (after.disk_reads - before.disk_reads) * __BLOCKSZ)
+    {
+        printf(" - Blob Range Keys read a blob\n");
+    }
+
+    /* Cursor values are blobs read back */
+    count = 0;
+    btree_cursor_open(&cursor, &btree);
+    for (i = !btree_cursor_first(&cursor) ? 0 : __NKEYS; i < __NKEYS; ++i) {
+        size = __blob_value(value, i, 0);
+        lkvalue = btree_cursor_value(&cursor, &lksize);
+        if (lkvalue == NULL || lksize != size || memcmp(lkvalue, value, size) ||
+            btree_cursor_value_size(&cursor) != size)
+        {
+            printf(" - Blob Cursor something wrong: %u %u %u\n", i, size, lksize);
+        }
+        count++;
+        if (btree_cursor_next(&cursor))
+            break;
+    }
+    btree_cursor_close(&cursor);
+    if (count != __NKEYS)
+        printf(" - Blob Cursor %u items\n", count);
+
+    /* Blobs become inline values, and inline values blobs */
+    for (i = 0; i < __NKEYS; ++i) {
+        snprintf(key, __KEYSZ + 1, "K-%08d", i);
+        size = __blob_value(value, i, 1);
+        if (btree_insert(&btree, key, value, size))
+            printf(" - Blob Replace Failed %s\n", key);
+    }
+    __test_blob_lookup(&btree, 0, __NKEYS, 1, 1);
+
+    __test_remove(&btree, 0, __NKEYS, 2);
+    btree_sync(&btree);
+    btree_close(&btree);
+
+    /* Blobs are read with no threshold set */
+    if (btree_open(&btree, disk, __CACHESZ, 512U,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed\n");
+        return;
+    }
+
+    __test_blob_lookup(&btree, 1, __NKEYS, 2, 1);
+    btree_close(&btree);
+
+    /* Values larger than a block are logged whole and replayed */
+    memcpy(&log, disk, sizeof(btdisk_t));
+    log.sync = __btdisk_sync;
+    log.erase = __btdisk_log_erase;
+    log.internal = &log_data;
+    log_data.offset = __WAL_OFFSET;
+    if ((log_data.fd = open("test-blob.log", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return;
+    }
+
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        if (btree_open(&btree, disk, __CACHESZ, 512U,
+                       0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+        {
+            printf(" - btree_open(): Failed\n");
+            _exit(1);
+        }
+
+        btree_append_only(&btree);
+        btree_blob_setup(&btree, __BLOB_THRESHOLD);
+        if (btree_wal_open(&btree, &log, __WAL_OFFSET, 0))
+            printf(" - btree_wal_open(): Failed\n");
+        btree_sync(&btree);
+
+        for (i = 0; i < __NKEYS; i += 2) {
+            snprintf(key, __KEYSZ + 1, "K-%08d", i);
+            size = __blob_value(value, i, 2);
+            if (btree_insert(&btree, key, value, size))
+                printf(" - Blob Insert Failed %s\n", key);
+        }
+        fflush(stdout);
+        _exit(0);
+    }
+
+    if (__test_crashed(pid, data, &log_data)) {
+        close(log_data.fd);
+        return;
+    }
+
+    if (btree_open(&btree, disk, __CACHESZ, 512U,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed\n");
+        close(log_data.fd);
+        return;
+    }
+
+    /* No threshold on replay, the values over a block are blobs still */
+    if (btree_wal_open(&btree, &log, __WAL_OFFSET, 0))
+        printf(" - btree_wal_open(): Replay Failed\n");
+    btree_blob_setup(&btree, __BLOB_THRESHOLD);
+    __test_blob_lookup(&btree, 0, __NKEYS, 2, 2);
+    __test_blob_lookup(&btree, 1, __NKEYS, 2, 1);
+    btree_close(&btree);
+    close(log_data.fd);
+
+    etime = time_micros();
+    printf("[TIME] Blob %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static void __test_mmap (void) {
+    uint64_t super_offset;
+    uint64_t stime, etime;
+    btree_t btree;
+    btdisk_t disk;
+
+    printf("Mmap Disk %u\n", __NKEYS);
+    stime = time_micros();
+
+    /* Uncompressed blocks, to be read in place, built-in crc */
+    unlink("test-mmap.disk");
+    memset(&disk, 0, sizeof(btdisk_t));
+    if (btdisk_mmap_open(&disk, "test-mmap.disk", 512U + 64U)) {
+        printf(" - btdisk_mmap_open(): Failed\n");
+        return;
+    }
+
+    if (btree_create(&btree, &disk, __CACHESZ, 512U,
+                     __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                     0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_create(): Failed\n");
+        btdisk_mmap_close(&disk);
+        return;
+    }
+
+    __test_insert(&btree, 0, __NKEYS, 1);
+    btree_sync(&btree);
+
+    /* Readers on the mapping, then the writer on its own copies */
+    __test_lookup(&btree, 0, __NKEYS, 1);
+    __test_scan(&btree, 0, __NKEYS);
+    __test_remove(&btree, 0, 10, 1);
+    __test_lookup(&btree, 10, __NKEYS, 1);
+    btree_sync(&btree);
+    if (disk.sync(&disk))
+        printf(" - btdisk_mmap sync(): Failed\n");
+    super_offset = btree.super_offset;
+    btree_close(&btree);
+
+    if (btree_open(&btree, &disk, __CACHESZ, super_offset,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed\n");
+        btdisk_mmap_close(&disk);
+        return;
+    }
+
+    /* Check nh_crc of the mapped blocks too */
+    btree_verify(&btree, BTREE_VERIFY_NODE);
+    __test_lookup(&btree, 10, __NKEYS, 1);
+    __test_scan(&btree, 10, __NKEYS);
+    btree_close(&btree);
+    btdisk_mmap_close(&disk);
+
+    etime = time_micros();
+    printf("[TIME] Mmap Disk %.5f\n", (etime - stime) / 1000000.0f);
+}
+
+static void __test_crc (void) {
+    uint8_t buffer[__BLOCKSZ + 8];
+    uint32_t crc, part;
+    uint32_t i, size;
+
+    printf("CRC32C\n");
+    if (btcrc32c(0, "123456789", 9) != 0xe3069283 ||
+        btcrc32c_sw(0, "123456789", 9) != 0xe3069283)
+    {
+        printf(" - CRC32C check value Failed\n");
+    }
+
+    for (i = 0; i < sizeof(buffer); ++i)
+        buffer[i] = (uint8_t)(i * 2654435761U >> 24);
+
+    /* Every size and alignment, in one or two parts */
+    for (size = 0; size <= __BLOCKSZ; ++size) {
+        crc = btcrc32c_sw(0, buffer + (size & 7), size);
+        part = btcrc32c(0, buffer + (size & 7), size / 3);
+        part = btcrc32c(part, buffer + (size & 7) + size / 3, size - size / 3);
+        if (btcrc32c(0, buffer + (size & 7), size) != crc || part != crc) {
+            printf(" - CRC32C Failed size %u\n", size);
+            break;
+        }
+    }
+}
+
+static void __test_cache_stats (btree_t *btree) {
+    btcache_stats_t stats;
+
+    btree_cache_stats(btree, &stats);
+    printf("[CACHE] %u/%u blocks %u pinned - %"PRIu64" hits %"PRIu64" misses "
+           "%"PRIu64" evictions\n", stats.used, stats.size, stats.pinned,
+           stats.hits, stats.misses, stats.evictions);
+
+    if (stats.used > stats.size || stats.pinned > stats.used)
+        printf(" - Cache Stats Failed\n");
+}
+
+static void __test_stats (btree_t *btree) {
+    btree_stats_t stats;
+    uint64_t timed;
+    uint32_t i;
+
+    btree_stats(btree, &stats);
+    printf("[STATS] %"PRIu64" lookups %"PRIu64" inserts %"PRIu64" removes - "
+           "splits %"PRIu64"/%"PRIu64" merges %"PRIu64"/%"PRIu64" (leaf/twig)\n",
+           stats.lookups, stats.inserts, stats.removes,
+           stats.leaf_splits, stats.twig_splits,
+           stats.leaf_merges, stats.twig_merges);
+    printf("[STATS] %"PRIu64" reads (%"PRIu64" bytes) %"PRIu64" writes "
+           "(%"PRIu64" bytes) - height %u, %u%% full\n",
+           stats.disk_reads, stats.disk_read_bytes,
+           stats.disk_writes, stats.disk_write_bytes,
+           stats.height, stats.fill);
+
+    /* Async reads are counted, but not timed */
+    timed = 0;
+    for (i = 0; i < BTREE_STATS_BUCKETS; ++i)
+        timed += stats.read_latency[i];
+
+    if (stats.fill > 100 || timed > stats.disk_reads ||
+        (stats.items > 0 && stats.height == 0))
+    {
+        printf(" - Stats Failed\n");
+    }
+}
+
+static int __btdisk_submit_fail (btdisk_t *disk,
+                                 btdisk_aio_t *aio,
+                                 uint32_t count)
+{
+    return(1);
+}
+
+static void __test_aio (uint32_t threads) {
+    btdisk_aio_op_t submit;
+    uint64_t super_offset;
+    uint64_t stime, etime;
+    btree_t btree;
+    btdisk_t disk;
+
+    printf("Async Disk %u (%s)\n", __NKEYS, threads ? "threads" : "io_uring");
+    stime = time_micros();
+
+    /* Compressed blocks, no mapping: syncs and scans go through aio */
+    unlink("test-aio.disk");
+    memset(&disk, 0, sizeof(btdisk_t));
+#if TEST_COMPRESS
+    disk.decompress = btcodec_lz_decompress;
+    disk.compress = btcodec_lz_compress;
+#endif
+    if (btdisk_mmap_open(&disk, "test-aio.disk", 512U + 64U)) {
+        printf(" - btdisk_mmap_open(): Failed\n");
+        return;
+    }
+
+    disk.map = NULL;
+    if (btdisk_mmap_aio(&disk, 32, threads)) {
+        printf(" - btdisk_mmap_aio(): Failed\n");
+        btdisk_mmap_close(&disk);
+        return;
+    }
+
+    if (!threads && !btdisk_mmap_uring(&disk))
+        printf(" - io_uring not available, thread pool\n");
+
+    if (btree_create(&btree, &disk, __CACHESZ, 512U,
+                     __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                     0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_create(): Failed\n");
+        btdisk_mmap_close(&disk);
+        return;
+    }
+
+    /* New blocks appended in batches, then rewritten in place */
+    __test_insert(&btree, 0, __NKEYS, 1);
+    btree_sync(&btree);
+    __test_insert(&btree, 0, __NKEYS, 2);
+    __test_remove(&btree, 0, 10, 1);
+    btree_sync(&btree);
+
+    /* Leaves not written keep their old pointers, the next sync does it */
+    __test_remove(&btree, 41, __NKEYS, 8);
+    submit = disk.submit;
+    disk.submit = __btdisk_submit_fail;
+    if (!btree_sync(&btree))
+        printf(" - btree_sync(): Expected to fail\n");
+    disk.submit = submit;
+    btree_sync(&btree);
+    super_offset = btree.super_offset;
+    btree_close(&btree);
+
+    if (btree_open(&btree, &disk, __CACHESZ, super_offset,
+                   0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf(" - btree_open(): Failed\n");
+        btdisk_mmap_close(&disk);
+        return;
+    }
+
+    /* Scans read the next leaves ahead */
+    btree_verify(&btree, BTREE_VERIFY_NODE);
+    __test_scan(&btree, 10, 41);
+    __test_lookup(&btree, 10, __NKEYS, 2);
+    __test_cache_stats(&btree);
+    btree_close(&btree);
+    btdisk_mmap_close(&disk);
+
+    etime = time_micros();
+    printf("[TIME] Async Disk %.5f\n", (etime - stime) / 1000000.0f);
+}
+
 int main (int argc, char **argv) {
     struct btdisk_data data;
     btree_t btree;
@@ -246,15 +1387,26 @@ int main (int argc, char **argv) {
     disk.append = __btdisk_append;
     disk.write = __btdisk_write;
     disk.read = __btdisk_read;
+    disk.sync = NULL;
+    disk.map = NULL;
+    disk.submit = NULL;
+    disk.complete = NULL;
     disk.erase = __btdisk_erase;
     disk.crc_pointer = __btdisk_addler32;
     disk.crc_block = __btdisk_addler32;
+#if TEST_COMPRESS
+    disk.decompress = btcodec_lz_decompress;
+    disk.compress = btcodec_lz_compress;
+#else
     disk.decompress = NULL;
     disk.compress = NULL;
+#endif
 
     data.offset = 512U + 64U;
     disk.internal = &data;
 
+    __test_crc();
+
 #if TEST_WRITE
     if ((data.fd = open("test.disk", O_CREAT | O_RDWR, 0600)) < 0) {
         perror("open()");
@@ -262,7 +1414,7 @@ int main (int argc, char **argv) {
     }
 
     if (btree_create(&btree, &disk, __CACHESZ, data.offset - 64U,
-                       __BLOCKSZ, 0, __KEYSZ,
+                       __BLOCKSZ, TEST_FORMAT, __KEYSZ,
                        0xf5bc2eac, 0xb4e6, __keycmp, NULL))
     {
         printf("btree_create(): Failed\n");
@@ -295,6 +1447,9 @@ int main (int argc, char **argv) {
 #endif
 #if 1
     __test_lookup(&btree, 0, __NKEYS, 1);
+    __test_lookup_batch(&btree, 0, __NKEYS);
+    __test_scan(&btree, 0, __NKEYS);
+    __test_cache_stats(&btree);
 #endif
 #ifdef __BTREE_DEBUG
     printf("Debug\n");
@@ -303,6 +1458,20 @@ int main (int argc, char **argv) {
 #if TEST_WRITE
     __test_remove(&btree, 0, 20, 1);
     __test_lookup(&btree, 20, __NKEYS, 1);
+    __test_scan(&btree, 20, __NKEYS);
+
+    /* Drop a quarter, then put it back */
+    __test_remove_range(&btree, __NKEYS >> 2, __NKEYS >> 1);
+    __test_insert(&btree, __NKEYS >> 2, __NKEYS >> 1, 1);
+    __test_lookup(&btree, 20, __NKEYS, 1);
+    __test_scan(&btree, 20, __NKEYS);
+    __test_stats(&btree);
+
+    /* Empty a half under a cursor, then put it back */
+    __test_cursor_write(&btree, __NKEYS >> 1, __NKEYS);
+    __test_insert(&btree, __NKEYS >> 1, __NKEYS, 1);
+    __test_lookup(&btree, 20, __NKEYS, 1);
+    __test_scan(&btree, 20, __NKEYS);
 
 #ifdef __BTREE_DEBUG
     printf("Debug\n");
@@ -312,5 +1481,108 @@ int main (int argc, char **argv) {
     printf("CLOSE\n");
     btree_close(&btree);
     close(data.fd);
+
+#if TEST_WRITE
+    /* Rebuild the same keys bottom-up, in a new file */
+    data.offset = 512U + 64U;
+    if ((data.fd = open("test-bulk.disk", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    if (btree_create(&btree, &disk, __CACHESZ, data.offset - 64U,
+                       __BLOCKSZ, TEST_FORMAT, __KEYSZ,
+                       0xf5bc2eac, 0xb4e6, __keycmp, NULL))
+    {
+        printf("btree_create(): Failed\n");
+        return(1);
+    }
+
+    /* Plain LRU, nothing pinned */
+    if (btree_cache_setup(&btree, BTCACHE_LRU, 0))
+        printf(" - Cache Setup Failed\n");
+
+    /* "K-%08d" keys sort as memcmp() */
+    if (btree_memcmp_keys(&btree))
+        printf(" - Memcmp Keys Failed\n");
+
+    __test_bulk_load(&btree, __NKEYS, 90);
+    __test_lookup(&btree, 0, __NKEYS, 1);
+    __test_scan(&btree, 0, __NKEYS);
+    __test_cache_stats(&btree);
+
+    printf("CLOSE\n");
+    btree_close(&btree);
+    close(data.fd);
+#endif
+
+#if TEST_WRITE && TEST_VARKEY
+    if ((data.fd = open("test-varkey.disk", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    __test_varkey(&disk, &data);
+    close(data.fd);
+#endif
+
+#if TEST_WRITE && TEST_SNAPSHOT
+    if ((data.fd = open("test-snapshot.disk", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    __test_snapshot(&disk, &data);
+    close(data.fd);
+#endif
+
+#if TEST_WRITE && TEST_WAL
+    if ((data.fd = open("test-wal.disk", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    __test_wal(&disk, &data);
+    close(data.fd);
+#endif
+
+#if TEST_WRITE && TEST_FLUSHER
+    if ((data.fd = open("test-flusher.disk", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    __test_flusher(&disk, &data);
+    close(data.fd);
+#endif
+
+#if TEST_WRITE && TEST_SPACE
+    if ((data.fd = open("test-space.disk", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    __test_space(&disk, &data);
+    close(data.fd);
+#endif
+
+#if TEST_WRITE && TEST_BLOB
+    if ((data.fd = open("test-blob.disk", O_CREAT | O_TRUNC | O_RDWR, 0600)) < 0) {
+        perror("open()");
+        return(1);
+    }
+
+    __test_blob(&disk, &data);
+    close(data.fd);
+#endif
+
+#if TEST_WRITE && TEST_MMAP
+    __test_mmap();
+#endif
+
+#if TEST_WRITE && TEST_AIO
+    __test_aio(0);
+    __test_aio(4);
+#endif
     return(0);
 }
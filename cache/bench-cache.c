@@ -0,0 +1,334 @@
+/*
+ * Cache policy benchmark, the key generator is in bench-utils. Build with:
+ *   cc -O2 -I../bench-utils bench-cache.c cache.c ../bench-utils/zipf.c -lm
+ */
+#define _XOPEN_SOURCE 500
+#include <sys/time.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "zipf.h"
+
+#define __TRACE_ZIPFIAN     (0)
+#define __TRACE_SCAN        (1)
+#define __TRACE_LOOP        (2)
+#define __TRACE_FILE        (3)
+
+#define __BENCH_KEY_SIZE    (16)
+#define __BENCH_SCAN_BURST  (1000)
+
+struct bench_conf {
+    const char *path;
+    uint32_t nkeys;
+    uint32_t requests;
+    uint32_t scan_pct;
+    int      trace;
+    double   scan_start;
+    double   theta;
+};
+
+/* A recorded or generated key trace, keys live as long as the trace */
+struct bench_trace {
+    const char **keys;
+    uint32_t     nkeys;
+    uint32_t     unique;
+    char *       data;
+};
+
+static const struct {
+    const char * name;
+    cache_type_t type;
+} __bench_policies[] = {
+    { "lru",     CACHE_LRU },
+    { "mru",     CACHE_MRU },
+    { "arc",     CACHE_ARC },
+    { "tinylfu", CACHE_TINYLFU },
+};
+
+#define __BENCH_NPOLICIES   (sizeof(__bench_policies) / sizeof(__bench_policies[0]))
+
+static uint64_t time_micros (void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return(now.tv_sec * 1000000U + now.tv_usec);
+}
+
+static int __keycmp (void *user_data,
+                     const void *a,
+                     const void *b)
+{
+    return(strcmp((const char *)a, (const char *)b));
+}
+
+/* FNV-1a */
+static size_t __hash (void *user_data, const void *key) {
+    const unsigned char *p;
+    uint64_t h;
+
+    h = 0xcbf29ce484222325ULL;
+    for (p = (const unsigned char *)key; *p != '\0'; ++p)
+        h = (h ^ *p) * 0x100000001b3ULL;
+
+    return((size_t)h);
+}
+
+/* ===========================================================================
+ *  Traces
+ */
+
+/* One key per line, empty lines are skipped */
+static int __trace_load (struct bench_trace *trace,
+                         const char *path)
+{
+    size_t size, rd, n;
+    char *p, *end;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror("fopen()");
+        return(-1);
+    }
+
+    size = 0;
+    n = 1 << 20;
+    trace->data = NULL;
+    do {
+        if ((p = realloc(trace->data, n + 1)) == NULL) {
+            fclose(fp);
+            return(-1);
+        }
+        trace->data = p;
+        rd = fread(trace->data + size, 1, n - size, fp);
+        size += rd;
+        if (size == n)
+            n <<= 1;
+    } while (rd > 0);
+    fclose(fp);
+    trace->data[size] = '\0';
+
+    n = 0;
+    for (p = trace->data; p < trace->data + size; ++p)
+        n += (*p == '\n');
+
+    if ((trace->keys = malloc((n + 1) * sizeof(const char *))) == NULL)
+        return(-1);
+
+    trace->nkeys = 0;
+    for (p = trace->data; *p != '\0'; p = end + 1) {
+        if ((end = strchr(p, '\n')) == NULL)
+            end = p + strlen(p);
+        if (end > p && end[-1] == '\r')
+            end[-1] = '\0';
+        if (end > p)
+            trace->keys[trace->nkeys++] = p;
+        if (*end == '\0')
+            break;
+        *end = '\0';
+    }
+
+    trace->unique = 0;
+    return(0);
+}
+
+/*
+ * zipfian: skewed ranks scrambled over the keys.
+ * scan:    zipfian, scan_pct of the requests are one-off keys read in
+ *          bursts (a table scan), never seen again.
+ * loop:    the keys in order, again and again (LRU worst case).
+ */
+static int __trace_generate (struct bench_trace *trace,
+                             const struct bench_conf *conf)
+{
+    uint32_t scan_left;
+    uint32_t nitems;
+    uint32_t i, id;
+    uint64_t seed;
+    zipf_t zipf;
+
+    nitems = conf->nkeys + conf->requests;
+    trace->data = malloc((size_t)nitems * __BENCH_KEY_SIZE);
+    trace->keys = malloc((size_t)conf->requests * sizeof(const char *));
+    if (trace->data == NULL || trace->keys == NULL)
+        return(-1);
+
+    memset(&zipf, 0, sizeof(zipf_t));
+    if (conf->trace != __TRACE_LOOP)
+        zipf_init(&zipf, conf->nkeys, conf->theta);
+
+    seed = 0x9e3779b97f4a7c15ULL;
+    scan_left = 0;
+    trace->unique = conf->nkeys;
+    for (i = 0; i < conf->requests; ++i) {
+        if (conf->trace == __TRACE_LOOP) {
+            id = i % conf->nkeys;
+        } else if (scan_left > 0 ||
+                   (conf->trace == __TRACE_SCAN &&
+                    xorshift64_double(&seed) < conf->scan_start))
+        {
+            scan_left = (scan_left > 0) ? (scan_left - 1) : (__BENCH_SCAN_BURST - 1);
+            id = trace->unique++;
+        } else {
+            id = zipf_scrambled(&zipf, &seed);
+        }
+
+        trace->keys[i] = trace->data + (size_t)id * __BENCH_KEY_SIZE;
+    }
+
+    for (i = 0; i < trace->unique; ++i)
+        snprintf(trace->data + (size_t)i * __BENCH_KEY_SIZE, __BENCH_KEY_SIZE, "key%u", i);
+
+    trace->nkeys = conf->requests;
+    return(0);
+}
+
+/* ===========================================================================
+ *  Replay
+ */
+static int __bench_replay (const struct bench_trace *trace,
+                           cache_type_t type,
+                           size_t size,
+                           double *hit_ratio,
+                           double *mops)
+{
+    uint64_t stime, etime;
+    uint64_t hits;
+    cache_t cache;
+    uint32_t i;
+
+    if (cache_alloc(&cache, type, size, __keycmp, __hash, NULL, NULL, NULL) == NULL)
+        return(-1);
+
+    hits = 0;
+    stime = time_micros();
+    for (i = 0; i < trace->nkeys; ++i) {
+        if (cache_retain(&cache, trace->keys[i]) != NULL) {
+            cache_release(&cache, trace->keys[i]);
+            hits++;
+        } else {
+            cache_insert(&cache, trace->keys[i], (void *)trace->keys[i]);
+        }
+    }
+    etime = time_micros();
+
+    cache_free(&cache);
+
+    *hit_ratio = trace->nkeys ? (100.0 * hits) / trace->nkeys : 0.0;
+    *mops = (etime > stime) ? (double)trace->nkeys / (etime - stime) : 0.0;
+    return(0);
+}
+
+static void __bench_usage (const char *name) {
+    fprintf(stderr,
+        "usage: %s [options] [cache size ...]\n"
+        "  -f path        replay a recorded trace, one key per line\n"
+        "  -d trace       zipfian, scan, loop (scan)\n"
+        "  -n keys        distinct keys of the generated trace (100000)\n"
+        "  -r requests    generated requests (2000000)\n"
+        "  -z theta       zipfian constant (0.99)\n"
+        "  -s percent     scan: requests that are one-off keys, in bursts of %d (20)\n"
+        "cache sizes default to 0.1%%, 1%%, 10%% of the keys\n",
+        name, __BENCH_SCAN_BURST);
+}
+
+int main (int argc, char **argv) {
+    struct bench_trace trace;
+    struct bench_conf conf;
+    size_t sizes[16];
+    double ratio, mops;
+    int nsizes, opt;
+    size_t i, p;
+
+    conf.path = NULL;
+    conf.nkeys = 100000;
+    conf.requests = 2000000;
+    conf.scan_pct = 20;
+    conf.trace = __TRACE_SCAN;
+    conf.theta = 0.99;
+
+    while ((opt = getopt(argc, argv, "f:d:n:r:z:s:h")) != -1) {
+        switch (opt) {
+            case 'f': conf.path = optarg; conf.trace = __TRACE_FILE; break;
+            case 'n': conf.nkeys = strtoul(optarg, NULL, 10); break;
+            case 'r': conf.requests = strtoul(optarg, NULL, 10); break;
+            case 'z': conf.theta = strtod(optarg, NULL); break;
+            case 's': conf.scan_pct = strtoul(optarg, NULL, 10); break;
+            case 'd':
+                if (!strcmp(optarg, "zipfian")) {
+                    conf.trace = __TRACE_ZIPFIAN;
+                } else if (!strcmp(optarg, "scan")) {
+                    conf.trace = __TRACE_SCAN;
+                } else if (!strcmp(optarg, "loop")) {
+                    conf.trace = __TRACE_LOOP;
+                } else {
+                    __bench_usage(argv[0]);
+                    return(1);
+                }
+                break;
+            default:
+                __bench_usage(argv[0]);
+                return(1);
+        }
+    }
+
+    if (conf.nkeys == 0 || conf.requests == 0 || conf.scan_pct > 100 ||
+        conf.theta <= 0.0 || conf.theta >= 1.0)
+    {
+        __bench_usage(argv[0]);
+        return(1);
+    }
+
+    /* Scans come in bursts, start one often enough to hit scan_pct */
+    if (conf.scan_pct >= 100)
+        conf.scan_start = 1.0;
+    else
+        conf.scan_start = conf.scan_pct / (100.0 - conf.scan_pct) / __BENCH_SCAN_BURST;
+
+    if (conf.trace == __TRACE_FILE) {
+        if (__trace_load(&trace, conf.path))
+            return(1);
+    } else if (__trace_generate(&trace, &conf)) {
+        fprintf(stderr, "trace allocation failed\n");
+        return(1);
+    }
+
+    nsizes = 0;
+    for (; optind < argc && nsizes < 16; ++optind)
+        sizes[nsizes++] = strtoul(argv[optind], NULL, 10);
+
+    if (nsizes == 0) {
+        p = (conf.trace == __TRACE_FILE) ? trace.nkeys / 10 : conf.nkeys;
+        sizes[nsizes++] = (p / 1000) ? (p / 1000) : 1;
+        sizes[nsizes++] = (p / 100) ? (p / 100) : 1;
+        sizes[nsizes++] = (p / 10) ? (p / 10) : 1;
+    }
+
+    printf("Trace %s: %u requests", conf.path ? conf.path :
+           (conf.trace == __TRACE_ZIPFIAN) ? "zipfian" :
+           (conf.trace == __TRACE_LOOP) ? "loop" : "scan", trace.nkeys);
+    if (conf.trace != __TRACE_FILE)
+        printf(", %u keys", trace.unique);
+    printf("\n%-10s", "size");
+    for (p = 0; p < __BENCH_NPOLICIES; ++p)
+        printf(" %16s", __bench_policies[p].name);
+    printf("\n");
+
+    for (i = 0; i < (size_t)nsizes; ++i) {
+        printf("%-10zu", sizes[i]);
+        for (p = 0; p < __BENCH_NPOLICIES; ++p) {
+            if (__bench_replay(&trace, __bench_policies[p].type, sizes[i], &ratio, &mops)) {
+                printf(" %16s", "-");
+                continue;
+            }
+            printf("  %6.2f%% %4.1fM/s", ratio, mops);
+        }
+        printf("\n");
+    }
+
+    free(trace.keys);
+    free(trace.data);
+    return(0);
+}
@@ -28,26 +28,126 @@
  */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include "cache.h"
 
+#define CACHE_LINE_SIZE         (64)
+#define CACHE_SLAB_NODES        (256)
+
+/* Node lists, per policy */
+#define CACHE_LIST_MAIN         (0)
+#define CACHE_ARC_T1            (0)         /* Seen once recently */
+#define CACHE_ARC_T2            (1)         /* Seen at least twice */
+#define CACHE_ARC_B1            (0)         /* Ghosts evicted from T1 */
+#define CACHE_ARC_B2            (1)         /* Ghosts evicted from T2 */
+#define CACHE_LFU_WINDOW        (0)         /* Admission window, LRU */
+#define CACHE_LFU_PROBATION     (1)         /* Main SLRU, cold segment */
+#define CACHE_LFU_PROTECTED     (2)         /* Main SLRU, hot segment */
+
+#define CACHE_SKETCH_DEPTH      (4)
+#define CACHE_SKETCH_MAX        (15)        /* 4-bit counters, two a byte */
+#define CACHE_SKETCH_SIZE(n)    ((CACHE_SKETCH_DEPTH * (n) + 1) >> 1)
+
+typedef struct _cghost cghost_t;
+
 struct _cnode {
     cnode_t *     next;
     cnode_t *     prev;
-    cnode_t *     hash;
 
     const void *  key;
     void *        data;
+    size_t        khash;
     size_t        retain;
+    size_t        weight;
+    uint64_t      expire;
+    unsigned int  list;
+};
+
+/* Nodes come from slabs and go back to cache->free_nodes, never freed
+ * until cache_free(). There are never more than size nodes.
+ */
+struct _cslab {
+    cslab_t *     next;
+    cnode_t       nodes[];
+};
+
+/* Open addressing, linear probing. The hash is inline so a probe only
+ * touches the node when the hashes match.
+ */
+struct _cslot {
+    size_t        hash;
+    cnode_t *     node;
+};
+
+/* ARC remembers evicted keys by hash only, keys may be gone with the data */
+struct _cghost {
+    cghost_t *    next;
+    cghost_t *    prev;
+    cghost_t *    hash;
+    size_t        khash;
+    unsigned int  list;
+};
+
+struct ghost_list {
+    cghost_t *    head;
+    cghost_t *    tail;
+    size_t        used;
+};
+
+struct _cache_policy {
+    /* ARC */
+    struct ghost_list ghosts[2];
+    cghost_t *    ghost_pool;
+    cghost_t *    ghost_free;
+    cghost_t **   ghost_table;
+    size_t        ghost_mask;
+    size_t        target;                 /* Adaptive T1 size (p) */
+    int           ghost_b2;               /* The pending miss hit B2 */
+
+    /* W-TinyLFU */
+    uint8_t *     sketch;                 /* Count-min, DEPTH rows, packed */
+    size_t        sketch_mask;
+    size_t        samples;
+    size_t        sample_limit;           /* Halve the counters when reached */
+    size_t        window_size;
+    size_t        protected_size;
+};
+
+struct _cache_segment {
+    union {
+        struct {
+            pthread_mutex_t lock;
+            cache_t         cache;
+        } s;
+        /* Keep neighbouring segment locks on separate cache lines */
+        char pad[(sizeof(pthread_mutex_t) + sizeof(cache_t) +
+                  CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1)];
+    } u;
 };
 
 #define __mmalk_data(cache)     ((cache)->alk->user_data)
 #define __mmalloc(cache, n)     ((cache)->alk->alloc(__mmalk_data(cache), (n)))
 #define __mmfree(cache, ptr)    ((cache)->alk->free(__mmalk_data(cache), (ptr)))
 
-#define __ht_size(n)            ((n) * sizeof(cnode_t *))
-#define __ht_alloc(cache, n)    ((cnode_t **) __mmalloc(cache, __ht_size(n)))
+#define __ht_size(n)            ((n) * sizeof(cslot_t))
+#define __ht_alloc(cache, n)    ((cslot_t *) __mmalloc(cache, __ht_size(n)))
+
+#define __cnode_expired(node)                                               \
+    ((node)->expire != 0 && (node)->expire <= __cache_now())
+
+#define __cache_overflow(cache, w)                                          \
+    ((cache)->max_weight > 0 && (cache)->weight + (w) > (cache)->max_weight)
 
+#define __cache_hash(cache, key)                                            \
+    ((cache)->hash_func((cache)->user_data, key))
+
+#define __scache_lock(seg)      pthread_mutex_lock(&((seg)->u.s.lock))
+#define __scache_unlock(seg)    pthread_mutex_unlock(&((seg)->u.s.lock))
 
 /* Default stdlib allocator */
 static void *__dmmalloc (void *x, size_t n) { return(malloc(n)); }
@@ -75,19 +175,59 @@ static size_t __nbucket_roundup (size_t size) {
     return(size);
 }
 
+static uint64_t __cache_now (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(now.tv_sec * 1000ULL + now.tv_nsec / 1000000U);
+}
+
+static int __cache_slab_grow (cache_t *cache) {
+    cslab_t *slab;
+    size_t count;
+
+    /* Slabs never hold more nodes than the cache can */
+    count = cache->size - cache->nodes;
+    if (count > CACHE_SLAB_NODES)
+        count = CACHE_SLAB_NODES;
+    if (count == 0)
+        return(-1);
+
+    slab = __mmalloc(cache, sizeof(cslab_t) + count * sizeof(cnode_t));
+    if (slab == NULL)
+        return(-1);
+
+    slab->next = cache->slabs;
+    cache->slabs = slab;
+    cache->nodes += count;
+
+    while (count-- > 0) {
+        slab->nodes[count].next = cache->free_nodes;
+        cache->free_nodes = &(slab->nodes[count]);
+    }
+
+    return(0);
+}
+
 static cnode_t *__cache_node_alloc (cache_t *cache,
                                     const void *key,
-                                    void *data)
+                                    void *data,
+                                    size_t hash)
 {
     cnode_t *node;
 
-    if ((node = __mmalloc(cache, sizeof(cnode_t))) == NULL)
+    if (cache->free_nodes == NULL && __cache_slab_grow(cache))
         return(NULL);
 
+    node = cache->free_nodes;
+    cache->free_nodes = node->next;
+
     node->key = key;
     node->data = data;
-    node->hash = NULL;
+    node->khash = hash;
     node->retain = 0;
+    node->weight = 0;
+    node->expire = 0;
+    node->list = CACHE_LIST_MAIN;
 
     return(node);
 }
@@ -98,79 +238,715 @@ static void __cache_node_free (cache_t *cache,
     if (cache->free_func != NULL)
         cache->free_func(cache->user_data, node->data);
 
-    __mmfree(cache, node);
+    node->next = cache->free_nodes;
+    cache->free_nodes = node;
 }
 
-static cnode_t **__cache_ht_lookup (const cache_t *cache,
-                                    const void *key)
+/* ============================================================================
+ *  PRIVATE Operations (Lists)
+ */
+static void __cache_list_unlink (cache_list_t *list,
+                                 cnode_t *node)
 {
-    cnode_t **node;
-    size_t hash;
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        list->head = node->next;
 
-    hash = cache->hash_func(cache->user_data, key);
-    node = &(cache->hashtable[hash & cache->mask]);
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    else
+        list->tail = node->prev;
 
-    while (*node && cache->keycmp_func(cache->user_data, (*node)->key, key))
-        node = &((*node)->hash);
+    list->used--;
+}
 
-    return(node);
+static void __cache_list_push (cache_list_t *list,
+                               cnode_t *node)
+{
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head != NULL)
+        list->head->prev = node;
+    else
+        list->tail = node;
+    list->head = node;
+    list->used++;
+}
+
+/* Take the node off the policy list it sits on, or off the retained one */
+static void __cache_node_unlink (cache_t *cache,
+                                 cnode_t *node)
+{
+    if (node->retain > 0)
+        __cache_list_unlink(&(cache->retained), node);
+    else
+        __cache_list_unlink(&(cache->lists[node->list]), node);
+}
+
+/* ============================================================================
+ *  PRIVATE Operations (Hashtable)
+ */
+/* Returns the key slot, or the empty slot where it would go */
+static cslot_t *__cache_ht_lookup (const cache_t *cache,
+                                   const void *key,
+                                   size_t hash)
+{
+    cslot_t *slot;
+    size_t i;
+
+    i = hash & cache->mask;
+    while ((slot = &(cache->hashtable[i]))->node != NULL) {
+        if (slot->hash == hash &&
+            !cache->keycmp_func(cache->user_data, slot->node->key, key))
+        {
+            break;
+        }
+        i = (i + 1) & cache->mask;
+    }
+
+    return(slot);
 }
 
 static cnode_t *__cache_ht_insert (cache_t *cache,
                                    const void *key,
-                                   void *data)
+                                   void *data,
+                                   size_t hash)
 {
-    cnode_t **node;
+    cslot_t *slot;
 
-    if (*(node = __cache_ht_lookup(cache, key)) != NULL)
+    if ((slot = __cache_ht_lookup(cache, key, hash))->node != NULL)
         return(NULL);
 
-    if ((*node = __cache_node_alloc(cache, key, data)) == NULL)
+    if ((slot->node = __cache_node_alloc(cache, key, data, hash)) == NULL)
         return(NULL);
 
+    slot->hash = hash;
     cache->used++;
 
-    return(*node);
+    return(slot->node);
 }
 
-static int __cache_ht_remove (cache_t *cache,
-                              cnode_t **node)
+/* Unlink the node from the hashtable and free it, the caller
+ * has already taken it off its list.
+ */
+static void __cache_ht_drop (cache_t *cache,
+                             cnode_t *node)
 {
-    cnode_t *p;
+    size_t i, j, home;
+    cslot_t *slots;
+
+    slots = cache->hashtable;
+    i = node->khash & cache->mask;
+    while (slots[i].node != node)
+        i = (i + 1) & cache->mask;
+
+    /* Backward shift, no tombstones: pull back every following entry
+     * whose home slot isn't between the hole and itself.
+     */
+    slots[i].node = NULL;
+    for (j = (i + 1) & cache->mask; slots[j].node != NULL; j = (j + 1) & cache->mask) {
+        home = slots[j].hash & cache->mask;
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        slots[i] = slots[j];
+        slots[j].node = NULL;
+        i = j;
+    }
 
-    p = *node;
-    *node = p->hash;
-    __cache_node_free(cache, p);
     cache->used--;
+    cache->weight -= node->weight;
+    if (node->expire != 0)
+        cache->expiring--;
 
-    return(0);
+    __cache_node_free(cache, node);
+}
+
+/* ============================================================================
+ *  PRIVATE Operations (ARC Ghosts)
+ */
+static cghost_t **__ghost_lookup (cache_policy_t *policy,
+                                  size_t hash)
+{
+    cghost_t **ghost;
+
+    ghost = &(policy->ghost_table[hash & policy->ghost_mask]);
+    while (*ghost != NULL && (*ghost)->khash != hash)
+        ghost = &((*ghost)->hash);
+
+    return(ghost);
+}
+
+static void __ghost_drop (cache_policy_t *policy,
+                          cghost_t *ghost)
+{
+    struct ghost_list *list = &(policy->ghosts[ghost->list]);
+    cghost_t **p;
+
+    if (ghost->prev != NULL)
+        ghost->prev->next = ghost->next;
+    else
+        list->head = ghost->next;
+
+    if (ghost->next != NULL)
+        ghost->next->prev = ghost->prev;
+    else
+        list->tail = ghost->prev;
+    list->used--;
+
+    p = __ghost_lookup(policy, ghost->khash);
+    while (*p != ghost)
+        p = &((*p)->hash);
+    *p = ghost->hash;
+
+    ghost->next = policy->ghost_free;
+    policy->ghost_free = ghost;
 }
 
+static void __ghost_add (cache_policy_t *policy,
+                         size_t hash,
+                         unsigned int list)
+{
+    struct ghost_list *glist = &(policy->ghosts[list]);
+    cghost_t **slot;
+    cghost_t *ghost;
+
+    /* Pool exhausted, forget the oldest ghost of the longer list */
+    if (policy->ghost_free == NULL) {
+        if (policy->ghosts[CACHE_ARC_B1].used > policy->ghosts[CACHE_ARC_B2].used)
+            __ghost_drop(policy, policy->ghosts[CACHE_ARC_B1].tail);
+        else
+            __ghost_drop(policy, policy->ghosts[CACHE_ARC_B2].tail);
+    }
+
+    if (*(slot = __ghost_lookup(policy, hash)) != NULL)
+        __ghost_drop(policy, *slot);
+
+    ghost = policy->ghost_free;
+    policy->ghost_free = ghost->next;
+
+    ghost->khash = hash;
+    ghost->list = list;
+    ghost->hash = NULL;
+    *__ghost_lookup(policy, hash) = ghost;
+
+    ghost->prev = NULL;
+    ghost->next = glist->head;
+    if (glist->head != NULL)
+        glist->head->prev = ghost;
+    else
+        glist->tail = ghost;
+    glist->head = ghost;
+    glist->used++;
+}
+
+static void __ghost_reset (cache_policy_t *policy,
+                           size_t nghosts)
+{
+    size_t i;
+
+    memset(policy->ghost_table, 0, (policy->ghost_mask + 1) * sizeof(cghost_t *));
+    memset(policy->ghosts, 0, sizeof(policy->ghosts));
+
+    policy->ghost_free = NULL;
+    for (i = 0; i < nghosts; ++i) {
+        policy->ghost_pool[i].next = policy->ghost_free;
+        policy->ghost_free = &(policy->ghost_pool[i]);
+    }
+
+    policy->target = 0;
+    policy->ghost_b2 = 0;
+}
+
+/* ============================================================================
+ *  PRIVATE Operations (TinyLFU Sketch)
+ */
+static size_t __sketch_index (const cache_policy_t *policy,
+                              size_t hash,
+                              unsigned int row)
+{
+    static const uint64_t seeds[CACHE_SKETCH_DEPTH] = {
+        0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+        0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL,
+    };
+    uint64_t h;
+
+    /* Index of the counter, its byte is index / 2 */
+    h = ((uint64_t)hash + seeds[row]) * seeds[row];
+    h ^= h >> 32;
+    return(row * (policy->sketch_mask + 1) + (h & policy->sketch_mask));
+}
+
+static unsigned int __sketch_frequency (const cache_policy_t *policy,
+                                        size_t hash)
+{
+    unsigned int freq;
+    unsigned int count;
+    unsigned int i;
+    size_t index;
+
+    freq = CACHE_SKETCH_MAX;
+    for (i = 0; i < CACHE_SKETCH_DEPTH; ++i) {
+        index = __sketch_index(policy, hash, i);
+        count = (policy->sketch[index >> 1] >> ((index & 1) << 2)) & 0xf;
+        if (count < freq)
+            freq = count;
+    }
+
+    return(freq);
+}
+
+static void __sketch_add (cache_policy_t *policy,
+                          size_t hash)
+{
+    unsigned int shift;
+    unsigned int i;
+    size_t index;
+    size_t n;
+
+    for (i = 0; i < CACHE_SKETCH_DEPTH; ++i) {
+        index = __sketch_index(policy, hash, i);
+        shift = (index & 1) << 2;
+        if (((policy->sketch[index >> 1] >> shift) & 0xf) < CACHE_SKETCH_MAX)
+            policy->sketch[index >> 1] += (1 << shift);
+    }
+
+    /* Aging, old popularity fades out: both counters of a byte at once */
+    if (++(policy->samples) >= policy->sample_limit) {
+        n = CACHE_SKETCH_SIZE(policy->sketch_mask + 1);
+        while (n-- > 0)
+            policy->sketch[n] = (policy->sketch[n] >> 1) & 0x77;
+        policy->samples >>= 1;
+    }
+}
+
+/* ============================================================================
+ *  PRIVATE Operations (Policies)
+ */
+static cache_policy_t *__cache_policy_alloc (cache_t *cache) {
+    cache_policy_t *policy;
+    size_t nbucket;
+
+    if ((policy = __mmalloc(cache, sizeof(cache_policy_t))) == NULL)
+        return(NULL);
+
+    memset(policy, 0, sizeof(cache_policy_t));
+    nbucket = __nbucket_roundup(cache->size);
+
+    switch (cache->type) {
+        case CACHE_ARC:
+            policy->ghost_mask = nbucket - 1;
+            policy->ghost_table = __mmalloc(cache, nbucket * sizeof(cghost_t *));
+            policy->ghost_pool = __mmalloc(cache, cache->size * sizeof(cghost_t));
+            if (policy->ghost_table == NULL || policy->ghost_pool == NULL)
+                break;
+            __ghost_reset(policy, cache->size);
+            return(policy);
+        case CACHE_TINYLFU:
+            policy->sketch_mask = nbucket - 1;
+            policy->sketch = __mmalloc(cache, CACHE_SKETCH_SIZE(nbucket));
+            if (policy->sketch == NULL)
+                break;
+            memset(policy->sketch, 0, CACHE_SKETCH_SIZE(nbucket));
+            policy->sample_limit = 10 * cache->size;
+            policy->window_size = (cache->size > 100) ? (cache->size / 100) : 1;
+            policy->protected_size = ((cache->size - policy->window_size) * 8) / 10;
+            return(policy);
+        default:
+            break;
+    }
+
+    if (policy->ghost_table != NULL) __mmfree(cache, policy->ghost_table);
+    if (policy->ghost_pool != NULL) __mmfree(cache, policy->ghost_pool);
+    if (policy->sketch != NULL) __mmfree(cache, policy->sketch);
+    __mmfree(cache, policy);
+    return(NULL);
+}
+
+static void __cache_policy_free (cache_t *cache) {
+    cache_policy_t *policy = cache->policy;
+
+    if (policy == NULL)
+        return;
+
+    if (policy->ghost_table != NULL) __mmfree(cache, policy->ghost_table);
+    if (policy->ghost_pool != NULL) __mmfree(cache, policy->ghost_pool);
+    if (policy->sketch != NULL) __mmfree(cache, policy->sketch);
+    __mmfree(cache, policy);
+}
+
+/* A retain of a key, hit or miss. Inserts don't count, they mostly
+ * follow a retain miss and would weigh misses twice as much as hits.
+ */
+static void __cache_policy_access (cache_t *cache,
+                                   size_t hash)
+{
+    if (cache->type == CACHE_TINYLFU)
+        __sketch_add(cache->policy, hash);
+}
+
+/* A hit on node, pick the list it returns to once released */
+static void __cache_policy_hit (cache_t *cache,
+                                cnode_t *node)
+{
+    switch (cache->type) {
+        case CACHE_ARC:
+            node->list = CACHE_ARC_T2;
+            break;
+        case CACHE_TINYLFU:
+            if (node->list == CACHE_LFU_PROBATION)
+                node->list = CACHE_LFU_PROTECTED;
+            break;
+        default:
+            break;
+    }
+}
+
+/* A miss about to be inserted, adapt and pick the list it goes to */
+static unsigned int __cache_policy_miss (cache_t *cache,
+                                         size_t hash)
+{
+    cache_policy_t *policy = cache->policy;
+    struct ghost_list *b1, *b2;
+    cghost_t *ghost;
+    size_t delta;
+
+    if (cache->type != CACHE_ARC)
+        return(CACHE_LIST_MAIN);
+
+    b1 = &(policy->ghosts[CACHE_ARC_B1]);
+    b2 = &(policy->ghosts[CACHE_ARC_B2]);
+    policy->ghost_b2 = 0;
+
+    if ((ghost = *__ghost_lookup(policy, hash)) != NULL) {
+        if (ghost->list == CACHE_ARC_B1) {
+            /* Evicted from T1 too early, grow the recency side */
+            delta = (b2->used > b1->used) ? (b2->used / b1->used) : 1;
+            policy->target += delta;
+            if (policy->target > cache->size)
+                policy->target = cache->size;
+        } else {
+            /* Evicted from T2 too early, grow the frequency side */
+            delta = (b1->used > b2->used) ? (b1->used / b2->used) : 1;
+            policy->target = (policy->target > delta) ? policy->target - delta : 0;
+            policy->ghost_b2 = 1;
+        }
+        __ghost_drop(policy, ghost);
+        return(CACHE_ARC_T2);
+    }
+
+    /* Directory bounds, |T1| + |B1| <= c and everything <= 2c */
+    if (cache->lists[CACHE_ARC_T1].used + b1->used >= cache->size) {
+        if (b1->tail != NULL)
+            __ghost_drop(policy, b1->tail);
+    } else if (cache->used + b1->used + b2->used >= 2 * cache->size) {
+        if (b2->tail != NULL)
+            __ghost_drop(policy, b2->tail);
+    }
+
+    return(CACHE_ARC_T1);
+}
+
+/* Move nodes between lists after an insert or a release */
+static void __cache_policy_balance (cache_t *cache) {
+    cache_policy_t *policy = cache->policy;
+    cnode_t *node;
+
+    if (cache->type != CACHE_TINYLFU)
+        return;
+
+    /* Overflowing window items go on probation, the sketch judges them
+     * only when the cache is full (see __cache_evict_tinylfu).
+     */
+    while (cache->lists[CACHE_LFU_WINDOW].used > policy->window_size) {
+        node = cache->lists[CACHE_LFU_WINDOW].tail;
+        __cache_list_unlink(&(cache->lists[CACHE_LFU_WINDOW]), node);
+        node->list = CACHE_LFU_PROBATION;
+        __cache_list_push(&(cache->lists[CACHE_LFU_PROBATION]), node);
+    }
+
+    while (cache->lists[CACHE_LFU_PROTECTED].used > policy->protected_size) {
+        node = cache->lists[CACHE_LFU_PROTECTED].tail;
+        __cache_list_unlink(&(cache->lists[CACHE_LFU_PROTECTED]), node);
+        node->list = CACHE_LFU_PROBATION;
+        __cache_list_push(&(cache->lists[CACHE_LFU_PROBATION]), node);
+    }
+}
+
+static cnode_t *__cache_evict_arc (cache_t *cache) {
+    cache_policy_t *policy = cache->policy;
+    cache_list_t *t1 = &(cache->lists[CACHE_ARC_T1]);
+    cache_list_t *t2 = &(cache->lists[CACHE_ARC_T2]);
+    cnode_t *node;
+
+    if (t1->tail != NULL &&
+        (t1->used > policy->target || t2->tail == NULL ||
+         (policy->ghost_b2 && t1->used == policy->target)))
+    {
+        node = t1->tail;
+        __ghost_add(policy, node->khash, CACHE_ARC_B1);
+    } else if ((node = t2->tail) != NULL) {
+        __ghost_add(policy, node->khash, CACHE_ARC_B2);
+    }
+
+    return(node);
+}
+
+static cnode_t *__cache_evict_tinylfu (cache_t *cache) {
+    cache_list_t *window = &(cache->lists[CACHE_LFU_WINDOW]);
+    cache_list_t *probation = &(cache->lists[CACHE_LFU_PROBATION]);
+    cache_list_t *protected = &(cache->lists[CACHE_LFU_PROTECTED]);
+    cnode_t *candidate;
+    cnode_t *victim;
+
+    victim = (probation->tail != NULL) ? probation->tail : protected->tail;
+
+    /* The window is full, its oldest item competes for the main space */
+    candidate = window->tail;
+    if (window->used >= cache->policy->window_size && candidate != NULL) {
+        if (victim == NULL)
+            return(candidate);
+
+        if (__sketch_frequency(cache->policy, candidate->khash) <=
+            __sketch_frequency(cache->policy, victim->khash))
+        {
+            return(candidate);
+        }
+
+        __cache_list_unlink(window, candidate);
+        candidate->list = CACHE_LFU_PROBATION;
+        __cache_list_push(probation, candidate);
+        return(victim);
+    }
+
+    return((victim != NULL) ? victim : candidate);
+}
+
+/* ============================================================================
+ *  PRIVATE Operations (Cache)
+ */
 static int __cache_node_purge (cache_t *cache)
 {
     cnode_t *node;
 
     switch (cache->type) {
         case CACHE_MRU:
-            node = cache->head;
-            cache->head = node->next;
-            cache->head->prev = NULL;
+            node = cache->lists[CACHE_LIST_MAIN].head;
             break;
         case CACHE_LRU:
-            node = cache->tail;
-            cache->tail = node->prev;
-            cache->tail->next = NULL;
+            node = cache->lists[CACHE_LIST_MAIN].tail;
+            break;
+        case CACHE_ARC:
+            node = __cache_evict_arc(cache);
+            break;
+        case CACHE_TINYLFU:
+            node = __cache_evict_tinylfu(cache);
             break;
         default:
             return(-1);
     }
 
-    __cache_ht_remove(cache, &node);
-    __cache_node_free(cache, node);
+    /* Every item is retained, nothing to evict */
+    if (node == NULL)
+        return(-1);
+
+    __cache_node_unlink(cache, node);
+    __cache_ht_drop(cache, node);
 
     return(0);
 }
 
+static int __cache_insert (cache_t *cache,
+                           const void *key,
+                           void *data,
+                           size_t hash,
+                           size_t weight,
+                           uint64_t ttl)
+{
+    unsigned int list;
+    cnode_t *node;
+
+    /* Would never fit, even with an empty cache */
+    if (cache->max_weight > 0 && weight > cache->max_weight)
+        return(-3);
+
+    if ((node = __cache_ht_lookup(cache, key, hash)->node) != NULL) {
+        if (node->retain > 0 || !__cnode_expired(node))
+            return(-2);
+
+        __cache_node_unlink(cache, node);
+        __cache_ht_drop(cache, node);
+    }
+
+    list = __cache_policy_miss(cache, hash);
+
+    /* Cache is full, purge until the new item fits */
+    while (cache->used >= cache->size || __cache_overflow(cache, weight)) {
+        if (__cache_node_purge(cache))
+            return(-1);
+    }
+
+    if (cache->type == CACHE_ARC)
+        cache->policy->ghost_b2 = 0;
+
+    if ((node = __cache_ht_insert(cache, key, data, hash)) == NULL)
+        return(-2);
+
+    node->list = list;
+    node->weight = weight;
+    cache->weight += weight;
+    if (ttl > 0) {
+        node->expire = __cache_now() + ttl;
+        cache->expiring++;
+    }
+
+    __cache_list_push(&(cache->lists[list]), node);
+    __cache_policy_balance(cache);
+    return(0);
+}
+
+static int __cache_remove (cache_t *cache,
+                           const void *key,
+                           size_t hash)
+{
+    cnode_t *node;
+
+    if ((node = __cache_ht_lookup(cache, key, hash)->node) == NULL)
+        return(-1);
+
+    if (node->retain > 0)
+        return(-2);
+
+    __cache_node_unlink(cache, node);
+    __cache_ht_drop(cache, node);
+    return(0);
+}
+
+static void *__cache_retain (cache_t *cache,
+                             const void *key,
+                             size_t hash)
+{
+    cnode_t *node;
+
+    __cache_policy_access(cache, hash);
+
+    if ((node = __cache_ht_lookup(cache, key, hash)->node) == NULL)
+        return(NULL);
+
+    /* Lazy expiry, a retained item goes away on its last release */
+    if (__cnode_expired(node)) {
+        if (node->retain == 0) {
+            __cache_node_unlink(cache, node);
+            __cache_ht_drop(cache, node);
+        }
+        return(NULL);
+    }
+
+    if (node->retain == 0) {
+        __cache_node_unlink(cache, node);
+        __cache_list_push(&(cache->retained), node);
+    }
+
+    __cache_policy_hit(cache, node);
+    node->retain++;
+    return(node->data);
+}
+
+static int __cache_release (cache_t *cache,
+                            const void *key,
+                            size_t hash)
+{
+    cnode_t *node;
+
+    if ((node = __cache_ht_lookup(cache, key, hash)->node) == NULL)
+        return(-1);
+
+    if (node->retain == 0)
+        return(-2);
+
+    if (node->retain == 1) {
+        __cache_node_unlink(cache, node);
+        node->retain = 0;
+
+        if (__cnode_expired(node)) {
+            __cache_ht_drop(cache, node);
+        } else {
+            __cache_list_push(&(cache->lists[node->list]), node);
+            __cache_policy_balance(cache);
+        }
+    } else {
+        node->retain--;
+    }
+
+    return(0);
+}
+
+static void __cache_reset (cache_t *cache) {
+    cnode_t *node;
+    unsigned int i;
+
+    for (i = 0; i < CACHE_NLISTS; ++i) {
+        while ((node = cache->lists[i].head) != NULL) {
+            cache->lists[i].head = node->next;
+            __cache_node_free(cache, node);
+        }
+        cache->lists[i].tail = NULL;
+        cache->lists[i].used = 0U;
+    }
+
+    memset(cache->hashtable, 0, __ht_size(cache->mask + 1));
+    cache->used = 0U;
+    cache->weight = 0U;
+    cache->expiring = 0U;
+
+    if (cache->type == CACHE_ARC)
+        __ghost_reset(cache->policy, cache->size);
+    else if (cache->type == CACHE_TINYLFU) {
+        memset(cache->policy->sketch, 0,
+               CACHE_SKETCH_SIZE(cache->policy->sketch_mask + 1));
+        cache->policy->samples = 0;
+    }
+}
+
+static size_t __cache_expire (cache_t *cache) {
+    cnode_t *node;
+    cnode_t *next;
+    unsigned int i;
+    uint64_t now;
+    size_t count;
+
+    if (cache->expiring == 0)
+        return(0);
+
+    count = 0;
+    now = __cache_now();
+    for (i = 0; i < CACHE_NLISTS; ++i) {
+        for (node = cache->lists[i].head; node != NULL; node = next) {
+            next = node->next;
+            if (node->expire != 0 && node->expire <= now) {
+                __cache_list_unlink(&(cache->lists[i]), node);
+                __cache_ht_drop(cache, node);
+                count++;
+            }
+        }
+    }
+
+    return(count);
+}
+
+static int __cache_set_budget (cache_t *cache, size_t max_weight) {
+    cache->max_weight = max_weight;
+    while (__cache_overflow(cache, 0)) {
+        if (__cache_node_purge(cache))
+            return(-1);
+    }
+    return(0);
+}
+
+/* ============================================================================
+ *  Cache
+ */
 cache_t *cache_alloc (cache_t *cache,
                       cache_type_t type,
                       size_t size,
@@ -185,11 +961,13 @@ cache_t *cache_alloc (cache_t *cache,
     /* Init Allocator */
     cache->alk = (allocator != NULL) ? allocator : &__default_mmallocator;
 
-    /* Allocate Hashtable */
-    nbucket = __nbucket_roundup(size);
+    /* Allocate Hashtable, at most 3/4 full */
+    nbucket = __nbucket_roundup(size + size / 3);
     if ((cache->hashtable = __ht_alloc(cache, nbucket)) == NULL)
         return(NULL);
 
+    memset(cache->hashtable, 0, __ht_size(nbucket));
+
     cache->keycmp_func = keycmp_func;
     cache->hash_func = hash_func;
     cache->free_func = free_func;
@@ -198,18 +976,40 @@ cache_t *cache_alloc (cache_t *cache,
     cache->mask = nbucket - 1;
     cache->size = size;
     cache->used = 0U;
-    cache->head = NULL;
-    cache->tail = NULL;
-    cache->retained = NULL;
+    cache->weight = 0U;
+    cache->max_weight = 0U;
+    cache->expiring = 0U;
+    cache->nodes = 0U;
+    cache->slabs = NULL;
+    cache->free_nodes = NULL;
     cache->type = type;
+    memset(cache->lists, 0, sizeof(cache->lists));
+    memset(&(cache->retained), 0, sizeof(cache_list_t));
+
+    /* Policy state, LRU and MRU have none */
+    cache->policy = NULL;
+    if (type == CACHE_ARC || type == CACHE_TINYLFU) {
+        if ((cache->policy = __cache_policy_alloc(cache)) == NULL) {
+            __mmfree(cache, cache->hashtable);
+            return(NULL);
+        }
+    }
 
     return(cache);
 }
 
 int cache_free (cache_t *cache) {
+    cslab_t *slab;
+
     if (cache_clear(cache))
         return(-1);
 
+    while ((slab = cache->slabs) != NULL) {
+        cache->slabs = slab->next;
+        __mmfree(cache, slab);
+    }
+
+    __cache_policy_free(cache);
     __mmfree(cache, cache->hashtable);
     return(0);
 }
@@ -218,122 +1018,343 @@ int cache_insert (cache_t *cache,
                   const void *key,
                   void *data)
 {
-    cnode_t *node;
-
-    /* Cache is full, purge one element */
-    if (cache->used == cache->size) {
-        if (__cache_node_purge(cache))
-            return(-1);
-    }
-
-    if ((node = __cache_ht_insert(cache, key, data)) == NULL)
-        return(-2);
-
-    if (cache->head != NULL)
-        cache->head->prev = node;
-    node->next = cache->head;
-    node->prev = NULL;
-    cache->head = node;
-    if (cache->tail == NULL)
-        cache->tail = node;
+    return(__cache_insert(cache, key, data, __cache_hash(cache, key), 1, 0));
+}
 
-    return(0);
+int cache_insert_weighted (cache_t *cache,
+                           const void *key,
+                           void *data,
+                           size_t weight,
+                           uint64_t ttl)
+{
+    return(__cache_insert(cache, key, data, __cache_hash(cache, key),
+                          weight, ttl));
 }
 
 int cache_remove (cache_t *cache,
                   const void *key)
 {
-    cnode_t **node;
-    cnode_t *p;
+    return(__cache_remove(cache, key, __cache_hash(cache, key)));
+}
 
-    if (*(node = __cache_ht_lookup(cache, key)) == NULL)
+int cache_clear (cache_t *cache)
+{
+    if (cache->retained.head != NULL)
         return(-1);
 
-    p = *node;
-    if (p->retain > 0)
-        return(-2);
+    __cache_reset(cache);
+    return(0);
+}
 
-    if (p->prev != NULL)
-        p->prev->next = p->next;
-    if (p->next != NULL)
-        p->next->prev = p->prev;
+int cache_set_budget (cache_t *cache,
+                      size_t max_weight)
+{
+    return(__cache_set_budget(cache, max_weight));
+}
 
-    __cache_ht_remove(cache, node);
-    __cache_node_free(cache, p);
-    return(0);
+size_t cache_expire (cache_t *cache) {
+    return(__cache_expire(cache));
 }
 
-int cache_clear (cache_t *cache)
+int cache_contains (const cache_t *cache,
+                    const void *key)
 {
     cnode_t *node;
 
-    if (cache->retained != NULL)
-        return(-1);
+    node = __cache_ht_lookup(cache, key, __cache_hash(cache, key))->node;
+    return(node != NULL && !__cnode_expired(node));
+}
+
+void *cache_retain (cache_t *cache,
+                    const void *key)
+{
+    return(__cache_retain(cache, key, __cache_hash(cache, key)));
+}
 
-    while (cache->head != NULL) {
-        node = cache->head;
-        cache->head = node->next;
-        __cache_ht_remove(cache, &node);
+int cache_release (cache_t *cache,
+                   const void *key)
+{
+    return(__cache_release(cache, key, __cache_hash(cache, key)));
+}
+
+/* ============================================================================
+ *  PRIVATE Operations (Segmented Cache)
+ */
+static size_t __scache_nsegments (size_t nsegments, size_t size) {
+    size_t n;
+    long ncpus;
+
+    if (nsegments == 0) {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nsegments = (ncpus > 0) ? (4 * ncpus) : 16;
     }
 
-    cache->tail = NULL;
+    /* Power of two, and at least one item per segment */
+    for (n = 1; n < nsegments; n <<= 1);
+    while (n > 1 && n > size)
+        n >>= 1;
 
-    return(0);
+    return(n);
 }
 
-int cache_contains (const cache_t *cache,
-                    const void *key)
+static cache_segment_t *__scache_segment (const scache_t *scache,
+                                          size_t hash)
 {
-    return(*__cache_ht_lookup(cache, key) != NULL);
+    /* The low bits pick the bucket, mix the high ones in for the segment */
+    hash = (hash ^ (hash >> 16)) * 0x45d9f3bU;
+    return(&(scache->segments[(hash >> 8) & scache->mask]));
 }
 
-void *cache_retain (cache_t *cache,
-                    const void *key)
+/* ============================================================================
+ *  Segmented Cache
+ */
+scache_t *scache_alloc (scache_t *scache,
+                        cache_type_t type,
+                        size_t size,
+                        size_t nsegments,
+                        item_keycmp_t keycmp_func,
+                        item_hash_t hash_func,
+                        mmallocator_t *allocator,
+                        mmfree_t free_func,
+                        void *user_data)
 {
-    cnode_t *node;
+    cache_segment_t *segment;
+    size_t seg_size;
+    size_t i;
 
-    if ((node = *__cache_ht_lookup(cache, key)) == NULL)
+    scache->alk = (allocator != NULL) ? allocator : &__default_mmallocator;
+    scache->hash_func = hash_func;
+    scache->user_data = user_data;
+
+    nsegments = __scache_nsegments(nsegments, size);
+    seg_size = (size + nsegments - 1) / nsegments;
+
+    /* Allocate one extra line to align the segment array */
+    scache->blob = __mmalloc(scache, (nsegments + 1) * sizeof(cache_segment_t));
+    if (scache->blob == NULL)
         return(NULL);
 
-    if (node->retain++ == 0) {
-        /* Update Cache List */
-        if (node->prev != NULL)
-            node->prev->next = node->next;
-        if (node->next != NULL)
-            node->next->prev = node->prev;
+    scache->segments = (cache_segment_t *)
+        (((uintptr_t)scache->blob + CACHE_LINE_SIZE - 1) &
+         ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    scache->mask = nsegments - 1;
+    scache->nsegments = nsegments;
+
+    for (i = 0; i < nsegments; ++i) {
+        segment = &(scache->segments[i]);
+        if (!cache_alloc(&(segment->u.s.cache), type, seg_size,
+                         keycmp_func, hash_func, allocator,
+                         free_func, user_data))
+        {
+            while (i-- > 0) {
+                segment = &(scache->segments[i]);
+                cache_free(&(segment->u.s.cache));
+                pthread_mutex_destroy(&(segment->u.s.lock));
+            }
+            __mmfree(scache, scache->blob);
+            return(NULL);
+        }
+
+        pthread_mutex_init(&(segment->u.s.lock), NULL);
+    }
+
+    return(scache);
+}
+
+int scache_free (scache_t *scache) {
+    cache_segment_t *segment;
+    size_t i;
+
+    if (scache_clear(scache))
+        return(-1);
 
-        /* Update Retain List */
-        node->prev = NULL;
-        node->next = cache->retained;
-        cache->retained = node;
+    for (i = 0; i < scache->nsegments; ++i) {
+        segment = &(scache->segments[i]);
+        cache_free(&(segment->u.s.cache));
+        pthread_mutex_destroy(&(segment->u.s.lock));
     }
 
-    return(node->data);
+    __mmfree(scache, scache->blob);
+    return(0);
 }
 
-int cache_release (cache_t *cache,
+int scache_insert (scache_t *scache,
+                   const void *key,
+                   void *data)
+{
+    return(scache_insert_weighted(scache, key, data, 1, 0));
+}
+
+int scache_insert_weighted (scache_t *scache,
+                            const void *key,
+                            void *data,
+                            size_t weight,
+                            uint64_t ttl)
+{
+    cache_segment_t *segment;
+    size_t hash;
+    int res;
+
+    hash = __cache_hash(scache, key);
+    segment = __scache_segment(scache, hash);
+
+    __scache_lock(segment);
+    res = __cache_insert(&(segment->u.s.cache), key, data, hash, weight, ttl);
+    __scache_unlock(segment);
+
+    return(res);
+}
+
+int scache_remove (scache_t *scache,
                    const void *key)
 {
+    cache_segment_t *segment;
+    size_t hash;
+    int res;
+
+    hash = __cache_hash(scache, key);
+    segment = __scache_segment(scache, hash);
+
+    __scache_lock(segment);
+    res = __cache_remove(&(segment->u.s.cache), key, hash);
+    __scache_unlock(segment);
+
+    return(res);
+}
+
+int scache_clear (scache_t *scache) {
+    size_t i;
+    int res;
+
+    /* Take every segment so the clear is all or nothing */
+    res = 0;
+    for (i = 0; i < scache->nsegments; ++i) {
+        __scache_lock(&(scache->segments[i]));
+        if (scache->segments[i].u.s.cache.retained.head != NULL)
+            res = -1;
+    }
+
+    for (i = 0; i < scache->nsegments; ++i) {
+        if (!res)
+            __cache_reset(&(scache->segments[i].u.s.cache));
+        __scache_unlock(&(scache->segments[i]));
+    }
+
+    return(res);
+}
+
+int scache_contains (scache_t *scache,
+                     const void *key)
+{
+    cache_segment_t *segment;
     cnode_t *node;
+    size_t hash;
+    int res;
 
-    if ((node = *__cache_ht_lookup(cache, key)) == NULL)
-        return(-1);
+    hash = __cache_hash(scache, key);
+    segment = __scache_segment(scache, hash);
+
+    __scache_lock(segment);
+    node = __cache_ht_lookup(&(segment->u.s.cache), key, hash)->node;
+    res = (node != NULL && !__cnode_expired(node));
+    __scache_unlock(segment);
 
-    if (--(node->retain) == 0) {
-        /* Update Retain List */
-        if (node->prev != NULL)
-            node->prev->next = node->next;
-        if (node->next != NULL)
-            node->next->prev = node->prev;
+    return(res);
+}
+
+void *scache_retain (scache_t *scache,
+                     const void *key)
+{
+    cache_segment_t *segment;
+    size_t hash;
+    void *data;
+
+    hash = __cache_hash(scache, key);
+    segment = __scache_segment(scache, hash);
+
+    __scache_lock(segment);
+    data = __cache_retain(&(segment->u.s.cache), key, hash);
+    __scache_unlock(segment);
 
-        /* Update Cache List */
-        node->next = cache->head;
-        node->prev = NULL;
-        cache->head = node;
-        if (cache->tail == NULL)
-            cache->tail = node;
+    return(data);
+}
+
+int scache_release (scache_t *scache,
+                    const void *key)
+{
+    cache_segment_t *segment;
+    size_t hash;
+    int res;
+
+    hash = __cache_hash(scache, key);
+    segment = __scache_segment(scache, hash);
+
+    __scache_lock(segment);
+    res = __cache_release(&(segment->u.s.cache), key, hash);
+    __scache_unlock(segment);
+
+    return(res);
+}
+
+size_t scache_used (scache_t *scache) {
+    size_t used;
+    size_t i;
+
+    used = 0;
+    for (i = 0; i < scache->nsegments; ++i) {
+        __scache_lock(&(scache->segments[i]));
+        used += scache->segments[i].u.s.cache.used;
+        __scache_unlock(&(scache->segments[i]));
     }
 
-    return(0);
+    return(used);
 }
 
+size_t scache_weight (scache_t *scache) {
+    size_t weight;
+    size_t i;
+
+    weight = 0;
+    for (i = 0; i < scache->nsegments; ++i) {
+        __scache_lock(&(scache->segments[i]));
+        weight += scache->segments[i].u.s.cache.weight;
+        __scache_unlock(&(scache->segments[i]));
+    }
+
+    return(weight);
+}
+
+int scache_set_budget (scache_t *scache,
+                       size_t max_weight)
+{
+    size_t seg_weight;
+    size_t i;
+    int res;
+
+    /* Split evenly, a zero budget disables the byte bound */
+    seg_weight = (max_weight + scache->nsegments - 1) / scache->nsegments;
+
+    res = 0;
+    for (i = 0; i < scache->nsegments; ++i) {
+        __scache_lock(&(scache->segments[i]));
+        res |= __cache_set_budget(&(scache->segments[i].u.s.cache), seg_weight);
+        __scache_unlock(&(scache->segments[i]));
+    }
+
+    return(res);
+}
+
+size_t scache_expire (scache_t *scache) {
+    size_t count;
+    size_t i;
+
+    /* One segment at a time, the others keep serving */
+    count = 0;
+    for (i = 0; i < scache->nsegments; ++i) {
+        __scache_lock(&(scache->segments[i]));
+        count += __cache_expire(&(scache->segments[i].u.s.cache));
+        __scache_unlock(&(scache->segments[i]));
+    }
+
+    return(count);
+}
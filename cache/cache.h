@@ -30,6 +30,13 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _cache_segment cache_segment_t;
+typedef struct _cache_policy cache_policy_t;
+typedef struct _cslab cslab_t;
+typedef struct _cslot cslot_t;
 typedef struct _cnode cnode_t;
 
 typedef size_t (*item_hash_t)   (void *user_data,
@@ -47,11 +54,28 @@ typedef struct _mmallocator {
     void *    user_data;
 } mmallocator_t;
 
+/*
+ * CACHE_ARC adapts between recency and frequency using the hashes of the
+ * last evicted keys (Megiddo & Modha). CACHE_TINYLFU is W-TinyLFU: a 1%
+ * LRU window in front of a segmented LRU, where a count-min sketch of the
+ * key hashes decides whether a window item may replace a main one.
+ * Both bound the cache by item count, weights are still honoured.
+ */
 typedef enum _cache_type {
     CACHE_LRU,
     CACHE_MRU,
+    CACHE_ARC,
+    CACHE_TINYLFU,
 } cache_type_t;
 
+#define CACHE_NLISTS        (3)
+
+typedef struct _cache_list {
+    cnode_t *     head;
+    cnode_t *     tail;
+    size_t        used;
+} cache_list_t;
+
 typedef struct _cache {
     mmallocator_t *alk;
 
@@ -60,17 +84,41 @@ typedef struct _cache {
     mmfree_t      free_func;
     void *        user_data;
 
-    cnode_t *     head;
-    cnode_t *     tail;
-    cnode_t *     retained;
-    cnode_t **    hashtable;
+    cache_list_t  lists[CACHE_NLISTS];  /* Evictable items, per policy */
+    cache_list_t  retained;
+    cache_policy_t *policy;
+    cslot_t *     hashtable;          /* Open addressing, hash inline */
+    cslab_t *     slabs;              /* Node storage */
+    cnode_t *     free_nodes;
 
     size_t        used;
     size_t        size;
     size_t        mask;
+    size_t        weight;             /* Sum of the item weights */
+    size_t        max_weight;         /* Weight budget, 0 is unbounded */
+    size_t        expiring;           /* Items with a TTL */
+    size_t        nodes;              /* Nodes in the slabs */
     cache_type_t  type;
 } cache_t;
 
+/*
+ * Segmented cache, safe to share between threads.
+ * Keys are split by hash into independent segments, each one is a cache_t
+ * with its own lock, hashtable and LRU/MRU list. Capacity and eviction are
+ * per segment (size / nsegments items each), so the aggregate is only
+ * approximately LRU/MRU.
+ */
+typedef struct _scache {
+    mmallocator_t *   alk;
+    item_hash_t       hash_func;
+    void *            user_data;
+
+    cache_segment_t * segments;
+    void *            blob;
+    size_t            nsegments;
+    size_t            mask;
+} scache_t;
+
 cache_t *   cache_alloc         (cache_t *cache,
                                  cache_type_t type,
                                  size_t size,
@@ -84,10 +132,30 @@ int         cache_free          (cache_t *cache);
 int         cache_insert        (cache_t *cache,
                                  const void *key,
                                  void *data);
+/*
+ * Insert an item that counts weight (e.g. bytes) against the budget set
+ * with cache_set_budget(), evicting until it fits, and that expires ttl
+ * msec from now (0 never). Items larger than the whole budget return -3.
+ * cache_insert() is a weight 1 item without TTL.
+ */
+int         cache_insert_weighted (cache_t *cache,
+                                 const void *key,
+                                 void *data,
+                                 size_t weight,
+                                 uint64_t ttl);
 int         cache_remove        (cache_t *cache,
                                  const void *key);
 int         cache_clear         (cache_t *cache);
 
+/* The item count given to cache_alloc() still bounds the cache too. */
+int         cache_set_budget    (cache_t *cache,
+                                 size_t max_weight);
+/*
+ * Expired items are dropped lazily on lookup, call this periodically to
+ * reclaim the ones nobody asks for. Returns the number of items dropped.
+ */
+size_t      cache_expire        (cache_t *cache);
+
 int         cache_contains      (const cache_t *cache,
                                  const void *key);
 void *      cache_retain        (cache_t *cache,
@@ -95,5 +163,44 @@ void *      cache_retain        (cache_t *cache,
 int         cache_release       (cache_t *cache,
                                  const void *key);
 
+/* nsegments is rounded up to a power of two, 0 picks 4 per online CPU. */
+scache_t *  scache_alloc        (scache_t *scache,
+                                 cache_type_t type,
+                                 size_t size,
+                                 size_t nsegments,
+                                 item_keycmp_t keycmp_func,
+                                 item_hash_t hash_func,
+                                 mmallocator_t *allocator,
+                                 mmfree_t free_func,
+                                 void *user_data);
+int         scache_free         (scache_t *scache);
+
+int         scache_insert       (scache_t *scache,
+                                 const void *key,
+                                 void *data);
+int         scache_insert_weighted (scache_t *scache,
+                                 const void *key,
+                                 void *data,
+                                 size_t weight,
+                                 uint64_t ttl);
+int         scache_remove       (scache_t *scache,
+                                 const void *key);
+int         scache_clear        (scache_t *scache);
+
+/* The budget is split evenly between the segments. */
+int         scache_set_budget   (scache_t *scache,
+                                 size_t max_weight);
+size_t      scache_expire       (scache_t *scache);
+
+int         scache_contains     (scache_t *scache,
+                                 const void *key);
+/* The returned data stays valid, and is never evicted, until released. */
+void *      scache_retain       (scache_t *scache,
+                                 const void *key);
+int         scache_release      (scache_t *scache,
+                                 const void *key);
+size_t      scache_used         (scache_t *scache);
+size_t      scache_weight       (scache_t *scache);
+
 #endif /* !_CACHE_H_ */
 
@@ -27,10 +27,29 @@
  * -----------------------------------------------------------------------------
  */
 
+#include <sys/time.h>
+#include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <stdio.h>
 #include "cache.h"
 
+#define TEST_THREADS        (4)
+#define TEST_THREAD_OPS     (100000)
+#define TEST_SCACHE_KEYS    (4096)
+#define TEST_SCACHE_SIZE    (1024)
+
+struct test_thread {
+    pthread_t thread;
+    scache_t *scache;
+    unsigned int seed;
+    unsigned long hits;
+    unsigned long errors;
+};
+
+static char __keys[TEST_SCACHE_KEYS][16];
+
 static int __keycmp (void *user_data, const void *k1, const void *k2) {
     return(strcmp((const char *)k1, (const char *)k2));
 }
@@ -46,9 +65,316 @@ static size_t __hash (void *user_data, const void *key)
     return(hash);
 }
 
+static void __check (int cond, const char *message) {
+    if (!cond)
+        printf(" - %s\n", message);
+}
+
+static void __test_lists (void) {
+    cache_t cache;
+
+    /* Removing head and tail must keep the list usable for eviction */
+    cache_alloc(&cache, CACHE_LRU, 3, __keycmp, __hash, NULL, NULL, NULL);
+    cache_insert(&cache, "Key1", "Item 1");
+    cache_insert(&cache, "Key2", "Item 2");
+    cache_insert(&cache, "Key3", "Item 3");
+    __check(cache_remove(&cache, "Key1") == 0, "Remove tail");
+    __check(cache_remove(&cache, "Key3") == 0, "Remove head");
+    __check(cache.lists[0].head == cache.lists[0].tail, "Head/Tail after remove");
+
+    /* Retained items are never evicted */
+    __check(cache_retain(&cache, "Key2") != NULL, "Retain Key2");
+    cache_insert(&cache, "Key4", "Item 4");
+    cache_insert(&cache, "Key5", "Item 5");
+    cache_insert(&cache, "Key6", "Item 6");
+    __check(cache.used == 3, "Used after eviction");
+    __check(cache_contains(&cache, "Key2"), "Retained Key2 evicted");
+    __check(!cache_contains(&cache, "Key4"), "LRU Key4 not evicted");
+    __check(cache_clear(&cache) < 0, "Clear with retained items");
+    __check(cache_release(&cache, "Key2") == 0, "Release Key2");
+    __check(cache_release(&cache, "Key2") < 0, "Release not retained");
+    __check(cache.retained.head == NULL, "Retained list after release");
+
+    /* Everything retained, insert can't purge */
+    cache_retain(&cache, "Key2");
+    cache_retain(&cache, "Key5");
+    cache_retain(&cache, "Key6");
+    __check(cache_insert(&cache, "Key7", "Item 7") < 0, "Insert when retained");
+    cache_release(&cache, "Key5");
+    cache_release(&cache, "Key6");
+    cache_release(&cache, "Key2");
+
+    __check(cache_clear(&cache) == 0, "Clear");
+    __check(!cache_contains(&cache, "Key6"), "Contains after clear");
+    __check(cache_insert(&cache, "Key6", "Item 6") == 0, "Insert after clear");
+    cache_free(&cache);
+}
+
+static void __test_weight (void) {
+    scache_t scache;
+    cache_t cache;
+
+    cache_alloc(&cache, CACHE_LRU, 16, __keycmp, __hash, NULL, NULL, NULL);
+    __check(cache_set_budget(&cache, 1000) == 0, "Set budget");
+    cache_insert_weighted(&cache, "Key1", "Item 1", 400, 0);
+    cache_insert_weighted(&cache, "Key2", "Item 2", 400, 0);
+    __check(cache.weight == 800, "Weight after insert");
+
+    /* Key1 is the LRU one, it makes room for Key3 */
+    cache_insert_weighted(&cache, "Key3", "Item 3", 300, 0);
+    __check(!cache_contains(&cache, "Key1"), "Key1 not evicted");
+    __check(cache.weight == 700, "Weight after eviction");
+    __check(cache_insert_weighted(&cache, "Key4", "Item 4", 1001, 0) == -3,
+            "Insert over budget");
+    __check(cache_contains(&cache, "Key2"), "Key2 evicted by oversized");
+
+    /* A big item pushes out more than one */
+    cache_retain(&cache, "Key2");
+    cache_insert_weighted(&cache, "Key5", "Item 5", 600, 0);
+    __check(cache_contains(&cache, "Key2"), "Retained Key2 evicted");
+    __check(!cache_contains(&cache, "Key3"), "Key3 not evicted");
+    __check(cache.weight == 1000, "Weight with retained");
+    cache_release(&cache, "Key2");
+
+    /* Shrinking the budget evicts right away */
+    __check(cache_set_budget(&cache, 700) == 0, "Shrink budget");
+    __check(cache.weight == 400 && cache_contains(&cache, "Key2"),
+            "Weight after shrink");
+    __check(cache_remove(&cache, "Key2") == 0, "Remove Key2");
+    __check(cache.weight == 0, "Weight after remove");
+    cache_free(&cache);
+
+    scache_alloc(&scache, CACHE_LRU, 1024, 4, __keycmp, __hash,
+                 NULL, NULL, NULL);
+    scache_set_budget(&scache, 4000);
+    scache_insert_weighted(&scache, __keys[0], __keys[0], 100, 0);
+    scache_insert_weighted(&scache, __keys[1], __keys[1], 100, 0);
+    __check(scache_weight(&scache) == 200, "Segmented weight");
+    __check(scache_insert_weighted(&scache, __keys[2], __keys[2], 1001, 0) == -3,
+            "Segmented insert over segment budget");
+    scache_free(&scache);
+}
+
+static void __test_ttl (void) {
+    scache_t scache;
+    cache_t cache;
+
+    cache_alloc(&cache, CACHE_LRU, 16, __keycmp, __hash, NULL, NULL, NULL);
+    cache_insert_weighted(&cache, "Key1", "Item 1", 1, 50);
+    cache_insert_weighted(&cache, "Key2", "Item 2", 1, 50);
+    cache_insert_weighted(&cache, "Key3", "Item 3", 1, 50);
+    cache_insert(&cache, "Key4", "Item 4");
+    __check(cache_retain(&cache, "Key3") != NULL, "Retain Key3");
+    __check(cache_expire(&cache) == 0, "Expire too early");
+
+    usleep(80000);
+
+    /* Lazy on lookup, periodic for the rest */
+    __check(!cache_contains(&cache, "Key1"), "Contains expired");
+    __check(cache_retain(&cache, "Key1") == NULL, "Retain expired");
+    __check(cache.used == 3, "Used after lazy expiry");
+    __check(cache_expire(&cache) == 1, "Expire Key2");
+    __check(cache_contains(&cache, "Key4"), "Key4 without TTL expired");
+
+    /* The retained one goes away on its last release */
+    __check(cache_retain(&cache, "Key3") == NULL, "Retain expired Key3");
+    __check(cache_insert(&cache, "Key3", "Item 3") == -2, "Replace retained");
+    cache_release(&cache, "Key3");
+    __check(cache.used == 1 && cache.expiring == 0, "Used after release");
+    __check(cache_insert(&cache, "Key3", "Item 3") == 0, "Insert Key3 again");
+    cache_free(&cache);
+
+    scache_alloc(&scache, CACHE_LRU, 1024, 4, __keycmp, __hash,
+                 NULL, NULL, NULL);
+    scache_insert_weighted(&scache, __keys[0], __keys[0], 1, 50);
+    scache_insert_weighted(&scache, __keys[1], __keys[1], 1, 50);
+    scache_insert(&scache, __keys[2], __keys[2]);
+    usleep(80000);
+    __check(scache_expire(&scache) == 2, "Segmented expire");
+    __check(scache_used(&scache) == 1, "Segmented used after expire");
+    scache_free(&scache);
+}
+
+static size_t __test_policy_access (cache_t *cache, const char *key) {
+    if (cache_retain(cache, key) != NULL) {
+        cache_release(cache, key);
+        return(1);
+    }
+    cache_insert(cache, key, (void *)key);
+    return(0);
+}
+
+/* A hot set revisited during a long scan, returns the hot hits (of 200) */
+static size_t __test_policy (cache_type_t type) {
+    cache_t cache;
+    size_t hits;
+    int i;
+
+    cache_alloc(&cache, type, 100, __keycmp, __hash, NULL, NULL, NULL);
+    for (i = 0; i < 60; ++i)
+        __test_policy_access(&cache, __keys[i % 20]);
+
+    /* Each hot key comes back after 100 scan keys, too late for LRU */
+    hits = 0;
+    for (i = 0; i < 1000; ++i) {
+        __test_policy_access(&cache, __keys[100 + i]);
+        if ((i % 5) == 0)
+            hits += __test_policy_access(&cache, __keys[(i / 5) % 20]);
+    }
+    __check(cache.used <= 100, "Policy used over size");
+
+    /* Retained items stay out of the policy lists */
+    if (cache_retain(&cache, __keys[1099]) != NULL) {
+        for (i = 2000; i < 2200; ++i)
+            __test_policy_access(&cache, __keys[i]);
+        __check(cache_contains(&cache, __keys[1099]), "Retained evicted");
+        cache_release(&cache, __keys[1099]);
+    }
+
+    __check(cache_clear(&cache) == 0, "Policy clear");
+    __check(cache_free(&cache) == 0, "Policy free");
+    return(hits);
+}
+
+static size_t __test_allocs;
+
+static void *__test_malloc (void *user_data, size_t n) {
+    __test_allocs++;
+    return(malloc(n));
+}
+
+static void __test_mfree (void *user_data, void *ptr) {
+    free(ptr);
+}
+
+/* Few distinct hashes, long probe runs to shift back on remove */
+static size_t __hash_collide (void *user_data, const void *key) {
+    return(__hash(user_data, key) & 0x7);
+}
+
+static void __test_storage (void) {
+    mmallocator_t allocator;
+    char present[512];
+    cache_t cache;
+    unsigned int seed;
+    size_t allocs;
+    int i, k, errors;
+
+    allocator.alloc = __test_malloc;
+    allocator.free = __test_mfree;
+    allocator.user_data = NULL;
+
+    /* Insert/evict churn allocates nothing once the slabs are full */
+    cache_alloc(&cache, CACHE_TINYLFU, 300, __keycmp, __hash,
+                &allocator, NULL, NULL);
+    for (i = 0; i < 1000; ++i)
+        cache_insert(&cache, __keys[i], __keys[i]);
+    allocs = __test_allocs;
+    for (i = 0; i < 20000; ++i) {
+        k = (i * 7919) % TEST_SCACHE_KEYS;
+        if (cache_retain(&cache, __keys[k]) != NULL)
+            cache_release(&cache, __keys[k]);
+        else
+            cache_insert(&cache, __keys[k], __keys[k]);
+        if ((i % 13) == 0)
+            cache_remove(&cache, __keys[(k + 1) % TEST_SCACHE_KEYS]);
+    }
+    __check(allocs == __test_allocs, "Allocations in steady state");
+    __check(cache.nodes == 300, "Slab nodes");
+    cache_free(&cache);
+
+    /* Random insert/remove with colliding hashes, against a reference */
+    cache_alloc(&cache, CACHE_LRU, 512, __keycmp, __hash_collide,
+                NULL, NULL, NULL);
+    memset(present, 0, sizeof(present));
+    seed = 7;
+    for (i = 0; i < 50000; ++i) {
+        k = rand_r(&seed) % 512;
+        if (present[k]) {
+            present[k] = (cache_remove(&cache, __keys[k]) != 0);
+        } else {
+            present[k] = (cache_insert(&cache, __keys[k], __keys[k]) == 0);
+        }
+    }
+
+    errors = 0;
+    for (k = 0; k < 512; ++k)
+        errors += (cache_contains(&cache, __keys[k]) != present[k]);
+    __check(errors == 0, "Index after collisions");
+    cache_free(&cache);
+}
+
+static void *__scache_worker (void *arg) {
+    struct test_thread *t = (struct test_thread *)arg;
+    const char *key;
+    void *data;
+    int i;
+
+    for (i = 0; i < TEST_THREAD_OPS; ++i) {
+        key = __keys[rand_r(&(t->seed)) % TEST_SCACHE_KEYS];
+        if ((data = scache_retain(t->scache, key)) != NULL) {
+            if (data != key)
+                t->errors++;
+            t->hits++;
+            if (scache_release(t->scache, key))
+                t->errors++;
+        } else {
+            scache_insert(t->scache, key, (void *)key);
+        }
+    }
+
+    return(NULL);
+}
+
+static void __test_scache (size_t nsegments) {
+    struct test_thread threads[TEST_THREADS];
+    unsigned long hits, errors;
+    struct timeval st, et;
+    scache_t scache;
+    double msec;
+    int i;
+
+    scache_alloc(&scache, CACHE_LRU, TEST_SCACHE_SIZE, nsegments,
+                 __keycmp, __hash, NULL, NULL, NULL);
+
+    gettimeofday(&st, NULL);
+    for (i = 0; i < TEST_THREADS; ++i) {
+        threads[i].scache = &scache;
+        threads[i].seed = i + 1;
+        threads[i].hits = 0;
+        threads[i].errors = 0;
+        pthread_create(&(threads[i].thread), NULL, __scache_worker, &threads[i]);
+    }
+
+    hits = errors = 0;
+    for (i = 0; i < TEST_THREADS; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        hits += threads[i].hits;
+        errors += threads[i].errors;
+    }
+    gettimeofday(&et, NULL);
+
+    msec = (et.tv_sec - st.tv_sec) * 1000.0 + (et.tv_usec - st.tv_usec) / 1000.0;
+    printf("Segments %3lu: %d threads %.2fmsec hits %.1f%%\n",
+           (unsigned long)scache.nsegments, TEST_THREADS, msec,
+           (100.0 * hits) / (TEST_THREADS * TEST_THREAD_OPS));
+
+    __check(errors == 0, "Segmented cache errors");
+    __check(scache_used(&scache) <= TEST_SCACHE_SIZE, "Segmented cache used");
+    if (scache_retain(&scache, __keys[0]) != NULL) {
+        __check(scache_contains(&scache, __keys[0]), "Contains retained");
+        __check(scache_clear(&scache) < 0, "Clear with retained items");
+        __check(scache_release(&scache, __keys[0]) == 0, "Release");
+    }
+    __check(scache_clear(&scache) == 0, "Segmented cache clear");
+    __check(scache_used(&scache) == 0, "Segmented cache used after clear");
+    __check(scache_free(&scache) == 0, "Segmented cache free");
+}
+
 int main (int argc, char **argv) {
     cache_t cache;
     void *item;
+    int i;
 
     cache_alloc(&cache, CACHE_LRU, 5, __keycmp, __hash, NULL, NULL, NULL);
     cache_insert(&cache, "Key1", "Item 1");
@@ -101,6 +427,23 @@ int main (int argc, char **argv) {
 
     cache_free(&cache);
 
+    __test_lists();
+
+    for (i = 0; i < TEST_SCACHE_KEYS; ++i)
+        snprintf(__keys[i], sizeof(__keys[i]), "Key%d", i);
+
+    __check(__test_policy(CACHE_LRU) < 50, "LRU hot set during scan");
+    __check(__test_policy(CACHE_ARC) > 180, "ARC hot set during scan");
+    __check(__test_policy(CACHE_TINYLFU) > 180, "TinyLFU hot set during scan");
+
+    __test_storage();
+    __test_weight();
+    __test_ttl();
+
+    __test_scache(1);
+    __test_scache(4);
+    __test_scache(0);
+
     return(0);
 }
 
@@ -0,0 +1,304 @@
+#define _XOPEN_SOURCE 500
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "flathash.h"
+
+struct bench_conf {
+    uint32_t nkeys;
+    uint32_t rounds;
+    int      strings;
+};
+
+/* Counts live bytes, a size header in front of every block */
+struct bench_alloc {
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t peak;
+};
+
+struct bench_ops {
+    const char *name;
+    void *  (*alloc)    (void *table, size_t size, keycmp_t keycmp,
+                         hashtable_hash_t hash, mmallocator_t *allocator);
+    void    (*free)     (void *table);
+    int     (*insert)   (void *table, void *key, void *value);
+    int     (*remove)   (void *table, const void *key);
+    void *  (*lookup)   (const void *table, const void *key);
+};
+
+union bench_table {
+    hashtable_t hashtable;
+    flathash_t  flathash;
+};
+
+static uint64_t time_nanos (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return(now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+static void *__bench_malloc (void *user_data, uint32_t n) {
+    struct bench_alloc *stats = (struct bench_alloc *)user_data;
+    uint64_t *p;
+
+    if ((p = (uint64_t *) malloc(n + sizeof(uint64_t))) == NULL)
+        return(NULL);
+
+    *p = n;
+    stats->allocs++;
+    stats->bytes += n;
+    if (stats->bytes > stats->peak)
+        stats->peak = stats->bytes;
+    return(p + 1);
+}
+
+static void __bench_mfree (void *user_data, void *ptr) {
+    struct bench_alloc *stats = (struct bench_alloc *)user_data;
+    uint64_t *p = ((uint64_t *)ptr) - 1;
+
+    stats->bytes -= *p;
+    free(p);
+}
+
+/* ===========================================================================
+ *  Keys
+ */
+static int __u64_keycmp (void *user_data, const void *a, const void *b) {
+    return(*(const uint64_t *)a != *(const uint64_t *)b);
+}
+
+static size_t __u64_hash (void *user_data, const void *key) {
+    uint64_t x = *(const uint64_t *)key;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return((size_t)x);
+}
+
+static int __str_keycmp (void *user_data, const void *a, const void *b) {
+    return(strcmp((const char *)a, (const char *)b));
+}
+
+/* FNV-1a */
+static size_t __str_hash (void *user_data, const void *key) {
+    const unsigned char *p;
+    uint64_t h;
+
+    h = 0xcbf29ce484222325ULL;
+    for (p = (const unsigned char *)key; *p != '\0'; ++p)
+        h = (h ^ *p) * 0x100000001b3ULL;
+
+    return((size_t)h);
+}
+
+/* ===========================================================================
+ *  Tables
+ */
+static void *__ht_alloc (void *table, size_t size, keycmp_t keycmp,
+                         hashtable_hash_t hash, mmallocator_t *allocator)
+{
+    return(hashtable_alloc(table, size, keycmp, hash, allocator, NULL, NULL, NULL));
+}
+
+static void *__fh_alloc (void *table, size_t size, keycmp_t keycmp,
+                         hashtable_hash_t hash, mmallocator_t *allocator)
+{
+    return(flathash_alloc(table, size, keycmp, hash, allocator, NULL, NULL, NULL));
+}
+
+static void __ht_free (void *table) { hashtable_free(table); }
+static int __ht_insert (void *table, void *key, void *value) {
+    return(hashtable_insert(table, key, value));
+}
+static int __ht_remove (void *table, const void *key) {
+    return(hashtable_remove(table, key));
+}
+static void *__ht_lookup (const void *table, const void *key) {
+    return(hashtable_lookup(table, key));
+}
+
+static void __fh_free (void *table) { flathash_free(table); }
+static int __fh_insert (void *table, void *key, void *value) {
+    return(flathash_insert(table, key, value));
+}
+static int __fh_remove (void *table, const void *key) {
+    return(flathash_remove(table, key));
+}
+static void *__fh_lookup (const void *table, const void *key) {
+    return(flathash_lookup(table, key));
+}
+
+static const struct bench_ops __bench_tables[] = {
+    { "hashtable", __ht_alloc, __ht_free, __ht_insert, __ht_remove, __ht_lookup },
+    { "flathash",  __fh_alloc, __fh_free, __fh_insert, __fh_remove, __fh_lookup },
+};
+
+#define __BENCH_NTABLES     (sizeof(__bench_tables) / sizeof(__bench_tables[0]))
+
+/* ===========================================================================
+ *  Run
+ */
+static uint64_t __bench_rand (uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return(x * 0x2545f4914f6cdd1dULL);
+}
+
+static double __bench_ns (uint64_t stime, uint32_t ops) {
+    return((double)(time_nanos() - stime) / ops);
+}
+
+static int __bench_run (const struct bench_ops *ops,
+                        const struct bench_conf *conf,
+                        void **keys,
+                        void **missing,
+                        const uint32_t *order)
+{
+    double insert_ns, hit_ns, miss_ns, remove_ns;
+    struct bench_alloc stats;
+    mmallocator_t allocator;
+    union bench_table table;
+    uint64_t stime, bytes;
+    uint32_t i, n, errors;
+
+    memset(&stats, 0, sizeof(struct bench_alloc));
+    allocator.alloc = __bench_malloc;
+    allocator.free = __bench_mfree;
+    allocator.user_data = &stats;
+
+    n = conf->nkeys;
+    if (ops->alloc(&table, 0,
+                   conf->strings ? __str_keycmp : __u64_keycmp,
+                   conf->strings ? __str_hash : __u64_hash,
+                   &allocator) == NULL)
+    {
+        return(-1);
+    }
+
+    errors = 0;
+    stime = time_nanos();
+    for (i = 0; i < n; ++i)
+        errors += (ops->insert(&table, keys[i], keys[i]) != 0);
+    insert_ns = __bench_ns(stime, n);
+    bytes = stats.bytes;
+
+    stime = time_nanos();
+    for (i = 0; i < n; ++i)
+        errors += (ops->lookup(&table, keys[order[i]]) != keys[order[i]]);
+    hit_ns = __bench_ns(stime, n);
+
+    stime = time_nanos();
+    for (i = 0; i < n; ++i)
+        errors += (ops->lookup(&table, missing[i]) != NULL);
+    miss_ns = __bench_ns(stime, n);
+
+    stime = time_nanos();
+    for (i = 0; i < n; ++i)
+        errors += (ops->remove(&table, keys[order[i]]) != 0);
+    remove_ns = __bench_ns(stime, n);
+
+    ops->free(&table);
+
+    printf("%-10s %8.1f %8.1f %8.1f %8.1f %10.1f %10.1f %6u\n",
+           ops->name, insert_ns, hit_ns, miss_ns, remove_ns,
+           (double)bytes / n, (double)stats.peak / n, errors);
+    return(0);
+}
+
+static void __bench_usage (const char *name) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -n keys        keys inserted (1000000)\n"
+        "  -r rounds      rounds per table (3)\n"
+        "  -s             string keys, the default is 64bit integers\n", name);
+}
+
+int main (int argc, char **argv) {
+    struct bench_conf conf;
+    uint64_t *ikeys;
+    uint32_t *order;
+    void **missing;
+    uint64_t seed;
+    char *skeys;
+    void **keys;
+    uint32_t i, j, t;
+    int opt;
+
+    conf.nkeys = 1000000;
+    conf.rounds = 3;
+    conf.strings = 0;
+
+    while ((opt = getopt(argc, argv, "n:r:sh")) != -1) {
+        switch (opt) {
+            case 'n': conf.nkeys = strtoul(optarg, NULL, 10); break;
+            case 'r': conf.rounds = strtoul(optarg, NULL, 10); break;
+            case 's': conf.strings = 1; break;
+            default:
+                __bench_usage(argv[0]);
+                return(1);
+        }
+    }
+
+    if (conf.nkeys == 0) {
+        __bench_usage(argv[0]);
+        return(1);
+    }
+
+    /* Keys, the second half are never inserted */
+    keys = (void **) malloc(2 * conf.nkeys * sizeof(void *));
+    order = (uint32_t *) malloc(conf.nkeys * sizeof(uint32_t));
+    ikeys = (uint64_t *) malloc(2 * conf.nkeys * sizeof(uint64_t));
+    skeys = (char *) malloc(2 * (size_t)conf.nkeys * 24);
+    if (keys == NULL || order == NULL || ikeys == NULL || skeys == NULL) {
+        fprintf(stderr, "keys allocation failed\n");
+        return(1);
+    }
+
+    seed = 0x9e3779b97f4a7c15ULL;
+    for (i = 0; i < 2 * conf.nkeys; ++i) {
+        ikeys[i] = __bench_rand(&seed);
+        if (conf.strings) {
+            snprintf(skeys + (size_t)i * 24, 24, "key:%016" PRIx64, ikeys[i]);
+            keys[i] = skeys + (size_t)i * 24;
+        } else {
+            keys[i] = &(ikeys[i]);
+        }
+    }
+    missing = keys + conf.nkeys;
+
+    /* Lookups and removes in a different random order */
+    for (i = 0; i < conf.nkeys; ++i)
+        order[i] = i;
+    for (i = conf.nkeys - 1; i > 0; --i) {
+        j = __bench_rand(&seed) % (i + 1);
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    printf("%u %s keys, ns/op and allocated bytes/item\n",
+           conf.nkeys, conf.strings ? "string" : "integer");
+    printf("%-10s %8s %8s %8s %8s %10s %10s %6s\n",
+           "table", "insert", "hit", "miss", "remove", "bytes", "peak", "errors");
+    for (i = 0; i < conf.rounds; ++i) {
+        for (t = 0; t < __BENCH_NTABLES; ++t)
+            __bench_run(&(__bench_tables[t]), &conf, keys, missing, order);
+    }
+
+    free(skeys);
+    free(ikeys);
+    free(order);
+    free(keys);
+    return(0);
+}
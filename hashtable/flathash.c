@@ -0,0 +1,447 @@
+/* [ flathash.c ] - Open Addressing Hash Table
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2010, Matteo Bertozzi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL MATTEO BERTOZZI BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "flathash.h"
+
+#define __FLATHASH_EMPTY        (0x80)
+#define __FLATHASH_MIN_SIZE     (32)
+#define __FLATHASH_MAX_SIZE     (1U << 27)
+
+#define __mmalk_data(table)    ((table)->alk->user_data)
+#define __mmalloc(table, n)    ((table)->alk->alloc(__mmalk_data(table), (n)))
+#define __mmfree(table, ptr)   ((table)->alk->free(__mmalk_data(table), (ptr)))
+
+/* Low 7 bits in the control byte, the rest picks the home slot.
+ * The home bits are kept per slot, to shift and resize without hash_func().
+ */
+#define __hash_h2(hash)         ((uint8_t)((hash) & 0x7f))
+#define __hash_h1(hash)         ((uint32_t)((hash) >> 7))
+#define __home(t, h1)           ((h1) & ((t)->size - 1))
+
+/* At most 7/8 full, there is always an empty slot to stop probing */
+#define __max_used(size)        ((size) - ((size) >> 3))
+
+#define __ctrl_size(n)          ((n) + __FLATHASH_GROUP)
+#define __slots_size(n)         ((n) * sizeof(flatslot_t))
+#define __hashes_size(n)        ((n) * sizeof(uint32_t))
+
+struct _flatslot {
+    void *  key;
+    void *  value;
+};
+
+/* ============================================================================
+ *  PRIVATE Operations (Control Groups)
+ *  match() returns a bit per control byte equal to h2,
+ *  empty() a bit per EMPTY one, bit 0 is the first byte.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define __FLATHASH_GROUP        (32)
+
+static inline uint32_t __group_match (const uint8_t *ctrl, uint8_t h2) {
+    __m256i group = _mm256_loadu_si256((const __m256i *)ctrl);
+    return(_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, _mm256_set1_epi8(h2))));
+}
+
+static inline uint32_t __group_empty (const uint8_t *ctrl) {
+    return(_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)ctrl)));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define __FLATHASH_GROUP        (16)
+
+static inline uint32_t __group_match (const uint8_t *ctrl, uint8_t h2) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(h2))));
+}
+
+static inline uint32_t __group_empty (const uint8_t *ctrl) {
+    return(_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl)));
+}
+#else
+#define __FLATHASH_GROUP        (8)
+
+static inline uint32_t __group_match (const uint8_t *ctrl, uint8_t h2) {
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < __FLATHASH_GROUP; ++i)
+        mask |= (uint32_t)(ctrl[i] == h2) << i;
+    return(mask);
+}
+
+static inline uint32_t __group_empty (const uint8_t *ctrl) {
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < __FLATHASH_GROUP; ++i)
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    return(mask);
+}
+#endif
+
+/* ============================================================================
+ *  PRIVATE Operations
+ */
+
+/* Default stdlib allocator */
+static void *__dmmalloc (void *x, uint32_t n) { return(malloc(n)); }
+static void __dmmfree (void *x, void *ptr) { free(ptr); }
+static mmallocator_t __default_mmallocator = {
+    .alloc = __dmmalloc,
+    .free  = __dmmfree,
+    .user_data = NULL,
+};
+
+static size_t __nslots_roundup (size_t size) {
+    if (size < __FLATHASH_MIN_SIZE)
+        return(__FLATHASH_MIN_SIZE);
+
+    size--;
+    size |= size >> 1;
+    size |= size >> 2;
+    size |= size >> 4;
+    size |= size >> 8;
+    size |= size >> 16;
+#if defined(__LP64__)
+    size |= size >> 32;
+#endif
+    size++;
+    return(size);
+}
+
+/* The first group of control bytes is cloned past the end,
+ * a group load starting at any slot needs no wrap around.
+ */
+static void __ctrl_set (flathash_t *table,
+                        size_t index,
+                        uint8_t value)
+{
+    table->ctrl[index] = value;
+    if (index < __FLATHASH_GROUP)
+        table->ctrl[table->size + index] = value;
+}
+
+/* Returns 1 and the key slot, or 0 and the first empty slot of the run */
+static int __flathash_find (const flathash_t *table,
+                            const void *key,
+                            size_t hash,
+                            size_t *index)
+{
+    const uint8_t *group;
+    uint32_t match;
+    size_t mask;
+    size_t pos;
+    size_t i;
+
+    mask = table->size - 1;
+    pos = __home(table, __hash_h1(hash));
+    for (;;) {
+        group = table->ctrl + pos;
+
+        /* 7 bits match, only ~1/128 of the keycmp() calls are wasted */
+        match = __group_match(group, __hash_h2(hash));
+        while (match != 0) {
+            i = (pos + __builtin_ctz(match)) & mask;
+            if (!table->keycmp_func(table->user_data, table->slots[i].key, key)) {
+                *index = i;
+                return(1);
+            }
+            match &= match - 1;
+        }
+
+        if ((match = __group_empty(group)) != 0) {
+            *index = (pos + __builtin_ctz(match)) & mask;
+            return(0);
+        }
+
+        pos = (pos + __FLATHASH_GROUP) & mask;
+    }
+}
+
+/* First empty slot from the home, for keys known to be missing */
+static size_t __flathash_probe (const flathash_t *table,
+                                uint32_t h1)
+{
+    uint32_t empty;
+    size_t pos;
+
+    pos = __home(table, h1);
+    while ((empty = __group_empty(table->ctrl + pos)) == 0)
+        pos = (pos + __FLATHASH_GROUP) & (table->size - 1);
+
+    return((pos + __builtin_ctz(empty)) & (table->size - 1));
+}
+
+static void __flathash_slot_free (flathash_t *table,
+                                  flatslot_t *slot)
+{
+    if (table->key_free_func != NULL)
+        table->key_free_func(table->user_data, slot->key);
+
+    if (table->value_free_func != NULL)
+        table->value_free_func(table->user_data, slot->value);
+}
+
+static int __flathash_resize (flathash_t *table,
+                              size_t new_size)
+{
+    flatslot_t *slots;
+    uint32_t *hashes;
+    uint8_t *ctrl;
+    size_t index;
+    size_t size;
+    size_t i;
+
+    new_size = __nslots_roundup(new_size);
+    if (new_size > __FLATHASH_MAX_SIZE)
+        return(-1);
+
+    /* Store old slots and sizes */
+    size = table->size;
+    ctrl = table->ctrl;
+    slots = table->slots;
+    hashes = table->hashes;
+
+    /* Allocate new slots */
+    table->size = new_size;
+    table->ctrl = (uint8_t *) __mmalloc(table, __ctrl_size(new_size));
+    table->slots = (flatslot_t *) __mmalloc(table, __slots_size(new_size));
+    table->hashes = (uint32_t *) __mmalloc(table, __hashes_size(new_size));
+    if (table->ctrl == NULL || table->slots == NULL || table->hashes == NULL) {
+        if (table->ctrl != NULL) __mmfree(table, table->ctrl);
+        if (table->slots != NULL) __mmfree(table, table->slots);
+        if (table->hashes != NULL) __mmfree(table, table->hashes);
+        table->ctrl = ctrl;
+        table->slots = slots;
+        table->hashes = hashes;
+        table->size = size;
+        return(-1);
+    }
+
+    /* Move the items, the home bits are kept no need to call hash_func() */
+    memset(table->ctrl, __FLATHASH_EMPTY, __ctrl_size(new_size));
+    if (ctrl != NULL) {
+        for (i = 0; i < size; ++i) {
+            if (ctrl[i] & __FLATHASH_EMPTY)
+                continue;
+
+            index = __flathash_probe(table, hashes[i]);
+            __ctrl_set(table, index, ctrl[i]);
+            table->slots[index] = slots[i];
+            table->hashes[index] = hashes[i];
+        }
+
+        __mmfree(table, ctrl);
+        __mmfree(table, slots);
+        __mmfree(table, hashes);
+    }
+
+    return(0);
+}
+
+/* ============================================================================
+ *  Flat Hashtable
+ */
+flathash_t *flathash_alloc (flathash_t *table,
+                            size_t size,
+                            keycmp_t key_cmp_func,
+                            hashtable_hash_t hash_func,
+                            mmallocator_t *allocator,
+                            mmfree_t key_free_func,
+                            mmfree_t value_free_func,
+                            void *user_data)
+{
+    /* Init Allocator */
+    table->alk = (allocator != NULL) ? allocator : &__default_mmallocator;
+
+    table->ctrl = NULL;
+    table->slots = NULL;
+    table->hashes = NULL;
+    table->size = 0U;
+    table->used = 0U;
+
+    /* Room for size items without growing */
+    if (__flathash_resize(table, size + (size >> 3) + 1))
+        return(NULL);
+
+    table->user_data = user_data;
+    table->hash_func = hash_func;
+    table->keycmp_func = key_cmp_func;
+    table->key_free_func = key_free_func;
+    table->value_free_func = value_free_func;
+
+    return(table);
+}
+
+void flathash_free (flathash_t *table) {
+    size_t i;
+
+    for (i = 0; i < table->size; ++i) {
+        if (!(table->ctrl[i] & __FLATHASH_EMPTY))
+            __flathash_slot_free(table, &(table->slots[i]));
+    }
+
+    __mmfree(table, table->ctrl);
+    __mmfree(table, table->slots);
+    __mmfree(table, table->hashes);
+}
+
+int flathash_insert (flathash_t *table,
+                     void *key,
+                     void *value)
+{
+    flatslot_t *slot;
+    size_t index;
+    size_t hash;
+
+    /* Lookup Key, if found Replace old value with the new value */
+    hash = table->hash_func(table->user_data, key);
+    if (__flathash_find(table, key, hash, &index)) {
+        slot = &(table->slots[index]);
+        if (slot->value != value && table->value_free_func != NULL)
+            table->value_free_func(table->user_data, slot->value);
+        slot->value = value;
+        return(0);
+    }
+
+    /* Resize Table if necessary */
+    if (table->used + 1 > __max_used(table->size)) {
+        if (__flathash_resize(table, table->size << 1))
+            return(-1);
+
+        index = __flathash_probe(table, __hash_h1(hash));
+    }
+
+    __ctrl_set(table, index, __hash_h2(hash));
+    slot = &(table->slots[index]);
+    slot->key = key;
+    slot->value = value;
+    table->hashes[index] = __hash_h1(hash);
+    table->used++;
+
+    return(0);
+}
+
+int flathash_remove (flathash_t *table,
+                     const void *key)
+{
+    size_t i, j, home;
+    uint32_t *hashes;
+    uint8_t *ctrl;
+    size_t mask;
+
+    if (!__flathash_find(table, key, table->hash_func(table->user_data, key), &i))
+        return(-1);
+
+    /* Remove Item */
+    __flathash_slot_free(table, &(table->slots[i]));
+    table->used--;
+
+    /* Backward shift, pull back every following entry of the run
+     * whose home slot isn't between the hole and itself.
+     */
+    ctrl = table->ctrl;
+    hashes = table->hashes;
+    mask = table->size - 1;
+    __ctrl_set(table, i, __FLATHASH_EMPTY);
+    for (j = (i + 1) & mask; !(ctrl[j] & __FLATHASH_EMPTY); j = (j + 1) & mask) {
+        home = __home(table, hashes[j]);
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        __ctrl_set(table, i, ctrl[j]);
+        table->slots[i] = table->slots[j];
+        hashes[i] = hashes[j];
+        __ctrl_set(table, j, __FLATHASH_EMPTY);
+        i = j;
+    }
+
+    /* Resize back if value is used is small */
+    if (table->size > __FLATHASH_MIN_SIZE && table->used < (table->size >> 2))
+        __flathash_resize(table, table->size >> 1);
+
+    return(0);
+}
+
+int flathash_clear (flathash_t *table) {
+    size_t i;
+
+    for (i = 0; i < table->size; ++i) {
+        if (!(table->ctrl[i] & __FLATHASH_EMPTY))
+            __flathash_slot_free(table, &(table->slots[i]));
+    }
+
+    memset(table->ctrl, __FLATHASH_EMPTY, __ctrl_size(table->size));
+    table->used = 0;
+
+    /* Resize back if value is used is small */
+    if (table->size > 1024)
+        __flathash_resize(table, table->size >> 3);
+
+    return(0);
+}
+
+int flathash_contains (const flathash_t *table,
+                       const void *key)
+{
+    size_t index;
+    return(__flathash_find(table, key, table->hash_func(table->user_data, key), &index));
+}
+
+void *flathash_lookup (const flathash_t *table,
+                       const void *key)
+{
+    size_t index;
+
+    if (!__flathash_find(table, key, table->hash_func(table->user_data, key), &index))
+        return(NULL);
+
+    return(table->slots[index].value);
+}
+
+size_t flathash_size (const flathash_t *table) {
+    return(table->used);
+}
+
+void flathash_foreach (const flathash_t *table,
+                       const hashtable_foreach_t func,
+                       void *user_data)
+{
+    size_t i;
+
+    for (i = 0; i < table->size; ++i) {
+        if (!(table->ctrl[i] & __FLATHASH_EMPTY))
+            func(user_data, table->slots[i].key, table->slots[i].value);
+    }
+}
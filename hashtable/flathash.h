@@ -0,0 +1,94 @@
+/* [ flathash.h ] - Open Addressing Hash Table
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2010, Matteo Bertozzi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL MATTEO BERTOZZI BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * -----------------------------------------------------------------------------
+ */
+
+#ifndef _FLATHASH_H_
+#define _FLATHASH_H_
+
+#include "hashtable.h"
+
+/*
+ * Open addressing table, keys and values live inline in the slot array
+ * (no node per entry). A control byte per slot holds 7 bits of the hash,
+ * or EMPTY, and probing compares a whole group of control bytes at once
+ * (32 with AVX2, 16 with SSE2, 8 portable). Probing is linear and removal
+ * shifts the following entries back, so there are no tombstones and
+ * lookups never slow down after many removes.
+ *
+ * Allocations go through mmalloc_t, one each for the control bytes, the
+ * slots and the home bits, so the table is limited to 2^27 slots (~117M
+ * items, 21 bytes per slot).
+ */
+typedef struct _flatslot flatslot_t;
+
+typedef struct _flathash {
+    uint8_t *        ctrl;             /* Control bytes, group-1 cloned */
+    flatslot_t *     slots;            /* Key/Value slots */
+    uint32_t *       hashes;           /* Hash home bits, per slot */
+
+    mmallocator_t *  alk;              /* Memory Allocator */
+    hashtable_hash_t hash_func;        /* Hash Function */
+    keycmp_t         keycmp_func;      /* Key Compare Func */
+    mmfree_t         key_free_func;    /* Key Free Func */
+    mmfree_t         value_free_func;  /* Value Free Func */
+    void *           user_data;        /* User Data passed to Key/Value Funcs */
+
+    size_t           size;             /* Number of slots, power of two */
+    size_t           used;             /* Number of items */
+} flathash_t;
+
+flathash_t * flathash_alloc     (flathash_t *table,
+                                 size_t size,
+                                 keycmp_t key_cmp_func,
+                                 hashtable_hash_t hash_func,
+                                 mmallocator_t *allocator,
+                                 mmfree_t key_free_func,
+                                 mmfree_t value_free_func,
+                                 void *user_data);
+void         flathash_free      (flathash_t *table);
+
+int          flathash_clear     (flathash_t *table);
+
+int          flathash_insert    (flathash_t *table,
+                                 void *key,
+                                 void *value);
+int          flathash_remove    (flathash_t *table,
+                                 const void *key);
+
+int          flathash_contains  (const flathash_t *table,
+                                 const void *key);
+void *       flathash_lookup    (const flathash_t *table,
+                                 const void *key);
+
+size_t       flathash_size      (const flathash_t *table);
+
+void         flathash_foreach   (const flathash_t *table,
+                                 const hashtable_foreach_t func,
+                                 void *user_data);
+
+#endif /* !_FLATHASH_H_ */
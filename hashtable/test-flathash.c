@@ -0,0 +1,159 @@
+/*
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2010, Matteo Bertozzi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the author nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL MATTEO BERTOZZI BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "flathash.h"
+
+#define TEST_KEYS       (20000)
+
+static char __keys[TEST_KEYS][16];
+
+static int __keycmp (void *user_data, const void *k1, const void *k2) {
+    return(strcmp((const char *)k1, (const char *)k2));
+}
+
+static size_t __hash (void *user_data, const void *key)
+{
+    size_t hash = 0;
+    const char *p;
+
+    for (p = (const char *)key; *p != '\0'; p++)
+        hash = (hash << 5) - hash + *p;
+
+    return(hash);
+}
+
+/* Few distinct homes, long runs to probe and shift back */
+static size_t __hash_collide (void *user_data, const void *key) {
+    return(__hash(user_data, key) & 0x3ff);
+}
+
+static void __foreach (void *user_data, const void *key, void *value) {
+    printf("[%s] = '%s'\n", (const char *)key, (const char *)value);
+}
+
+static void __foreach_count (void *user_data, const void *key, void *value) {
+    (*(size_t *)user_data)++;
+}
+
+static void __check (int cond, const char *message) {
+    if (!cond)
+        printf(" - %s\n", message);
+}
+
+/* Random insert/remove against a reference array */
+static void __test_random (hashtable_hash_t hash_func, int nkeys) {
+    flathash_t table;
+    unsigned int seed;
+    char *present;
+    size_t count;
+    int i, k, errors;
+
+    present = calloc(nkeys, 1);
+    flathash_alloc(&table, 0, __keycmp, hash_func, NULL, NULL, NULL, NULL);
+
+    seed = 11;
+    for (i = 0; i < 20 * nkeys; ++i) {
+        k = rand_r(&seed) % nkeys;
+        if (present[k] && (rand_r(&seed) & 1)) {
+            __check(flathash_remove(&table, __keys[k]) == 0, "Remove present");
+            present[k] = 0;
+        } else {
+            __check(flathash_insert(&table, __keys[k], __keys[k]) == 0, "Insert");
+            present[k] = 1;
+        }
+    }
+
+    count = errors = 0;
+    for (k = 0; k < nkeys; ++k) {
+        errors += (flathash_contains(&table, __keys[k]) != present[k]);
+        errors += present[k] && (flathash_lookup(&table, __keys[k]) != __keys[k]);
+        count += present[k];
+    }
+    __check(errors == 0, "Lookup after random insert/remove");
+    __check(flathash_size(&table) == count, "Size after random insert/remove");
+
+    count = 0;
+    flathash_foreach(&table, __foreach_count, &count);
+    __check(count == flathash_size(&table), "Foreach count");
+
+    /* Remove everything, the table shrinks back */
+    for (k = 0; k < nkeys; ++k) {
+        if (present[k])
+            flathash_remove(&table, __keys[k]);
+    }
+    __check(flathash_size(&table) == 0, "Size after remove all");
+    __check(table.size <= 64, "Shrink after remove all");
+    __check(flathash_remove(&table, __keys[0]) < 0, "Remove missing");
+
+    flathash_free(&table);
+    free(present);
+}
+
+int main (int argc, char **argv) {
+    flathash_t table;
+    int i;
+
+    flathash_alloc(&table, 6, __keycmp, __hash, NULL, NULL, NULL, NULL);
+    printf("FH SIZE: %zu\n", table.size);
+    printf("FH USED: %zu\n", table.used);
+
+    flathash_insert(&table, "Key0", "Value 0");
+    flathash_insert(&table, "Key1", "Value 1");
+    flathash_insert(&table, "Key2", "Value 2");
+    flathash_insert(&table, "Key3", "Value 3");
+    flathash_insert(&table, "Key4", "Value 4");
+    flathash_insert(&table, "Key2", "Value 2b");
+
+    printf("FH SIZE: %zu\n", table.size);
+    printf("FH USED: %zu\n", table.used);
+    flathash_foreach(&table, __foreach, NULL);
+
+    flathash_remove(&table, "Key2");
+    printf("FH USED: %zu\n", table.used);
+    flathash_foreach(&table, __foreach, NULL);
+
+    __check(flathash_lookup(&table, "Key2") == NULL, "Lookup removed");
+    __check(!strcmp(flathash_lookup(&table, "Key3"), "Value 3"), "Lookup Key3");
+    flathash_clear(&table);
+    __check(flathash_size(&table) == 0, "Size after clear");
+    __check(!flathash_contains(&table, "Key3"), "Contains after clear");
+    flathash_free(&table);
+
+    for (i = 0; i < TEST_KEYS; ++i)
+        snprintf(__keys[i], sizeof(__keys[i]), "Key%d", i);
+
+    __test_random(__hash, TEST_KEYS);
+    __test_random(__hash_collide, 2000);
+
+    return(0);
+}